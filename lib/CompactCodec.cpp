@@ -0,0 +1,88 @@
+#include "CompactCodec.hpp"
+
+using namespace std;
+using namespace cereal;
+
+
+// Max number of bytes in a varint encoded uint32_t
+#define MAX_VARINT_SIZE ( 5 )
+
+
+static size_t writeVarint ( uint32_t value, uint8_t *dst )
+{
+    size_t size = 0;
+
+    while ( value >= 0x80 )
+    {
+        dst[size++] = uint8_t ( value | 0x80 );
+        value >>= 7;
+    }
+
+    dst[size++] = uint8_t ( value );
+    return size;
+}
+
+void saveVarint ( BinaryOutputArchive& ar, uint32_t value )
+{
+    uint8_t bytes[MAX_VARINT_SIZE];
+    ar ( binary_data ( bytes, writeVarint ( value, bytes ) ) );
+}
+
+uint32_t loadVarint ( BinaryInputArchive& ar )
+{
+    uint32_t value = 0;
+
+    for ( size_t i = 0; i < MAX_VARINT_SIZE; ++i )
+    {
+        uint8_t byte;
+        ar ( byte );
+
+        value |= uint32_t ( byte & 0x7F ) << ( 7 * i );
+
+        if ( ! ( byte & 0x80 ) )
+            return value;
+    }
+
+    throw Exception ( "Varint too long" );
+}
+
+void saveCompactInputs ( BinaryOutputArchive& ar, const uint16_t *inputs, size_t count )
+{
+    uint16_t previous = 0;
+
+    for ( size_t i = 0; i < count; )
+    {
+        size_t end = i + 1;
+
+        while ( end < count && inputs[end] == inputs[i] )
+            ++end;
+
+        // Write each run with a single call, so the archive isn't called per byte
+        uint8_t bytes[2 * MAX_VARINT_SIZE];
+        size_t size = writeVarint ( inputs[i] ^ previous, bytes );
+        size += writeVarint ( end - i - 1, bytes + size );
+        ar ( binary_data ( bytes, size ) );
+
+        previous = inputs[i];
+        i = end;
+    }
+}
+
+void loadCompactInputs ( BinaryInputArchive& ar, uint16_t *inputs, size_t count )
+{
+    uint16_t previous = 0;
+
+    for ( size_t i = 0; i < count; )
+    {
+        const uint32_t delta = loadVarint ( ar );
+        const uint32_t extra = loadVarint ( ar );
+
+        if ( delta > 0xFFFF || extra >= count - i )
+            throw Exception ( "Invalid compact inputs" );
+
+        previous ^= uint16_t ( delta );
+
+        for ( size_t end = i + extra + 1; i < end; ++i )
+            inputs[i] = previous;
+    }
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cereal/archives/binary.hpp>
+
+#include <cstdint>
+#include <cstddef>
+
+
+// Variable length unsigned integer, 7 bits per byte, the high bit indicates more bytes follow.
+void saveVarint ( cereal::BinaryOutputArchive& ar, uint32_t value );
+uint32_t loadVarint ( cereal::BinaryInputArchive& ar );
+
+// Compact encoding of a window of inputs, which are mostly the same input held over many frames.
+// Encoded as runs of identical inputs, each run is a varint of the input XOR the previous run's input,
+// followed by a varint of the run length - 1. A window of one held input is only 2 bytes.
+void saveCompactInputs ( cereal::BinaryOutputArchive& ar, const uint16_t *inputs, size_t count );
+
+// Decode exactly count inputs, throws cereal::Exception if the encoded runs don't match count.
+void loadCompactInputs ( cereal::BinaryInputArchive& ar, uint16_t *inputs, size_t count );
@@ -6,6 +6,7 @@
 #include <md5.h>
 
 #include <cstring>
+#include <cstdlib>
 
 using namespace std;
 
@@ -36,6 +37,210 @@ bool checkMD5 ( const string& str, const char md5[16] )
 }
 
 
+// Reflected CRC32C polynomial
+#define CRC32C_POLY ( 0x82F63B78u )
+
+static uint32_t crc32cTable[8][256];
+
+static bool initCRC32CTable()
+{
+    for ( uint32_t i = 0; i < 256; ++i )
+    {
+        uint32_t crc = i;
+
+        for ( int j = 0; j < 8; ++j )
+            crc = ( crc >> 1 ) ^ ( ( crc & 1 ) ? CRC32C_POLY : 0 );
+
+        crc32cTable[0][i] = crc;
+    }
+
+    for ( uint32_t i = 0; i < 256; ++i )
+    {
+        for ( int j = 1; j < 8; ++j )
+            crc32cTable[j][i] = ( crc32cTable[j - 1][i] >> 8 ) ^ crc32cTable[0][crc32cTable[j - 1][i] & 0xFF];
+    }
+
+    return true;
+}
+
+// Slicing-by-8 software implementation
+static uint32_t getCRC32CSoftware ( const char *bytes, size_t len )
+{
+    static const bool initialized = initCRC32CTable();
+    ( void ) initialized;
+
+    const uint8_t *p = ( const uint8_t * ) bytes;
+    uint32_t crc = 0xFFFFFFFFu;
+
+    for ( ; len >= 8; len -= 8, p += 8 )
+    {
+        uint32_t lo, hi;
+        memcpy ( &lo, p, 4 );
+        memcpy ( &hi, p + 4, 4 );
+        lo ^= crc;
+
+        crc = crc32cTable[7][lo & 0xFF] ^ crc32cTable[6][( lo >> 8 ) & 0xFF]
+              ^ crc32cTable[5][( lo >> 16 ) & 0xFF] ^ crc32cTable[4][lo >> 24]
+              ^ crc32cTable[3][hi & 0xFF] ^ crc32cTable[2][( hi >> 8 ) & 0xFF]
+              ^ crc32cTable[1][( hi >> 16 ) & 0xFF] ^ crc32cTable[0][hi >> 24];
+    }
+
+    for ( ; len; --len, ++p )
+        crc = ( crc >> 8 ) ^ crc32cTable[0][( crc ^ *p ) & 0xFF];
+
+    return ~crc;
+}
+
+#if defined ( __i386__ ) || defined ( __x86_64__ )
+
+__attribute__ ( ( target ( "sse4.2" ) ) )
+static uint32_t getCRC32CHardware ( const char *bytes, size_t len )
+{
+    uint32_t crc = 0xFFFFFFFFu;
+
+    for ( ; len >= 4; len -= 4, bytes += 4 )
+    {
+        uint32_t value;
+        memcpy ( &value, bytes, 4 );
+        crc = __builtin_ia32_crc32si ( crc, value );
+    }
+
+    for ( ; len; --len, ++bytes )
+        crc = __builtin_ia32_crc32qi ( crc, ( uint8_t ) *bytes );
+
+    return ~crc;
+}
+
+bool hasHardwareCRC32C()
+{
+    static const bool hasSSE42 = __builtin_cpu_supports ( "sse4.2" );
+    return hasSSE42;
+}
+
+#else
+
+static uint32_t getCRC32CHardware ( const char *bytes, size_t len )
+{
+    return getCRC32CSoftware ( bytes, len );
+}
+
+bool hasHardwareCRC32C()
+{
+    return false;
+}
+
+#endif // __i386__ || __x86_64__
+
+uint32_t getCRC32C ( const char *bytes, size_t len )
+{
+    if ( hasHardwareCRC32C() )
+        return getCRC32CHardware ( bytes, len );
+
+    return getCRC32CSoftware ( bytes, len );
+}
+
+
+// xxHash64 primes
+#define XXH_PRIME64_1 ( 0x9E3779B185EBCA87ull )
+#define XXH_PRIME64_2 ( 0xC2B2AE3D27D4EB4Full )
+#define XXH_PRIME64_3 ( 0x165667B19E3779F9ull )
+#define XXH_PRIME64_4 ( 0x85EBCA77C2B2AE63ull )
+#define XXH_PRIME64_5 ( 0x27D4EB2F165667C5ull )
+
+static inline uint64_t rotl64 ( uint64_t x, int r )
+{
+    return ( x << r ) | ( x >> ( 64 - r ) );
+}
+
+static inline uint64_t read64 ( const uint8_t *p )
+{
+    uint64_t value;
+    memcpy ( &value, p, 8 );
+    return value;
+}
+
+static inline uint32_t read32 ( const uint8_t *p )
+{
+    uint32_t value;
+    memcpy ( &value, p, 4 );
+    return value;
+}
+
+static inline uint64_t xxhRound ( uint64_t acc, uint64_t input )
+{
+    acc += input * XXH_PRIME64_2;
+    acc = rotl64 ( acc, 31 );
+    return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxhMergeRound ( uint64_t acc, uint64_t value )
+{
+    acc ^= xxhRound ( 0, value );
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+uint64_t getXXHash64 ( const char *bytes, size_t len, uint64_t seed )
+{
+    const uint8_t *p = ( const uint8_t * ) bytes;
+    const uint8_t *end = p + len;
+    uint64_t hash;
+
+    if ( len >= 32 )
+    {
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+
+        for ( ; p + 32 <= end; p += 32 )
+        {
+            v1 = xxhRound ( v1, read64 ( p ) );
+            v2 = xxhRound ( v2, read64 ( p + 8 ) );
+            v3 = xxhRound ( v3, read64 ( p + 16 ) );
+            v4 = xxhRound ( v4, read64 ( p + 24 ) );
+        }
+
+        hash = rotl64 ( v1, 1 ) + rotl64 ( v2, 7 ) + rotl64 ( v3, 12 ) + rotl64 ( v4, 18 );
+        hash = xxhMergeRound ( hash, v1 );
+        hash = xxhMergeRound ( hash, v2 );
+        hash = xxhMergeRound ( hash, v3 );
+        hash = xxhMergeRound ( hash, v4 );
+    }
+    else
+    {
+        hash = seed + XXH_PRIME64_5;
+    }
+
+    hash += len;
+
+    for ( ; p + 8 <= end; p += 8 )
+    {
+        hash ^= xxhRound ( 0, read64 ( p ) );
+        hash = rotl64 ( hash, 27 ) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+
+    if ( p + 4 <= end )
+    {
+        hash ^= read32 ( p ) * XXH_PRIME64_1;
+        hash = rotl64 ( hash, 23 ) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+
+    for ( ; p < end; ++p )
+    {
+        hash ^= ( *p ) * XXH_PRIME64_5;
+        hash = rotl64 ( hash, 11 ) * XXH_PRIME64_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+
 size_t compress ( const char *src, size_t srcLen, char *dst, size_t dstLen, int level )
 {
     mz_ulong len = dstLen;
@@ -62,3 +267,48 @@ size_t compressBound ( size_t srcLen )
 {
     return mz_compressBound ( srcLen );
 }
+
+
+Compressor::~Compressor()
+{
+    if ( _state )
+        free ( _state );
+}
+
+size_t Compressor::compress ( const char *src, size_t srcLen, char *dst, size_t dstLen, int level )
+{
+    if ( ! _state )
+    {
+        _state = malloc ( sizeof ( tdefl_compressor ) );
+
+        if ( ! _state )
+        {
+            LOG ( "Failed to allocate compressor" );
+            return 0;
+        }
+    }
+
+    tdefl_compressor *comp = ( tdefl_compressor * ) _state;
+
+    // Same flags as mz_compress2 so the output is identical
+    const mz_uint flags = TDEFL_COMPUTE_ADLER32
+                          | tdefl_create_comp_flags_from_zip_params ( level, MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY );
+
+    tdefl_status status = tdefl_init ( comp, 0, 0, flags );
+
+    if ( status != TDEFL_STATUS_OKAY )
+    {
+        LOG ( "[%d] tdefl_init failed", status );
+        return 0;
+    }
+
+    size_t inLen = srcLen;
+    size_t outLen = dstLen;
+    status = tdefl_compress ( comp, src, &inLen, dst, &outLen, TDEFL_FINISH );
+
+    if ( status == TDEFL_STATUS_DONE )
+        return outLen;
+
+    LOG ( "[%d] tdefl_compress failed", status );
+    return 0;
+}
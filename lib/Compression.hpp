@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <cstdint>
 
 
 // MD5 calculation
@@ -10,7 +11,36 @@ bool checkMD5 ( const char *bytes, size_t len, const char md5[16] );
 bool checkMD5 ( const std::string& str, const char md5[16] );
 
 
+// CRC32C (Castagnoli) calculation, uses the SSE 4.2 crc32 instruction if the CPU supports it
+uint32_t getCRC32C ( const char *bytes, size_t len );
+bool hasHardwareCRC32C();
+
+// 64-bit xxHash calculation
+uint64_t getXXHash64 ( const char *bytes, size_t len, uint64_t seed = 0 );
+
+
 // zlib compression
 size_t compress ( const char *src, size_t srcLen, char *dst, size_t dstLen, int level = 9 );
 size_t uncompress ( const char *src, size_t srcLen, char *dst, size_t dstLen );
 size_t compressBound ( size_t srcLen );
+
+
+// Reusable zlib compressor, the compressor state is only allocated once instead of on every call.
+// Produces exactly the same output as the compress function above.
+class Compressor
+{
+public:
+
+    Compressor() {}
+    ~Compressor();
+
+    Compressor ( const Compressor& ) = delete;
+    const Compressor& operator= ( const Compressor& ) = delete;
+
+    size_t compress ( const char *src, size_t srcLen, char *dst, size_t dstLen, int level = 9 );
+
+private:
+
+    // tdefl_compressor state, allocated on first use
+    void *_state = 0;
+};
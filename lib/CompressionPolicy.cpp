@@ -0,0 +1,182 @@
+#include "CompressionPolicy.hpp"
+#include "Logger.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+
+// Default minimum size to try compressing, small messages almost never get smaller after the overhead
+#define DEFAULT_MIN_SIZE    ( 64 )
+
+// Default compression level
+#define DEFAULT_LEVEL       ( 9 )
+
+// Number of compression attempts before re-evaluating the policy for a message type
+#define LEARN_WINDOW        ( 32 )
+
+// Number of skipped messages between compression attempts for a disabled message type
+#define PROBE_INTERVAL      ( 1024 )
+
+
+// Default policy for specific message types
+static const struct
+{
+    MsgType type;
+    uint32_t minSize;
+    uint8_t level;
+}
+defaultPolicy[] =
+{
+    // Sent every frame, so only use the fastest compression
+    { MsgType::PlayerInputs, DEFAULT_MIN_SIZE, 1 },
+    { MsgType::BothInputs, DEFAULT_MIN_SIZE, 1 },
+
+    // Contains already encoded messages, so never compress
+    { MsgType::SplitMessage, 0, 0 },
+    { MsgType::SharedSequence, 0, 0 },
+};
+
+
+void CompressionPolicy::set ( MsgType type, uint32_t minSize, uint8_t level )
+{
+    Entry& entry = _entries[( uint8_t ) type];
+
+    entry.defaultMinSize = entry.minSize = minSize;
+    entry.level = level;
+    entry.enabled = true;
+    entry.windowAttempts = entry.windowWins = entry.windowMinWinSize = 0;
+    entry.probeCountDown = 0;
+}
+
+uint8_t CompressionPolicy::getLevel ( MsgType type, size_t size, uint8_t maxLevel )
+{
+    Entry& entry = _entries[( uint8_t ) type];
+
+    if ( entry.level == 0 || size < entry.minSize )
+    {
+        ++entry.stats.skipped;
+        return 0;
+    }
+
+    // Occasionally probe disabled types in case the data has changed
+    if ( ! entry.enabled )
+    {
+        if ( entry.probeCountDown )
+        {
+            --entry.probeCountDown;
+            ++entry.stats.skipped;
+            return 0;
+        }
+
+        entry.probeCountDown = PROBE_INTERVAL;
+    }
+
+    return min ( entry.level, maxLevel );
+}
+
+void CompressionPolicy::update ( MsgType type, size_t size, size_t compressedSize, uint64_t nanoseconds )
+{
+    Entry& entry = _entries[( uint8_t ) type];
+
+    const bool win = ( compressedSize < size );
+
+    ++entry.stats.attempts;
+    entry.stats.nanoseconds += nanoseconds;
+
+    if ( win )
+    {
+        ++entry.stats.wins;
+        entry.stats.bytesSaved += ( size - compressedSize );
+    }
+
+    // Result of a probe, re-enable if the compression won
+    if ( ! entry.enabled )
+    {
+        if ( win )
+        {
+            LOG ( "Enabled compression for %s", type );
+            set ( type, entry.defaultMinSize, entry.level );
+        }
+        return;
+    }
+
+    ++entry.windowAttempts;
+
+    if ( win )
+    {
+        ++entry.windowWins;
+
+        if ( entry.windowMinWinSize == 0 || size < entry.windowMinWinSize )
+            entry.windowMinWinSize = size;
+    }
+
+    if ( entry.windowAttempts >= LEARN_WINDOW )
+    {
+        learn ( entry );
+
+        if ( ! entry.enabled )
+            LOG ( "Disabled compression for %s", type );
+    }
+}
+
+void CompressionPolicy::learn ( Entry& entry )
+{
+    if ( entry.windowWins == 0 )
+    {
+        // Never benefits, so stop compressing
+        entry.enabled = false;
+        entry.probeCountDown = PROBE_INTERVAL;
+    }
+    else if ( entry.windowWins * 2 < entry.windowAttempts )
+    {
+        // Mostly losing, so only try sizes that have won before
+        entry.minSize = entry.windowMinWinSize;
+    }
+    else
+    {
+        // Mostly winning, so start trying smaller sizes again
+        entry.minSize = max ( entry.defaultMinSize, ( entry.minSize + entry.defaultMinSize ) / 2 );
+    }
+
+    entry.windowAttempts = entry.windowWins = entry.windowMinWinSize = 0;
+}
+
+void CompressionPolicy::logStats() const
+{
+    for ( size_t i = 0; i < _entries.size(); ++i )
+    {
+        const Entry& entry = _entries[i];
+
+        if ( entry.stats.attempts == 0 )
+            continue;
+
+        LOG ( "%s: enabled=%u; minSize=%u; attempts=%llu; wins=%llu; skipped=%llu; bytesSaved=%llu; time=%llu us",
+              MsgType ( i ), entry.enabled, entry.minSize, entry.stats.attempts, entry.stats.wins,
+              entry.stats.skipped, entry.stats.bytesSaved, entry.stats.nanoseconds / 1000 );
+    }
+}
+
+void CompressionPolicy::reset()
+{
+    for ( Entry& entry : _entries )
+    {
+        entry = Entry();
+        entry.defaultMinSize = entry.minSize = DEFAULT_MIN_SIZE;
+        entry.level = DEFAULT_LEVEL;
+    }
+
+    for ( const auto& policy : defaultPolicy )
+        set ( policy.type, policy.minSize, policy.level );
+}
+
+CompressionPolicy::CompressionPolicy()
+{
+    reset();
+}
+
+CompressionPolicy& CompressionPolicy::get()
+{
+    static CompressionPolicy instance;
+    return instance;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "Protocol.hpp"
+
+#include <array>
+
+
+// Per message type compression policy, with a minimum size and compression level for each type.
+// Learns online from the observed compression results, and disables compression for types that don't benefit.
+class CompressionPolicy
+{
+public:
+
+    // Compression counters for a message type
+    struct Stats
+    {
+        // Number of compression attempts
+        uint64_t attempts = 0;
+
+        // Number of attempts where the compressed data was actually smaller
+        uint64_t wins = 0;
+
+        // Number of messages that skipped compression because of the policy
+        uint64_t skipped = 0;
+
+        // Total bytes saved by compression
+        uint64_t bytesSaved = 0;
+
+        // Total time spent compressing, including attempts that didn't win
+        uint64_t nanoseconds = 0;
+    };
+
+    // Set the minimum uncompressed size and compression level for a message type, this also re-enables it
+    void set ( MsgType type, uint32_t minSize, uint8_t level );
+
+    // Get the compression level to use for a message of the given size, 0 means don't compress.
+    // The level is capped at maxLevel, which is the compression level of the message itself.
+    uint8_t getLevel ( MsgType type, size_t size, uint8_t maxLevel );
+
+    // Update with the result of a compression attempt, compressedSize includes any extra overhead
+    void update ( MsgType type, size_t size, size_t compressedSize, uint64_t nanoseconds );
+
+    // Get the current policy for a message type
+    bool isEnabled ( MsgType type ) const { return _entries[( uint8_t ) type].enabled; }
+    uint32_t getMinSize ( MsgType type ) const { return _entries[( uint8_t ) type].minSize; }
+
+    // Get the counters for a message type
+    const Stats& getStats ( MsgType type ) const { return _entries[( uint8_t ) type].stats; }
+
+    // Log the counters of every message type that was compressed
+    void logStats() const;
+
+    // Reset the default policy and clear all counters
+    void reset();
+
+    // Get the singleton instance
+    static CompressionPolicy& get();
+
+private:
+
+    struct Entry
+    {
+        // Configured minimum size, the learned minimum size never goes below this
+        uint32_t defaultMinSize = 0;
+
+        // Current minimum uncompressed size to try compressing
+        uint32_t minSize = 0;
+
+        // Compression level to use
+        uint8_t level = 0;
+
+        // If compression is enabled for this type
+        bool enabled = true;
+
+        // Attempts and wins in the current learning window
+        uint32_t windowAttempts = 0, windowWins = 0;
+
+        // Smallest size that won in the current learning window
+        uint32_t windowMinWinSize = 0;
+
+        // Number of messages until the next probe, while disabled
+        uint32_t probeCountDown = 0;
+
+        // Counters
+        Stats stats;
+    };
+
+    // Entries indexed by MsgType
+    std::array<Entry, 256> _entries;
+
+    // Evaluate the current learning window
+    void learn ( Entry& entry );
+
+    // Private constructor, etc. for singleton class
+    CompressionPolicy();
+    CompressionPolicy ( const CompressionPolicy& );
+    const CompressionPolicy& operator= ( const CompressionPolicy& );
+};
@@ -0,0 +1,34 @@
+#include "ControllerManager.hpp"
+#include "Logger.hpp"
+
+using namespace std;
+
+
+// Kept apart from ControllerManager so the protocol builds without DirectInput
+
+void ControllerMappings::save ( cereal::BinaryOutputArchive& ar ) const
+{
+    ar ( mappings.size() );
+
+    for ( const auto& kv : mappings )
+        ar ( kv.first, Protocol::encode ( kv.second ) );
+}
+
+void ControllerMappings::load ( cereal::BinaryInputArchive& ar )
+{
+    size_t count;
+    ar ( count );
+
+    string name;
+    string buffer;
+    size_t consumed;
+
+    for ( size_t i = 0; i < count; ++i )
+    {
+        ar ( name, buffer );
+
+        mappings[name] = Protocol::decode ( &buffer[0], buffer.size(), consumed );
+
+        ASSERT ( consumed == buffer.size() );
+    }
+}
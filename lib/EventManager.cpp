@@ -1,12 +1,17 @@
 #include "EventManager.hpp"
 #include "TimerManager.hpp"
 #include "SocketManager.hpp"
-#include "ControllerManager.hpp"
 #include "Logger.hpp"
 
+#ifdef _WIN32
 #include <winsock2.h>
 #include <windows.h>
 #include <mmsystem.h>
+#else
+// Only Windows needs to raise the timer resolution
+#define timeBeginPeriod(PERIOD)
+#define timeEndPeriod(PERIOD)
+#endif
 
 using namespace std;
 
@@ -24,6 +29,11 @@ void EventManager::checkEvents ( uint64_t timeout )
 
     TimerManager::get().check();
 
+    if ( ! _running )
+        return;
+
+    runTasks();
+
     if ( ! _running )
         return;
 
@@ -40,7 +50,25 @@ void EventManager::checkEvents ( uint64_t timeout )
 
     ASSERT ( timeout > 0 );
 
-    SocketManager::get().check ( timeout );
+    const bool ready = SocketManager::get().check ( timeout );
+
+    // Nothing blocks in virtual time, so when nothing was ready skip straight to the next timer
+    if ( ! ready && TimerManager::get().isVirtualTime() )
+        TimerManager::get().advanceTime ( timeout );
+
+    // Run anything posted during the wait right away
+    runTasks();
+}
+
+void EventManager::runTasks()
+{
+    // Clear the flag first, so a post during this loop wakes up the next wait
+    _tasksPending.store ( false );
+
+    function<void()> task;
+
+    while ( _running && _tasks.pop ( task ) )
+        task();
 }
 
 void EventManager::eventLoop()
@@ -49,11 +77,9 @@ void EventManager::eventLoop()
     {
         timeBeginPeriod ( 1 ); // for select, see comment in SocketManager
 
+        // Each check blocks until a socket is ready, the next timer expires, or a wakeup
         while ( _running )
-        {
-            Sleep ( 1 );
             checkEvents ( DEFAULT_TIMEOUT_MILLISECONDS );
-        }
 
         timeEndPeriod ( 1 ); // for select, see comment in SocketManager
     }
@@ -62,16 +88,13 @@ void EventManager::eventLoop()
         timeBeginPeriod ( 1 ); // for timeGetTime AND select
 
         while ( _running )
-        {
-            Sleep ( 1 );
             checkEvents ( DEFAULT_TIMEOUT_MILLISECONDS );
-        }
 
         timeEndPeriod ( 1 ); // for timeGetTime AND select
     }
 }
 
-EventManager::EventManager() {}
+EventManager::EventManager() : _tasksPending ( false ) {}
 
 bool EventManager::poll ( uint64_t timeout )
 {
@@ -135,6 +158,9 @@ void EventManager::stop()
 
     _running = false;
 
+    // Return from any blocking check right away
+    wakeup();
+
     // LOG ( "Joining reaper thread" );
     // _reaperThread.join();
     // LOG ( "Joined reaper thread" );
@@ -146,11 +172,26 @@ void EventManager::release()
 
     _running = false;
 
+    wakeup();
+
     LOG ( "Releasing reaper thread" );
 
     _reaperThread.release();
 }
 
+void EventManager::wakeup()
+{
+    SocketManager::get().wakeup();
+}
+
+void EventManager::post ( const function<void()>& task )
+{
+    _tasks.push ( task );
+
+    if ( ! _tasksPending.exchange ( true ) )
+        wakeup();
+}
+
 EventManager& EventManager::get()
 {
     static EventManager instance;
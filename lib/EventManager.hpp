@@ -2,8 +2,11 @@
 
 #include "Thread.hpp"
 #include "BlockingQueue.hpp"
+#include "MpscQueue.hpp"
 
 #include <memory>
+#include <functional>
+#include <atomic>
 
 
 #define CHECK_TIMERS        0x0001
@@ -33,6 +36,13 @@ public:
     // Stop the EventManager and release background threads, can be called on a different thread
     void release();
 
+    // Wake up the event loop if it is waiting for events, can be called on a different thread
+    void wakeup();
+
+    // Queue a task to run on the event loop thread, can be called on a different thread.
+    // Wakes up the event loop, so the task runs as soon as the current wait returns.
+    void post ( const std::function<void()>& task );
+
     // Indicate the EventManager is running
     bool isRunning() const { return _running; }
 
@@ -58,6 +68,15 @@ private:
     // Flag to indicate the event loop is running
     volatile bool _running = false;
 
+    // Tasks posted from other threads
+    MpscQueue<std::function<void()>> _tasks;
+
+    // Set when a task is posted, so only the first post since the last run needs to wake up the event loop
+    std::atomic<bool> _tasksPending;
+
+    // Run all the posted tasks
+    void runTasks();
+
     // Check for events
     void checkEvents ( uint64_t timeout );
 
@@ -1,9 +1,9 @@
 #include "Exceptions.hpp"
 #include "StringUtils.hpp"
 
-#include <winsock2.h>
-#include <windows.h>
-#include <ws2tcpip.h>
+#include "SocketCompat.hpp"
+
+#include <cstring>
 
 using namespace std;
 
@@ -24,6 +24,8 @@ string WinException::str() const
     return format ( "[%d] '%s'; %s; %s", code, desc, debug, user );
 }
 
+#ifdef _WIN32
+
 string WinException::getAsString ( int windowsErrorCode )
 {
     string str;
@@ -40,6 +42,24 @@ string WinException::getLastError()
     return getAsString ( GetLastError() );
 }
 
+#else
+
+string WinException::getAsString ( int windowsErrorCode )
+{
+    // getaddrinfo errors are negative, and have their own strings
+    if ( windowsErrorCode < 0 )
+        return gai_strerror ( windowsErrorCode );
+
+    return strerror ( windowsErrorCode );
+}
+
+string WinException::getLastError()
+{
+    return getAsString ( errno );
+}
+
+#endif // _WIN32
+
 string WinException::getLastSocketError()
 {
     return getAsString ( WSAGetLastError() );
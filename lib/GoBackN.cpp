@@ -1,17 +1,15 @@
 #include "GoBackN.hpp"
+#include "TimerManager.hpp"
 #include "Logger.hpp"
 
 #include <cereal/types/string.hpp>
 
 #include <string>
+#include <algorithm>
 
 using namespace std;
 
 
-// TODO increase me
-#define MTU ( 256 )
-
-
 string formatSerializableSequence ( const MsgPtr& msg )
 {
     ASSERT ( msg->getBaseType() == BaseType::SerializableSequence );
@@ -19,11 +17,36 @@ string formatSerializableSequence ( const MsgPtr& msg )
 }
 
 
+MtuProbe::MtuProbe ( uint32_t size ) : size ( size )
+{
+    // Padding doesn't need to be compressed, it only needs to have the right size
+    compressionLevel = 0;
+
+    MtuProbe empty;
+    empty.size = size;
+    empty.compressionLevel = 0;
+
+    const size_t overhead = ::Protocol::encode ( empty ).size();
+
+    if ( size > overhead )
+        padding.assign ( size - overhead, ( char ) 0 );
+}
+
+
 void GoBackN::timerExpired ( Timer *timer )
 {
-    ASSERT ( timer == _sendTimer.get() );
     ASSERT ( owner != 0 );
 
+    // Nothing went out that the ACK could be piggybacked on
+    if ( timer == _ackTimer.get() )
+    {
+        if ( _ackPending )
+            sendAck();
+        return;
+    }
+
+    ASSERT ( timer == _sendTimer.get() );
+
     if ( _sendList.empty() && !_keepAlive )
     {
         return;
@@ -37,29 +60,58 @@ void GoBackN::timerExpired ( Timer *timer )
     }
     else
     {
-        if ( _sendListPos == _sendList.cend() )
-            _sendListPos = _sendList.cbegin();
+        if ( _sendListPos == _sendList.end() )
+            _sendListPos = _sendList.begin();
+
+        // Skip messages that have already been selectively ACKed
+        for ( size_t i = 0; _sendListPos->acked && i < _sendList.size(); ++i )
+        {
+            if ( ++_sendListPos == _sendList.end() )
+                _sendListPos = _sendList.begin();
+        }
 
 #ifndef DISABLE_LOGGING
         logSendList();
 #endif
 
-        const MsgPtr& msg = *_sendListPos;
+        if ( ! _sendListPos->acked )
+        {
+            const MsgPtr& msg = _sendListPos->msg;
+
+            // Back off once per retransmission round, ie when the oldest unACKed message is resent.
+            // The front of the send list is never selectively ACKed, since it's the next expected sequence.
+            if ( _sendListPos->sendCount > 0 && _sendListPos == _sendList.begin() )
+                backOffRto();
+
+            // Large messages that keep getting lost might not fit the path anymore, so fall back to the
+            // minimum MTU for new messages, and only probe below this size again.
+            if ( _sendListPos->sendCount >= MTU_FALLBACK_RESENDS
+                    && _sendListPos->bytes.size() > MIN_MTU && _mtu >= _sendListPos->bytes.size() )
+            {
+                LOG ( "Falling back to MIN_MTU; mtu=%u; size=%u", _mtu, _sendListPos->bytes.size() );
+
+                resetMtu();
+                _mtuLimit = _sendListPos->bytes.size() - 1;
+            }
+
+            LOG ( "Sending '%s'; sequence=%u; sendSequence=%d; rto=%llu",
+                  msg, msg->getAs<SerializableSequence>().getSequence(), _sendSequence, _rto );
 
-        LOG ( "Sending '%s'; sequence=%u; sendSequence=%d",
-              msg, msg->getAs<SerializableSequence>().getSequence(), _sendSequence );
+            sendEntry ( *_sendListPos );
+        }
 
-        owner->goBackNSendRaw ( this, msg );
         ++_sendListPos;
     }
 
+    checkMtuProbe();
+
     if ( _keepAlive )
     {
-        LOG ( "this=%08x; keepAlive=%llu; countDown=%d", this, _keepAlive, _countDown );
+        LOG ( "this=%08x; keepAlive=%llu; countDown=%llu", this, _keepAlive, _countDown );
 
         if ( _countDown )
         {
-            --_countDown;
+            _countDown -= min ( _countDown, _timerDelay );
         }
         else
         {
@@ -69,7 +121,27 @@ void GoBackN::timerExpired ( Timer *timer )
         }
     }
 
-    _sendTimer->start ( _interval );
+    // Retransmit at the adaptive interval, otherwise only keep alive packets are sent at the base interval
+    _timerDelay = ( _sendList.empty() ? _interval : _rto );
+    _sendTimer->start ( _timerDelay );
+}
+
+void GoBackN::sendEntry ( SendEntry& entry )
+{
+    if ( entry.sendCount++ == 0 )
+        entry.sendTime = TimerManager::get().getNow ( true );
+
+    // Retransmissions just resend the bytes from the first encode, the sequence never changes once sent
+    if ( ! entry.bytes.empty() || owner->goBackNEncode ( this, entry.msg, entry.bytes ) )
+        owner->goBackNSendBytes ( this, entry.bytes );
+    else
+        owner->goBackNSendRaw ( this, entry.msg );
+}
+
+void GoBackN::pushAndSend ( const MsgPtr& msg )
+{
+    _sendList.push_back ( SendEntry ( msg ) );
+    sendEntry ( _sendList.back() );
 }
 
 void GoBackN::checkAndStartTimer()
@@ -77,8 +149,59 @@ void GoBackN::checkAndStartTimer()
     if ( ! _sendTimer )
         _sendTimer.reset ( new Timer ( this ) );
 
-    if ( ! _sendTimer->isStarted() )
-        _sendTimer->start ( _interval );
+    const uint64_t delay = ( _sendList.empty() ? _interval : _rto );
+
+    // Restart the timer if the retransmission interval is shorter than the keep alive interval
+    if ( ! _sendTimer->isStarted() || delay < _timerDelay )
+    {
+        _timerDelay = delay;
+        _sendTimer->start ( _timerDelay );
+    }
+}
+
+void GoBackN::updateRtt ( uint64_t rtt )
+{
+    if ( ! _hasRtt )
+    {
+        _srtt = rtt;
+        _rttVar = rtt / 2;
+        _hasRtt = true;
+    }
+    else
+    {
+        const uint64_t delta = ( _srtt > rtt ? _srtt - rtt : rtt - _srtt );
+        _rttVar = ( 3 * _rttVar + delta ) / 4;
+        _srtt = ( 7 * _srtt + rtt ) / 8;
+    }
+
+    resetRto();
+
+    LOG ( "rtt=%llu; srtt=%llu; rttVar=%llu; rto=%llu", rtt, _srtt, _rttVar, _rto );
+}
+
+void GoBackN::resetRto()
+{
+    if ( ! _hasRtt )
+    {
+        _rto = _interval;
+        return;
+    }
+
+    // The timer has millisecond granularity, so the variance term is at least 1 ms.
+    // In delayed ACK mode the peer also delays ACKs, so allow for a full delay on top of the average.
+    _rto = _srtt + max<uint64_t> ( _delayedAck ? DELAYED_ACK_INTERVAL : 1, 4 * _rttVar );
+    _rto = min<uint64_t> ( max<uint64_t> ( _rto, MIN_SEND_INTERVAL ), MAX_SEND_INTERVAL );
+}
+
+void GoBackN::backOffRto()
+{
+    // Resent messages never give a new RTT sample, so under steady random loss the backoff would only
+    // come down when an ACK happens to get through. Every message is resent one interval after the
+    // previous one, so a large backoff slows down the whole send list, not just the lost message.
+    const uint64_t limit = min<uint64_t> ( max ( 2 * _srtt, _interval ), MAX_SEND_INTERVAL );
+
+    // The interval from the RTT estimate itself can already be past the limit
+    _rto = max ( _rto, min<uint64_t> ( 2 * _rto, limit ) );
 }
 
 void GoBackN::sendViaGoBackN ( SerializableSequence *message )
@@ -92,7 +215,7 @@ void GoBackN::sendViaGoBackN ( const MsgPtr& msg )
     LOG ( "Adding '%s'; sendSequence=%d", msg, _sendSequence + 1 );
 
     ASSERT ( msg->getBaseType() == BaseType::SerializableSequence );
-    ASSERT ( _sendList.empty() || _sendList.back()->getAs<SerializableSequence>().getSequence() == _sendSequence );
+    ASSERT ( _sendList.empty() || _sendList.back().msg->getAs<SerializableSequence>().getSequence() == _sendSequence );
     ASSERT ( owner != 0 );
 
     if ( msg->getAs<SerializableSequence>().getSequence() != 0 )
@@ -100,33 +223,33 @@ void GoBackN::sendViaGoBackN ( const MsgPtr& msg )
         MsgPtr clone = msg->clone();
         clone->getAs<SerializableSequence>().setSequence ( ++_sendSequence );
 
-        owner->goBackNSendRaw ( this, clone );
-        _sendList.push_back ( clone );
+        pushAndSend ( clone );
     }
     else
     {
         msg->getAs<SerializableSequence>().setSequence ( _sendSequence + 1 );
-        string bytes = ::Protocol::encode ( msg );
 
-        if ( bytes.size() <= MTU )
+        // Encode once with the owner's encoding, the same bytes are checked against the MTU,
+        // and then either cached for retransmissions or split into smaller messages.
+        string bytes;
+        const bool cached = owner->goBackNEncode ( this, msg, bytes );
+
+        if ( ! cached )
+            bytes = ::Protocol::encode ( msg );
+
+        if ( bytes.size() <= _mtu )
         {
             ++_sendSequence;
-            owner->goBackNSendRaw ( this, msg );
-            _sendList.push_back ( msg );
+            _sendList.push_back ( SendEntry ( msg ) );
+
+            if ( cached )
+                _sendList.back().bytes.swap ( bytes );
+
+            sendEntry ( _sendList.back() );
         }
         else
         {
-            const uint32_t count = ( bytes.size() / MTU ) + ( bytes.size() % MTU == 0 ? 0 : 1 );
-
-            for ( uint32_t pos = 0, i = 0; pos < bytes.size(); pos += MTU, ++i )
-            {
-                SplitMessage *splitMsg = new SplitMessage ( msg->getMsgType(), bytes.substr ( pos, MTU ), i, count );
-                splitMsg->setSequence ( ++_sendSequence );
-
-                MsgPtr msg ( splitMsg );
-                owner->goBackNSendRaw ( this, msg );
-                _sendList.push_back ( msg );
-            }
+            pushAndSendSplit ( msg->getMsgType(), bytes );
         }
     }
 
@@ -135,6 +258,35 @@ void GoBackN::sendViaGoBackN ( const MsgPtr& msg )
     checkAndStartTimer();
 }
 
+void GoBackN::sendViaGoBackN ( MsgType type, const string& bytes )
+{
+    LOG ( "Adding encoded '%s' [ %u bytes ]; sendSequence=%d", type, bytes.size(), _sendSequence + 1 );
+
+    ASSERT ( bytes.empty() == false );
+    ASSERT ( owner != 0 );
+
+    pushAndSendSplit ( type, bytes );
+
+    logSendList();
+
+    checkAndStartTimer();
+}
+
+void GoBackN::pushAndSendSplit ( MsgType type, const string& bytes )
+{
+    // Each chunk is sized so the encoded SplitMessage still fits in the MTU
+    const uint32_t chunk = _mtu - SPLIT_MESSAGE_OVERHEAD;
+    const uint32_t count = ( bytes.size() / chunk ) + ( bytes.size() % chunk == 0 ? 0 : 1 );
+
+    for ( uint32_t pos = 0, i = 0; pos < bytes.size(); pos += chunk, ++i )
+    {
+        SplitMessage *splitMsg = new SplitMessage ( type, bytes.substr ( pos, chunk ), i, count );
+        splitMsg->setSequence ( ++_sendSequence );
+
+        pushAndSend ( MsgPtr ( splitMsg ) );
+    }
+}
+
 void GoBackN::recvFromSocket ( const MsgPtr& msg )
 {
     ASSERT ( owner != 0 );
@@ -143,7 +295,7 @@ void GoBackN::recvFromSocket ( const MsgPtr& msg )
     {
         refreshKeepAlive();
 
-        LOG ( "this=%08x; keepAlive=%llu; countDown=%d", this, _keepAlive, _countDown );
+        LOG ( "this=%08x; keepAlive=%llu; countDown=%llu", this, _keepAlive, _countDown );
 
         checkAndStartTimer();
     }
@@ -152,6 +304,17 @@ void GoBackN::recvFromSocket ( const MsgPtr& msg )
     if ( ! msg.get() )
         return;
 
+    // Handle any ACK piggybacked on the message
+    if ( msg->ackSequence && msg->ackSequence <= _sendSequence )
+        recvAck ( msg->ackSequence, 0 );
+
+    // MTU probes are handled here instead of by the owner
+    if ( msg->getMsgType() == MsgType::MtuProbe || msg->getMsgType() == MsgType::MtuProbeAck )
+    {
+        recvMtuProbe ( msg );
+        return;
+    }
+
     // Filter non-sequential messages
     if ( msg->getBaseType() != BaseType::SerializableSequence )
     {
@@ -165,62 +328,329 @@ void GoBackN::recvFromSocket ( const MsgPtr& msg )
     // Check for ACK messages
     if ( msg->getMsgType() == MsgType::AckSequence )
     {
-        if ( sequence > _ackSequence )
-            _ackSequence = sequence;
-
-        LOG ( "Got AckSequence; sequence=%u; sendSequence=%u", sequence, _sendSequence );
-
-        // Remove messages from sendList with sequence <= the ACKed sequence
-        while ( !_sendList.empty() && _sendList.front()->getAs<SerializableSequence>().getSequence() <= sequence )
-            _sendList.pop_front();
-        _sendListPos = _sendList.cend();
+        recvAck ( sequence, 0 );
+        return;
+    }
 
-        logSendList();
+    if ( msg->getMsgType() == MsgType::SackSequence )
+    {
+        recvAck ( sequence, msg->getAs<SackSequence>().received );
         return;
     }
 
     if ( sequence != _recvSequence + 1 )
     {
-        owner->goBackNSendRaw ( this, MsgPtr ( new AckSequence ( _recvSequence ) ) );
+        // Buffer out of order messages in selective repeat mode, so they don't need to be resent
+        if ( _selectiveRepeat && sequence > _recvSequence + 1 && sequence - _recvSequence - 2 < SACK_WINDOW )
+        {
+            LOG ( "Buffered '%s'; sequence=%u; recvSequence=%u", msg, sequence, _recvSequence );
+            _recvOutOfOrder.insert ( make_pair ( sequence, msg ) );
+        }
+
+        sendAck();
         return;
     }
 
     LOG ( "Received '%s'; sequence=%u; recvSequence=%u", msg, sequence, _recvSequence );
 
-    ++_recvSequence;
+    vector<MsgPtr> msgs;
 
-    owner->goBackNSendRaw ( this, MsgPtr ( new AckSequence ( _recvSequence ) ) );
+    recvInOrder ( msg, msgs );
 
-    if ( msg->getMsgType() == MsgType::SplitMessage )
+    // Any buffered messages that are now in order
+    while ( !_recvOutOfOrder.empty() && _recvOutOfOrder.begin()->first == _recvSequence + 1 )
     {
-        const SplitMessage& splitMsg = msg->getAs<SplitMessage>();
+        const MsgPtr next = _recvOutOfOrder.begin()->second;
+        _recvOutOfOrder.erase ( _recvOutOfOrder.begin() );
+        recvInOrder ( next, msgs );
+    }
+
+    queueAck();
+
+    for ( const MsgPtr& msg : msgs )
+        owner->goBackNRecvMsg ( this, msg );
+}
 
-        _recvBuffer += splitMsg.bytes;
+void GoBackN::recvAck ( uint32_t sequence, uint32_t received )
+{
+    if ( sequence > _ackSequence )
+        _ackSequence = sequence;
+
+    LOG ( "Got AckSequence; sequence=%u; received=%08x; sendSequence=%u", sequence, received, _sendSequence );
 
-        if ( splitMsg.isLastMessage() )
+    // Only messages that were sent once give an unambiguous round trip time sample
+    bool hasSample = false;
+    uint64_t sampleTime = 0;
+
+    const auto newlyAcked = [&] ( SendEntry& entry )
+    {
+        if ( entry.sendCount == 1 && ( ! hasSample || entry.sendTime > sampleTime ) )
         {
-            size_t consumed = 0;
-            MsgPtr msg = ::Protocol::decode ( &_recvBuffer[0], _recvBuffer.size(), consumed );
+            hasSample = true;
+            sampleTime = entry.sendTime;
+        }
+    };
 
-            if ( !msg.get() || msg->getMsgType() != splitMsg.origMsgType || consumed != _recvBuffer.size() )
-            {
-                LOG ( "Failed to recreate '%s' from [ %u bytes ]", splitMsg.origMsgType, _recvBuffer.size() );
-                msg.reset();
-            }
+    // Remove messages from sendList with sequence <= the ACKed sequence
+    bool advanced = false;
+    while ( !_sendList.empty() && _sendList.front().msg->getAs<SerializableSequence>().getSequence() <= sequence )
+    {
+        if ( ! _sendList.front().acked )
+            newlyAcked ( _sendList.front() );
 
-            _recvBuffer.clear();
+        _sendList.pop_front();
+        advanced = true;
+    }
+    _sendListPos = _sendList.end();
+
+    // Mark selectively ACKed messages, so only the missing messages get resent
+    if ( received )
+    {
+        for ( SendEntry& entry : _sendList )
+        {
+            const uint32_t offset = entry.msg->getAs<SerializableSequence>().getSequence() - sequence - 2;
 
-            if ( msg )
+            if ( offset < SACK_WINDOW && ( received & ( 1u << offset ) ) && ! entry.acked )
             {
-                LOG ( "Recreated '%s'", msg );
-                owner->goBackNRecvMsg ( this, msg );
+                entry.acked = true;
+                newlyAcked ( entry );
             }
         }
+    }
+
+    if ( hasSample )
+    {
+        const uint64_t now = TimerManager::get().getNow ( true );
+        updateRtt ( now > sampleTime ? now - sampleTime : 0 );
+    }
+    else if ( advanced )
+    {
+        // The cumulative ACK advanced, so the path is delivering again, drop any backoff
+        resetRto();
+    }
+
+    logSendList();
+}
+
+void GoBackN::recvInOrder ( const MsgPtr& msg, vector<MsgPtr>& msgs )
+{
+    ++_recvSequence;
 
+    if ( msg->getMsgType() != MsgType::SplitMessage )
+    {
+        recvUnwrapped ( msg, msgs );
+        return;
+    }
+
+    const SplitMessage& splitMsg = msg->getAs<SplitMessage>();
+
+    _recvBuffer += splitMsg.bytes;
+
+    if ( ! splitMsg.isLastMessage() )
+        return;
+
+    size_t consumed = 0;
+    MsgPtr origMsg = ::Protocol::decode ( &_recvBuffer[0], _recvBuffer.size(), consumed );
+
+    if ( !origMsg.get() || origMsg->getMsgType() != splitMsg.origMsgType || consumed != _recvBuffer.size() )
+    {
+        LOG ( "Failed to recreate '%s' from [ %u bytes ]", splitMsg.origMsgType, _recvBuffer.size() );
+        origMsg.reset();
+    }
+
+    _recvBuffer.clear();
+
+    if ( origMsg )
+    {
+        LOG ( "Recreated '%s'", origMsg );
+        recvUnwrapped ( origMsg, msgs );
+    }
+}
+
+void GoBackN::recvUnwrapped ( const MsgPtr& msg, vector<MsgPtr>& msgs )
+{
+    if ( msg->getMsgType() != MsgType::SharedSequence )
+    {
+        msgs.push_back ( msg );
+        return;
+    }
+
+    // The wrapped message was already decoded and checked when the SharedSequence was loaded
+    const MsgPtr& origMsg = msg->getAs<SharedSequence>().msg;
+
+    ASSERT ( origMsg.get() != 0 );
+
+    LOG ( "Unwrapped '%s'", origMsg );
+    msgs.push_back ( origMsg );
+}
+
+void GoBackN::sendAck()
+{
+    _ackPending = false;
+
+    if ( _ackTimer )
+        _ackTimer->stop();
+
+    // Buffered sequences are always in the range [recvSequence + 2, recvSequence + 2 + SACK_WINDOW)
+    uint32_t received = 0;
+
+    for ( const auto& kv : _recvOutOfOrder )
+        received |= ( 1u << ( kv.first - _recvSequence - 2 ) );
+
+    if ( received )
+        owner->goBackNSendRaw ( this, MsgPtr ( new SackSequence ( _recvSequence, received ) ) );
+    else
+        owner->goBackNSendRaw ( this, MsgPtr ( new AckSequence ( _recvSequence ) ) );
+}
+
+void GoBackN::queueAck()
+{
+    // Selective ACKs can't be piggybacked, and out of order messages should be ACKed immediately anyway
+    if ( ! _delayedAck || ! _recvOutOfOrder.empty() )
+    {
+        sendAck();
+        return;
+    }
+
+    _ackPending = true;
+
+    if ( ! _ackTimer )
+        _ackTimer.reset ( new Timer ( this ) );
+
+    if ( ! _ackTimer->isStarted() )
+        _ackTimer->start ( DELAYED_ACK_INTERVAL );
+}
+
+uint32_t GoBackN::takeAckSequence()
+{
+    if ( ! _ackPending )
+        return 0;
+
+    _ackPending = false;
+    _ackTimer->stop();
+
+    return _recvSequence;
+}
+
+void GoBackN::setDelayedAck ( bool enabled )
+{
+    _delayedAck = enabled;
+
+    // Don't leave a pending ACK waiting for the timer
+    if ( ! enabled && _ackPending )
+        sendAck();
+
+    LOG ( "delayedAck=%u", _delayedAck );
+}
+
+void GoBackN::setSelectiveRepeat ( bool enabled )
+{
+    // Already buffered messages are kept even if disabled, since they might have been selectively ACKed
+    _selectiveRepeat = enabled;
+
+    LOG ( "selectiveRepeat=%u", _selectiveRepeat );
+}
+
+void GoBackN::setMtuProbing ( bool enabled )
+{
+    // The discovered MTU is kept even if disabled, since it doesn't need the peer to support anything
+    _mtuProbing = enabled;
+    _mtuProbeSize = _mtuProbeCount = 0;
+
+    LOG ( "mtuProbing=%u; mtu=%u", _mtuProbing, _mtu );
+}
+
+void GoBackN::checkMtuProbe()
+{
+    if ( ! _mtuProbing )
+        return;
+
+    const uint64_t now = TimerManager::get().getNow ( true );
+
+    // Wait for the outstanding probe to be answered
+    if ( _mtuProbeCount && now < _mtuProbeTime + max<uint64_t> ( MTU_PROBE_INTERVAL, 2 * _rto ) )
+        return;
+
+    // Too many unanswered probes, so this size doesn't fit
+    if ( _mtuProbeCount >= MTU_PROBE_ATTEMPTS )
+    {
+        LOG ( "MTU probe failed; size=%u; mtu=%u", _mtuProbeSize, _mtu );
+
+        _mtuLimit = _mtuProbeSize - 1;
+        _mtuProbeSize = _mtuProbeCount = 0;
+    }
+
+    if ( ! _mtuProbeSize )
+    {
+        if ( _mtuLimit < _mtu + MTU_PROBE_STEP )
+            return;
+
+        // Try the upper limit first since it usually fits, otherwise binary search between the MTU and the limit
+        _mtuProbeSize = ( _mtuLimit == MAX_MTU ? MAX_MTU : ( _mtu + _mtuLimit + 1 ) / 2 );
+    }
+
+    ++_mtuProbeCount;
+    _mtuProbeTime = now;
+
+    LOG ( "Sending MtuProbe; size=%u; count=%u; mtu=%u", _mtuProbeSize, _mtuProbeCount, _mtu );
+
+    MtuProbe *probe = new MtuProbe ( _mtuProbeSize );
+    MsgPtr msg ( probe );
+
+    // The padding is sized for the default encoding, so resize it for the owner's hash type and flags,
+    // and send the encoded bytes as is, so no ACK gets piggybacked on the probe.
+    string bytes;
+    if ( owner->goBackNEncode ( this, msg, bytes ) )
+    {
+        if ( bytes.size() != _mtuProbeSize )
+        {
+            const size_t overhead = bytes.size() - probe->padding.size();
+
+            probe->padding.assign ( _mtuProbeSize > overhead ? _mtuProbeSize - overhead : 0, ( char ) 0 );
+            probe->invalidate();
+
+            bytes.clear();
+            owner->goBackNEncode ( this, msg, bytes );
+        }
+
+        LOG ( "Encoded MtuProbe to [ %u bytes ]", bytes.size() );
+
+        owner->goBackNSendBytes ( this, bytes );
         return;
     }
 
-    owner->goBackNRecvMsg ( this, msg );
+    owner->goBackNSendRaw ( this, msg );
+}
+
+void GoBackN::recvMtuProbe ( const MsgPtr& msg )
+{
+    if ( msg->getMsgType() == MsgType::MtuProbe )
+    {
+        LOG ( "Received MtuProbe; size=%u", msg->getAs<MtuProbe>().size );
+        owner->goBackNSendRaw ( this, MsgPtr ( new MtuProbeAck ( msg->getAs<MtuProbe>().size ) ) );
+        return;
+    }
+
+    const uint32_t size = msg->getAs<MtuProbeAck>().size;
+
+    // Ignore late replies to earlier probes
+    if ( ! _mtuProbing || size != _mtuProbeSize )
+        return;
+
+    _mtu = max ( _mtu, size );
+    _mtuProbeSize = _mtuProbeCount = 0;
+
+    LOG ( "MTU probe succeeded; mtu=%u; mtuLimit=%u", _mtu, _mtuLimit );
+
+    // Probe the next size immediately
+    checkMtuProbe();
+}
+
+void GoBackN::resetMtu()
+{
+    _mtu = MIN_MTU;
+    _mtuLimit = MAX_MTU;
+    _mtuProbeSize = _mtuProbeCount = 0;
 }
 
 void GoBackN::setSendInterval ( uint64_t interval )
@@ -229,9 +659,12 @@ void GoBackN::setSendInterval ( uint64_t interval )
 
     _interval = interval;
 
+    if ( ! _hasRtt )
+        _rto = interval;
+
     refreshKeepAlive();
 
-    LOG ( "interval=%llu; countDown=%d", _interval, _countDown );
+    LOG ( "interval=%llu; rto=%llu; countDown=%llu", _interval, _rto, _countDown );
 }
 
 void GoBackN::setKeepAlive ( uint64_t timeout )
@@ -240,7 +673,7 @@ void GoBackN::setKeepAlive ( uint64_t timeout )
 
     refreshKeepAlive();
 
-    LOG ( "keepAlive=%llu; countDown=%d", _keepAlive, _countDown );
+    LOG ( "keepAlive=%llu; countDown=%llu", _keepAlive, _countDown );
 }
 
 void GoBackN::reset()
@@ -249,15 +682,25 @@ void GoBackN::reset()
 
     _sendSequence = _recvSequence = 0;
     _sendList.clear();
-    _sendListPos = _sendList.cend();
+    _sendListPos = _sendList.end();
     _sendTimer.reset();
+    _ackTimer.reset();
+    _ackPending = false;
     _recvBuffer.clear();
+    _recvOutOfOrder.clear();
+
+    _srtt = _rttVar = 0;
+    _hasRtt = false;
+    _rto = _interval;
+
+    resetMtu();
 }
 
 GoBackN::GoBackN ( Owner *owner, uint64_t interval, uint64_t timeout )
     : owner ( owner )
-    , _sendListPos ( _sendList.cend() )
+    , _sendListPos ( _sendList.end() )
     , _interval ( interval )
+    , _rto ( interval )
     , _keepAlive ( timeout )
 {
     ASSERT ( _interval > 0 );
@@ -267,7 +710,7 @@ GoBackN::GoBackN ( Owner *owner, uint64_t interval, uint64_t timeout )
 
 GoBackN::GoBackN ( Owner *owner, const GoBackN& state )
     : owner ( owner )
-    , _sendListPos ( _sendList.cend() )
+    , _sendListPos ( _sendList.end() )
 {
     *this = state;
 }
@@ -282,29 +725,83 @@ GoBackN& GoBackN::operator= ( const GoBackN& other )
     _sendSequence = other._sendSequence;
     _recvSequence = other._recvSequence;
     _ackSequence = other._ackSequence;
-    _sendList = other._sendList;
     _interval = other._interval;
+    _srtt = other._srtt;
+    _rttVar = other._rttVar;
+    _hasRtt = other._hasRtt;
+    _rto = other._rto;
     _keepAlive = other._keepAlive;
     _countDown = other._keepAlive;
 
+    // Only copy the messages, the cached bytes are specific to the owner that encoded them
+    list<SendEntry> sendList;
+    for ( const SendEntry& entry : other._sendList )
+    {
+        sendList.push_back ( SendEntry ( entry.msg ) );
+        sendList.back().acked = entry.acked;
+    }
+    _sendList.swap ( sendList );
+    _sendListPos = _sendList.end();
+
+    _recvOutOfOrder = other._recvOutOfOrder;
+    _selectiveRepeat = other._selectiveRepeat;
+    _delayedAck = other._delayedAck;
+
+    _mtu = other._mtu;
+    _mtuLimit = other._mtuLimit;
+    _mtuProbing = other._mtuProbing;
+    _mtuProbeSize = _mtuProbeCount = 0;
+
     ASSERT ( _interval > 0 );
 
     return *this;
 }
 
+void SharedSequence::save ( cereal::BinaryOutputArchive& ar ) const
+{
+    // The bytes are last, since the hash doesn't cover them
+    if ( bytes )
+        ar ( *bytes );
+    else
+        ar ( string() );
+}
+
+void SharedSequence::load ( cereal::BinaryInputArchive& ar )
+{
+    string str;
+    ar ( str );
+    bytes = make_shared<const string> ( move ( str ) );
+
+    // This also checks the hash of the wrapped message, which the SharedSequence hash didn't cover
+    size_t consumed = 0;
+    msg = ::Protocol::decode ( bytes->data(), bytes->size(), consumed );
+
+    if ( !msg.get() || consumed != bytes->size() )
+        throw cereal::Exception ( "Invalid shared message" );
+}
+
 void GoBackN::save ( cereal::BinaryOutputArchive& ar ) const
 {
-    ar ( _recvBuffer, _keepAlive, _sendSequence, _recvSequence, _ackSequence );
+    ar ( _recvBuffer, _keepAlive, _sendSequence, _recvSequence, _ackSequence, _selectiveRepeat, _delayedAck );
+    ar ( _interval, _srtt, _rttVar, _hasRtt, _rto );
+    ar ( _mtu, _mtuLimit, _mtuProbing );
 
     ar ( _sendList.size() );
 
-    for ( const MsgPtr& msg : _sendList )
-        ar ( Protocol::encode ( msg ) );
+    for ( const SendEntry& entry : _sendList )
+        ar ( Protocol::encode ( entry.msg ), entry.acked );
+
+    ar ( _recvOutOfOrder.size() );
+
+    for ( const auto& kv : _recvOutOfOrder )
+        ar ( kv.first, Protocol::encode ( kv.second ) );
 }
 
 void GoBackN::load ( cereal::BinaryInputArchive& ar )
 {
-    ar ( _recvBuffer, _keepAlive, _sendSequence, _recvSequence, _ackSequence );
+    ar ( _recvBuffer, _keepAlive, _sendSequence, _recvSequence, _ackSequence, _selectiveRepeat, _delayedAck );
+    ar ( _interval, _srtt, _rttVar, _hasRtt, _rto );
+    ar ( _mtu, _mtuLimit, _mtuProbing );
 
     size_t size, consumed;
     ar ( size );
@@ -312,14 +809,25 @@ void GoBackN::load ( cereal::BinaryInputArchive& ar )
     string buffer;
     for ( size_t i = 0; i < size; ++i )
     {
-        ar ( buffer );
-        _sendList.push_back ( Protocol::decode ( &buffer[0], buffer.size(), consumed ) );
+        bool acked;
+        ar ( buffer, acked );
+        _sendList.push_back ( SendEntry ( Protocol::decode ( &buffer[0], buffer.size(), consumed ) ) );
+        _sendList.back().acked = acked;
+    }
+
+    ar ( size );
+
+    for ( size_t i = 0; i < size; ++i )
+    {
+        uint32_t sequence;
+        ar ( sequence, buffer );
+        _recvOutOfOrder[sequence] = Protocol::decode ( &buffer[0], buffer.size(), consumed );
     }
 }
 
 void GoBackN::logSendList() const
 {
-    LOG_LIST ( _sendList, formatSerializableSequence );
+    LOG_LIST ( _sendList, [] ( const SendEntry & entry ) { return formatSerializableSequence ( entry.msg ); } );
 }
 
 void GoBackN::delayKeepAliveOnce()
@@ -329,5 +837,5 @@ void GoBackN::delayKeepAliveOnce()
 
 void GoBackN::refreshKeepAlive()
 {
-    _countDown = ( _keepAlive / _interval );
+    _countDown = _keepAlive;
 }
@@ -4,10 +4,43 @@
 #include "Timer.hpp"
 
 #include <list>
+#include <map>
+#include <vector>
 
 
 #define DEFAULT_SEND_INTERVAL ( 50 )
 
+// Limits for the adaptive retransmission interval
+#define MIN_SEND_INTERVAL ( 5 )
+#define MAX_SEND_INTERVAL ( 500 )
+
+// Number of sequences after the ACKed sequence that can be selectively ACKed
+#define SACK_WINDOW ( 32 )
+
+// Largest encoded message size that is sent without splitting. The minimum is the largest UDP payload
+// that is always deliverable over IPv4, larger sizes up to the maximum are only used once probed.
+#define MIN_MTU ( 508 )
+#define MAX_MTU ( 1200 )
+
+// Stop probing once the probe range is smaller than this
+#define MTU_PROBE_STEP ( 32 )
+
+// Number of unanswered probes before a size is considered too large
+#define MTU_PROBE_ATTEMPTS ( 3 )
+
+// Minimum interval between probes
+#define MTU_PROBE_INTERVAL ( 250 )
+
+// Number of resends of a message larger than MIN_MTU before falling back to MIN_MTU
+#define MTU_FALLBACK_RESENDS ( 8 )
+
+// Upper bound on the bytes SplitMessage adds to each chunk
+#define SPLIT_MESSAGE_OVERHEAD ( 48 )
+
+// Delay before sending a standalone ACK in delayed ACK mode, this is longer than a frame,
+// so the ACK is usually piggybacked on the next frame's inputs instead.
+#define DELAYED_ACK_INTERVAL ( 20 )
+
 
 struct AckSequence : public SerializableSequence
 {
@@ -17,6 +50,41 @@ struct AckSequence : public SerializableSequence
 };
 
 
+struct SackSequence : public SerializableSequence
+{
+    // Bit i is set if sequence + 2 + i was also received, the sequence itself is the cumulative ACK
+    uint32_t received = 0;
+
+    SackSequence ( uint32_t sequence, uint32_t received )
+        : SerializableSequence ( sequence ), received ( received ) {}
+
+    PROTOCOL_MESSAGE_BOILERPLATE ( SackSequence, received )
+};
+
+
+// Unsequenced message padded to an exact encoded size, the peer replies with MtuProbeAck if it arrives
+struct MtuProbe : public SerializableMessage
+{
+    uint32_t size = 0;
+
+    std::string padding;
+
+    MtuProbe ( uint32_t size );
+
+    PROTOCOL_MESSAGE_BOILERPLATE ( MtuProbe, size, padding )
+};
+
+
+struct MtuProbeAck : public SerializableMessage
+{
+    uint32_t size = 0;
+
+    MtuProbeAck ( uint32_t size ) : size ( size ) {}
+
+    PROTOCOL_MESSAGE_BOILERPLATE ( MtuProbeAck, size )
+};
+
+
 struct SplitMessage : public SerializableSequence
 {
     MsgType origMsgType;
@@ -41,6 +109,23 @@ struct SplitMessage : public SerializableSequence
 };
 
 
+// Sequenced wrapper around an encoded message that is shared by many connections, see Socket::sendShared.
+// The encoded message has its own hash, so the wrapper's hash only covers the sequence and the size.
+struct SharedSequence : public SerializableSequence
+{
+    std::shared_ptr<const std::string> bytes;
+
+    // The wrapped message, decoded on load so a corrupted payload fails the whole SharedSequence before it is acked
+    MsgPtr msg;
+
+    SharedSequence ( const std::shared_ptr<const std::string>& bytes ) : bytes ( bytes ) {}
+
+    size_t getUnhashedSize() const override { return bytes ? bytes->size() : 0; }
+
+    DECLARE_MESSAGE_BOILERPLATE ( SharedSequence )
+};
+
+
 class GoBackN : public SerializableSequence, private Timer::Owner
 {
 public:
@@ -50,6 +135,14 @@ public:
         // Send a message via raw socket
         virtual void goBackNSendRaw ( GoBackN *gbn, const MsgPtr& msg ) = 0;
 
+        // Encode a sequenced message for sending via raw socket, the bytes are cached for retransmissions.
+        // Return false if the bytes shouldn't be cached, then goBackNSendRaw is used for every send.
+        // This is also used to size MtuProbe padding to the owner's encoding.
+        virtual bool goBackNEncode ( GoBackN *gbn, const MsgPtr& msg, std::string& bytes ) { return false; }
+
+        // Send the cached bytes of a sequenced message via raw socket
+        virtual void goBackNSendBytes ( GoBackN *gbn, const std::string& bytes ) {}
+
         // Receive a raw non-sequenced message
         virtual void goBackNRecvRaw ( GoBackN *gbn, const MsgPtr& msg ) = 0;
 
@@ -72,13 +165,22 @@ public:
     void sendViaGoBackN ( SerializableSequence *message );
     void sendViaGoBackN ( const MsgPtr& msg );
 
+    // Send an already encoded message via GoBackN, wrapped in SplitMessage so only the sequence is encoded here.
+    // This lets the same encoded bytes be sent over many connections, see SharedMessage.
+    void sendViaGoBackN ( MsgType type, const std::string& bytes );
+
     // Receive a message from the raw socket
     void recvFromSocket ( const MsgPtr& msg );
 
-    // Get / set the interval to send packets, should be non-zero
-    uint64_t getSendInterval() const { return _interval; }
+    // Get the current retransmission interval, this adapts to the measured round trip time.
+    // Set the base interval, which is used for keep alive packets and until the round trip time is measured.
+    uint64_t getSendInterval() const { return _rto; }
     void setSendInterval ( uint64_t interval );
 
+    // Get the smoothed round trip time and variance measured from ACKs, 0 if not measured yet
+    uint64_t getSmoothedRtt() const { return _srtt; }
+    uint64_t getRttVariance() const { return _rttVar; }
+
     // Get / set the timeout for keep alive packets, 0 to disable
     uint64_t getKeepAlive() const { return _keepAlive; }
     void setKeepAlive ( uint64_t timeout );
@@ -90,6 +192,28 @@ public:
     // Get the number of messages ACKed
     uint32_t getAckCount() const { return _ackSequence; }
 
+    // Get / set selective repeat mode, where out of order messages are buffered and selectively ACKed,
+    // so only the missing messages are resent. Both sides must support SackSequence to enable this.
+    bool isSelectiveRepeat() const { return _selectiveRepeat; }
+    void setSelectiveRepeat ( bool enabled );
+
+    // Get the current MTU, messages that encode larger than this are split
+    uint32_t getMtu() const { return _mtu; }
+
+    // Get / set path MTU probing, where the MTU is raised towards MAX_MTU with MtuProbe messages.
+    // Both sides must support MtuProbe to enable this.
+    bool isMtuProbing() const { return _mtuProbing; }
+    void setMtuProbing ( bool enabled );
+
+    // Get / set delayed ACK mode, where in order messages are ACKed by piggybacking on outgoing messages,
+    // and a standalone ACK is only sent if nothing goes out within DELAYED_ACK_INTERVAL.
+    // Both sides must support Serializable::ackSequence to enable this.
+    bool isDelayedAck() const { return _delayedAck; }
+    void setDelayedAck ( bool enabled );
+
+    // Take the pending ACK sequence to piggyback on an outgoing message, 0 if there is none
+    uint32_t takeAckSequence();
+
     // Delay sending the next keep alive packet
     void delayKeepAliveOnce();
 
@@ -109,11 +233,27 @@ private:
     // Last ACKed sequence
     uint32_t _ackSequence = 0;
 
+    // Message to repeatedly send, with the encoded bytes cached after the first send
+    struct SendEntry
+    {
+        MsgPtr msg;
+        std::string bytes;
+
+        // Selectively ACKed, so this doesn't need to be resent
+        bool acked = false;
+
+        // Number of times sent, and the time of the first send
+        uint32_t sendCount = 0;
+        uint64_t sendTime = 0;
+
+        SendEntry ( const MsgPtr& msg ) : msg ( msg ) {}
+    };
+
     // Current list of messages to repeatedly send
-    std::list<MsgPtr> _sendList;
+    std::list<SendEntry> _sendList;
 
     // Current position in the sendList
-    std::list<MsgPtr>::const_iterator _sendListPos;
+    std::list<SendEntry>::iterator _sendListPos;
 
     // Timer for repeatedly sending messages
     TimerPtr _sendTimer;
@@ -121,24 +261,100 @@ private:
     // Buffer for accumulating split messages
     std::string _recvBuffer;
 
-    // The interval to send packets, should be non-zero
+    // Out of order messages received in selective repeat mode, indexed by sequence
+    std::map<uint32_t, MsgPtr> _recvOutOfOrder;
+
+    // Selective repeat mode
+    bool _selectiveRepeat = false;
+
+    // Current MTU, and the largest size that might still work
+    uint32_t _mtu = MIN_MTU, _mtuLimit = MAX_MTU;
+
+    // Path MTU probing mode
+    bool _mtuProbing = false;
+
+    // Size of the outstanding probe, 0 if none, and the number of times it has been sent
+    uint32_t _mtuProbeSize = 0, _mtuProbeCount = 0;
+
+    // The time the last probe was sent
+    uint64_t _mtuProbeTime = 0;
+
+    // Delayed ACK mode, and if there is an ACK waiting to be sent
+    bool _delayedAck = false, _ackPending = false;
+
+    // Timer for sending a delayed ACK
+    TimerPtr _ackTimer;
+
+    // The base interval to send packets, should be non-zero
     uint64_t _interval = DEFAULT_SEND_INTERVAL;
 
+    // Smoothed round trip time and variance, see RFC 6298
+    uint64_t _srtt = 0, _rttVar = 0;
+    bool _hasRtt = false;
+
+    // Current retransmission interval, including any backoff
+    uint64_t _rto = DEFAULT_SEND_INTERVAL;
+
+    // The delay the send timer was last started with
+    uint64_t _timerDelay = 0;
+
     // The timeout for keep alive packets, 0 to disable
     uint64_t _keepAlive = 0;
 
-    // The countdown timer for the keep alive packets
-    uint32_t _countDown = 0;
+    // The remaining time until keep alive timeout
+    uint64_t _countDown = 0;
 
     // Delay sending the keep alive packet for one iteration
     bool _skipNextKeepAlive = false;
 
-    // Timer callback that sends the messages
+    // Timer callback that sends the messages, or the delayed ACK
     void timerExpired ( Timer *timer ) override;
 
+    // Send a message in the send list, using the cached bytes if possible
+    void sendEntry ( SendEntry& entry );
+
+    // Add a message to the send list and send it
+    void pushAndSend ( const MsgPtr& msg );
+
+    // Split the encoded bytes of a message into sequenced SplitMessages that fit in the MTU, and send them
+    void pushAndSendSplit ( MsgType type, const std::string& bytes );
+
+    // Handle an ACK, received is the selective ACK bitmap
+    void recvAck ( uint32_t sequence, uint32_t received );
+
+    // Handle the next in order message, appending any complete messages to msgs
+    void recvInOrder ( const MsgPtr& msg, std::vector<MsgPtr>& msgs );
+
+    // Add a received message to msgs, unwrapping the message in a SharedSequence
+    void recvUnwrapped ( const MsgPtr& msg, std::vector<MsgPtr>& msgs );
+
+    // Send an ACK for the current received sequence, selective if there are buffered messages
+    void sendAck();
+
+    // Send an ACK now, or later in delayed ACK mode
+    void queueAck();
+
     // Start the timer if necessary
     void checkAndStartTimer();
 
+    // Update the round trip time estimate with a new sample, this also resets any backoff
+    void updateRtt ( uint64_t rtt );
+
+    // Set the retransmission interval from the round trip time estimate, without any backoff
+    void resetRto();
+
+    // Double the retransmission interval, up to twice the smoothed round trip time or the base interval
+    void backOffRto();
+
+    // Send the next MTU probe if it is time to
+    void checkMtuProbe();
+
+    // Handle MtuProbe / MtuProbeAck messages
+    void recvMtuProbe ( const MsgPtr& msg );
+
+    // Reset the MTU and any outstanding probe
+    void resetMtu();
+
     // Refresh keep alive count down
     void refreshKeepAlive();
 };
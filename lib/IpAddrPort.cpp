@@ -2,11 +2,10 @@
 #include "Exceptions.hpp"
 #include "ErrorStrings.hpp"
 
-#include <winsock2.h>
-#include <windows.h>
-#include <ws2tcpip.h>
+#include "SocketCompat.hpp"
 
 #include <cctype>
+#include <cstring>
 
 using namespace std;
 
@@ -14,7 +13,7 @@ using namespace std;
 shared_ptr<addrinfo> getAddrInfo ( const string& addr, uint16_t port, bool isV4, bool passive )
 {
     addrinfo addrConf, *addrRes = 0;
-    ZeroMemory ( &addrConf, sizeof ( addrConf ) );
+    memset ( &addrConf, 0, sizeof ( addrConf ) );
 
     addrConf.ai_family = ( isV4 ? AF_INET : AF_INET6 );
 
@@ -49,6 +48,8 @@ uint16_t getPortFromSockAddr ( const sockaddr *sa )
         return ntohs ( ( ( sockaddr_in6 * ) sa )->sin6_port );
 }
 
+#ifdef _WIN32
+
 const char *inet_ntop ( int af, const void *src, char *dst, size_t size )
 {
     if ( af == AF_INET )
@@ -73,6 +74,8 @@ const char *inet_ntop ( int af, const void *src, char *dst, size_t size )
     return 0;
 }
 
+#endif // _WIN32
+
 IpAddrPort::IpAddrPort ( const string& addrPort ) : addr ( addrPort ), port ( 0 ), isV4 ( true )
 {
     if ( addrPort.empty() )
@@ -1,7 +1,7 @@
 #include "JoystickDetector.hpp"
 #include "ControllerManager.hpp"
 #include "Thread.hpp"
-#include "UdpSocket.hpp"
+#include "EventManager.hpp"
 #include "Exceptions.hpp"
 #include "ErrorStrings.hpp"
 
@@ -18,8 +18,6 @@ using namespace std;
 DEFINE_GUID ( GUID_DEVINTERFACE_HID, 0x4D1E55B2L, 0xF16F, 0x11CF, 0x88, 0xCB, 0x00, 0x11, 0x11, 0x00, 0x00, 0x30 );
 
 
-static SocketPtr sendSocket, recvSocket;
-
 static LRESULT CALLBACK joystickCallback ( HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam )
 {
     switch ( message )
@@ -32,10 +30,8 @@ static LRESULT CALLBACK joystickCallback ( HWND hwnd, UINT message, WPARAM wPara
                     if ( ( ( DEV_BROADCAST_HDR * ) lParam )->dbch_devicetype != DBT_DEVTYP_DEVICEINTERFACE )
                         break;
 
-                    if ( !sendSocket || !sendSocket->isConnected() )
-                        break;
-
-                    sendSocket->send ( new JoysticksChanged() );
+                    // Refresh on the event loop thread, since ControllerManager isn't used from this thread
+                    EventManager::get().post ( [] { ControllerManager::get().refreshJoysticks(); } );
                     break;
             }
             return 0;
@@ -169,29 +165,10 @@ public:
 static JoystickThread joystickThread;
 
 
-void JoystickDetector::socketRead ( Socket *socket, const MsgPtr& msg, const IpAddrPort& address )
-{
-    ASSERT ( socket == recvSocket.get() );
-
-    if ( !msg.get() || msg->getMsgType() != MsgType::JoysticksChanged )
-    {
-        LOG ( "Unexpected '%s'", msg );
-        return;
-    }
-
-    ControllerManager::get().refreshJoysticks();
-}
-
 void JoystickDetector::start()
 {
-    if ( recvSocket || sendSocket )
-        return;
-
     LOG ( "Starting joystick detection" );
 
-    recvSocket = UdpSocket::bind ( this, 0 );
-    sendSocket = UdpSocket::bind ( 0, { "127.0.0.1", recvSocket->address.port } );
-
     joystickThread.start();
 
     LOG ( "Started detecting joysticks" );
@@ -203,9 +180,6 @@ void JoystickDetector::stop()
 
     joystickThread.join();
 
-    sendSocket.reset();
-    recvSocket.reset();
-
     LOG ( "Stopped detecting joysticks" );
 }
 
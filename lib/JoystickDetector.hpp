@@ -1,17 +1,8 @@
 #pragma once
 
-#include "Protocol.hpp"
-#include "Socket.hpp"
-
-
-struct JoysticksChanged : public SerializableMessage
-{
-    EMPTY_MESSAGE_BOILERPLATE ( JoysticksChanged )
-};
-
 
 // Class that detects joystick attach / detach events, and automatically updates ControllerManager
-class JoystickDetector : private Socket::Owner
+class JoystickDetector
 {
 public:
 
@@ -23,12 +14,4 @@ public:
 
     // Get the singleton instance
     static JoystickDetector& get();
-
-private:
-
-    // Socket callbacks
-    void socketAccepted ( Socket *socket ) override {}
-    void socketConnected ( Socket *socket ) override {}
-    void socketDisconnected ( Socket *socket ) override {}
-    void socketRead ( Socket *socket, const MsgPtr& msg, const IpAddrPort& address ) override;
 };
@@ -0,0 +1,151 @@
+#include "LinkEmulator.hpp"
+#include "TimerManager.hpp"
+#include "Logger.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+
+LinkEmulator::LinkEmulator ( Owner *owner, const LinkConfig& config )
+    : owner ( owner ), config ( config ), _rng ( config.seed ) {}
+
+void LinkEmulator::send ( const char *bytes, size_t len, const IpAddrPort& address )
+{
+    ++_stats.sent;
+
+    if ( isLost() )
+    {
+        LOG ( "Dropped [ %u bytes ] to '%s'; bad=%u", len, address, _bad );
+        ++_stats.dropped;
+        return;
+    }
+
+    const bool duplicate = ( random() < config.duplicate );
+
+    if ( duplicate )
+        ++_stats.duplicated;
+
+    const uint64_t now = TimerManager::get().getNowNs ( true );
+
+    for ( int i = 0; i < ( duplicate ? 2 : 1 ); ++i )
+        schedule ( bytes, len, address, now );
+}
+
+double LinkEmulator::random()
+{
+    // 53 random bits, the same on every platform for a given seed, unlike the standard distributions
+    return ( _rng() >> 11 ) * ( 1.0 / 9007199254740992.0 );
+}
+
+bool LinkEmulator::isLost()
+{
+    if ( _bad )
+        _bad = ! ( random() < config.badToGood );
+    else
+        _bad = ( random() < config.goodToBad );
+
+    return ( random() < ( _bad ? config.badLoss : config.goodLoss ) );
+}
+
+uint64_t LinkEmulator::getDelay()
+{
+    double delay = config.delay;
+
+    if ( config.jitter > 0 )
+    {
+        if ( config.distribution == LinkConfig::Normal )
+        {
+            // Box-Muller transform
+            const double u1 = 1.0 - random(), u2 = random();
+            delay += config.jitter * sqrt ( -2.0 * log ( u1 ) ) * cos ( 2.0 * M_PI * u2 );
+        }
+        else
+        {
+            delay += config.jitter * ( 2.0 * random() - 1.0 );
+        }
+    }
+
+    if ( config.reorder > 0 && random() < config.reorder )
+    {
+        delay += config.reorderDelay;
+        ++_stats.reordered;
+    }
+
+    return uint64_t ( max ( 0.0, delay ) * NS_PER_MS );
+}
+
+void LinkEmulator::schedule ( const char *bytes, size_t len, const IpAddrPort& address, uint64_t now )
+{
+    uint64_t departure = now;
+
+    if ( config.rate )
+    {
+        const uint64_t start = max ( now, _linkFreeAt );
+
+        // Bytes still waiting for the link to be free
+        const uint64_t backlog = ( ( start - now ) * config.rate ) / NS_PER_SECOND;
+
+        if ( config.queueLimit && backlog + len > config.queueLimit )
+        {
+            LOG ( "Dropped [ %u bytes ] to '%s'; backlog=%llu", len, address, backlog );
+            ++_stats.dropped;
+            return;
+        }
+
+        _linkFreeAt = departure = start + ( len * NS_PER_SECOND ) / config.rate;
+    }
+
+    const uint64_t releaseTime = departure + getDelay();
+
+    if ( releaseTime <= now && _queue.empty() )
+    {
+        ++_stats.delivered;
+
+        if ( owner )
+            owner->linkEmulatorSend ( this, bytes, len, address );
+        return;
+    }
+
+    Packet packet;
+    packet.bytes.assign ( bytes, len );
+    packet.address = address;
+
+    _queue.insert ( make_pair ( releaseTime, packet ) );
+
+    release();
+}
+
+void LinkEmulator::release()
+{
+    const uint64_t now = TimerManager::get().getNowNs ( true );
+
+    while ( ! _queue.empty() && _queue.begin()->first <= now )
+    {
+        const Packet packet = _queue.begin()->second;
+        _queue.erase ( _queue.begin() );
+
+        ++_stats.delivered;
+
+        if ( owner )
+            owner->linkEmulatorSend ( this, &packet.bytes[0], packet.bytes.size(), packet.address );
+    }
+
+    if ( _queue.empty() )
+        return;
+
+    if ( ! _timer )
+        _timer.reset ( new Timer ( this ) );
+
+    const uint64_t wait = _queue.begin()->first - now;
+
+    _timer->start ( max<uint64_t> ( 1, ( wait + NS_PER_MS - 1 ) / NS_PER_MS ) );
+}
+
+void LinkEmulator::timerExpired ( Timer *timer )
+{
+    ASSERT ( timer == _timer.get() );
+
+    release();
+}
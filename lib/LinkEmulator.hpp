@@ -0,0 +1,120 @@
+#pragma once
+
+#include "IpAddrPort.hpp"
+#include "Timer.hpp"
+
+#include <map>
+#include <random>
+#include <string>
+
+
+// Network conditions modelled by LinkEmulator, probabilities are in the range [0, 1]
+struct LinkConfig
+{
+    // Seed for every random decision, the same seed and packets always give the same results
+    uint64_t seed = 0;
+
+    // Distribution of the delay around the base delay, jitter is the half-width for Uniform,
+    // and the standard deviation for Normal. The delay is never negative.
+    enum Distribution { Uniform, Normal } distribution = Uniform;
+
+    // Base delay and jitter in milliseconds
+    double delay = 0, jitter = 0;
+
+    // Gilbert-Elliott loss model: the chance to change state before each packet,
+    // and the chance to lose a packet in each state
+    double goodToBad = 0, badToGood = 1, goodLoss = 0, badLoss = 0;
+
+    // Chance to send a packet twice
+    double duplicate = 0;
+
+    // Chance to hold a packet back by reorderDelay milliseconds, so later packets overtake it
+    double reorder = 0, reorderDelay = 0;
+
+    // Bandwidth limit in bytes per second, and the most bytes that can wait for the link, 0 for no limit
+    uint32_t rate = 0, queueLimit = 0;
+
+    // Uniform random loss, no bursts
+    static LinkConfig loss ( double probability, uint64_t seed = 0 )
+    {
+        LinkConfig config;
+        config.seed = seed;
+        config.goodLoss = probability;
+        return config;
+    }
+};
+
+
+// Emulates an impaired network link for outgoing datagrams, for testing purposes.
+// Packets are dropped, duplicated, delayed, reordered, and rate limited, then passed to the owner to actually send.
+class LinkEmulator : private Timer::Owner
+{
+public:
+
+    struct Owner
+    {
+        // Send a datagram that made it through the emulated link
+        virtual void linkEmulatorSend ( LinkEmulator *link, const char *bytes, size_t len,
+                                        const IpAddrPort& address ) = 0;
+    };
+
+    struct Stats
+    {
+        uint64_t sent = 0, dropped = 0, duplicated = 0, reordered = 0, delivered = 0;
+    };
+
+    Owner *owner = 0;
+
+    const LinkConfig config;
+
+    LinkEmulator ( Owner *owner, const LinkConfig& config );
+
+    // Pass a datagram through the emulated link
+    void send ( const char *bytes, size_t len, const IpAddrPort& address );
+
+    // Get the number of packets handled so far
+    const Stats& getStats() const { return _stats; }
+
+    // Check if the Gilbert-Elliott model is in the bad state
+    bool isBadState() const { return _bad; }
+
+private:
+
+    struct Packet
+    {
+        std::string bytes;
+        IpAddrPort address;
+    };
+
+    std::mt19937_64 _rng;
+
+    // Current Gilbert-Elliott state
+    bool _bad = false;
+
+    // Time in nanoseconds when the rate limited link is free again
+    uint64_t _linkFreeAt = 0;
+
+    // Packets waiting to be sent, ordered by release time in nanoseconds, then by send order
+    std::multimap<uint64_t, Packet> _queue;
+
+    TimerPtr _timer;
+
+    Stats _stats;
+
+    // Random number in the range [0, 1)
+    double random();
+
+    // Check if the next packet is lost, this updates the Gilbert-Elliott state
+    bool isLost();
+
+    // Get a random delay in nanoseconds
+    uint64_t getDelay();
+
+    // Queue a packet, or send it right away if it has no delay
+    void schedule ( const char *bytes, size_t len, const IpAddrPort& address, uint64_t now );
+
+    // Send every packet that is due, and wait for the next one
+    void release();
+
+    void timerExpired ( Timer *timer ) override;
+};
@@ -2,6 +2,11 @@
 #include "Algorithms.hpp"
 #include "TimerManager.hpp"
 
+#ifndef _WIN32
+#include <unistd.h>
+#define _getpid getpid
+#endif
+
 using namespace std;
 
 
@@ -0,0 +1,110 @@
+#include "LoopbackNetwork.hpp"
+#include "Logger.hpp"
+
+#include "SocketCompat.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+
+#define LOOPBACK_ADDR "127.0.0.1"
+
+
+uint16_t LoopbackNetwork::bind ( Socket *socket, uint16_t port )
+{
+    ASSERT ( _endpoints.find ( socket ) == _endpoints.end() );
+
+    if ( port == 0 )
+    {
+        // Search from the last bound port, the same as an OS picking ephemeral ports
+        for ( uint32_t i = 0; i < 0x10000 && ( _nextPort == 0 || _ports.count ( _nextPort ) ); ++i )
+            ++_nextPort;
+
+        if ( _nextPort == 0 || _ports.count ( _nextPort ) )
+            return 0;
+
+        port = _nextPort++;
+    }
+    else if ( _ports.count ( port ) )
+    {
+        return 0;
+    }
+
+    _ports[port] = socket;
+    _endpoints[socket].port = port;
+
+    LOG ( "Bound socket=%08x; port=%u", socket, port );
+    return port;
+}
+
+void LoopbackNetwork::unbind ( Socket *socket )
+{
+    auto it = _endpoints.find ( socket );
+
+    if ( it == _endpoints.end() )
+        return;
+
+    LOG ( "Unbound socket=%08x; port=%u", socket, it->second.port );
+
+    _ports.erase ( it->second.port );
+    _endpoints.erase ( it );
+    _ready.erase ( remove ( _ready.begin(), _ready.end(), socket ), _ready.end() );
+}
+
+void LoopbackNetwork::send ( Socket *socket, const char *bytes, size_t len, const IpAddrPort& address )
+{
+    auto src = _endpoints.find ( socket );
+    auto dst = _ports.find ( address.port );
+
+    ASSERT ( src != _endpoints.end() );
+
+    if ( dst == _ports.end() )
+    {
+        LOG ( "No socket bound to port=%u; dropped [ %u bytes ]", address.port, len );
+        return;
+    }
+
+    Endpoint& endpoint = _endpoints[dst->second];
+
+    if ( endpoint.queue.empty() )
+        _ready.push_back ( dst->second );
+
+    endpoint.queue.push_back ( Datagram { string ( bytes, len ), src->second.port } );
+}
+
+int LoopbackNetwork::recvfrom ( Socket *socket, char *buffer, size_t& len, IpAddrPort& address )
+{
+    auto it = _endpoints.find ( socket );
+
+    if ( it == _endpoints.end() || it->second.queue.empty() )
+        return WSAEWOULDBLOCK;
+
+    Datagram& datagram = it->second.queue.front();
+
+    // Truncate like a real datagram socket
+    len = min ( len, datagram.bytes.size() );
+    memcpy ( buffer, &datagram.bytes[0], len );
+    address = IpAddrPort ( LOOPBACK_ADDR, datagram.port );
+
+    it->second.queue.pop_front();
+
+    // Sockets stay ready until their queue is empty, like a real socket
+    if ( it->second.queue.empty() )
+        _ready.erase ( find ( _ready.begin(), _ready.end(), socket ) );
+
+    return 0;
+}
+
+void LoopbackNetwork::getReady ( vector<Socket *>& ready ) const
+{
+    ready.insert ( ready.end(), _ready.begin(), _ready.end() );
+}
+
+void LoopbackNetwork::clear()
+{
+    _endpoints.clear();
+    _ports.clear();
+    _ready.clear();
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "IpAddrPort.hpp"
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+
+class Socket;
+
+
+// In-process datagram transport for testing, see SocketManager::setLoopback.
+// UDP sockets are bound to ports of this network instead of the OS, and datagrams are queued in memory,
+// so they are ready on the very next check. Only the port of an address is used.
+class LoopbackNetwork
+{
+public:
+
+    // Bind a socket to a port, 0 picks an unused port. Returns the bound port, or 0 if the port is taken.
+    uint16_t bind ( Socket *socket, uint16_t port );
+    void unbind ( Socket *socket );
+
+    // Queue a datagram for the socket bound to the port of the address, it is dropped if there is none
+    void send ( Socket *socket, const char *bytes, size_t len, const IpAddrPort& address );
+
+    // Take the next datagram queued for a socket, 0 on success, otherwise returns WSAEWOULDBLOCK
+    int recvfrom ( Socket *socket, char *buffer, size_t& len, IpAddrPort& address );
+
+    // Append the sockets with datagrams queued, in the order their queues became non-empty
+    void getReady ( std::vector<Socket *>& ready ) const;
+
+    // Check if any datagrams are queued
+    bool hasReady() const { return !_ready.empty(); }
+
+    // Unbind everything
+    void clear();
+
+private:
+
+    struct Datagram
+    {
+        std::string bytes;
+        uint16_t port;
+    };
+
+    struct Endpoint
+    {
+        uint16_t port = 0;
+        std::deque<Datagram> queue;
+    };
+
+    std::unordered_map<Socket *, Endpoint> _endpoints;
+
+    std::unordered_map<uint16_t, Socket *> _ports;
+
+    // Sockets with datagrams queued, in the order their queues became non-empty
+    std::vector<Socket *> _ready;
+
+    // Next port to try when binding to any port
+    uint16_t _nextPort = 49152;
+};
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+
+// Lock-free multi-producer single-consumer queue.
+// Any thread can push, but only one thread can pop. Based on Dmitry Vyukov's non-intrusive MPSC queue.
+template<typename T> class MpscQueue
+{
+public:
+
+    MpscQueue() : _head ( new Node() ), _tail ( _head.load() ) {}
+
+    ~MpscQueue()
+    {
+        T t;
+        while ( pop ( t ) );
+        delete _tail;
+    }
+
+    // Can be called on any thread
+    void push ( const T& t )
+    {
+        Node *node = new Node();
+        node->value = t;
+
+        Node *prev = _head.exchange ( node, std::memory_order_acq_rel );
+        prev->next.store ( node, std::memory_order_release );
+    }
+
+    // Must only be called on the consumer thread, returns false if empty.
+    // A push that is still in progress may not be visible yet.
+    bool pop ( T& t )
+    {
+        Node *next = _tail->next.load ( std::memory_order_acquire );
+
+        if ( ! next )
+            return false;
+
+        // The popped node becomes the new empty tail
+        t = std::move ( next->value );
+        next->value = T();
+
+        delete _tail;
+        _tail = next;
+        return true;
+    }
+
+private:
+
+    struct Node
+    {
+        std::atomic<Node *> next;
+        T value;
+
+        Node() : next ( 0 ) {}
+    };
+
+    // Producers push onto the head, the consumer pops from the tail
+    std::atomic<Node *> _head;
+    Node *_tail;
+
+    // Non-copyable
+    MpscQueue ( const MpscQueue& );
+    const MpscQueue& operator= ( const MpscQueue& );
+};
@@ -7,6 +7,7 @@
 
 struct Ping : public SerializableMessage
 {
+    // Nanosecond timestamp from the pinging side, the other side only echoes it back
     uint64_t timestamp;
 
     Ping ( uint64_t timestamp ) : timestamp ( timestamp ) {}
@@ -2,9 +2,14 @@
 #include "Protocol.include.hpp"
 #include "Protocol.inlineimpl.hpp"
 #include "Compression.hpp"
+#include "CompressionPolicy.hpp"
 #include "Logger.hpp"
 #include "Enum.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
 using namespace std;
 using namespace cereal;
 
@@ -20,35 +25,109 @@ using namespace cereal;
 Compressed:
 
     1 byte  message type
-    1 byte  compression level
+    1 byte  flags
+    4 byte  piggybacked ACK sequence, only if the flag is set
     4 byte  uncompressed size
     4 byte  compressed data size
     ...     compressed data
             ========================
             ...     raw data
-            16 byte hash
+            N byte  hash
             ========================
 
 Not compressed:
 
     1 byte  message type
-    1 byte  compression level
+    1 byte  flags
+    4 byte  piggybacked ACK sequence, only if the flag is set
     ========================
     ...     raw data
-    16 byte hash
+    N byte  hash
     ========================
 
+Flags:
+
+    bits 0-3    compression level, 0 means not compressed
+    bits 4-5    hash type, N is 16 for MD5, 4 for CRC32C, 8 for XXHash64
+    bit 6       raw data uses the compact encoding of the message
+    bit 7       the header includes a piggybacked ACK sequence
+
+The flags byte was originally only the compression level, so older versions only understand MD5 hashes.
+
+The hash only covers the raw data, so it can be cached across sends. A piggybacked ACK sequence is XORed into
+the first 4 bytes of the hash, so a corrupted ACK sequence still fails the hash check.
+
 */
 
 
-// Encode with compression
-string encodeStageTwo ( const MsgPtr& msg, const string& msgData );
+// Size of the message type + flags
+#define HEADER_SIZE ( 2 )
+
+// Bits of the flags byte
+#define COMPRESSION_LEVEL_MASK  ( 0x0F )
+#define HASH_TYPE_MASK          ( 0x30 )
+#define HASH_TYPE_SHIFT         ( 4 )
+#define COMPACT_FLAG            ( 0x40 )
+#define ACK_SEQUENCE_FLAG       ( 0x80 )
 
-// Result of the decode
-ENUM ( DecodeResult, Failed, NotCompressed, Compressed );
+// Size of the piggybacked ACK sequence
+#define ACK_SEQUENCE_SIZE ( 4 )
+
+// Size of the uncompressed size + compressed data size
+#define COMPRESSED_HEADER_SIZE ( 8 )
+
+// Calculate the hash of the given type, dst must have space for getHashSize ( type ) bytes
+static void getHash ( HashType type, const char *bytes, size_t len, char *dst )
+{
+    switch ( type )
+    {
+        case HashType::CRC32C:
+        {
+            const uint32_t crc = getCRC32C ( bytes, len );
+            memcpy ( dst, &crc, sizeof ( crc ) );
+            break;
+        }
 
-// Decode with compression. Must manually update the value of consumed if the data was not compressed.
-DecodeResult decodeStageTwo ( const char *bytes, size_t len, size_t& consumed, MsgType& type, string& msgData );
+        case HashType::XXHash64:
+        {
+            const uint64_t hash = getXXHash64 ( bytes, len );
+            memcpy ( dst, &hash, sizeof ( hash ) );
+            break;
+        }
+
+        default:
+            getMD5 ( bytes, len, dst );
+            break;
+    }
+}
+
+static bool checkHash ( HashType type, const char *bytes, size_t len, const char *hash )
+{
+    char tmp[16];
+    getHash ( type, bytes, len, tmp );
+    return ( memcmp ( tmp, hash, Protocol::getHashSize ( type ) ) == 0 );
+}
+
+// XOR the ACK sequence into the first 4 bytes of the hash, every hash type is at least that long.
+// This is its own inverse, so the same call removes it again.
+static void foldAckSequence ( char *hash, uint32_t ackSequence )
+{
+    for ( size_t i = 0; i < sizeof ( ackSequence ); ++i )
+        hash[i] ^= ( char ) ( ackSequence >> ( 8 * i ) );
+}
+
+// Read only stream buffer over existing bytes, so decoding doesn't need to copy them into a stringstream
+struct ByteSpanBuf : public std::streambuf
+{
+    ByteSpanBuf ( const char *bytes, size_t len )
+    {
+        char *begin = const_cast<char *> ( bytes );
+        setg ( begin, begin, begin + len );
+    }
+
+    // Number of bytes read so far
+    size_t position() const { return ( gptr() - eback() ); }
+};
 
 
 string Protocol::encode ( const Serializable& message )
@@ -67,75 +146,230 @@ string Protocol::encode ( Serializable *message )
 }
 
 string Protocol::encode ( const MsgPtr& msg )
+{
+    EncodeBuffer buffer;
+    return encode ( msg, buffer ).str();
+}
+
+size_t Protocol::getHashSize ( HashType type )
+{
+    switch ( type )
+    {
+        case HashType::CRC32C:
+            return 4;
+
+        case HashType::XXHash64:
+            return 8;
+
+        default:
+            return 16;
+    }
+}
+
+HashType Protocol::getFastHashType()
+{
+    // Software CRC32C is slower than XXHash64, so only use it if there is hardware support
+    return ( hasHardwareCRC32C() ? HashType::CRC32C : HashType::XXHash64 );
+}
+
+ByteSpan Protocol::encode ( const MsgPtr& msg, EncodeBuffer& buffer, HashType hashType, bool compact,
+                            uint32_t ackSequence )
 {
     if ( ! msg.get() )
-        return "";
+        return ByteSpan();
 
-    ostringstream ss ( stringstream::binary );
-    BinaryOutputArchive archive ( ss );
+    compact = ( compact && msg->hasCompact() );
+
+    vector<char>& bytes = buffer._bytes;
+
+    // The header only includes the ACK sequence if there is one
+    const size_t headerSize = HEADER_SIZE + ( ackSequence ? ACK_SEQUENCE_SIZE : 0 );
+
+    // Reserve space for the header, the raw data is appended directly after it
+    bytes.resize ( headerSize );
 
     // Encode base message data
-    msg->saveBase ( archive );
+    msg->saveBase ( buffer._archive );
 
     // Encode actual message data
-    msg->save ( archive );
+    if ( compact )
+        msg->saveCompact ( buffer._archive );
+    else
+        msg->save ( buffer._archive );
 
 #ifndef DISABLE_UPDATE_HASH
-    // Update the hash
-    if ( msg->_hashValid )
+    // Update the hash, the cached hash is only valid for the same hash type and encoding
+    if ( msg->_hashValid || msg->_hashType != hashType || msg->_hashCompact != compact )
     {
-        getMD5 ( ss.str(), &msg->_hash[0] );
+        ASSERT ( msg->getUnhashedSize() <= bytes.size() - headerSize );
+
+        getHash ( hashType, bytes.data() + headerSize, bytes.size() - headerSize - msg->getUnhashedSize(),
+                  &msg->_hash[0] );
+        msg->_hashType = hashType;
+        msg->_hashCompact = compact;
         msg->_hashValid = false;
 
 #ifdef LOG_PROTOCOL
         LOG ( "%s", msg->getMsgType() );
-        if ( ss.str().size() <= 256 )
-            LOG ( "data=[ %s ]", formatAsHex ( ss.str() ) );
-        LOG ( "hash=[ %s ]", formatAsHex ( msg->_hash, msg->_hash.size() ) );
+        if ( bytes.size() - headerSize <= 256 )
+            LOG ( "data=[ %s ]", formatAsHex ( bytes.data() + headerSize, bytes.size() - headerSize ) );
+        LOG ( "hash=[ %s ]", formatAsHex ( &msg->_hash[0], getHashSize ( hashType ) ) );
 #endif
     }
 #endif // NOT DISABLE_UPDATE_HASH
 
     // Encode hash at the end of message data
-    archive ( msg->_hash );
+    bytes.insert ( bytes.end(), msg->_hash.begin(), msg->_hash.begin() + getHashSize ( hashType ) );
+
+    // The cached hash doesn't include the ACK sequence, since that changes every send
+    if ( ackSequence )
+        foldAckSequence ( &bytes[bytes.size() - getHashSize ( hashType )], ackSequence );
+
+    const uint8_t hashFlags = ( uint8_t ( hashType ) << HASH_TYPE_SHIFT ) | ( compact ? COMPACT_FLAG : 0 )
+                              | ( ackSequence ? ACK_SEQUENCE_FLAG : 0 );
+
+    const char *msgData = bytes.data() + headerSize;
+    const uint32_t msgDataSize = bytes.size() - headerSize;
+
+    // Compress message data if needed, the policy decides based on the message type and size
+#ifdef FORCE_COMPRESSION
+    const uint8_t compressionLevel = msg->compressionLevel;
+#else
+    const uint8_t compressionLevel = ( msg->compressionLevel
+                                       ? CompressionPolicy::get().getLevel ( msg->getMsgType(), msgDataSize,
+                                               msg->compressionLevel )
+                                       : 0 );
+#endif
+
+    if ( compressionLevel )
+    {
+        vector<char>& compressed = buffer._scratch;
+        compressed.resize ( headerSize + COMPRESSED_HEADER_SIZE + compressBound ( msgDataSize ) );
+
+        const auto start = chrono::steady_clock::now();
+
+        const uint32_t size = buffer._compressor.compress (
+                                  msgData, msgDataSize,
+                                  &compressed[headerSize + COMPRESSED_HEADER_SIZE],
+                                  compressed.size() - headerSize - COMPRESSED_HEADER_SIZE,
+                                  compressionLevel );
+
+        CompressionPolicy::get().update (
+            msg->getMsgType(), msgDataSize, size ? COMPRESSED_HEADER_SIZE + size : msgDataSize,
+            chrono::duration_cast<chrono::nanoseconds> ( chrono::steady_clock::now() - start ).count() );
+
+        // Only use compressed message data if actually smaller after the overhead
+#ifndef FORCE_COMPRESSION
+        if ( size && COMPRESSED_HEADER_SIZE + size < msgDataSize )
+#endif
+        {
+            compressed[0] = ( char ) msg->getMsgType();
+            compressed[1] = ( char ) ( ( compressionLevel & COMPRESSION_LEVEL_MASK ) | hashFlags );
+            if ( ackSequence )
+                memcpy ( &compressed[HEADER_SIZE], &ackSequence, sizeof ( ackSequence ) );     // ACK sequence
+            memcpy ( &compressed[headerSize], &msgDataSize, sizeof ( msgDataSize ) );          // uncompressed size
+            memcpy ( &compressed[headerSize + 4], &size, sizeof ( size ) );                    // compressed size
+            compressed.resize ( headerSize + COMPRESSED_HEADER_SIZE + size );                  // compressed data
+
+            bytes.swap ( compressed );
+            return buffer.bytes();
+        }
 
-    // Encode with compression
-    return encodeStageTwo ( msg, ss.str() );
+        // Otherwise update compression level so we don't try to compress this again
+        msg->compressionLevel = 0;
+    }
+
+    // uncompressed data does not include uncompressedSize or any other sizes
+    bytes[0] = ( char ) msg->getMsgType();
+    bytes[1] = ( char ) hashFlags;
+    if ( ackSequence )
+        memcpy ( &bytes[HEADER_SIZE], &ackSequence, sizeof ( ackSequence ) );
+    return buffer.bytes();
 }
 
 MsgPtr Protocol::decode ( const char *bytes, size_t len, size_t& consumed )
 {
-    MsgPtr msg;
+    consumed = 0;
+
+    if ( len < HEADER_SIZE )
+        return NullMsg;
 
-    if ( len == 0 )
+    // Decode message type first before decompression
+    const MsgType type = MsgType ( bytes[0] );
+    const uint8_t flags = bytes[1];
+    const uint8_t compressionLevel = ( flags & COMPRESSION_LEVEL_MASK );
+    const HashType hashType = HashType ( ( flags & HASH_TYPE_MASK ) >> HASH_TYPE_SHIFT );
+    const size_t hashSize = getHashSize ( hashType );
+    const bool compact = ( flags & COMPACT_FLAG );
+    const size_t headerSize = HEADER_SIZE + ( ( flags & ACK_SEQUENCE_FLAG ) ? ACK_SEQUENCE_SIZE : 0 );
+
+    // Reject unknown flags and hash types
+    if ( ( flags & ~( COMPRESSION_LEVEL_MASK | HASH_TYPE_MASK | COMPACT_FLAG | ACK_SEQUENCE_FLAG ) )
+            || hashType > HashType::XXHash64 )
     {
-        consumed = 0;
+#ifdef LOG_PROTOCOL
+        LOG ( "type=%s; unknown flags=%02x", type, flags );
+#endif
         return NullMsg;
     }
 
-    MsgType type;
-    string data;
+    if ( len < headerSize )
+        return NullMsg;
+
+    uint32_t ackSequence = 0;
+    if ( flags & ACK_SEQUENCE_FLAG )
+        memcpy ( &ackSequence, &bytes[HEADER_SIZE], sizeof ( ackSequence ) );
+
+    // The raw data + hash, points directly into bytes unless the data was compressed
+    const char *msgData = bytes + headerSize;
+    size_t msgDataSize = len - headerSize;
+
+    // Decompression output, only used if compressed
+    string buffer;
+
+    // Only compressed data includes uncompressedSize + a compressed data buffer
+    if ( compressionLevel )
+    {
+        if ( len < headerSize + COMPRESSED_HEADER_SIZE )
+            return NullMsg;
 
-    // Decode with compression
-    DecodeResult result = decodeStageTwo ( bytes, len, consumed, type, data );
+        uint32_t uncompressedSize, compressedSize;
+        memcpy ( &uncompressedSize, &bytes[headerSize], sizeof ( uncompressedSize ) );
+        memcpy ( &compressedSize, &bytes[headerSize + 4], sizeof ( compressedSize ) );
 
+        if ( len - headerSize - COMPRESSED_HEADER_SIZE < compressedSize )
+        {
 #ifdef LOG_PROTOCOL
-    LOG ( "decodeStageTwo: result=%s", result );
+            LOG ( "type=%s; incomplete compressed data", type );
 #endif
+            return NullMsg;
+        }
 
-    if ( result == DecodeResult::Failed )
-    {
-        consumed = 0;
-        return NullMsg;
+        buffer.resize ( uncompressedSize );
+        const size_t size = uncompress ( &bytes[headerSize + COMPRESSED_HEADER_SIZE], compressedSize,
+                                         &buffer[0], buffer.size() );
+
+        if ( size != uncompressedSize )
+            return NullMsg;
+
+        msgData = &buffer[0];
+        msgDataSize = buffer.size();
+
+        // The compressed size is known upfront
+        consumed = headerSize + COMPRESSED_HEADER_SIZE + compressedSize;
     }
 
 #ifdef LOG_PROTOCOL
-    if ( data.size() <= 256 )
-        LOG ( "decodeStageTwo: data=[ %s ]", formatAsHex ( data ) );
+    LOG ( "type=%s; compressionLevel=%u", type, compressionLevel );
+    if ( msgDataSize <= 256 )
+        LOG ( "data=[ %s ]", formatAsHex ( msgData, msgDataSize ) );
 #endif
 
-    istringstream ss ( data, stringstream::binary );
-    BinaryInputArchive archive ( ss );
+    MsgPtr msg;
+
+    ByteSpanBuf streamBuf ( msgData, msgDataSize );
+    istream stream ( &streamBuf );
+    BinaryInputArchive archive ( stream );
 
     try
     {
@@ -153,11 +387,23 @@ MsgPtr Protocol::decode ( const char *bytes, size_t len, size_t& consumed )
         msg->loadBase ( archive );
 
         // Decode actual message data
-        msg->load ( archive );
-
-        // Decode hash at end of message data
-        archive ( msg->_hash );
+        if ( ! compact )
+            msg->load ( archive );
+        else if ( msg->hasCompact() )
+            msg->loadCompact ( archive );
+        else
+            throw cereal::Exception ( "No compact encoding" );
+
+        // Decode hash at end of message data, without the ACK sequence so it can be reused when re-encoding
+        archive ( binary_data ( &msg->_hash[0], hashSize ) );
+
+        if ( ackSequence )
+            foldAckSequence ( &msg->_hash[0], ackSequence );
+        msg->_hashType = hashType;
+        msg->_hashCompact = compact;
         msg->_hashValid = false;
+
+        msg->ackSequence = ackSequence;
     }
     catch ( const cereal::Exception& exc )
     {
@@ -187,31 +433,29 @@ MsgPtr Protocol::decode ( const char *bytes, size_t len, size_t& consumed )
         return NullMsg;
     }
 
-    size_t dataSize = data.size();
-
-    // decodeStageTwo does not update the value of consumed if the data was not compressed
-    if ( result == DecodeResult::NotCompressed )
+    // Uncompressed data has no size, so the message ends wherever the archive stopped reading
+    if ( ! compressionLevel )
     {
-        // Check for unread bytes
-        size_t remaining = ss.rdbuf()->in_avail();
-        ASSERT ( len >= remaining );
-        consumed = ( len - remaining );
-        dataSize = ( data.size() - remaining );
+        msgDataSize = streamBuf.position();
+        consumed = headerSize + msgDataSize;
     }
 
 #ifndef DISABLE_UPDATE_HASH
+    // The unhashed bytes were read as part of the message data, so they always fit, but don't rely on that
+    const size_t hashedSize = msgDataSize - hashSize - min ( msg->getUnhashedSize(), msgDataSize - hashSize );
+
     // Check if the hash is correct
-    if ( ! checkMD5 ( &data[0], dataSize - msg->_hash.size(), &msg->_hash[0] ) )
+    if ( ! checkHash ( hashType, msgData, hashedSize, &msg->_hash[0] ) )
     {
 #ifdef LOG_PROTOCOL
         LOG ( "hash check failed for %s", type );
-        LOG ( "data=[ %s ]", formatAsHex ( &data[0], dataSize - msg->_hash.size() ) );
-        LOG ( "hash    =[ %s ]", formatAsHex ( msg->_hash, msg->_hash.size() ) );
+        LOG ( "data=[ %s ]", formatAsHex ( msgData, hashedSize ) );
+        LOG ( "hash    =[ %s ]", formatAsHex ( &msg->_hash[0], hashSize ) );
 
-        char hash[msg->_hash.size()];
-        gethash ( &data[0], dataSize - msg->_hash.size(), hash );
+        char hash[16];
+        getHash ( hashType, msgData, hashedSize, hash );
 
-        LOG ( "expected=[ %s ]", formatAsHex ( hash, msg->_hash.size() ) );
+        LOG ( "expected=[ %s ]", formatAsHex ( hash, hashSize ) );
 #endif
         return NullMsg;
     }
@@ -220,115 +464,6 @@ MsgPtr Protocol::decode ( const char *bytes, size_t len, size_t& consumed )
     return msg;
 }
 
-string encodeStageTwo ( const MsgPtr& msg, const string& msgData )
-{
-    ostringstream ss ( stringstream::binary );
-    BinaryOutputArchive archive ( ss );
-
-    // Encode message type first without compression
-    archive ( msg->getMsgType() );
-
-    // Compress message data if needed
-    if ( msg->compressionLevel )
-    {
-        string buffer ( compressBound ( msgData.size() ), ( char ) 0 );
-        size_t size = compress ( &msgData[0], msgData.size(), &buffer[0], buffer.size(), msg->compressionLevel );
-        buffer.resize ( size );
-
-        // Only use compressed message data if actually smaller after the overhead
-#ifndef FORCE_COMPRESSION
-        if ( sizeof ( msgData.size() ) + sizeof ( buffer.size() ) + buffer.size() < msgData.size() )
-#endif
-        {
-            archive ( msg->compressionLevel );
-            archive ( msgData.size() );         // uncompressed size
-            archive ( buffer );                 // compressed size + compressed data
-            return ss.str();
-        }
-
-        // Otherwise update compression level so we don't try to compress this again
-        msg->compressionLevel = 0;
-    }
-
-    // uncompressed data does not include uncompressedSize or any other sizes
-    archive ( msg->compressionLevel );
-    return ss.str() + msgData;
-}
-
-DecodeResult decodeStageTwo ( const char *bytes, size_t len, size_t& consumed, MsgType& type, string& msgData )
-{
-    istringstream ss ( string ( bytes, len ), stringstream::binary );
-    BinaryInputArchive archive ( ss );
-
-    uint8_t compressionLevel;
-    uint32_t uncompressedSize;
-
-    try
-    {
-        // Decode message type first before decompression
-        archive ( type );
-        archive ( compressionLevel );
-
-        // Only compressed data includes uncompressedSize + a compressed data buffer
-        if ( compressionLevel )
-        {
-            archive ( uncompressedSize );       // uncompressed size
-            archive ( msgData );                // compressed size + compressed data
-        }
-    }
-    catch ( const cereal::Exception& exc )
-    {
-#ifdef LOG_PROTOCOL
-        LOG ( "cereal::Exception: '%s'", type, exc.what() );
-#endif
-        consumed = 0;
-        return DecodeResult::Failed;
-    }
-    catch ( const std::exception& exc )
-    {
-#ifdef LOG_PROTOCOL
-        LOG ( "std::exception: '%s'", type, exc.what() );
-#endif
-        consumed = 0;
-        return DecodeResult::Failed;
-    }
-    catch ( ... )
-    {
-#ifdef LOG_PROTOCOL
-        LOG ( "Unknown exception!" );
-#endif
-        consumed = 0;
-        return DecodeResult::Failed;
-    }
-
-    // Get remaining bytes
-    size_t remaining = ss.rdbuf()->in_avail();
-    ASSERT ( len >= remaining );
-
-    // Decompress message data if needed
-    if ( compressionLevel )
-    {
-        string buffer ( uncompressedSize, ( char ) 0 );
-        size_t size = uncompress ( &msgData[0], msgData.size(), &buffer[0], buffer.size() );
-
-        if ( size != uncompressedSize )
-        {
-            consumed = 0;
-            return DecodeResult::Failed;
-        }
-
-        // Update consumed bytes
-        consumed = len - remaining;
-        msgData = buffer;
-        return DecodeResult::Compressed;
-    }
-
-    // Get remaining bytes
-    msgData.resize ( remaining );
-    ss.rdbuf()->sgetn ( &msgData[0], remaining );
-    return DecodeResult::NotCompressed;
-}
-
 
 ostream& operator<< ( ostream& os, MsgType type )
 {
@@ -357,6 +492,10 @@ ostream& operator<< ( ostream& os, const Serializable& msg )
 }
 
 
+// EncodeBuffer methods
+EncodeBuffer::EncodeBuffer() : _appendBuf ( _bytes ), _stream ( &_appendBuf ), _archive ( _stream ) {}
+
+
 // Serializable methods
 Serializable::Serializable() : compressionLevel ( 9 ) {}
 
@@ -376,3 +515,24 @@ void SerializableSequence::setSequence ( uint32_t sequence ) const
     invalidate();
     _sequence = sequence;
 }
+
+
+// SharedMessage methods
+const shared_ptr<const string>& SharedMessage::getBytes ( HashType hashType, bool compact )
+{
+    ASSERT ( msg.get() != 0 );
+
+    // Messages without a compact encoding encode the same either way
+    compact = ( compact && msg->hasCompact() );
+
+    shared_ptr<const string>& bytes = _bytes[size_t ( hashType )][compact];
+
+    if ( bytes )
+        return bytes;
+
+    EncodeBuffer buffer;
+    bytes = make_shared<const string> ( Protocol::encode ( msg, buffer, hashType, compact ).str() );
+
+    ++_encodeCount;
+    return bytes;
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Enum.hpp"
+#include "Compression.hpp"
 
 #include <cereal/archives/binary.hpp>
 
@@ -8,6 +9,8 @@
 #include <memory>
 #include <iostream>
 #include <sstream>
+#include <vector>
+#include <array>
 
 
 #define EMPTY_MESSAGE_BOILERPLATE(NAME)                                                                     \
@@ -43,6 +46,23 @@ enum class MsgType : uint8_t
 // Base message type
 ENUM ( BaseType, SerializableMessage, SerializableSequence );
 
+// Hash type used to check message integrity, encoded in the message header
+enum class HashType : uint8_t { MD5 = 0, CRC32C = 1, XXHash64 = 2 };
+
+
+// Protocol levels for features that both peers need to support, the level used is the lowest of the two.
+// Messages are self-describing, so decoding always supports every level, only sending is restricted.
+#define PROTOCOL_LEVEL_FAST_HASH    ( 1 )   // CRC32C or XXHash64 instead of MD5
+#define PROTOCOL_LEVEL_COMPACT      ( 2 )   // Compact encoding for messages that support it, ie inputs
+#define PROTOCOL_LEVEL_SACK         ( 3 )   // Selective repeat with SackSequence in GoBackN
+#define PROTOCOL_LEVEL_MTU_PROBE    ( 4 )   // Path MTU probing with MtuProbe in GoBackN
+#define PROTOCOL_LEVEL_ACK_SEQUENCE ( 5 )   // Delayed ACKs piggybacked in the message header
+#define PROTOCOL_LEVEL_INPUT_LOSS   ( 6 )   // InputLoss reports for adaptive input redundancy
+#define PROTOCOL_LEVEL_SHARED       ( 7 )   // SharedSequence in GoBackN, only hashes the per-connection header
+
+// The protocol level supported by this version
+#define PROTOCOL_LEVEL              ( 7 )
+
 // Common declarations
 struct Serializable;
 typedef std::shared_ptr<Serializable> MsgPtr;
@@ -58,6 +78,75 @@ inline void ignoreMsgPtr ( Serializable * ) {}
 const MsgPtr NullMsg;
 
 
+// Non-owning view of a series of bytes
+struct ByteSpan
+{
+    const char *data = 0;
+    size_t size = 0;
+
+    ByteSpan() {}
+    ByteSpan ( const char *data, size_t size ) : data ( data ), size ( size ) {}
+
+    bool empty() const { return ( size == 0 ); }
+    std::string str() const { return std::string ( data, size ); }
+};
+
+
+// Caller owned storage for encoding messages. The storage is only grown, never freed, so reusing
+// the same buffer means encoding does not allocate once it has reached the largest message size.
+class EncodeBuffer
+{
+public:
+
+    EncodeBuffer();
+
+    EncodeBuffer ( const EncodeBuffer& ) = delete;
+    const EncodeBuffer& operator= ( const EncodeBuffer& ) = delete;
+
+    // The most recently encoded bytes, only valid until the next encode
+    ByteSpan bytes() const { return ByteSpan ( _bytes.empty() ? 0 : &_bytes[0], _bytes.size() ); }
+
+private:
+
+    // Stream buffer that appends to the end of the byte vector
+    struct AppendBuf : public std::streambuf
+    {
+        std::vector<char>& bytes;
+
+        AppendBuf ( std::vector<char>& bytes ) : bytes ( bytes ) {}
+
+        std::streamsize xsputn ( const char *s, std::streamsize n ) override
+        {
+            bytes.insert ( bytes.end(), s, s + n );
+            return n;
+        }
+
+        int_type overflow ( int_type c ) override
+        {
+            if ( c != traits_type::eof() )
+                bytes.push_back ( traits_type::to_char_type ( c ) );
+            return c;
+        }
+    };
+
+    // Encoded bytes
+    std::vector<char> _bytes;
+
+    // Compression output
+    std::vector<char> _scratch;
+
+    // Output stream and archive writing into _bytes, these are kept to avoid constructing them per message
+    AppendBuf _appendBuf;
+    std::ostream _stream;
+    cereal::BinaryOutputArchive _archive;
+
+    // Reused compressor state
+    Compressor _compressor;
+
+    friend class Protocol;
+};
+
+
 // Contains protocol methods
 class Protocol
 {
@@ -68,6 +157,14 @@ public:
     static std::string encode ( Serializable *message );
     static std::string encode ( const MsgPtr& msg );
 
+    // Encode a message into a caller owned buffer, returns a view of the encoded bytes inside the buffer.
+    // The returned bytes are only valid until the next encode using the same buffer.
+    // If compact is set, messages that have a compact encoding will use it.
+    // If ackSequence is non-zero, it is piggybacked in the header, see Serializable::ackSequence.
+    // The hash also covers it, without changing the hash cached in the message.
+    static ByteSpan encode ( const MsgPtr& msg, EncodeBuffer& buffer,
+                             HashType hashType = HashType::MD5, bool compact = false, uint32_t ackSequence = 0 );
+
     // Decode a series of bytes into a message, consumed indicates the number of bytes read.
     // This returns null if the message failed to decode, NOTE consumed will still be updated.
     static MsgPtr decode ( const char *bytes, size_t len, size_t& consumed );
@@ -76,6 +173,12 @@ public:
     {
         return ( type > MsgType::FirstType && type < MsgType::LastType );
     }
+
+    // Get the number of bytes used by the hash at the end of the message data
+    static size_t getHashSize ( HashType type );
+
+    // Get the fastest hash type to use for peers that support it
+    static HashType getFastHashType();
 };
 
 
@@ -99,6 +202,15 @@ public:
     virtual void save ( cereal::BinaryOutputArchive& ar ) const {}
     virtual void load ( cereal::BinaryInputArchive& ar ) {}
 
+    // Alternative compact serialization, only used if the peer supports PROTOCOL_LEVEL_COMPACT
+    virtual bool hasCompact() const { return false; }
+    virtual void saveCompact ( cereal::BinaryOutputArchive& ar ) const { save ( ar ); }
+    virtual void loadCompact ( cereal::BinaryInputArchive& ar ) { load ( ar ); }
+
+    // Number of bytes at the end of the serialized data that the hash doesn't cover,
+    // because they are already checked some other way, ie an encoded message with its own hash.
+    virtual size_t getUnhashedSize() const { return 0; }
+
     // Cast this to another another type
     template<typename T> T& getAs() { return *static_cast<T *> ( this ); }
     template<typename T> const T& getAs() const { return *static_cast<const T *> ( this ); }
@@ -112,12 +224,17 @@ public:
     // Flag to indicate compression level
     mutable uint8_t compressionLevel;
 
+    // GoBackN ACK sequence piggybacked in the header of a decoded message, 0 if none
+    uint32_t ackSequence = 0;
+
 private:
 
-    typedef std::array<char, 16> HashType;
+    typedef std::array<char, 16> Hash;
 
-    // Cached hash data
-    mutable HashType _hash;
+    // Cached hash data, only the first getHashSize ( _hashType ) bytes are used
+    mutable Hash _hash;
+    mutable HashType _hashType = HashType::MD5;
+    mutable bool _hashCompact = false;
     mutable bool _hashValid = true;
 
     // Serialize and deserialize the base type
@@ -175,3 +292,34 @@ private:
     void saveBase ( cereal::BinaryOutputArchive& ar ) const override { ar ( _sequence ); };
     void loadBase ( cereal::BinaryInputArchive& ar ) override { ar ( _sequence ); };
 };
+
+
+// Message that is encoded once and sent to many sockets, see Socket::sendShared.
+// The encoded bytes depend on the hash type and encoding each socket negotiated, so each combination
+// is only encoded on first use. The message shouldn't be modified after this is constructed.
+class SharedMessage
+{
+public:
+
+    const MsgPtr msg;
+
+    SharedMessage ( const MsgPtr& msg ) : msg ( msg ) {}
+
+    SharedMessage ( const SharedMessage& ) = delete;
+    const SharedMessage& operator= ( const SharedMessage& ) = delete;
+
+    // Get the encoded bytes for the given hash type and encoding, these are never modified once encoded
+    const std::shared_ptr<const std::string>& getBytes ( HashType hashType, bool compact );
+
+    // Get the number of times the message was actually encoded
+    size_t getEncodeCount() const { return _encodeCount; }
+
+private:
+
+    // Encoded bytes indexed by hash type, then compact encoding
+    std::array<std::array<std::shared_ptr<const std::string>, 2>, 3> _bytes;
+
+    size_t _encodeCount = 0;
+};
+
+typedef std::shared_ptr<SharedMessage> SharedMsgPtr;
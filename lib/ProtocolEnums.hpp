@@ -29,6 +29,12 @@ TestMessage,
 UdpControl,
 Version,
 VersionConfig,
-JoysticksChanged,
+JoysticksChanged, // Deleted message
 TransitionIndex,
 PaletteManager,
+SackSequence,
+MtuProbe,
+MtuProbeAck,
+InputLoss,
+SharedSequence,
+ProtocolLevel,
@@ -0,0 +1,495 @@
+#include "RelayForwarder.hpp"
+#include "Exceptions.hpp"
+#include "ErrorStrings.hpp"
+
+#ifdef __linux__
+#include "Thread.hpp"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
+#endif
+
+using namespace std;
+
+
+#ifdef __linux__
+
+#define THROW_FORWARDER_EXCEPTION(DEBUG) THROW_EXCEPTION ( DEBUG ": %s", ERROR_NETWORK_GENERIC, strerror ( errno ) )
+
+// Number of datagrams read and sent per system call
+#define BATCH_SIZE ( 64 )
+
+// Larger datagrams are dropped, the game's messages are well under this
+#define MAX_DATAGRAM_SIZE ( 2048 )
+
+// Kernel receive buffer for each relay port, so bursts aren't dropped while the worker is busy with other matches
+#define RELAY_PORT_RECV_BUFFER ( 256 * 1024 )
+
+// Maximum time between removing idle matches
+#define MAX_SWEEP_INTERVAL ( 1000 )
+
+
+static uint64_t getSteadyMilliseconds()
+{
+    return chrono::duration_cast<chrono::milliseconds> ( chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+
+namespace
+{
+
+struct Forward;
+
+// One side of a forwarded match, and the relay port it sends to
+struct End
+{
+    Forward *forward = 0;
+
+    RelayForwarder::Side side = RelayForwarder::Client;
+
+    int fd = -1;
+
+    uint16_t port = 0;
+
+    // Only datagrams from this IP address are accepted
+    in_addr ip;
+
+    // Source address of the last accepted datagram, this is where the other side's datagrams are sent
+    sockaddr_in address;
+
+    bool latched = false;
+};
+
+struct Forward
+{
+    const uint32_t matchId;
+
+    End ends[2];
+
+    // Only written by the worker thread, but read by the control thread
+    atomic<uint64_t> packets[2], bytes[2], dropped;
+
+    // Time of the last accepted datagram, only used by the worker thread after the match is added
+    uint64_t lastActive = 0;
+
+    Forward ( uint32_t matchId ) : matchId ( matchId )
+    {
+        for ( size_t i = 0; i < 2; ++i )
+        {
+            packets[i] = bytes[i] = 0;
+
+            ends[i].forward = this;
+            ends[i].side = RelayForwarder::Side ( i );
+        }
+
+        dropped = 0;
+    }
+
+    ~Forward()
+    {
+        // Closing the fds also removes them from the epoll set
+        for ( End& end : ends )
+        {
+            if ( end.fd >= 0 )
+                close ( end.fd );
+        }
+    }
+
+    RelayForwarder::Counters getCounters() const
+    {
+        RelayForwarder::Counters counters;
+
+        for ( size_t i = 0; i < 2; ++i )
+        {
+            counters.packets[i] = packets[i].load ( memory_order_relaxed );
+            counters.bytes[i] = bytes[i].load ( memory_order_relaxed );
+        }
+
+        counters.dropped = dropped.load ( memory_order_relaxed );
+        return counters;
+    }
+};
+
+typedef shared_ptr<Forward> ForwardPtr;
+
+} // namespace
+
+
+struct RelayForwarder::Worker : public Thread
+{
+    const uint64_t idleTimeout;
+
+    int epfd = -1, wakeFd = -1;
+
+    atomic<bool> stopping;
+
+    // Guards forwards and removed, the worker thread only takes it to add or remove matches
+    mutable Mutex mutex;
+
+    unordered_map<uint32_t, ForwardPtr> forwards;
+
+    vector<pair<uint32_t, Counters>> removed;
+
+    // Batch buffers, only used by the worker thread. Datagrams are sent straight out of the buffers they were read into.
+    char buffers[BATCH_SIZE][MAX_DATAGRAM_SIZE];
+    sockaddr_in sources[BATCH_SIZE];
+    iovec recvIovs[BATCH_SIZE], sendIovs[BATCH_SIZE];
+    mmsghdr recvMsgs[BATCH_SIZE], sendMsgs[BATCH_SIZE];
+
+    Worker ( uint64_t idleTimeout ) : idleTimeout ( idleTimeout ), stopping ( false )
+    {
+        memset ( recvMsgs, 0, sizeof ( recvMsgs ) );
+        memset ( sendMsgs, 0, sizeof ( sendMsgs ) );
+
+        for ( size_t i = 0; i < BATCH_SIZE; ++i )
+        {
+            recvIovs[i].iov_base = buffers[i];
+            recvIovs[i].iov_len = MAX_DATAGRAM_SIZE;
+
+            recvMsgs[i].msg_hdr.msg_iov = &recvIovs[i];
+            recvMsgs[i].msg_hdr.msg_iovlen = 1;
+            recvMsgs[i].msg_hdr.msg_name = &sources[i];
+
+            sendMsgs[i].msg_hdr.msg_iov = &sendIovs[i];
+            sendMsgs[i].msg_hdr.msg_iovlen = 1;
+            sendMsgs[i].msg_hdr.msg_namelen = sizeof ( sockaddr_in );
+        }
+
+        // Event fd that stop writes to, it's registered without an End
+        wakeFd = eventfd ( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+
+        if ( wakeFd < 0 )
+            THROW_FORWARDER_EXCEPTION ( "eventfd failed" );
+
+        epfd = epoll_create1 ( EPOLL_CLOEXEC );
+
+        if ( epfd < 0 )
+        {
+            close ( wakeFd );
+            THROW_FORWARDER_EXCEPTION ( "epoll_create1 failed" );
+        }
+
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = 0;
+
+        epoll_ctl ( epfd, EPOLL_CTL_ADD, wakeFd, &event );
+    }
+
+    ~Worker()
+    {
+        stopping = true;
+
+        const uint64_t value = 1;
+        ssize_t ignored = write ( wakeFd, &value, sizeof ( value ) );
+        ( void ) ignored;
+
+        join();
+
+        close ( epfd );
+        close ( wakeFd );
+    }
+
+    void add ( const ForwardPtr& forward )
+    {
+        LOCK ( mutex );
+
+        forwards[forward->matchId] = forward;
+
+        for ( End& end : forward->ends )
+        {
+            epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = &end;
+
+            // The match is left for removeIdle, since this thread may already be forwarding from the first port
+            if ( epoll_ctl ( epfd, EPOLL_CTL_ADD, end.fd, &event ) != 0 )
+                THROW_FORWARDER_EXCEPTION ( "epoll_ctl failed" );
+        }
+    }
+
+    size_t getMatchCount() const
+    {
+        LOCK ( mutex );
+        return forwards.size();
+    }
+
+    bool getCounters ( uint32_t matchId, Counters& counters ) const
+    {
+        LOCK ( mutex );
+
+        const auto it = forwards.find ( matchId );
+
+        if ( it == forwards.end() )
+            return false;
+
+        counters = it->second->getCounters();
+        return true;
+    }
+
+    void takeRemoved ( vector<pair<uint32_t, Counters>>& removed )
+    {
+        LOCK ( mutex );
+
+        removed.insert ( removed.end(), this->removed.begin(), this->removed.end() );
+        this->removed.clear();
+    }
+
+    void run() override
+    {
+        const uint64_t sweepInterval = min<uint64_t> ( idleTimeout, MAX_SWEEP_INTERVAL );
+
+        uint64_t lastSweep = getSteadyMilliseconds();
+
+        epoll_event events[BATCH_SIZE];
+
+        while ( ! stopping )
+        {
+            const int count = epoll_wait ( epfd, events, BATCH_SIZE, sweepInterval );
+
+            for ( int i = 0; i < count; ++i )
+            {
+                if ( events[i].data.ptr )
+                {
+                    forward ( *static_cast<End *> ( events[i].data.ptr ) );
+                    continue;
+                }
+
+                uint64_t value;
+                ssize_t ignored = read ( wakeFd, &value, sizeof ( value ) );
+                ( void ) ignored;
+            }
+
+            const uint64_t now = getSteadyMilliseconds();
+
+            if ( now - lastSweep < sweepInterval )
+                continue;
+
+            removeIdle ( now );
+            lastSweep = now;
+        }
+    }
+
+    // Read and forward all the datagrams queued on a relay port
+    void forward ( End& from )
+    {
+        Forward& forward = *from.forward;
+        End& to = forward.ends[1 - from.side];
+
+        for ( ;; )
+        {
+            for ( size_t i = 0; i < BATCH_SIZE; ++i )
+                recvMsgs[i].msg_hdr.msg_namelen = sizeof ( sockaddr_in );
+
+            const int count = recvmmsg ( from.fd, recvMsgs, BATCH_SIZE, MSG_DONTWAIT, 0 );
+
+            if ( count <= 0 )
+                return;
+
+            size_t accepted = 0, sendCount = 0;
+
+            for ( int i = 0; i < count; ++i )
+            {
+                if ( sources[i].sin_family != AF_INET || sources[i].sin_addr.s_addr != from.ip.s_addr
+                        || ( recvMsgs[i].msg_hdr.msg_flags & MSG_TRUNC ) )
+                {
+                    continue;
+                }
+
+                ++accepted;
+
+                // Always update the latched address, in case the NAT maps the side to a new port
+                from.address = sources[i];
+                from.latched = true;
+
+                if ( ! to.latched )
+                    continue;
+
+                sendIovs[sendCount].iov_base = buffers[i];
+                sendIovs[sendCount].iov_len = recvMsgs[i].msg_len;
+                sendMsgs[sendCount].msg_hdr.msg_name = &to.address;
+                ++sendCount;
+            }
+
+            // Sent from the other side's relay port, which is the address the other side was told about
+            size_t sent = 0;
+
+            while ( sent < sendCount )
+            {
+                const int result = sendmmsg ( to.fd, &sendMsgs[sent], sendCount - sent, MSG_DONTWAIT );
+
+                // Drop the rest of the batch, like a full network queue would
+                if ( result <= 0 )
+                    break;
+
+                sent += result;
+            }
+
+            uint64_t bytes = 0;
+
+            for ( size_t i = 0; i < sent; ++i )
+                bytes += sendIovs[i].iov_len;
+
+            forward.packets[from.side].fetch_add ( sent, memory_order_relaxed );
+            forward.bytes[from.side].fetch_add ( bytes, memory_order_relaxed );
+            forward.dropped.fetch_add ( count - sent, memory_order_relaxed );
+
+            if ( accepted )
+                forward.lastActive = getSteadyMilliseconds();
+
+            if ( count < BATCH_SIZE )
+                return;
+        }
+    }
+
+    void removeIdle ( uint64_t now )
+    {
+        LOCK ( mutex );
+
+        for ( auto it = forwards.begin(); it != forwards.end(); )
+        {
+            if ( now - it->second->lastActive < idleTimeout )
+            {
+                ++it;
+                continue;
+            }
+
+            removed.push_back ( make_pair ( it->first, it->second->getCounters() ) );
+            it = forwards.erase ( it );
+        }
+    }
+};
+
+
+// Bind a relay port on all interfaces
+static void bindRelayPort ( End& end )
+{
+    end.fd = socket ( AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP );
+
+    if ( end.fd < 0 )
+        THROW_FORWARDER_EXCEPTION ( "socket failed" );
+
+    // Should be safe to continue even if this fails
+    const int size = RELAY_PORT_RECV_BUFFER;
+    setsockopt ( end.fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof ( size ) );
+
+    sockaddr_in addr;
+    memset ( &addr, 0, sizeof ( addr ) );
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl ( INADDR_ANY );
+    addr.sin_port = 0;
+
+    socklen_t len = sizeof ( addr );
+
+    if ( ::bind ( end.fd, ( sockaddr * ) &addr, sizeof ( addr ) ) != 0
+            || getsockname ( end.fd, ( sockaddr * ) &addr, &len ) != 0 )
+    {
+        THROW_FORWARDER_EXCEPTION ( "bind failed" );
+    }
+
+    end.port = ntohs ( addr.sin_port );
+}
+
+
+bool RelayForwarder::isSupported()
+{
+    return true;
+}
+
+RelayForwarder::RelayForwarder ( size_t workerCount, uint64_t idleTimeout )
+{
+    if ( workerCount == 0 )
+        workerCount = max ( 1L, sysconf ( _SC_NPROCESSORS_ONLN ) );
+
+    for ( size_t i = 0; i < workerCount; ++i )
+    {
+        _workers.push_back ( shared_ptr<Worker> ( new Worker ( idleTimeout ) ) );
+        _workers.back()->start();
+    }
+}
+
+RelayForwarder::~RelayForwarder()
+{
+    _workers.clear();
+}
+
+void RelayForwarder::add ( uint32_t matchId, const string addrs[2], uint16_t ports[2] )
+{
+    ForwardPtr forward ( new Forward ( matchId ) );
+
+    for ( End& end : forward->ends )
+    {
+        if ( inet_pton ( AF_INET, addrs[end.side].c_str(), &end.ip ) != 1 )
+            THROW_EXCEPTION ( "Invalid IPv4 address '%s'", ERROR_NETWORK_GENERIC, addrs[end.side] );
+
+        bindRelayPort ( end );
+
+        ports[end.side] = end.port;
+    }
+
+    forward->lastActive = getSteadyMilliseconds();
+
+    getWorker ( matchId ).add ( forward );
+}
+
+size_t RelayForwarder::getMatchCount() const
+{
+    size_t count = 0;
+
+    for ( const auto& worker : _workers )
+        count += worker->getMatchCount();
+
+    return count;
+}
+
+bool RelayForwarder::getCounters ( uint32_t matchId, Counters& counters ) const
+{
+    return getWorker ( matchId ).getCounters ( matchId, counters );
+}
+
+vector<pair<uint32_t, RelayForwarder::Counters>> RelayForwarder::takeRemoved()
+{
+    vector<pair<uint32_t, Counters>> removed;
+
+    for ( const auto& worker : _workers )
+        worker->takeRemoved ( removed );
+
+    return removed;
+}
+
+#else // NOT __linux__
+
+struct RelayForwarder::Worker {};
+
+bool RelayForwarder::isSupported()
+{
+    return false;
+}
+
+RelayForwarder::RelayForwarder ( size_t workerCount, uint64_t idleTimeout )
+{
+    THROW_EXCEPTION ( "Forwarding is only supported on Linux", ERROR_NETWORK_GENERIC );
+}
+
+RelayForwarder::~RelayForwarder() {}
+
+void RelayForwarder::add ( uint32_t matchId, const string addrs[2], uint16_t ports[2] ) {}
+
+size_t RelayForwarder::getMatchCount() const { return 0; }
+
+bool RelayForwarder::getCounters ( uint32_t matchId, Counters& counters ) const { return false; }
+
+vector<pair<uint32_t, RelayForwarder::Counters>> RelayForwarder::takeRemoved() { return {}; }
+
+#endif // __linux__
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+
+#define DEFAULT_FORWARD_IDLE_TIMEOUT ( 60000 )
+
+
+// Data plane of the relay server, forwards the UDP traffic of a match when the two sides can't reach each other.
+// Each side sends to its own relay port, and is latched to the source address of its datagrams from its known IP,
+// since a symmetric NAT maps a different port for every destination. Datagrams from one side are sent out of the
+// other side's relay port, so each side only ever sees the address it was told about in its TunInfo.
+// Matches are sharded across worker threads by matchId, each thread polls only the sockets of its own matches,
+// and a batch of datagrams is read with one recvmmsg and sent from the same buffers with one sendmmsg.
+class RelayForwarder
+{
+public:
+
+    // Index of each side of a match
+    enum Side { Client = 0, Host = 1 };
+
+    // Forwarded datagrams and bytes, indexed by the side they came from
+    struct Counters
+    {
+        uint64_t packets[2] = { 0, 0 }, bytes[2] = { 0, 0 };
+
+        // Datagrams from an unknown IP address, or that came before the other side was latched
+        uint64_t dropped = 0;
+    };
+
+    // If forwarding is implemented on this platform, it needs epoll and recvmmsg / sendmmsg
+    static bool isSupported();
+
+    // Start the worker threads, 0 for one per core. Matches are removed after idleTimeout milliseconds without data.
+    RelayForwarder ( size_t workerCount = 0, uint64_t idleTimeout = DEFAULT_FORWARD_IDLE_TIMEOUT );
+
+    // Stop the worker threads and close all the relay ports
+    ~RelayForwarder();
+
+    // Start forwarding a match between the given client and host IPv4 addresses.
+    // Sets the relay port each side should send to, throws if the ports can't be bound.
+    void add ( uint32_t matchId, const std::string addrs[2], uint16_t ports[2] );
+
+    // Get the number of worker threads
+    size_t getWorkerCount() const { return _workers.size(); }
+
+    // Get the number of currently forwarded matches
+    size_t getMatchCount() const;
+
+    // Get the counters of a forwarded match, returns false if the match isn't forwarded
+    bool getCounters ( uint32_t matchId, Counters& counters ) const;
+
+    // Get the final counters of the matches that were removed since the last call
+    std::vector<std::pair<uint32_t, Counters>> takeRemoved();
+
+private:
+
+    struct Worker;
+
+    std::vector<std::shared_ptr<Worker>> _workers;
+
+    Worker& getWorker ( uint32_t matchId ) const { return *_workers[matchId % _workers.size()]; }
+};
@@ -0,0 +1,220 @@
+#include "RelayProbe.hpp"
+#include "UdpSocket.hpp"
+#include "TimerManager.hpp"
+#include "Logger.hpp"
+#include "Exceptions.hpp"
+#include "SocketCompat.hpp"
+
+#include <algorithm>
+#include <unordered_map>
+
+using namespace std;
+
+
+namespace
+{
+
+struct CachedRtt
+{
+    uint32_t rtt = UNKNOWN_RTT;
+
+    uint64_t time = 0;
+};
+
+}
+
+static unordered_map<IpAddrPort, CachedRtt> cache;
+
+
+RelayProbe::RelayProbe ( Owner *owner, const vector<IpAddrPort>& relays, const string& hostKey, uint64_t timeout )
+    : owner ( owner ), hostKey ( hostKey )
+{
+    for ( const IpAddrPort& address : relays )
+    {
+        Result result;
+        result.address = address;
+        _results.push_back ( result );
+
+        // Replies come from the numeric address, so resolve host names first
+        IpAddrPort resolved;
+
+        try
+        {
+            resolved = IpAddrPort ( getAddrFromSockAddr ( address.getAddrInfo()->ai_addr ), address.port );
+        }
+        catch ( const Exception& exc )
+        {
+            LOG ( "Failed to resolve relay='%s'", address );
+        }
+
+        _resolved.push_back ( resolved );
+
+        // Don't wait for servers that recently didn't reply, or that can't be reached at all
+        uint32_t rtt;
+        _expected.push_back ( ! resolved.empty() && ( ! getCachedRtt ( address, rtt ) || rtt != UNKNOWN_RTT ) );
+    }
+
+    _socket = UdpSocket::bind ( this, 0, true ); // Raw socket
+
+    _deadline = TimerManager::get().getNow ( true ) + timeout;
+
+    sendPings();
+
+    // The owner is always called back asynchronously, a timer started with 0 never expires
+    _timer.reset ( new Timer ( this ) );
+    _timer->start ( isComplete() ? 1 : min<uint64_t> ( timeout, RELAY_PROBE_INTERVAL ) );
+}
+
+void RelayProbe::socketDisconnected ( Socket *socket )
+{
+    LOG ( "Probe socket disconnected" );
+
+    finish();
+}
+
+void RelayProbe::socketRead ( Socket *socket, const char *buffer, size_t len, const IpAddrPort& address )
+{
+    RelayPong pong;
+
+    if ( ! RelayPong::decode ( buffer, len, pong ) )
+        return;
+
+    for ( size_t i = 0; i < _results.size(); ++i )
+    {
+        Result& result = _results[i];
+
+        if ( _resolved[i] != address || result.rtt != UNKNOWN_RTT )
+            continue;
+
+        result.rtt = TimerManager::get().getNow ( true ) - pong.timestamp;
+        result.hostRtt = pong.hostRtt;
+
+        LOG ( "relay='%s'; address='%s'; rtt=%u; hostRtt=%d", result.address, address, result.rtt, ( int ) result.hostRtt );
+        break;
+    }
+
+    if ( isComplete() )
+        finish();
+}
+
+void RelayProbe::timerExpired ( Timer *timer )
+{
+    ASSERT ( timer == _timer.get() );
+
+    const uint64_t now = TimerManager::get().getNow();
+
+    if ( isComplete() || now >= _deadline )
+    {
+        finish();
+        return;
+    }
+
+    sendPings();
+
+    _timer->start ( min<uint64_t> ( _deadline - now, RELAY_PROBE_INTERVAL ) );
+}
+
+void RelayProbe::sendPings()
+{
+    const string ping = RelayPing ( TimerManager::get().getNow ( true ), hostKey ).encode();
+
+    for ( size_t i = 0; i < _results.size(); ++i )
+    {
+        if ( _results[i].rtt == UNKNOWN_RTT && ! _resolved[i].empty() )
+            _socket->send ( &ping[0], ping.size(), _resolved[i] );
+    }
+}
+
+bool RelayProbe::isComplete() const
+{
+    for ( size_t i = 0; i < _results.size(); ++i )
+    {
+        if ( _expected[i] && _results[i].rtt == UNKNOWN_RTT )
+            return false;
+    }
+
+    return true;
+}
+
+void RelayProbe::finish()
+{
+    _timer.reset();
+    _socket.reset();
+
+    const uint64_t now = TimerManager::get().getNow();
+
+    for ( const Result& result : _results )
+    {
+        cache[result.address].rtt = result.rtt;
+        cache[result.address].time = now;
+    }
+
+    if ( owner )
+        owner->relayProbeDone ( this );
+}
+
+vector<IpAddrPort> RelayProbe::rank ( const vector<Result>& results )
+{
+    // Servers that know the host first, then servers that replied, then the rest
+    auto tier = [] ( const Result& result ) -> int
+    {
+        if ( result.rtt == UNKNOWN_RTT )
+            return 2;
+
+        return ( result.hostRtt == UNKNOWN_RTT ? 1 : 0 );
+    };
+
+    auto combined = [] ( const Result& result ) -> uint64_t
+    {
+        if ( result.rtt == UNKNOWN_RTT )
+            return 0;
+
+        return uint64_t ( result.rtt ) + ( result.hostRtt == UNKNOWN_RTT ? 0 : result.hostRtt );
+    };
+
+    vector<Result> sorted = results;
+
+    stable_sort ( sorted.begin(), sorted.end(), [&] ( const Result& a, const Result& b )
+    {
+        if ( tier ( a ) != tier ( b ) )
+            return tier ( a ) < tier ( b );
+
+        return combined ( a ) < combined ( b );
+    } );
+
+    vector<IpAddrPort> ranked;
+
+    for ( const Result& result : sorted )
+        ranked.push_back ( result.address );
+
+    return ranked;
+}
+
+bool RelayProbe::getCachedRtt ( const IpAddrPort& address, uint32_t& rtt )
+{
+    const auto it = cache.find ( address );
+
+    if ( it == cache.end() || TimerManager::get().getNow() >= it->second.time + RELAY_RTT_TTL )
+        return false;
+
+    rtt = it->second.rtt;
+    return true;
+}
+
+bool RelayProbe::isCached ( const vector<IpAddrPort>& relays )
+{
+    uint32_t rtt;
+
+    for ( const IpAddrPort& address : relays )
+    {
+        if ( ! getCachedRtt ( address, rtt ) )
+            return false;
+    }
+
+    return true;
+}
+
+void RelayProbe::clearCache()
+{
+    cache.clear();
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include "Socket.hpp"
+#include "Timer.hpp"
+#include "TunnelProtocol.hpp"
+
+#include <string>
+#include <vector>
+
+
+#define DEFAULT_RELAY_PROBE_TIMEOUT ( 1000 )
+
+// Interval to resend RelayPing to servers that haven't replied yet, in case it was lost
+#define RELAY_PROBE_INTERVAL ( 200 )
+
+// How long measured round trip times are cached
+#define RELAY_RTT_TTL ( 5 * 60 * 1000 )
+
+
+// Measures the round trip time to every tunnel server in parallel, by sending RelayPing over one UDP socket.
+// The measured times are cached for RELAY_RTT_TTL, and shared with later probes. If given the host's address,
+// the servers also reply with the host's round trip time, so they can be ranked by the combined latency.
+class RelayProbe
+    : private Socket::Owner
+    , private Timer::Owner
+{
+public:
+
+    // RelayProbe owner interface
+    struct Owner
+    {
+        virtual void relayProbeDone ( RelayProbe *relayProbe ) = 0;
+    };
+
+    struct Result
+    {
+        IpAddrPort address;
+
+        // Round trip times in milliseconds, UNKNOWN_RTT if there was no reply, or if the server doesn't know the host
+        uint32_t rtt = UNKNOWN_RTT, hostRtt = UNKNOWN_RTT;
+    };
+
+    Owner *owner = 0;
+
+    // TypedConnectionAddress of the host, empty to only measure the servers
+    const std::string hostKey;
+
+    // Start probing, the owner is called back once every server replied, or after the timeout.
+    // Servers that didn't reply the last time they were probed within the TTL are not waited for.
+    RelayProbe ( Owner *owner, const std::vector<IpAddrPort>& relays, const std::string& hostKey = "",
+                 uint64_t timeout = DEFAULT_RELAY_PROBE_TIMEOUT );
+
+    // Check if the probe is done
+    bool isDone() const { return !_timer; }
+
+    // Get the results in the same order as the servers
+    const std::vector<Result>& getResults() const { return _results; }
+
+    // Get the servers ordered by combined round trip time
+    std::vector<IpAddrPort> getRanked() const { return rank ( _results ); }
+
+    // Order the servers that know the host by their combined round trip time, then the other servers that replied by
+    // their round trip time, then the servers that didn't reply in their original order
+    static std::vector<IpAddrPort> rank ( const std::vector<Result>& results );
+
+    // Get the cached round trip time to a server, returns false if there is none within the TTL.
+    // The time is UNKNOWN_RTT if the server didn't reply the last time.
+    static bool getCachedRtt ( const IpAddrPort& address, uint32_t& rtt );
+
+    // Check if every server has a cached round trip time within the TTL
+    static bool isCached ( const std::vector<IpAddrPort>& relays );
+
+    // Forget all the cached round trip times
+    static void clearCache();
+
+private:
+
+    SocketPtr _socket;
+
+    TimerPtr _timer;
+
+    // Time to stop waiting for replies
+    uint64_t _deadline = 0;
+
+    std::vector<Result> _results;
+
+    // Numeric addresses of the servers, indexed like _results, empty if the name didn't resolve
+    std::vector<IpAddrPort> _resolved;
+
+    // If each server is expected to reply, indexed like _results
+    std::vector<bool> _expected;
+
+    // Socket callbacks
+    void socketAccepted ( Socket *serverSocket ) override {}
+    void socketConnected ( Socket *socket ) override {}
+    void socketDisconnected ( Socket *socket ) override;
+    void socketRead ( Socket *socket, const MsgPtr& msg, const IpAddrPort& address ) override {}
+    void socketRead ( Socket *socket, const char *buffer, size_t len, const IpAddrPort& address ) override;
+
+    // Timer callback
+    void timerExpired ( Timer *timer ) override;
+
+    // Send RelayPing to every server that hasn't replied yet
+    void sendPings();
+
+    // Check if every server that is expected to reply has replied
+    bool isComplete() const;
+
+    // Cache the results and call back the owner
+    void finish();
+};
@@ -0,0 +1,402 @@
+#include "RelayServer.hpp"
+#include "TcpSocket.hpp"
+#include "UdpSocket.hpp"
+#include "TunnelProtocol.hpp"
+#include "Logger.hpp"
+#include "Exceptions.hpp"
+
+#include <ctime>
+
+using namespace std;
+
+
+#define FORWARD_LOG_INTERVAL ( 1000 )
+
+
+RelayServer::RelayServer ( uint16_t port, uint64_t statsInterval, bool printEvents )
+    : printEvents ( printEvents ), _statsInterval ( statsInterval )
+{
+    _tcpServer = TcpSocket::listen ( this, port, true ); // Raw socket
+    _tcpServer->setReadBufferSize ( ReadBufferSize );
+
+    // UDP holes are reported on the same port as the TCP server
+    _udpServer = UdpSocket::bind ( this, _tcpServer->address.port, true ); // Raw socket
+    _udpServer->setReadBufferSize ( ReadBufferSize );
+
+    logEvent ( format ( "event=listening; port=%u", getPort() ) );
+
+    if ( ! _statsInterval )
+        return;
+
+    _statsTimer.reset ( new Timer ( this ) );
+    _statsTimer->start ( _statsInterval );
+}
+
+RelayServer::~RelayServer()
+{
+    _statsTimer.reset();
+    _forwardTimer.reset();
+    _forwarder.reset();
+
+    _matches.clear();
+    _hosts.clear();
+    _connections.clear();
+
+    _udpServer.reset();
+    _tcpServer.reset();
+}
+
+uint16_t RelayServer::getPort() const
+{
+    return _tcpServer->address.port;
+}
+
+void RelayServer::enableForwarding ( const string& address, size_t workerCount, uint64_t idleTimeout )
+{
+    _forwarder.reset ( new RelayForwarder ( workerCount, idleTimeout ) );
+    _forwardAddress = address;
+
+    _forwardTimer.reset ( new Timer ( this ) );
+    _forwardTimer->start ( FORWARD_LOG_INTERVAL );
+
+    logEvent ( format ( "event=forwarding; address='%s'; workers=%u", address, _forwarder->getWorkerCount() ) );
+}
+
+void RelayServer::socketAccepted ( Socket *serverSocket )
+{
+    ASSERT ( serverSocket == _tcpServer.get() );
+
+    SocketPtr socket = serverSocket->accept ( this );
+
+    if ( ! socket )
+        return;
+
+    ++_stats.accepted;
+
+    _connections[socket.get()].socket = socket;
+
+    LOG ( "event=accepted; address='%s'", socket->address );
+}
+
+void RelayServer::socketDisconnected ( Socket *socket )
+{
+    if ( socket == _tcpServer.get() || socket == _udpServer.get() )
+    {
+        logEvent ( format ( "event=error; reason='%s server socket disconnected'", socket->protocol ) );
+        return;
+    }
+
+    LOG ( "event=disconnected; address='%s'", socket->address );
+
+    removeConnection ( socket );
+}
+
+void RelayServer::socketRead ( Socket *socket, const char *buffer, size_t len, const IpAddrPort& address )
+{
+    if ( socket == _udpServer.get() )
+    {
+        gotUdpData ( buffer, len, address );
+        return;
+    }
+
+    const auto it = _connections.find ( socket );
+
+    if ( it == _connections.end() )
+        return;
+
+    // Otherwise disconnect the socket, same as an unknown request
+    if ( gotRequest ( it->second, buffer, len ) )
+        return;
+
+    LOG ( "event=rejected; address='%s'", socket->address );
+
+    ++_stats.rejected;
+
+    removeConnection ( socket );
+}
+
+bool RelayServer::gotRequest ( Connection& connection, const char *buffer, size_t len )
+{
+    Socket *socket = connection.socket.get();
+
+    // Hosts send the port they are hosting on, and keep the connection open to be told about clients
+    const TypedHostingPort hosting = TypedHostingPort::decode ( buffer, len );
+
+    if ( hosting.port )
+    {
+        const string hostKey = format ( "%c%s:%u", hosting.type, socket->address.addr, hosting.port );
+
+        // A host can change its hosting port without reconnecting
+        const auto it = _hosts.find ( connection.hostKey );
+
+        if ( it != _hosts.end() && it->second == socket )
+            _hosts.erase ( it );
+
+        connection.hostKey = hostKey;
+        connection.hostRtt = hosting.rtt;
+        _hosts[hostKey] = socket;
+
+        ++_stats.hosted;
+
+        logEvent ( format ( "event=hosting; host='%s'; rtt=%d", hostKey, ( int ) hosting.rtt ) );
+        return true;
+    }
+
+    // Clients send the typed address of the host they want to connect to
+    if ( ! TypedConnectionAddress::isValid ( buffer, len ) )
+        return false;
+
+    const bool forwarded = TypedConnectionAddress::isForwarded ( buffer );
+
+    // Disconnecting tells the client to try another server
+    if ( forwarded && ! _forwarder )
+        return false;
+
+    const auto it = _hosts.find ( TypedConnectionAddress::getHostKey ( buffer, len ) );
+
+    if ( it == _hosts.end() )
+        return false;
+
+    Socket *host = it->second;
+
+    const uint32_t matchId = nextMatchId();
+    const string matchInfo = MatchInfo::encode ( matchId );
+
+    socket->send ( &matchInfo[0], matchInfo.size() );
+    host->send ( &matchInfo[0], matchInfo.size() );
+
+    Match& match = _matches[matchId];
+    match.peers[0] = socket;
+    match.peers[1] = host;
+    match.forwarded = forwarded;
+
+    connection.matchIds.insert ( matchId );
+    _connections[host].matchIds.insert ( matchId );
+
+    ++_stats.matched;
+
+    logEvent ( format ( "event=matched; matchId=%u; host='%s'; client='%s'; forwarded=%u",
+                        matchId, it->first, socket->address, forwarded ) );
+    return true;
+}
+
+void RelayServer::gotUdpData ( const char *buffer, size_t len, const IpAddrPort& address )
+{
+    ++_stats.udpPackets;
+
+    bool isClient = false;
+    const uint32_t matchId = UdpData::decode ( buffer, len, isClient );
+
+    if ( ! matchId )
+    {
+        gotRelayPing ( buffer, len, address );
+        return;
+    }
+
+    const auto it = _matches.find ( matchId );
+
+    if ( it == _matches.end() )
+        return;
+
+    Match& match = it->second;
+
+    if ( match.forwarded )
+    {
+        gotForwardedUdpData ( matchId, match, isClient, address );
+        return;
+    }
+
+    // Both sides keep sending UdpData until connected, but the other side only needs its TunInfo once
+    const size_t index = ( isClient ? 1 : 0 );
+
+    if ( ! match.tunneled[index] )
+    {
+        const string tunInfo = TunInfo::encode ( matchId, address );
+
+        match.peers[index]->send ( &tunInfo[0], tunInfo.size() );
+        match.tunneled[index] = true;
+
+        ++_stats.tunneled;
+
+        logEvent ( format ( "event=tunneled; matchId=%u; isClient=%u; address='%s'", matchId, isClient, address ) );
+    }
+
+    if ( match.tunneled[0] && match.tunneled[1] )
+        removeMatch ( matchId );
+}
+
+void RelayServer::gotRelayPing ( const char *buffer, size_t len, const IpAddrPort& address )
+{
+    RelayPing ping;
+
+    if ( ! RelayPing::decode ( buffer, len, ping ) )
+        return;
+
+    uint32_t hostRtt = UNKNOWN_RTT;
+
+    if ( ! ping.hostKey.empty() )
+    {
+        const auto it = _hosts.find ( TypedConnectionAddress::getHostKey ( &ping.hostKey[0], ping.hostKey.size() ) );
+
+        if ( it != _hosts.end() )
+            hostRtt = _connections[it->second].hostRtt;
+    }
+
+    const string pong = RelayPong ( ping.timestamp, hostRtt ).encode();
+
+    _udpServer->send ( &pong[0], pong.size(), address );
+
+    ++_stats.pinged;
+
+    LOG ( "event=pinged; address='%s'; host='%s'; hostRtt=%d", address, ping.hostKey, ( int ) hostRtt );
+}
+
+void RelayServer::gotForwardedUdpData ( uint32_t matchId, Match& match, bool isClient, const IpAddrPort& address )
+{
+    match.holes[isClient ? RelayForwarder::Client : RelayForwarder::Host] = address;
+
+    if ( match.holes[0].empty() || match.holes[1].empty() )
+        return;
+
+    // Only the IP addresses are kept, a symmetric NAT maps a different port for the relay ports
+    const string addrs[2] = { match.holes[0].addr, match.holes[1].addr };
+    uint16_t ports[2];
+
+    try
+    {
+        _forwarder->add ( matchId, addrs, ports );
+    }
+    catch ( const Exception& exc )
+    {
+        logEvent ( format ( "event=error; matchId=%u; reason='%s'", matchId, exc.user ) );
+        removeMatch ( matchId );
+        return;
+    }
+
+    // Each side is told the relay port it sends to, instead of the other side's UDP hole
+    for ( size_t i = 0; i < 2; ++i )
+    {
+        const string tunInfo = TunInfo::encode ( matchId, IpAddrPort ( _forwardAddress, ports[i] ) );
+
+        match.peers[i]->send ( &tunInfo[0], tunInfo.size() );
+    }
+
+    _stats.tunneled += 2;
+    ++_stats.forwarded;
+
+    logEvent ( format ( "event=forwarded; matchId=%u; client='%s'; host='%s'; clientPort=%u; hostPort=%u", matchId,
+                        match.holes[RelayForwarder::Client], match.holes[RelayForwarder::Host],
+                        ports[RelayForwarder::Client], ports[RelayForwarder::Host] ) );
+
+    removeMatch ( matchId );
+}
+
+uint32_t RelayServer::nextMatchId()
+{
+    do
+    {
+        ++_lastMatchId;
+    }
+    while ( _lastMatchId == 0 || _matches.find ( _lastMatchId ) != _matches.end() );
+
+    return _lastMatchId;
+}
+
+void RelayServer::removeMatch ( uint32_t matchId )
+{
+    const auto it = _matches.find ( matchId );
+
+    if ( it == _matches.end() )
+        return;
+
+    for ( Socket *peer : it->second.peers )
+    {
+        const auto jt = _connections.find ( peer );
+
+        if ( jt != _connections.end() )
+            jt->second.matchIds.erase ( matchId );
+    }
+
+    _matches.erase ( it );
+}
+
+void RelayServer::removeConnection ( Socket *socket )
+{
+    const auto it = _connections.find ( socket );
+
+    if ( it == _connections.end() )
+        return;
+
+    Connection& connection = it->second;
+
+    if ( ! connection.hostKey.empty() )
+    {
+        const auto jt = _hosts.find ( connection.hostKey );
+
+        if ( jt != _hosts.end() && jt->second == socket )
+        {
+            _hosts.erase ( jt );
+
+            logEvent ( format ( "event=unhosted; host='%s'", connection.hostKey ) );
+        }
+    }
+
+    // The other side of each match can't be told about this socket anymore
+    unordered_set<uint32_t> matchIds;
+    matchIds.swap ( connection.matchIds );
+
+    for ( uint32_t matchId : matchIds )
+        removeMatch ( matchId );
+
+    _connections.erase ( it );
+}
+
+void RelayServer::timerExpired ( Timer *timer )
+{
+    if ( timer == _forwardTimer.get() )
+    {
+        logRemovedForwards();
+
+        _forwardTimer->start ( FORWARD_LOG_INTERVAL );
+        return;
+    }
+
+    ASSERT ( timer == _statsTimer.get() );
+
+    logEvent ( format ( "event=stats; connections=%u; hosts=%u; matches=%u; forwards=%u; accepted=%llu; "
+                        "hosted=%llu; matched=%llu; rejected=%llu; tunneled=%llu; forwarded=%llu; pinged=%llu; "
+                        "udpPackets=%llu", _connections.size(), _hosts.size(), _matches.size(),
+                        ( _forwarder ? _forwarder->getMatchCount() : 0 ), _stats.accepted, _stats.hosted,
+                        _stats.matched, _stats.rejected, _stats.tunneled, _stats.forwarded, _stats.pinged,
+                        _stats.udpPackets ) );
+
+    _statsTimer->start ( _statsInterval );
+}
+
+void RelayServer::logRemovedForwards()
+{
+    for ( const auto& kv : _forwarder->takeRemoved() )
+    {
+        const RelayForwarder::Counters& counters = kv.second;
+
+        logEvent ( format ( "event=unforwarded; matchId=%u; clientPackets=%llu; clientBytes=%llu; hostPackets=%llu; "
+                            "hostBytes=%llu; dropped=%llu", kv.first,
+                            counters.packets[RelayForwarder::Client], counters.bytes[RelayForwarder::Client],
+                            counters.packets[RelayForwarder::Host], counters.bytes[RelayForwarder::Host],
+                            counters.dropped ) );
+    }
+}
+
+void RelayServer::logEvent ( const string& event )
+{
+    LOG ( "%s", event );
+
+    if ( ! printEvents )
+        return;
+
+    char timestamp[32];
+    const time_t now = time ( 0 );
+    strftime ( timestamp, sizeof ( timestamp ), "%Y-%m-%dT%H:%M:%SZ", gmtime ( &now ) );
+
+    PRINT ( "%s %s", timestamp, event );
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include "Socket.hpp"
+#include "Timer.hpp"
+#include "RelayForwarder.hpp"
+#include "TunnelProtocol.hpp"
+
+#include <unordered_map>
+#include <unordered_set>
+
+
+// Tunnel server that match-makes hosts and clients, then tells each side the other's UDP hole.
+// Speaks the tunnel protocol in TunnelProtocol.hpp, which SmartSocket uses to fall back to a UDP tunnel.
+// Can also forward the UDP traffic of matches that ask for it, see RelayForwarder.
+class RelayServer
+    : private Socket::Owner
+    , private Timer::Owner
+{
+public:
+
+    struct Stats
+    {
+        uint64_t accepted = 0, hosted = 0, matched = 0, rejected = 0, tunneled = 0, forwarded = 0, pinged = 0;
+        uint64_t udpPackets = 0;
+    };
+
+    // Also print events and statistics to stdout, they are always logged
+    const bool printEvents;
+
+    // Listen on the TCP and UDP port, log statistics every statsInterval milliseconds, 0 to disable
+    RelayServer ( uint16_t port, uint64_t statsInterval = 0, bool printEvents = false );
+
+    // Disconnect everything
+    ~RelayServer();
+
+    // Get the bound TCP and UDP port
+    uint16_t getPort() const;
+
+    // Forward the UDP traffic of matches that ask for it, the address is this server's public IPv4 address.
+    // Throws if forwarding isn't supported on this platform.
+    void enableForwarding ( const std::string& address, size_t workerCount = 0,
+                            uint64_t idleTimeout = DEFAULT_FORWARD_IDLE_TIMEOUT );
+
+    // Get the forwarder, null if forwarding isn't enabled
+    const RelayForwarder *getForwarder() const { return _forwarder.get(); }
+
+    // Emulate an impaired link for everything sent over UDP, for testing purposes
+    void setLinkEmulator ( const LinkConfig& config ) { _udpServer->setLinkEmulator ( config ); }
+
+    // Get the number of currently connected TCP sockets, registered hosts, and pending matches
+    size_t getConnectionCount() const { return _connections.size(); }
+    size_t getHostCount() const { return _hosts.size(); }
+    size_t getMatchCount() const { return _matches.size(); }
+
+    // Get the number of events handled so far
+    const Stats& getStats() const { return _stats; }
+
+private:
+
+    // Hosts and clients only send a few bytes each, so they don't need a large read buffer
+    static const size_t ReadBufferSize = 256;
+
+    struct Connection
+    {
+        SocketPtr socket;
+
+        // Key in _hosts if this is a host, eg. "T1.2.3.4:3939"
+        std::string hostKey;
+
+        // Round trip time the host reported when it registered
+        uint32_t hostRtt = UNKNOWN_RTT;
+
+        // Pending matches this socket is in
+        std::unordered_set<uint32_t> matchIds;
+    };
+
+    struct Match
+    {
+        // The client and host socket, indexed by the isClient flag of the UdpData with the other side's address
+        Socket *peers[2] = { 0, 0 };
+
+        // If each socket has been sent the other side's TunInfo
+        bool tunneled[2] = { false, false };
+
+        // If the client asked for forwarding, then the UDP holes of both sides are needed first
+        bool forwarded = false;
+
+        // UDP holes indexed by RelayForwarder::Side, only used for forwarded matches
+        IpAddrPort holes[2];
+    };
+
+    SocketPtr _tcpServer, _udpServer;
+
+    // Connected socket -> connection data
+    std::unordered_map<Socket *, Connection> _connections;
+
+    // Typed host address -> host socket
+    std::unordered_map<std::string, Socket *> _hosts;
+
+    // matchId -> pending match
+    std::unordered_map<uint32_t, Match> _matches;
+
+    uint32_t _lastMatchId = 0;
+
+    TimerPtr _statsTimer;
+
+    // Periodically logs the counters of matches that stopped being forwarded
+    TimerPtr _forwardTimer;
+
+    std::shared_ptr<RelayForwarder> _forwarder;
+
+    // Public address of this server for forwarded TunInfos
+    std::string _forwardAddress;
+
+    uint64_t _statsInterval = 0;
+
+    Stats _stats;
+
+    // Socket callbacks
+    void socketAccepted ( Socket *serverSocket ) override;
+    void socketConnected ( Socket *socket ) override {}
+    void socketDisconnected ( Socket *socket ) override;
+    void socketRead ( Socket *socket, const MsgPtr& msg, const IpAddrPort& address ) override {}
+    void socketRead ( Socket *socket, const char *buffer, size_t len, const IpAddrPort& address ) override;
+
+    // Timer callback
+    void timerExpired ( Timer *timer ) override;
+
+    // Handle a TypedHostingPort or TypedConnectionAddress, returns false if the socket should be disconnected
+    bool gotRequest ( Connection& connection, const char *buffer, size_t len );
+
+    // Handle a UdpData from the given UDP hole
+    void gotUdpData ( const char *buffer, size_t len, const IpAddrPort& address );
+
+    // Reply to a RelayPing with the round trip time of the host it asks about
+    void gotRelayPing ( const char *buffer, size_t len, const IpAddrPort& address );
+
+    // Handle a UdpData for a forwarded match, starts forwarding once both sides' UDP holes are known
+    void gotForwardedUdpData ( uint32_t matchId, Match& match, bool isClient, const IpAddrPort& address );
+
+    // Log the final counters of the matches that stopped being forwarded
+    void logRemovedForwards();
+
+    // Get an unused non-zero matchId
+    uint32_t nextMatchId();
+
+    // Forget a match and remove it from both connections
+    void removeMatch ( uint32_t matchId );
+
+    // Forget a connection, its host address, and its pending matches
+    void removeConnection ( Socket *socket );
+
+    // Log an event formatted as key=value pairs
+    void logEvent ( const std::string& event );
+};
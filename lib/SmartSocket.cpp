@@ -1,9 +1,14 @@
 #include "SmartSocket.hpp"
 #include "TcpSocket.hpp"
 #include "UdpSocket.hpp"
+#include "TunnelProtocol.hpp"
+#include "TimerManager.hpp"
 #include "Logger.hpp"
+#include "Exceptions.hpp"
 
-#include <ws2tcpip.h>
+#include "SocketCompat.hpp"
+
+#include <fstream>
 
 using namespace std;
 
@@ -12,123 +17,13 @@ using namespace std;
 
 #define SEND_INTERVAL ( 50 )
 
-static const vector<IpAddrPort> relayServers =
+static vector<IpAddrPort> relayServers =
 {
     "104.206.199.123:3939",
     "192.210.227.23:3939",
 };
 
-/* Tunnel protocol
-
-    1 - Host opens a TCP socket to the server and sends its TypedHostingPort.
-        Host should maintain the socket connection; reconnect and resend if needed.
-
-    2 - Client opens a TCP socket to the server and sends its TypedConnectionAddress.
-
-    2 - Server tries to match-make:
-        If a matching host if found, the server sends MatchInfo to host AND client over TCP.
-        Otherwise disconnects the client if no matching host exists.
-
-    3 - On match, host and client both create a new UDP socket bound to any port,
-        and start repeatedly sending UdpData to the server's UDP port.
-
-    4 - Server recvs UdpData from the client and sends TunInfo ONCE to the host over TCP.
-        Server recvs UdpData from the host and sends TunInfo ONCE to the client over TCP.
-
-    5 - Host and client can now connect over the address specified in TunInfo.
-
-  Binary formats (little-endian):
-
-    TypedHostingPort is a char followed by a single uint16_t. The char must by 'T' for TCP or 'U' for UDP.
-
-    TypedConnectionAddress is a NON-null-terminated string, eg. "T<ip>:<port>". The first char is the socket type.
-
-    MatchInfo is "MatchInfo" followed by the matchId.
-
-    UdpData is a uint8_t followed by the matchId. The uint8_t is a boolean flag indicating isClient.
-
-    TunInfo is "TunInfo" followed by the matchId, followed by a NULL-terminated address string (for easier parsing).
-
-    The matchId is always a uint32_t, and should be non-zero.
-
-*/
-
-struct MatchInfo
-{
-    static uint32_t decode ( const char *buffer, size_t len, size_t& consumed )
-    {
-        static const string header = "MatchInfo";
-
-        if ( len < header.size() + sizeof ( uint32_t ) || string ( buffer, header.size() ) != header )
-        {
-            consumed = 0;
-            return 0;
-        }
-
-        consumed = header.size() + sizeof ( uint32_t );
-        return * ( uint32_t * ) ( buffer + header.size() );
-    }
-};
-
-struct UdpData
-{
-    char buffer[5];
-
-    UdpData ( bool isClient, uint32_t matchId )
-    {
-        ASSERT ( matchId != 0 );
-
-        buffer[0] = ( char ) ( isClient ? 1 : 0 );
-        memcpy ( &buffer[1], ( char * ) &matchId, sizeof ( uint32_t ) );
-    }
-};
-
-struct TunInfo
-{
-    uint32_t matchId = 0;
-
-    IpAddrPort address;
-
-    TunInfo() {}
-    TunInfo ( uint32_t matchId, const string& address ) : matchId ( matchId ), address ( address ) {}
-
-    static TunInfo decode ( const char *buffer, size_t len, size_t& consumed )
-    {
-        static const string header = "TunInfo";
-
-        if ( len < header.size() + sizeof ( uint32_t ) || string ( buffer, header.size() ) != header )
-        {
-            consumed = 0;
-            return TunInfo();
-        }
-
-        const size_t start = header.size() + sizeof ( uint32_t );
-
-        size_t i, end = 0;
-
-        for ( i = 0; i < 22; ++i ) // max string length ("255.255.255.255:65535\0")
-        {
-            if ( start + i >= len )
-                break;
-
-            if ( buffer[start + i] == '\0' )
-            {
-                end = start + i;
-                break;
-            }
-        }
-
-        // Not enough data or failed to find null-terminator
-        if ( end == 0 || i == 22 )
-        {
-            consumed = 0;
-            return TunInfo();
-        }
-
-        consumed = end + 1;
-        return TunInfo ( * ( uint32_t * ) &buffer[header.size()], string ( buffer + start, end - start ) );
-    }
-};
+static uint64_t raceStagger = DEFAULT_RACE_STAGGER;
 
 SmartSocket::SmartSocket ( Owner *owner, uint16_t port, Socket::Protocol protocol )
     : Socket ( owner, IpAddrPort ( "", port ), Protocol::Smart, false )
@@ -140,8 +35,13 @@ SmartSocket::SmartSocket ( Owner *owner, uint16_t port, Socket::Protocol protoco
 
     _state = State::Listening;
 
-    _vpsAddress = relayServers.cbegin();
-    _vpsSocket = TcpSocket::connect ( this, *_vpsAddress, true ); // Raw socket
+    _relays = relayServers;
+
+    // The measured latency is reported when registering, so clients can pick the server with the lowest combined latency
+    if ( RelayProbe::isCached ( _relays ) )
+        connectRelays();
+    else
+        _relayProbe.reset ( new RelayProbe ( this, _relays ) );
 
     try
     {
@@ -175,16 +75,24 @@ SmartSocket::SmartSocket ( Owner *owner, const IpAddrPort& address, Socket::Prot
 
     if ( forceTun )
     {
-        _vpsAddress = relayServers.cbegin();
-        _vpsSocket = TcpSocket::connect ( this, *_vpsAddress, true );
+        startTunnel();
         return;
     }
 
-    // Try to connect directly first
+    _directStart = TimerManager::get().getNow ( true );
+
     if ( _isDirectTCP )
         _directSocket = TcpSocket::connect ( this, address );
     else
         _directSocket = UdpSocket::connect ( this, address );
+
+    // Otherwise the tunnel only starts after the direct socket fails
+    if ( raceStagger >= _connectTimeout )
+        return;
+
+    // Always start the tunnel asynchronously, so the owner is called back after it gets this socket
+    _raceTimer.reset ( new Timer ( this ) );
+    _raceTimer->start ( raceStagger );
 }
 
 SmartSocket::~SmartSocket()
@@ -200,11 +108,14 @@ void SmartSocket::disconnect()
     _tunAddress.clear();
 
     _directSocket.reset();
+    _relayProbe.reset();
     _vpsSocket.reset();
+    _vpsSockets.clear();
     _tunSocket.reset();
 
     _sendTimer.reset();
     _connectTimer.reset();
+    _raceTimer.reset();
 }
 
 void SmartSocket::socketAccepted ( Socket *serverSocket )
@@ -219,35 +130,74 @@ void SmartSocket::socketAccepted ( Socket *serverSocket )
 
 void SmartSocket::socketConnected ( Socket *socket )
 {
-    if ( socket == _directSocket.get() || socket == _tunSocket.get() )
+    if ( socket == _directSocket.get() )
     {
-        _sendTimer.reset();
-        _connectTimer.reset();
+        _connectTime = getElapsed ( _directStart );
+
+        if ( isTunnelActive() )
+        {
+            LOG_SMART_SOCKET ( this, "Connected directly in %llu ms; cancelled UDP tunnel after %llu ms",
+                               _connectTime, getElapsed ( _tunnelStart ) );
+        }
+        else
+        {
+            LOG_SMART_SOCKET ( this, "Connected directly in %llu ms", _connectTime );
+        }
+
+        _raceTimer.reset();
+        stopTunnel();
 
         _state = State::Connected;
 
         if ( owner )
             owner->socketConnected ( this );
     }
-    else if ( socket == _vpsSocket.get() )
+    else if ( socket == _tunSocket.get() )
     {
-        if ( isServer() )
-        {
-            char buffer[3];
-            buffer[0] = ( _isDirectTCP ? 'T' : 'U' );
-            memcpy ( &buffer[1], ( char * ) &address.port, sizeof ( uint16_t ) );
+        _connectTime = getElapsed ( _tunnelStart );
 
-            _vpsSocket->send ( buffer, sizeof ( buffer ) );
+        if ( _directSocket )
+        {
+            LOG_SMART_SOCKET ( this, "Connected over UDP tunnel in %llu ms; cancelled direct after %llu ms",
+                               _connectTime, getElapsed ( _directStart ) );
         }
         else
         {
-            const string buffer = ( _isDirectTCP ? "T" : "U" ) + address.str();
+            LOG_SMART_SOCKET ( this, "Connected over UDP tunnel in %llu ms", _connectTime );
+        }
 
-            _vpsSocket->send ( &buffer[0], buffer.size() );
+        // The direct socket disconnects cleanly, in case the host already accepted it
+        _directSocket.reset();
 
-            _connectTimer.reset ( new Timer ( this ) );
-            _connectTimer->start ( _connectTimeout );
-        }
+        _sendTimer.reset();
+        _connectTimer.reset();
+
+        _state = State::Connected;
+
+        if ( owner )
+            owner->socketConnected ( this );
+    }
+    else if ( isServer() && getRelayIndex ( socket ) < _vpsSockets.size() )
+    {
+        // Servers that didn't reply to RelayPing may not accept the round trip time
+        uint32_t rtt = UNKNOWN_RTT;
+        RelayProbe::getCachedRtt ( _relays[getRelayIndex ( socket )], rtt );
+
+        const string buffer = TypedHostingPort ( _isDirectTCP ? 'T' : 'U', address.port, rtt ).encode();
+
+        socket->send ( &buffer[0], buffer.size() );
+
+        // Wait for callback to gotMatch
+    }
+    else if ( socket == _vpsSocket.get() )
+    {
+        const string buffer = ( _isForwarded ? ( _isDirectTCP ? "t" : "u" ) : ( _isDirectTCP ? "T" : "U" ) )
+                              + address.str();
+
+        _vpsSocket->send ( &buffer[0], buffer.size() );
+
+        _connectTimer.reset ( new Timer ( this ) );
+        _connectTimer->start ( _connectTimeout );
 
         // Wait for callback to gotMatch
     }
@@ -265,16 +215,60 @@ void SmartSocket::socketDisconnected ( Socket *socket )
     }
     else if ( socket == _directSocket.get() && isConnecting() )
     {
-        LOG_SMART_SOCKET ( this, "Switching to UDP tunnel" );
+        LOG_SMART_SOCKET ( this, "Direct connection failed after %llu ms", getElapsed ( _directStart ) );
 
         _directSocket.reset();
+        _raceTimer.reset();
 
-        _vpsAddress = relayServers.cbegin();
-        _vpsSocket = TcpSocket::connect ( this, *_vpsAddress, true ); // Raw socket
+        // Already racing the UDP tunnel, which is now the only way to connect
+        if ( isTunnelActive() )
+        {
+            LOG_SMART_SOCKET ( this, "Continuing with UDP tunnel" );
+
+            if ( owner )
+                ( ( SmartSocket::Owner * ) owner )->smartSocketSwitchedToUDP ( this );
+            return;
+        }
+
+        // The UDP tunnel already failed
+        if ( _tunnelStart )
+        {
+            Socket::Owner *const owner = this->owner;
+
+            disconnect();
+
+            if ( owner )
+                owner->socketDisconnected ( this );
+            return;
+        }
+
+        LOG_SMART_SOCKET ( this, "Switching to UDP tunnel" );
+
+        startTunnel();
 
         if ( owner )
             ( ( SmartSocket::Owner * ) owner )->smartSocketSwitchedToUDP ( this );
     }
+    else if ( socket == _tunSocket.get() && isClient() && isConnecting() && ! _isForwarded )
+    {
+        LOG_SMART_SOCKET ( this, "Switching to forwarded UDP tunnel" );
+
+        _isForwarded = true;
+
+        _matchId = 0;
+        _tunAddress.clear();
+
+        _tunSocket.reset();
+        _sendTimer.reset();
+
+        // Try the servers in the same order, they were already ranked
+        _vpsAddress = _relays.cbegin();
+        _vpsSocket = TcpSocket::connect ( this, *_vpsAddress, true ); // Raw socket
+    }
+    else if ( socket == _tunSocket.get() && isClient() && isConnecting() )
+    {
+        tunnelFailed();
+    }
     else if ( ( socket == _directSocket.get() && isConnected() ) || socket == _tunSocket.get() )
     {
         LOG_SMART_SOCKET ( this, "Tunnel socket disconnected" );
@@ -286,15 +280,24 @@ void SmartSocket::socketDisconnected ( Socket *socket )
         if ( owner )
             owner->socketDisconnected ( this );
     }
+    else if ( isServer() && getRelayIndex ( socket ) < _vpsSockets.size() )
+    {
+        const size_t relay = getRelayIndex ( socket );
+
+        LOG_SMART_SOCKET ( this, "vpsSocket disconnected from '%s'", _relays[relay] );
+
+        // Still registered on the other servers
+        _vpsSockets[relay].reset();
+    }
     else if ( socket == _vpsSocket.get() )
     {
         LOG_SMART_SOCKET ( this, "vpsSocket disconnected" );
 
-        ASSERT ( _vpsAddress != relayServers.cend() );
+        ASSERT ( _vpsAddress != _relays.cend() );
 
         ++_vpsAddress;
 
-        if ( _vpsAddress != relayServers.cend() )
+        if ( _vpsAddress != _relays.cend() )
         {
             _connectTimer.reset();
             _vpsSocket = TcpSocket::connect ( this, *_vpsAddress, true ); // Raw socket
@@ -303,15 +306,10 @@ void SmartSocket::socketDisconnected ( Socket *socket )
 
         _vpsSocket.reset();
 
-        if ( isConnected() || isServer() )
+        if ( isConnected() )
             return;
 
-        Socket::Owner *const owner = this->owner;
-
-        disconnect();
-
-        if ( owner )
-            owner->socketDisconnected ( this );
+        tunnelFailed();
     }
     else
     {
@@ -327,10 +325,10 @@ void SmartSocket::socketRead ( Socket *socket, const MsgPtr& msg, const IpAddrPo
 
 void SmartSocket::socketRead ( Socket *socket, const char *buffer, size_t len, const IpAddrPort& address )
 {
-    ASSERT ( socket == _vpsSocket.get() );
+    ASSERT ( socket == _vpsSocket.get() || getRelayIndex ( socket ) < _vpsSockets.size() );
 
-    _vpsSocket->_readPos += len;
-    LOG ( "Read [ %u bytes ] from '%s'; %u bytes remaining in buffer", len, address, _vpsSocket->_readPos );
+    socket->_readPos += len;
+    LOG ( "Read [ %u bytes ] from '%s'; %u bytes remaining in buffer", len, address, socket->_readPos );
 
     if ( len > 0 && len <= 256 )
         LOG ( "Hex: %s", formatAsHex ( buffer, len ) );
@@ -341,27 +339,27 @@ void SmartSocket::socketRead ( Socket *socket, const char *buffer, size_t len, c
 
     for ( ;; )
     {
-        id = MatchInfo::decode ( &_vpsSocket->_readBuffer[0], _vpsSocket->_readPos, consumed );
+        id = MatchInfo::decode ( &socket->_readBuffer[0], socket->_readPos, consumed );
 
         if ( id )
         {
             LOG_SMART_SOCKET ( this, "gotMatch ( %u )", id );
 
-            _vpsSocket->consumeBuffer ( consumed );
+            socket->consumeBuffer ( consumed );
 
-            gotMatch ( id );
+            gotMatch ( socket, id );
             continue;
         }
 
-        tun = TunInfo::decode ( &_vpsSocket->_readBuffer[0], _vpsSocket->_readPos, consumed );
+        tun = TunInfo::decode ( &socket->_readBuffer[0], socket->_readPos, consumed );
 
         if ( tun.matchId )
         {
             LOG_SMART_SOCKET ( this, "gotTunInfo ( %u, '%s' )", tun.matchId, tun.address );
 
-            _vpsSocket->consumeBuffer ( consumed );
+            socket->consumeBuffer ( consumed );
 
-            gotTunInfo ( tun.matchId, tun.address );
+            gotTunInfo ( socket, tun.matchId, tun.address );
             continue;
         }
 
@@ -376,12 +374,16 @@ void SmartSocket::timerExpired ( Timer *timer )
     {
         LOG_SMART_SOCKET ( this, "No matching host found" );
 
-        Socket::Owner *const owner = this->owner;
+        tunnelFailed();
+    }
+    else if ( timer == _raceTimer.get() )
+    {
+        _raceTimer.reset();
 
-        disconnect();
+        LOG_SMART_SOCKET ( this, "Racing UDP tunnel after %llu ms", getElapsed ( _directStart ) );
 
-        if ( owner )
-            owner->socketDisconnected ( this );
+        // The direct connection is still trying, so this isn't a switch yet
+        startTunnel();
     }
     else if ( timer == _sendTimer.get() )
     {
@@ -392,9 +394,9 @@ void SmartSocket::timerExpired ( Timer *timer )
                 const TunnelClient& tunClient = kv.second;
                 const UdpData data ( isClient(), tunClient.matchId );
 
-                ASSERT ( _vpsAddress != relayServers.cend() );
+                ASSERT ( tunClient.relay < _relays.size() );
 
-                _tunSocket->send ( data.buffer, sizeof ( data.buffer ), *_vpsAddress );
+                _tunSocket->send ( data.buffer, sizeof ( data.buffer ), _relays[tunClient.relay] );
 
                 if ( ! tunClient.address.empty() )
                     _tunSocket->send ( NullMsg, tunClient.address );
@@ -404,7 +406,7 @@ void SmartSocket::timerExpired ( Timer *timer )
         {
             const UdpData data ( isClient(), _matchId );
 
-            ASSERT ( _vpsAddress != relayServers.cend() );
+            ASSERT ( _vpsAddress != _relays.cend() );
 
             _tunSocket->send ( data.buffer, sizeof ( data.buffer ), *_vpsAddress );
 
@@ -429,7 +431,8 @@ void SmartSocket::timerExpired ( Timer *timer )
 
         if ( it != _pendingClients.end() )
         {
-            LOG_SMART_SOCKET ( this, "matchId=%u; address='%s'; Client timed out", it->first, it->second.address );
+            LOG_SMART_SOCKET ( this, "matchId=%u; address='%s'; Client timed out",
+                               it->second.matchId, it->second.address );
 
             _pendingClients.erase ( it );
         }
@@ -445,7 +448,107 @@ void SmartSocket::timerExpired ( Timer *timer )
     }
 }
 
-void SmartSocket::gotMatch ( uint32_t matchId )
+void SmartSocket::relayProbeDone ( RelayProbe *relayProbe )
+{
+    ASSERT ( relayProbe == _relayProbe.get() );
+
+    if ( isServer() )
+    {
+        _relayProbe.reset();
+
+        connectRelays();
+        return;
+    }
+
+    _relays = _relayProbe->getRanked();
+
+    for ( const RelayProbe::Result& result : _relayProbe->getResults() )
+    {
+        LOG_SMART_SOCKET ( this, "relay='%s'; rtt=%d; hostRtt=%d",
+                           result.address, ( int ) result.rtt, ( int ) result.hostRtt );
+    }
+
+    _relayProbe.reset();
+
+    if ( _relays.empty() )
+    {
+        LOG_SMART_SOCKET ( this, "No tunnel servers" );
+
+        tunnelFailed();
+        return;
+    }
+
+    _vpsAddress = _relays.cbegin();
+    _vpsSocket = TcpSocket::connect ( this, *_vpsAddress, true ); // Raw socket
+}
+
+void SmartSocket::startTunnel()
+{
+    // The servers also reply with the host's latency, and the host is looked up the same way as when connecting
+    const string hostKey = ( _isDirectTCP ? "T" : "U" ) + address.str();
+
+    _tunnelStart = TimerManager::get().getNow ( true );
+
+    _relayProbe.reset ( new RelayProbe ( this, relayServers, hostKey ) );
+}
+
+void SmartSocket::stopTunnel()
+{
+    _matchId = 0;
+    _tunAddress.clear();
+
+    _relayProbe.reset();
+    _vpsSocket.reset();
+    _tunSocket.reset();
+
+    _sendTimer.reset();
+    _connectTimer.reset();
+}
+
+void SmartSocket::tunnelFailed()
+{
+    if ( _directSocket && isConnecting() )
+    {
+        LOG_SMART_SOCKET ( this, "UDP tunnel failed after %llu ms; still connecting directly",
+                           getElapsed ( _tunnelStart ) );
+
+        stopTunnel();
+        return;
+    }
+
+    Socket::Owner *const owner = this->owner;
+
+    disconnect();
+
+    if ( owner )
+        owner->socketDisconnected ( this );
+}
+
+uint64_t SmartSocket::getElapsed ( uint64_t start )
+{
+    return TimerManager::get().getNow ( true ) - start;
+}
+
+void SmartSocket::connectRelays()
+{
+    _vpsSockets.clear();
+
+    for ( const IpAddrPort& relay : _relays )
+        _vpsSockets.push_back ( TcpSocket::connect ( this, relay, true ) ); // Raw socket
+}
+
+size_t SmartSocket::getRelayIndex ( Socket *vpsSocket ) const
+{
+    for ( size_t i = 0; i < _vpsSockets.size(); ++i )
+    {
+        if ( _vpsSockets[i].get() == vpsSocket )
+            return i;
+    }
+
+    return _vpsSockets.size();
+}
+
+void SmartSocket::gotMatch ( Socket *vpsSocket, uint32_t matchId )
 {
     ASSERT ( matchId != 0 );
 
@@ -453,19 +556,23 @@ void SmartSocket::gotMatch ( uint32_t matchId )
     {
         TunnelClient tunClient;
         tunClient.matchId = matchId;
+        tunClient.relay = getRelayIndex ( vpsSocket );
         tunClient.timer.reset ( new Timer ( this ) );
         tunClient.timer->start ( _connectTimeout );
 
-        _pendingClients[matchId] = tunClient;
-        _pendingTimers[tunClient.timer.get()] = matchId;
+        const uint64_t key = getClientKey ( tunClient.relay, matchId );
+
+        _pendingClients[key] = tunClient;
+        _pendingTimers[tunClient.timer.get()] = key;
     }
     else
     {
         _matchId = matchId;
 
-        ASSERT ( _vpsAddress != relayServers.cend() );
+        ASSERT ( _vpsAddress != _relays.cend() );
 
         _tunSocket = UdpSocket::bind ( this, *_vpsAddress );
+        _tunSocket->setProtocolLevel ( _protocolLevel );
     }
 
     if ( _sendTimer )
@@ -475,23 +582,21 @@ void SmartSocket::gotMatch ( uint32_t matchId )
     _sendTimer->start ( SEND_INTERVAL );
 }
 
-void SmartSocket::gotTunInfo ( uint32_t matchId, const IpAddrPort& address )
+void SmartSocket::gotTunInfo ( Socket *vpsSocket, uint32_t matchId, const IpAddrPort& address )
 {
     ASSERT ( matchId != 0 );
     ASSERT ( address.empty() == false );
 
     if ( isServer() )
     {
-        for ( auto& kv : _pendingClients )
+        const auto it = _pendingClients.find ( getClientKey ( getRelayIndex ( vpsSocket ), matchId ) );
+
+        if ( it != _pendingClients.end() )
         {
-            TunnelClient& tunClient = kv.second;
+            TunnelClient& tunClient = it->second;
 
-            if ( tunClient.matchId == matchId )
-            {
-                tunClient.address = address;
-                tunClient.timer->start ( _connectTimeout );
-                break;
-            }
+            tunClient.address = address;
+            tunClient.timer->start ( _connectTimeout );
         }
     }
     else
@@ -507,6 +612,60 @@ void SmartSocket::gotTunInfo ( uint32_t matchId, const IpAddrPort& address )
     }
 }
 
+void SmartSocket::setRelayServers ( const vector<IpAddrPort>& relays )
+{
+    relayServers = relays;
+}
+
+const vector<IpAddrPort>& SmartSocket::getRelayServers()
+{
+    return relayServers;
+}
+
+void SmartSocket::setRaceStagger ( uint64_t stagger )
+{
+    raceStagger = stagger;
+}
+
+uint64_t SmartSocket::getRaceStagger()
+{
+    return raceStagger;
+}
+
+bool SmartSocket::loadRelayServers ( const string& file )
+{
+    ifstream fin ( file.c_str() );
+
+    if ( ! fin.good() )
+        return false;
+
+    vector<IpAddrPort> relays;
+    string line;
+
+    while ( getline ( fin, line ) )
+    {
+        line = trimmed ( line );
+
+        if ( line.empty() || line[0] == '#' )
+            continue;
+
+        try
+        {
+            relays.push_back ( IpAddrPort ( line ) );
+        }
+        catch ( const Exception& exc )
+        {
+            LOG ( "Invalid relay server '%s'", line );
+        }
+    }
+
+    if ( relays.empty() )
+        return false;
+
+    relayServers = relays;
+    return true;
+}
+
 SocketPtr SmartSocket::listenTCP ( Owner *owner, uint16_t port )
 {
     return SocketPtr ( new SmartSocket ( owner, port, Socket::Protocol::TCP ) );
@@ -534,6 +693,17 @@ bool SmartSocket::isTunnel() const
     return ( isClient() && _tunSocket && !_tunSocket->getAsUDP().isConnectionLess() && _tunSocket->isConnected() );
 }
 
+void SmartSocket::setProtocolLevel ( uint8_t level )
+{
+    Socket::setProtocolLevel ( level );
+
+    if ( _directSocket )
+        _directSocket->setProtocolLevel ( level );
+
+    if ( _tunSocket )
+        _tunSocket->setProtocolLevel ( level );
+}
+
 SocketPtr SmartSocket::accept ( Socket::Owner *owner )
 {
     if ( _isDirectAccept && _directSocket )
@@ -600,3 +770,17 @@ bool SmartSocket::send ( const MsgPtr& message, const IpAddrPort& address )
 {
     BOILERPLATE_SEND ( message, address );
 }
+
+bool SmartSocket::sendShared ( SharedMessage& message )
+{
+    if ( ! isConnected() )
+        return false;
+
+    if ( _directSocket && _directSocket->isConnected() )
+        return _directSocket->sendShared ( message );
+
+    if ( _tunSocket && _tunSocket->isConnected() )
+        return _tunSocket->sendShared ( message );
+
+    return false;
+}
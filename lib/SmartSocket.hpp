@@ -2,22 +2,32 @@
 
 #include "Socket.hpp"
 #include "Timer.hpp"
+#include "RelayProbe.hpp"
 
 #include <unordered_map>
 
 
+// Delay before the UDP tunnel starts racing the direct connection
+#define DEFAULT_RACE_STAGGER ( 250 )
+
+
 // Socket class that tries to listen / connect over the desired protocol, but automatically falls back
 // to using UDP tunnel if the initial protocol fails. Queries a remote server for UDP tunnel data.
+// Hosts register on every tunnel server, and clients try the servers in order of combined latency, see RelayProbe.
+// Clients race the UDP tunnel against the direct connection, and keep whichever connects first.
 class SmartSocket
     : public Socket
     , private Socket::Owner
     , private Timer::Owner
+    , private RelayProbe::Owner
 {
 public:
 
     // SmartSocket owner interface
     struct Owner : public Socket::Owner
     {
+        // Called when the direct connection failed and the client continues over the UDP tunnel.
+        // Not called when the tunnel only starts racing the direct connection.
         virtual void smartSocketSwitchedToUDP ( SmartSocket *smartSocket ) {}
     };
 
@@ -31,6 +41,19 @@ public:
     static SocketPtr connectTCP ( Owner *owner, const IpAddrPort& address, bool forceTunnel = false );
     static SocketPtr connectUDP ( Owner *owner, const IpAddrPort& address, bool forceTunnel = false );
 
+    // Set / get the tunnel servers, the default list is compiled in
+    static void setRelayServers ( const std::vector<IpAddrPort>& relays );
+    static const std::vector<IpAddrPort>& getRelayServers();
+
+    // Load the tunnel servers from a file with one address per line, blank lines and lines starting with # are ignored.
+    // Returns false and keeps the current servers if the file can't be read or has no valid addresses.
+    static bool loadRelayServers ( const std::string& file );
+
+    // Set / get the delay in milliseconds before the UDP tunnel starts racing the direct connection.
+    // 0 starts both at once, a delay of at least the connect timeout only starts the tunnel after the direct fails.
+    static void setRaceStagger ( uint64_t stagger );
+    static uint64_t getRaceStagger();
+
     // Destructor
     ~SmartSocket() override;
 
@@ -43,6 +66,12 @@ public:
     // If this client UDP socket is connected over the UDP tunnel
     bool isTunnel() const;
 
+    // Milliseconds the winning path took to connect, from when that path started, 0 if not connected yet
+    uint64_t getConnectTime() const { return _connectTime; }
+
+    // Set the protocol level for the underlying sockets
+    void setProtocolLevel ( uint8_t level ) override;
+
     // Send raw bytes directly, a return value of false indicates socket is disconnected
     bool send ( const char *buffer, size_t len );
     bool send ( const char *buffer, size_t len, const IpAddrPort& address );
@@ -51,6 +80,7 @@ public:
     bool send ( SerializableMessage *message, const IpAddrPort& address = NullAddress ) override;
     bool send ( SerializableSequence *message, const IpAddrPort& address = NullAddress ) override;
     bool send ( const MsgPtr& message, const IpAddrPort& address = NullAddress ) override;
+    bool sendShared ( SharedMessage& message ) override;
 
 private:
 
@@ -63,18 +93,39 @@ private:
     // True if the socketAccepted is for directSocket
     bool _isDirectAccept = false;
 
+    // If the client asked the tunnel server to forward the UDP traffic, after the UDP tunnel failed to connect
+    bool _isForwarded = false;
+
     // Socket that tries to listen / connect directly
     SocketPtr _directSocket;
 
-    // Socket that connects to the notification and tunnel server
+    // Tunnel servers, clients rank them by latency before trying them in order
+    std::vector<IpAddrPort> _relays;
+
+    // Measures the latency to the tunnel servers, before registering or trying them
+    std::shared_ptr<RelayProbe> _relayProbe;
+
+    // Client socket that connects to the notification and tunnel server
     SocketPtr _vpsSocket;
 
-    // Current tunnel server to try
+    // Client's current tunnel server to try
     std::vector<IpAddrPort>::const_iterator _vpsAddress;
 
+    // Server sockets that are registered on each tunnel server, indexed like _relays
+    std::vector<SocketPtr> _vpsSockets;
+
     // Timeout for UDP tunnel match
     TimerPtr _connectTimer;
 
+    // Timer to start the UDP tunnel while the direct socket is still connecting
+    TimerPtr _raceTimer;
+
+    // Times the direct socket and the UDP tunnel started connecting, 0 if not started
+    uint64_t _directStart = 0, _tunnelStart = 0;
+
+    // See getConnectTime
+    uint64_t _connectTime = 0;
+
     // Client socket's connecting matchId
     uint32_t _matchId = 0;
 
@@ -90,6 +141,9 @@ private:
         // Remote client socket's connecting matchId
         uint32_t matchId = 0;
 
+        // Index of the tunnel server that matched the client
+        size_t relay = 0;
+
         // Timeout for the connecting client
         TimerPtr timer;
 
@@ -97,11 +151,11 @@ private:
         IpAddrPort address;
     };
 
-    // Remote connecting matchId -> remote client data
-    std::unordered_map<uint32_t, TunnelClient> _pendingClients;
+    // Remote connecting client key -> remote client data, see getClientKey
+    std::unordered_map<uint64_t, TunnelClient> _pendingClients;
 
-    // Connecting client timer -> matchId
-    std::unordered_map<Timer *, uint32_t> _pendingTimers;
+    // Connecting client timer -> client key
+    std::unordered_map<Timer *, uint64_t> _pendingTimers;
 
     // UDP tunnel send timer
     TimerPtr _sendTimer;
@@ -119,11 +173,38 @@ private:
     // Timer callback
     void timerExpired ( Timer *timer ) override;
 
+    // RelayProbe callback
+    void relayProbeDone ( RelayProbe *relayProbe ) override;
+
+    // Rank the tunnel servers, then try connecting to them in order
+    void startTunnel();
+
+    // If the UDP tunnel is still trying to connect or connected
+    bool isTunnelActive() const { return _relayProbe || _vpsSocket || _tunSocket; }
+
+    // Close the UDP tunnel, without disconnecting the direct socket
+    void stopTunnel();
+
+    // Give up on the UDP tunnel, only disconnects if the direct socket isn't still connecting
+    void tunnelFailed();
+
+    // Milliseconds since the given start time
+    static uint64_t getElapsed ( uint64_t start );
+
+    // Register on every tunnel server
+    void connectRelays();
+
+    // Get the index of a server socket's tunnel server, or _vpsSockets.size() if not found
+    size_t getRelayIndex ( Socket *vpsSocket ) const;
+
+    // Each tunnel server picks its own matchIds, so they are only unique per server
+    static uint64_t getClientKey ( size_t relay, uint32_t matchId ) { return ( uint64_t ( relay ) << 32 ) | matchId; }
+
     // Got a match from the tunnel server
-    void gotMatch ( uint32_t matchId );
+    void gotMatch ( Socket *vpsSocket, uint32_t matchId );
 
     // Got the final tunnel info from the tunnel server
-    void gotTunInfo ( uint32_t matchId, const IpAddrPort& address );
+    void gotTunInfo ( Socket *vpsSocket, uint32_t matchId, const IpAddrPort& address );
 
     // Construct a server socket
     SmartSocket ( Owner *owner, uint16_t port, Socket::Protocol protocol );
@@ -6,9 +6,7 @@
 #include "Exceptions.hpp"
 #include "ErrorStrings.hpp"
 
-#include <winsock2.h>
-#include <windows.h>
-#include <ws2tcpip.h>
+#include "SocketCompat.hpp"
 
 #include <cereal/types/unordered_map.hpp>
 
@@ -17,8 +15,8 @@
 
 using namespace std;
 
-
-#define READ_BUFFER_SIZE ( 1024 * 4096 )
+// Placeholder fd for sockets on the loopback network, these never have an OS socket
+#define LOOPBACK_FD ( -1 )
 
 #define SET_NON_BLOCKING_MODE(VALUE)                                                                                \
     do {                                                                                                            \
@@ -35,8 +33,8 @@ using namespace std;
 static bool enableForceReusePort = true;
 
 
-Socket::Socket ( Owner *owner, const IpAddrPort& address, Protocol protocol, bool isRaw )
-    : owner ( owner ), address ( address ), protocol ( protocol ), _isRaw ( isRaw )
+Socket::Socket ( Owner *owner, const IpAddrPort& address, Protocol protocol, bool isRaw, size_t readBufferSize )
+    : owner ( owner ), address ( address ), protocol ( protocol ), _readBufferSize ( readBufferSize ), _isRaw ( isRaw )
 {
     resetBuffer();
 }
@@ -50,22 +48,33 @@ void Socket::disconnect()
 {
     LOG_SOCKET ( this, "disconnected" );
 
-    if ( _fd )
+    if ( _isLoopback )
+        SocketManager::get().getLoopback().unbind ( this );
+    else if ( _fd )
         closesocket ( _fd );
 
     owner = 0;
+    _isLoopback = false;
     _state = State::Disconnected;
     _fd = 0;
 
     freeBuffer();
 
     _packetLoss = _hashFailRate = 0;
+
+    _links.clear();
 }
 
 void Socket::init()
 {
     ASSERT ( _fd == 0 );
 
+    if ( isUDP() && SocketManager::get().isLoopback() )
+    {
+        initLoopback();
+        return;
+    }
+
     WinException exc;
     shared_ptr<addrinfo> addrInfo;
 
@@ -100,11 +109,11 @@ void Socket::init()
 
         if ( enableForceReusePort && ( isServer() || isUDP() ) )
         {
-            const char yes = 1;
+            const int yes = 1;
 
             // SO_REUSEADDR can replace existing port binds
             // SO_EXCLUSIVEADDRUSE only replaces if not exact match
-            if ( setsockopt ( _fd, SOL_SOCKET, SO_REUSEADDR, &yes, 1 ) == SOCKET_ERROR )
+            if ( setsockopt ( _fd, SOL_SOCKET, SO_REUSEADDR, ( const char * ) &yes, sizeof ( yes ) ) == SOCKET_ERROR )
             {
                 exc = WinException ( WSAGetLastError(), "setsockopt failed", ERROR_NETWORK_GENERIC );
                 LOG_SOCKET ( this, "%s", exc );
@@ -122,8 +131,8 @@ void Socket::init()
                 {
                     int error = WSAGetLastError();
 
-                    // Successful non-blocking connect
-                    if ( error == WSAEWOULDBLOCK || error == WSAEINVAL )
+                    // Successful non-blocking connect, POSIX reports EINPROGRESS instead
+                    if ( error == WSAEWOULDBLOCK || error == WSAEINVAL || error == WSAEINPROGRESS )
                         break;
 
                     exc = WinException ( error, "connect failed", ERROR_NETWORK_GENERIC );
@@ -198,7 +207,7 @@ void Socket::init()
     if ( address.port == 0 )
     {
         sockaddr_storage sas;
-        int saLen = sizeof ( sas );
+        socklen_t saLen = sizeof ( sas );
 
         if ( getsockname ( _fd, ( sockaddr * ) &sas, &saLen ) == SOCKET_ERROR )
         {
@@ -213,6 +222,28 @@ void Socket::init()
     }
 }
 
+void Socket::initLoopback()
+{
+    // Client UDP sockets bind to any available local port, the same as init
+    const uint16_t port = SocketManager::get().getLoopback().bind ( this, isClient() ? 0 : address.port );
+
+    if ( port == 0 )
+    {
+        LOG_SOCKET ( this, "loopback bind failed" );
+        THROW_WIN_EXCEPTION ( WSAEADDRINUSE, ERROR_NETWORK_PORT_BIND, "", address.port );
+    }
+
+    _fd = LOOPBACK_FD;
+    _isLoopback = true;
+
+    // Update the local port if bound to any available port
+    if ( address.port == 0 )
+    {
+        address.port = port;
+        address.invalidate();
+    }
+}
+
 bool Socket::send ( const char *buffer, size_t len )
 {
     if ( _fd == 0 || isDisconnected() )
@@ -234,7 +265,11 @@ bool Socket::send ( const char *buffer, size_t len )
         if ( isTCP() )
         {
             LOG_SOCKET ( this, "send ( [ %u bytes ] )", len );
-            sentBytes = ::send ( _fd, buffer, len, 0 );
+            sentBytes = ::send ( _fd, buffer, len, MSG_NOSIGNAL );
+        }
+        else if ( _isLoopback )
+        {
+            return sendto ( buffer, len, address );
         }
         else
         {
@@ -284,6 +319,35 @@ bool Socket::send ( const char *buffer, size_t len, const IpAddrPort& address )
     ASSERT ( _fd != 0 );
     ASSERT ( address.addr.empty() == false );
 
+#ifndef RELEASE
+    // Simulated network conditions
+    if ( !_links.empty() )
+    {
+        auto it = _links.find ( address );
+
+        if ( it == _links.end() )
+            it = _links.find ( NullAddress );
+
+        if ( it != _links.end() )
+        {
+            it->second->send ( buffer, len, address );
+            return true;
+        }
+    }
+#endif
+
+    return sendto ( buffer, len, address );
+}
+
+bool Socket::sendto ( const char *buffer, size_t len, const IpAddrPort& address )
+{
+    if ( _isLoopback )
+    {
+        LOG_SOCKET ( this, "loopback sendto ( [ %u bytes ], '%s' )", len, address );
+        SocketManager::get().getLoopback().send ( this, buffer, len, address );
+        return true;
+    }
+
     size_t totalBytes = 0;
 
     while ( totalBytes < len || len == 0 )
@@ -330,8 +394,11 @@ int Socket::recvfrom ( char *buffer, size_t& len, IpAddrPort& address )
     ASSERT ( isUDP() == true );
     ASSERT ( _fd != 0 );
 
+    if ( _isLoopback )
+        return SocketManager::get().getLoopback().recvfrom ( this, buffer, len, address );
+
     sockaddr_storage sas;
-    int saLen = sizeof ( sas );
+    socklen_t saLen = sizeof ( sas );
 
     int recvBytes = ::recvfrom ( _fd, buffer, len, 0, ( sockaddr * ) &sas, &saLen );
 
@@ -345,11 +412,25 @@ int Socket::recvfrom ( char *buffer, size_t& len, IpAddrPort& address )
 
 void Socket::resetBuffer()
 {
-    _readBuffer.reserve ( READ_BUFFER_SIZE );
-    _readBuffer.resize ( READ_BUFFER_SIZE, ( char ) 0 );
+    _readBuffer.reserve ( _readBufferSize );
+    _readBuffer.resize ( _readBufferSize, ( char ) 0 );
     _readPos = 0;
 }
 
+void Socket::setReadBufferSize ( size_t size )
+{
+    ASSERT ( size > _readPos );
+
+    _readBufferSize = size;
+
+    // A freed buffer stays freed
+    if ( _readBuffer.empty() )
+        return;
+
+    _readBuffer.resize ( size, ( char ) 0 );
+    _readBuffer.shrink_to_fit();
+}
+
 void Socket::freeBuffer()
 {
     _readBuffer.clear();
@@ -365,8 +446,8 @@ void Socket::consumeBuffer ( size_t bytes )
     // Erase the consumed bytes (shifting the array)
     ASSERT ( bytes <= _readPos );
     _readBuffer.erase ( 0, bytes );
-    _readBuffer.reserve ( READ_BUFFER_SIZE );
-    _readBuffer.resize ( READ_BUFFER_SIZE, ( char ) 0 );
+    _readBuffer.reserve ( _readBufferSize );
+    _readBuffer.resize ( _readBufferSize, ( char ) 0 );
     _readPos -= bytes;
 }
 
@@ -458,9 +539,21 @@ void Socket::socketRead()
         MsgPtr msg = ::Protocol::decode ( &_readBuffer[0], _readPos, consumedBytes );
         consumeBuffer ( consumedBytes );
 
+        // Skip a message that was consumed but failed the hash check
+        if ( ! msg.get() && consumedBytes )
+            continue;
+
         // Abort if a message could not be decoded
         if ( ! msg.get() )
+        {
+            // UDP datagrams are never split, so any remaining bytes can't be completed by the next read
+            if ( isUDP() && _readPos )
+            {
+                LOG ( "Clearing [ %u bytes ] that could not be decoded", _readPos );
+                resetBuffer();
+            }
             return;
+        }
 
         LOG ( "Decoded '%s' using [ %u bytes ]; %u bytes remaining in buffer", msg, consumedBytes, _readPos );
         socketRead ( msg, address );
@@ -517,6 +610,7 @@ SocketShareData::SocketShareData ( const IpAddrPort& address,
 
 void SocketShareData::save ( cereal::BinaryOutputArchive& ar ) const
 {
+#ifdef _WIN32
     ar ( address, protocol, readBuffer, readPos, isRaw, state, connectTimeout,
          info->dwServiceFlags1,
          info->dwServiceFlags2,
@@ -542,6 +636,10 @@ void SocketShareData::save ( cereal::BinaryOutputArchive& ar ) const
          info->dwMessageSize,
          info->dwProviderReserved,
          info->szProtocol );
+#else
+    ar ( address, protocol, readBuffer, readPos, isRaw, state, connectTimeout,
+         info->iAddressFamily, info->iSocketType, info->iProtocol );
+#endif
 
     ar ( udpType, Protocol::encode ( gbnState ), childSockets );
 }
@@ -550,6 +648,7 @@ void SocketShareData::load ( cereal::BinaryInputArchive& ar )
 {
     info.reset ( new WSAPROTOCOL_INFO() );
 
+#ifdef _WIN32
     ar ( address, protocol, readBuffer, readPos, isRaw, state, connectTimeout,
          info->dwServiceFlags1,
          info->dwServiceFlags2,
@@ -575,6 +674,10 @@ void SocketShareData::load ( cereal::BinaryInputArchive& ar )
          info->dwMessageSize,
          info->dwProviderReserved,
          info->szProtocol );
+#else
+    ar ( address, protocol, readBuffer, readPos, isRaw, state, connectTimeout,
+         info->iAddressFamily, info->iSocketType, info->iProtocol );
+#endif
 
     string buffer;
     ar ( udpType, buffer, childSockets );
@@ -644,3 +747,41 @@ void Socket::setCheckSumFail ( uint8_t percentage )
     _hashFailRate = percentage;
 }
 
+void Socket::setLinkEmulator ( const LinkConfig& config, const IpAddrPort& address )
+{
+    _links[address].reset ( new LinkEmulator ( this, config ) );
+}
+
+const LinkEmulator *Socket::getLinkEmulator ( const IpAddrPort& address ) const
+{
+    const auto it = _links.find ( address );
+
+    if ( it == _links.end() )
+        return 0;
+
+    return it->second.get();
+}
+
+void Socket::clearLinkEmulators()
+{
+    _links.clear();
+}
+
+void Socket::linkEmulatorSend ( LinkEmulator *link, const char *bytes, size_t len, const IpAddrPort& address )
+{
+    if ( _fd == 0 || isDisconnected() )
+        return;
+
+    sendto ( bytes, len, address );
+}
+
+void Socket::setProtocolLevel ( uint8_t level )
+{
+    _protocolLevel = level;
+    _hashType = ( level >= PROTOCOL_LEVEL_FAST_HASH ? ::Protocol::getFastHashType() : HashType::MD5 );
+    _compact = ( level >= PROTOCOL_LEVEL_COMPACT );
+
+    LOG_SOCKET ( this, "protocolLevel=%u; hashType=%u; compact=%u",
+                 _protocolLevel, ( uint8_t ) _hashType, _compact );
+}
+
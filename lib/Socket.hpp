@@ -2,6 +2,7 @@
 
 #include "IpAddrPort.hpp"
 #include "GoBackN.hpp"
+#include "LinkEmulator.hpp"
 #include "Enum.hpp"
 
 #include <vector>
@@ -10,6 +11,8 @@
 
 #define DEFAULT_CONNECT_TIMEOUT ( 5000 )
 
+#define DEFAULT_READ_BUFFER_SIZE ( 1024 * 4096 )
+
 
 #define LOG_SOCKET(SOCKET, FORMAT, ...)                                                                             \
     LOG ( "%s socket=%08x; fd=%08x; state=%s; address='%s'; isRaw=%u; " FORMAT,                                     \
@@ -29,7 +32,7 @@ typedef std::shared_ptr<Socket> SocketPtr;
 
 
 // Generic socket base class
-class Socket
+class Socket : private LinkEmulator::Owner
 {
 public:
 
@@ -70,7 +73,8 @@ public:
     const Protocol protocol;
 
     // Constructor
-    Socket ( Owner *owner, const IpAddrPort& address, Protocol protocol, bool isRaw );
+    Socket ( Owner *owner, const IpAddrPort& address, Protocol protocol, bool isRaw,
+             size_t readBufferSize = DEFAULT_READ_BUFFER_SIZE );
 
     // Virtual destructor
     virtual ~Socket();
@@ -94,6 +98,9 @@ public:
     virtual bool send ( const char *buffer, size_t len );
     virtual bool send ( const char *buffer, size_t len, const IpAddrPort& address );
 
+    // Send anything that was queued to be sent together, see UdpSocket
+    virtual void flush() {}
+
     // Accept a new socket, should not be called without an socketAccepted.
     // Check socket implementation for specific behaviours.
     virtual SocketPtr accept ( Owner *owner ) = 0;
@@ -110,12 +117,31 @@ public:
         return send ( MsgPtr ( const_cast<Serializable *> ( &message ), ignoreMsgPtr ), address );
     }
 
+    // Send a message that is encoded once for every socket it is sent to, see SharedMessage.
+    // Sockets that can't reuse the encoded bytes just send the message.
+    virtual bool sendShared ( SharedMessage& message ) { return send ( message.msg ); }
+
     // Set the packet loss for testing purposes
     void setPacketLoss ( uint8_t percentage );
 
     // Set the check sum fail percentage for testing purposes
     void setCheckSumFail ( uint8_t percentage );
 
+    // Emulate the network conditions for outgoing datagrams to an address, for testing purposes.
+    // The NullAddress config applies to every address without its own config.
+    void setLinkEmulator ( const LinkConfig& config, const IpAddrPort& address = NullAddress );
+    const LinkEmulator *getLinkEmulator ( const IpAddrPort& address = NullAddress ) const;
+    void clearLinkEmulators();
+
+    // Set the size of the read buffer, sockets that only read small messages can use much less memory.
+    // Sockets accepted from a TCP server socket start with the server socket's size.
+    void setReadBufferSize ( size_t size );
+    size_t getReadBufferSize() const { return _readBufferSize; }
+
+    // Set the protocol level negotiated with the remote, this enables any newer protocol features when sending
+    virtual void setProtocolLevel ( uint8_t level );
+    uint8_t getProtocolLevel() const { return _protocolLevel; }
+
     // Cast this to another socket type
     TcpSocket& getAsTCP();
     const TcpSocket& getAsTCP() const;
@@ -138,11 +164,26 @@ protected:
     // Socket read buffer
     std::string _readBuffer;
 
+    // Size of the read buffer when it is allocated
+    size_t _readBufferSize = DEFAULT_READ_BUFFER_SIZE;
+
     // The position for the next read event.
     // In raw mode, this should be manually updated, otherwise each read will at the same position.
     // In message mode, this is automatically managed, and is only reset when a decode fails.
     size_t _readPos = 0;
 
+    // Reused buffer for encoding outgoing messages
+    EncodeBuffer _encodeBuffer;
+
+    // Negotiated protocol level
+    uint8_t _protocolLevel = 0;
+
+    // Hash type for outgoing messages, depends on the protocol level
+    HashType _hashType = HashType::MD5;
+
+    // If outgoing messages can use their compact encoding, depends on the protocol level
+    bool _compact = false;
+
     // Raw socket type flag
     bool _isRaw = false;
 
@@ -152,6 +193,9 @@ protected:
     // Underlying socket fd
     int _fd = 0;
 
+    // Bound to the in-process loopback network instead of an OS socket, see SocketManager::setLoopback
+    bool _isLoopback = false;
+
     // Initial connect timeout
     uint64_t _connectTimeout = DEFAULT_CONNECT_TIMEOUT;
 
@@ -161,6 +205,9 @@ protected:
     // Hash failure percentage for testing purposes
     uint8_t _hashFailRate = 0;
 
+    // Emulated links for outgoing datagrams for testing purposes
+    std::unordered_map<IpAddrPort, std::shared_ptr<LinkEmulator>> _links;
+
     // Reset the read buffer to its initial size
     void resetBuffer();
 
@@ -184,9 +231,18 @@ protected:
     // Initialize the socket fd with the provided address and protocol
     void init();
 
+    // Bind to the loopback network instead, called by init
+    void initLoopback();
+
     // Read raw bytes directly, 0 on success, otherwise returns the socket error code
     int recv ( char *buffer, size_t& len );
     int recvfrom ( char *buffer, size_t& len, IpAddrPort& address );
+
+    // Send a datagram directly, bypassing any emulated link
+    bool sendto ( const char *buffer, size_t len, const IpAddrPort& address );
+
+    // Send a datagram that made it through an emulated link
+    void linkEmulatorSend ( LinkEmulator *link, const char *bytes, size_t len, const IpAddrPort& address ) override;
 };
 
 
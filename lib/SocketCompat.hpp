@@ -0,0 +1,69 @@
+#pragma once
+
+// Native socket API, the networking code is written against WinSock,
+// so on other platforms the WinSock names used are mapped to their BSD socket equivalents.
+
+#ifdef _WIN32
+
+#include <winsock2.h>
+#include <windows.h>
+#include <ws2tcpip.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL ( 0 )
+#endif
+
+#else
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <cstdint>
+
+typedef int SOCKET;
+typedef unsigned long u_long;
+
+#define INVALID_SOCKET  ( -1 )
+#define SOCKET_ERROR    ( -1 )
+
+#define WSAEWOULDBLOCK  EWOULDBLOCK
+#define WSAEINPROGRESS  EINPROGRESS
+#define WSAEINVAL       EINVAL
+#define WSAECONNRESET   ECONNRESET
+#define WSAEADDRINUSE   EADDRINUSE
+#define WSAEMSGSIZE     EMSGSIZE
+
+inline int WSAGetLastError() { return errno; }
+
+inline int closesocket ( SOCKET fd ) { return close ( fd ); }
+
+inline int ioctlsocket ( SOCKET fd, long cmd, u_long *arg )
+{
+    int value = *arg;
+    return ioctl ( fd, cmd, &value );
+}
+
+// Sockets are only shared across processes with the Windows hook DLL, so these always fail
+struct _WSAPROTOCOL_INFOA
+{
+    int iAddressFamily = 0, iSocketType = 0, iProtocol = 0;
+};
+
+typedef struct _WSAPROTOCOL_INFOA WSAPROTOCOL_INFO;
+
+inline int WSADuplicateSocket ( SOCKET, int, WSAPROTOCOL_INFO * ) { errno = EOPNOTSUPP; return SOCKET_ERROR; }
+
+inline SOCKET WSASocket ( int, int, int, WSAPROTOCOL_INFO *, unsigned, unsigned )
+{
+    errno = EOPNOTSUPP;
+    return INVALID_SOCKET;
+}
+
+#endif // _WIN32
@@ -4,94 +4,53 @@
 #include "Exceptions.hpp"
 #include "ErrorStrings.hpp"
 
-#include <winsock2.h>
-#include <windows.h>
+#include "SocketCompat.hpp"
 
 using namespace std;
 
 
-void SocketManager::check ( uint64_t timeout )
+bool SocketManager::check ( uint64_t timeout )
 {
     if ( ! _initialized )
-        return;
-
-    if ( _changed )
-    {
-        for ( Socket *socket : _allocatedSockets )
-        {
-            if ( _activeSockets.find ( socket ) != _activeSockets.end() )
-                continue;
-
-            LOG_SOCKET ( socket, "added" );
-            _activeSockets.insert ( socket );
-        }
-
-        for ( auto it = _activeSockets.cbegin(); it != _activeSockets.cend(); )
-        {
-            if ( _allocatedSockets.find ( *it ) != _allocatedSockets.end() )
-            {
-                ++it;
-                continue;
-            }
-
-            LOG ( "socket=%08x removed", *it ); // Don't log any extra data cus already deleted
-            _activeSockets.erase ( it++ );
-        }
+        return false;
 
-        _changed = false;
-    }
-
-    if ( _activeSockets.empty() )
-        return;
-
-    fd_set readFds, writeFds;
-    FD_ZERO ( &readFds );
-    FD_ZERO ( &writeFds );
-
-    for ( Socket *socket : _activeSockets )
-    {
-        if ( socket->isConnecting() && socket->isTCP() )
-            FD_SET ( socket->_fd, &writeFds );
-        else
-            FD_SET ( socket->_fd, &readFds );
-    }
+    // Send everything queued since the last check before waiting
+    flush();
 
     ASSERT ( timeout > 0 );
 
-    timeval tv;
-    tv.tv_sec = timeout / 1000UL;
-    tv.tv_usec = ( timeout * 1000UL ) % 1000000UL;
+    _readySockets.clear();
 
-    // Note: select should be called between timeBeginPeriod / timeEndPeriod to ensure accurate timeouts
-    int count = select ( 0, &readFds, &writeFds, 0, &tv );
+    // Loopback datagrams are ready right away, so only poll the real sockets without waiting.
+    // Virtual time never waits, the clock jumps ahead instead, see EventManager::checkEvents.
+    _loopback.getReady ( _readySockets );
 
-    if ( count == SOCKET_ERROR )
-        THROW_WIN_EXCEPTION ( WSAGetLastError(), "select failed", ERROR_NETWORK_GENERIC );
+    if ( ! _readySockets.empty() || TimerManager::get().isVirtualTime() )
+        timeout = 0;
 
-    if ( count == 0 )
-        return;
+    if ( ! _poller->poll ( timeout, _readySockets ) && _readySockets.empty() )
+        return false;
 
     ASSERT ( TimerManager::get().isInitialized() == true );
     TimerManager::get().updateNow();
 
-    for ( Socket *socket : _activeSockets )
+    for ( Socket *socket : _readySockets )
     {
+        // Skip sockets removed while dispatching earlier ones
         if ( _allocatedSockets.find ( socket ) == _allocatedSockets.end() )
             continue;
 
         if ( socket->isConnecting() && socket->isTCP() )
         {
-            if ( ! FD_ISSET ( socket->_fd, &writeFds ) )
-                continue;
-
             LOG_SOCKET ( socket, "socketConnected" );
             socket->socketConnected();
+
+            // Switch to read events once connected
+            if ( isAllocated ( socket ) && ! socket->isConnecting() )
+                _poller->modify ( socket, socket->_fd, false );
         }
         else
         {
-            if ( ! FD_ISSET ( socket->_fd, &readFds ) )
-                continue;
-
             if ( socket->isServer() && socket->isTCP() )
             {
                 LOG_SOCKET ( socket, "socketAccepted" );
@@ -104,14 +63,21 @@ void SocketManager::check ( uint64_t timeout )
             }
         }
     }
+
+    // Send any replies to what was just read
+    flush();
+    return true;
 }
 
 void SocketManager::add ( Socket *socket )
 {
     LOG_SOCKET ( socket, "Adding socket" );
 
-    _allocatedSockets.insert ( socket );
-    _changed = true;
+    if ( ! _allocatedSockets.insert ( socket ).second || ! _poller || socket->_isLoopback )
+        return;
+
+    // TCP sockets wait for write events while connecting, everything else waits for read events
+    _poller->add ( socket, socket->_fd, socket->isConnecting() && socket->isTCP() );
 }
 
 void SocketManager::remove ( Socket *socket )
@@ -120,10 +86,34 @@ void SocketManager::remove ( Socket *socket )
     {
         LOG_SOCKET ( socket, "Removing socket" );
 
-        _changed = true;
+        // This is called before the fd is closed
+        if ( _poller && ! socket->_isLoopback )
+            _poller->remove ( socket, socket->_fd );
     }
 }
 
+void SocketManager::flushLater ( Socket *socket )
+{
+    _flushSockets.insert ( socket );
+}
+
+void SocketManager::cancelFlush ( Socket *socket )
+{
+    _flushSockets.erase ( socket );
+}
+
+void SocketManager::flush()
+{
+    if ( _flushSockets.empty() )
+        return;
+
+    unordered_set<Socket *> sockets;
+    sockets.swap ( _flushSockets );
+
+    for ( Socket *socket : sockets )
+        socket->flush();
+}
+
 void SocketManager::clear()
 {
     LOG ( "Clearing sockets" );
@@ -131,9 +121,17 @@ void SocketManager::clear()
     for ( auto it = _allocatedSockets.begin(); it != _allocatedSockets.end(); )
         ( *it++ )->disconnect();
 
-    _activeSockets.clear();
     _allocatedSockets.clear();
-    _changed = true;
+    _flushSockets.clear();
+
+    if ( _poller )
+        _poller->clear();
+}
+
+void SocketManager::wakeup()
+{
+    if ( _poller )
+        _poller->wakeup();
 }
 
 SocketManager::SocketManager() {}
@@ -145,12 +143,19 @@ void SocketManager::initialize()
 
     _initialized = true;
 
+#ifdef _WIN32
     // Initialize WinSock
     WSADATA wsaData;
     int error = WSAStartup ( MAKEWORD ( 2, 2 ), &wsaData );
 
     if ( error != NO_ERROR )
         THROW_WIN_EXCEPTION ( error, "WSAStartup failed", ERROR_NETWORK_INIT );
+#endif
+
+    // The backend may need WinSock for its wakeup socket
+    _poller = SocketPoller::create();
+
+    LOG ( "Using %s socket backend", _poller->name() );
 }
 
 void SocketManager::deinitialize()
@@ -162,7 +167,14 @@ void SocketManager::deinitialize()
 
     SocketManager::get().clear();
 
+    _poller.reset();
+
+    _loopback.clear();
+    _isLoopback = false;
+
+#ifdef _WIN32
     WSACleanup();
+#endif
 }
 
 SocketManager& SocketManager::get()
@@ -1,5 +1,8 @@
 #pragma once
 
+#include "SocketPoller.hpp"
+#include "LoopbackNetwork.hpp"
+
 #include <unordered_set>
 
 
@@ -10,14 +13,26 @@ class SocketManager
 {
 public:
 
-    // Check for socket events
-    void check ( uint64_t timeout );
+    // Check for socket events, blocks until a socket is ready, the timeout, or a wakeup.
+    // Never blocks while loopback datagrams are queued, or in virtual time, see TimerManager::setVirtualTime.
+    // Returns false if nothing happened before the timeout.
+    bool check ( uint64_t timeout );
+
+    // Make the current or next check return early, can be called on a different thread
+    void wakeup();
 
     // Add / remove / clear socket instances
     void add ( Socket *socket );
     void remove ( Socket *socket );
     void clear();
 
+    // Queue a socket to be flushed before the next check, or cancel that
+    void flushLater ( Socket *socket );
+    void cancelFlush ( Socket *socket );
+
+    // Flush all the queued sockets
+    void flush();
+
     // Initialize / deinitialize socket manager
     void initialize();
     void deinitialize();
@@ -29,16 +44,38 @@ public:
         return ( _allocatedSockets.find ( socket ) != _allocatedSockets.end() );
     }
 
+    // Get the name of the readiness backend
+    const char *getBackendName() const { return _poller->name(); }
+
+    // Bind new UDP sockets to an in-process network instead of the OS, for testing purposes.
+    // This should be set before creating any sockets, and is reset on deinitialize.
+    void setLoopback ( bool enabled ) { _isLoopback = enabled; }
+    bool isLoopback() const { return _isLoopback; }
+    LoopbackNetwork& getLoopback() { return _loopback; }
+
     // Get the singleton instance
     static SocketManager& get();
 
 private:
 
-    // Sets of active and allocated socket instances
-    std::unordered_set<Socket *> _activeSockets, _allocatedSockets;
+    // Set of allocated socket instances
+    std::unordered_set<Socket *> _allocatedSockets;
+
+    // Readiness backend, sockets are registered on add and unregistered on remove.
+    // Only exists while initialized.
+    std::shared_ptr<SocketPoller> _poller;
+
+    // Reused list of sockets that are ready after each poll
+    std::vector<Socket *> _readySockets;
+
+    // Set of sockets with data queued to be sent
+    std::unordered_set<Socket *> _flushSockets;
+
+    // In-process network for loopback sockets
+    LoopbackNetwork _loopback;
 
-    // Flag to indicate the set of allocated sockets has changed
-    bool _changed = false;
+    // Flag to indicate if new UDP sockets use the loopback network
+    bool _isLoopback = false;
 
     // Flag to indicate if initialized
     bool _initialized = false;
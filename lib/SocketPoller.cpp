@@ -0,0 +1,506 @@
+#include "SocketPoller.hpp"
+#include "Exceptions.hpp"
+#include "ErrorStrings.hpp"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+#endif
+
+#include <unordered_map>
+#include <algorithm>
+#include <cstddef>
+
+using namespace std;
+
+
+#ifdef _WIN32
+#define THROW_POLLER_EXCEPTION(DEBUG) THROW_WIN_EXCEPTION ( WSAGetLastError(), DEBUG, ERROR_NETWORK_GENERIC )
+#else
+#define THROW_POLLER_EXCEPTION(DEBUG) THROW_EXCEPTION ( DEBUG ": %s", ERROR_NETWORK_GENERIC, strerror ( errno ) )
+#endif
+
+
+#ifdef _WIN32
+
+// Winsock select doesn't scan the fd_sets by fd value, it only reads fd_count entries from fd_array,
+// and returns only the ready sockets in fd_array. So the sets can be sized to fit any number of sockets,
+// and dispatch only walks the ready sockets.
+class SelectPoller : public SocketPoller
+{
+public:
+
+    SelectPoller()
+    {
+        // Loopback UDP socket that wakeup sends to, since select can only wait on sockets
+        _wakeFd = ::socket ( AF_INET, SOCK_DGRAM, IPPROTO_UDP );
+
+        if ( _wakeFd == INVALID_SOCKET )
+            THROW_POLLER_EXCEPTION ( "socket failed" );
+
+        sockaddr_in addr;
+        memset ( &addr, 0, sizeof ( addr ) );
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl ( INADDR_LOOPBACK );
+
+        int len = sizeof ( _wakeAddr );
+        u_long flag = 1;
+
+        if ( ::bind ( _wakeFd, ( sockaddr * ) &addr, sizeof ( addr ) ) == SOCKET_ERROR
+                || getsockname ( _wakeFd, ( sockaddr * ) &_wakeAddr, &len ) == SOCKET_ERROR
+                || ioctlsocket ( _wakeFd, FIONBIO, &flag ) != 0 )
+        {
+            const int error = WSAGetLastError();
+            closesocket ( _wakeFd );
+            THROW_WIN_EXCEPTION ( error, "wakeup socket failed", ERROR_NETWORK_GENERIC );
+        }
+    }
+
+    ~SelectPoller()
+    {
+        closesocket ( _wakeFd );
+    }
+
+    void add ( Socket *socket, int fd, bool write ) override
+    {
+        _sockets[fd] = socket;
+        insert ( write ? _write : _read, fd );
+    }
+
+    void remove ( Socket *socket, int fd ) override
+    {
+        if ( ! _sockets.erase ( fd ) )
+            return;
+
+        erase ( _read, fd );
+        erase ( _write, fd );
+    }
+
+    void modify ( Socket *socket, int fd, bool write ) override
+    {
+        erase ( write ? _read : _write, fd );
+        insert ( write ? _write : _read, fd );
+    }
+
+    void clear() override
+    {
+        _sockets.clear();
+        _read.fds.clear();
+        _read.index.clear();
+        _write.fds.clear();
+        _write.index.clear();
+    }
+
+    bool poll ( uint64_t timeout, vector<Socket *>& ready ) override
+    {
+        fd_set *readFds = fill ( _readBuffer, _read, _wakeFd );
+        fd_set *writeFds = fill ( _writeBuffer, _write, INVALID_SOCKET );
+
+        timeval tv;
+        tv.tv_sec = timeout / 1000UL;
+        tv.tv_usec = ( timeout * 1000UL ) % 1000000UL;
+
+        // Note: select should be called between timeBeginPeriod / timeEndPeriod to ensure accurate timeouts
+        int count = select ( 0, readFds, writeFds, 0, &tv );
+
+        if ( count == SOCKET_ERROR )
+            THROW_POLLER_EXCEPTION ( "select failed" );
+
+        if ( count == 0 )
+            return false;
+
+        collect ( readFds, ready );
+        collect ( writeFds, ready );
+        return true;
+    }
+
+    void wakeup() override
+    {
+        sendto ( _wakeFd, "", 1, 0, ( const sockaddr * ) &_wakeAddr, sizeof ( _wakeAddr ) );
+    }
+
+    const char *name() const override { return "select"; }
+
+private:
+
+    // Persistent list of registered fds, with the position of each fd for constant time removal
+    struct FdList
+    {
+        vector<SOCKET> fds;
+        unordered_map<SOCKET, size_t> index;
+    };
+
+    FdList _read, _write;
+
+    unordered_map<SOCKET, Socket *> _sockets;
+
+    // Reused fd_set storage, the first element holds fd_count
+    vector<SOCKET> _readBuffer, _writeBuffer;
+
+    // Wakeup socket and its bound address
+    SOCKET _wakeFd = INVALID_SOCKET;
+    sockaddr_in _wakeAddr;
+
+    static_assert ( offsetof ( fd_set, fd_array ) == sizeof ( SOCKET ), "Unexpected fd_set layout" );
+
+    static void insert ( FdList& list, SOCKET fd )
+    {
+        if ( list.index.find ( fd ) != list.index.end() )
+            return;
+
+        list.index[fd] = list.fds.size();
+        list.fds.push_back ( fd );
+    }
+
+    static void erase ( FdList& list, SOCKET fd )
+    {
+        auto it = list.index.find ( fd );
+
+        if ( it == list.index.end() )
+            return;
+
+        // Swap the last fd into the removed slot
+        const size_t i = it->second;
+        list.index.erase ( it );
+
+        if ( i + 1 < list.fds.size() )
+        {
+            list.fds[i] = list.fds.back();
+            list.index[list.fds[i]] = i;
+        }
+
+        list.fds.pop_back();
+    }
+
+    static fd_set *fill ( vector<SOCKET>& buffer, const FdList& list, SOCKET extra )
+    {
+        const size_t count = list.fds.size() + ( extra == INVALID_SOCKET ? 0 : 1 );
+
+        if ( count == 0 )
+            return 0;
+
+        buffer.resize ( 1 + count );
+        copy ( list.fds.begin(), list.fds.end(), buffer.begin() + 1 );
+
+        if ( extra != INVALID_SOCKET )
+            buffer.back() = extra;
+
+        fd_set *fds = reinterpret_cast<fd_set *> ( &buffer[0] );
+        fds->fd_count = count;
+        return fds;
+    }
+
+    void collect ( const fd_set *fds, vector<Socket *>& ready ) const
+    {
+        if ( ! fds )
+            return;
+
+        for ( u_int i = 0; i < fds->fd_count; ++i )
+        {
+            if ( fds->fd_array[i] == _wakeFd )
+            {
+                char buffer[64];
+                while ( recv ( _wakeFd, buffer, sizeof ( buffer ), 0 ) > 0 );
+                continue;
+            }
+
+            auto it = _sockets.find ( fds->fd_array[i] );
+
+            if ( it != _sockets.end() )
+                ready.push_back ( it->second );
+        }
+    }
+};
+
+#endif // _WIN32
+
+
+#ifndef _WIN32
+
+// The kernel still scans every fd, but there is no FD_SETSIZE limit and the array persists between polls.
+// WSAPoll isn't used on Windows, since it needs Vista and doesn't report failed connects on older versions.
+class PollPoller : public SocketPoller
+{
+public:
+
+    PollPoller()
+    {
+        // Pipe that wakeup writes to, the read end is always the first entry in _fds
+        if ( pipe ( _wakeFds ) != 0 )
+            THROW_POLLER_EXCEPTION ( "pipe failed" );
+
+        for ( int fd : _wakeFds )
+        {
+            fcntl ( fd, F_SETFL, fcntl ( fd, F_GETFL ) | O_NONBLOCK );
+            fcntl ( fd, F_SETFD, FD_CLOEXEC );
+        }
+
+        clear();
+    }
+
+    ~PollPoller()
+    {
+        close ( _wakeFds[0] );
+        close ( _wakeFds[1] );
+    }
+
+    void add ( Socket *socket, int fd, bool write ) override
+    {
+        if ( _index.find ( fd ) != _index.end() )
+            return modify ( socket, fd, write );
+
+        pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = ( write ? POLLOUT : POLLIN );
+        pfd.revents = 0;
+
+        _index[fd] = _fds.size();
+        _fds.push_back ( pfd );
+        _sockets.push_back ( socket );
+    }
+
+    void remove ( Socket *socket, int fd ) override
+    {
+        auto it = _index.find ( fd );
+
+        if ( it == _index.end() )
+            return;
+
+        // Swap the last fd into the removed slot
+        const size_t i = it->second;
+        _index.erase ( it );
+
+        if ( i + 1 < _fds.size() )
+        {
+            _fds[i] = _fds.back();
+            _sockets[i] = _sockets.back();
+            _index[_fds[i].fd] = i;
+        }
+
+        _fds.pop_back();
+        _sockets.pop_back();
+    }
+
+    void modify ( Socket *socket, int fd, bool write ) override
+    {
+        auto it = _index.find ( fd );
+
+        if ( it != _index.end() )
+            _fds[it->second].events = ( write ? POLLOUT : POLLIN );
+    }
+
+    void clear() override
+    {
+        pollfd pfd;
+        pfd.fd = _wakeFds[0];
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        _fds.assign ( 1, pfd );
+        _sockets.assign ( 1, ( Socket * ) 0 );
+        _index.clear();
+    }
+
+    bool poll ( uint64_t timeout, vector<Socket *>& ready ) override
+    {
+        int count = ::poll ( &_fds[0], _fds.size(), timeout );
+
+        if ( count < 0 )
+        {
+            if ( errno == EINTR )
+                return false;
+
+            THROW_POLLER_EXCEPTION ( "poll failed" );
+        }
+
+        if ( count == 0 )
+            return false;
+
+        if ( _fds[0].revents )
+        {
+            char buffer[64];
+            while ( read ( _wakeFds[0], buffer, sizeof ( buffer ) ) > 0 );
+            --count;
+        }
+
+        // Errors are also dispatched, so the socket sees them on its next read
+        for ( size_t i = 1; i < _fds.size() && count > 0; ++i )
+        {
+            if ( ! _fds[i].revents )
+                continue;
+
+            ready.push_back ( _sockets[i] );
+            --count;
+        }
+
+        return true;
+    }
+
+    void wakeup() override
+    {
+        const char byte = 0;
+        ssize_t ignored = write ( _wakeFds[1], &byte, 1 );
+        ( void ) ignored;
+    }
+
+    const char *name() const override { return "poll"; }
+
+private:
+
+    // Read and write ends of the wakeup pipe
+    int _wakeFds[2];
+
+    vector<pollfd> _fds;
+
+    // Socket for each entry in _fds
+    vector<Socket *> _sockets;
+
+    // Position of each fd in _fds
+    unordered_map<int, size_t> _index;
+};
+
+#endif // NOT _WIN32
+
+
+#ifdef __linux__
+
+// Only the ready sockets are returned by the kernel, so the cost of each poll doesn't depend on the number of sockets
+class EpollPoller : public SocketPoller
+{
+public:
+
+    EpollPoller()
+    {
+        // Event fd that wakeup writes to, it's registered without a socket
+        _wakeFd = eventfd ( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+
+        if ( _wakeFd < 0 )
+            THROW_POLLER_EXCEPTION ( "eventfd failed" );
+
+        create();
+    }
+
+    ~EpollPoller()
+    {
+        close ( _epfd );
+        close ( _wakeFd );
+    }
+
+    void add ( Socket *socket, int fd, bool write ) override
+    {
+        control ( EPOLL_CTL_ADD, socket, fd, write );
+        ++_count;
+    }
+
+    void remove ( Socket *socket, int fd ) override
+    {
+        // Closed fds are already removed from the epoll set
+        if ( epoll_ctl ( _epfd, EPOLL_CTL_DEL, fd, 0 ) == 0 )
+            --_count;
+    }
+
+    void modify ( Socket *socket, int fd, bool write ) override
+    {
+        control ( EPOLL_CTL_MOD, socket, fd, write );
+    }
+
+    void clear() override
+    {
+        close ( _epfd );
+        create();
+    }
+
+    bool poll ( uint64_t timeout, vector<Socket *>& ready ) override
+    {
+        _events.resize ( _count + 1 );
+
+        int count = epoll_wait ( _epfd, &_events[0], _events.size(), timeout );
+
+        if ( count < 0 )
+        {
+            if ( errno == EINTR )
+                return false;
+
+            THROW_POLLER_EXCEPTION ( "epoll_wait failed" );
+        }
+
+        for ( int i = 0; i < count; ++i )
+        {
+            if ( _events[i].data.ptr )
+            {
+                ready.push_back ( static_cast<Socket *> ( _events[i].data.ptr ) );
+                continue;
+            }
+
+            uint64_t value;
+            ssize_t ignored = read ( _wakeFd, &value, sizeof ( value ) );
+            ( void ) ignored;
+        }
+
+        return ( count > 0 );
+    }
+
+    void wakeup() override
+    {
+        const uint64_t value = 1;
+        ssize_t ignored = write ( _wakeFd, &value, sizeof ( value ) );
+        ( void ) ignored;
+    }
+
+    const char *name() const override { return "epoll"; }
+
+private:
+
+    int _epfd = -1, _wakeFd = -1;
+
+    // Number of registered fds
+    size_t _count = 0;
+
+    // Reused event buffer
+    vector<epoll_event> _events;
+
+    void create()
+    {
+        _epfd = epoll_create1 ( EPOLL_CLOEXEC );
+        _count = 0;
+
+        if ( _epfd < 0 )
+            THROW_POLLER_EXCEPTION ( "epoll_create1 failed" );
+
+        control ( EPOLL_CTL_ADD, 0, _wakeFd, false );
+    }
+
+    void control ( int op, Socket *socket, int fd, bool write )
+    {
+        epoll_event event;
+        event.events = ( write ? EPOLLOUT : EPOLLIN );
+        event.data.ptr = socket;
+
+        if ( epoll_ctl ( _epfd, op, fd, &event ) != 0 )
+            THROW_POLLER_EXCEPTION ( "epoll_ctl failed" );
+    }
+};
+
+#endif // __linux__
+
+
+shared_ptr<SocketPoller> SocketPoller::create()
+{
+#if defined ( _WIN32 )
+    return shared_ptr<SocketPoller> ( new SelectPoller() );
+#elif defined ( __linux__ )
+    return shared_ptr<SocketPoller> ( new EpollPoller() );
+#else
+    return shared_ptr<SocketPoller> ( new PollPoller() );
+#endif
+}
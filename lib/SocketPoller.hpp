@@ -0,0 +1,40 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+
+
+class Socket;
+
+
+// Readiness backend used by SocketManager.
+// Sockets stay registered between polls, and only the sockets that are ready get returned.
+class SocketPoller
+{
+public:
+
+    virtual ~SocketPoller() {}
+
+    // Register / unregister a socket fd, write interest is for TCP connects, otherwise read interest
+    virtual void add ( Socket *socket, int fd, bool write ) = 0;
+    virtual void remove ( Socket *socket, int fd ) = 0;
+
+    // Change the interest of a registered socket fd
+    virtual void modify ( Socket *socket, int fd, bool write ) = 0;
+
+    // Unregister everything
+    virtual void clear() = 0;
+
+    // Wait up to timeout milliseconds and fill ready with the sockets that have events.
+    // Returns false if the wait timed out without any events, a wakeup returns true with no sockets.
+    virtual bool poll ( uint64_t timeout, std::vector<Socket *>& ready ) = 0;
+
+    // Make the current or next poll return early, can be called on a different thread
+    virtual void wakeup() = 0;
+
+    // Name of the backend for logging
+    virtual const char *name() const = 0;
+
+    // Create the best backend available on this platform
+    static std::shared_ptr<SocketPoller> create();
+};
@@ -4,9 +4,7 @@
 #include "Exceptions.hpp"
 #include "ErrorStrings.hpp"
 
-#include <winsock2.h>
-#include <windows.h>
-#include <ws2tcpip.h>
+#include "SocketCompat.hpp"
 
 #include <algorithm>
 
@@ -36,8 +34,8 @@ TcpSocket::TcpSocket ( Socket::Owner *owner, const IpAddrPort& address, bool isR
     _connectTimer->start ( connectTimeout );
 }
 
-TcpSocket::TcpSocket ( Socket::Owner *owner, int fd, const IpAddrPort& address, bool isRaw )
-    : Socket ( owner, address, Protocol::TCP, isRaw )
+TcpSocket::TcpSocket ( Socket::Owner *owner, int fd, const IpAddrPort& address, bool isRaw, size_t readBufferSize )
+    : Socket ( owner, address, Protocol::TCP, isRaw, readBufferSize )
 {
     _state = State::Connected;
     _fd = fd;
@@ -102,7 +100,7 @@ SocketPtr TcpSocket::accept ( Socket::Owner *owner )
         return 0;
 
     sockaddr_storage sas;
-    int saLen = sizeof ( sas );
+    socklen_t saLen = sizeof ( sas );
 
     const int newFd = ::accept ( _fd, ( sockaddr * ) &sas, &saLen );
 
@@ -113,7 +111,7 @@ SocketPtr TcpSocket::accept ( Socket::Owner *owner )
         return 0;
     }
 
-    return SocketPtr ( new TcpSocket ( owner, newFd, IpAddrPort ( ( sockaddr * ) &sas ), _isRaw ) );
+    return SocketPtr ( new TcpSocket ( owner, newFd, IpAddrPort ( ( sockaddr * ) &sas ), _isRaw, _readBufferSize ) );
 }
 
 bool TcpSocket::send ( SerializableMessage *message, const IpAddrPort& address )
@@ -128,14 +126,24 @@ bool TcpSocket::send ( SerializableSequence *message, const IpAddrPort& address
 
 bool TcpSocket::send ( const MsgPtr& msg, const IpAddrPort& address )
 {
-    const string buffer = ::Protocol::encode ( msg );
+    const ByteSpan buffer = ::Protocol::encode ( msg, _encodeBuffer, _hashType, _compact );
+
+    LOG ( "Encoded '%s' to [ %u bytes ]", msg, buffer.size );
+
+    if ( !buffer.empty() && buffer.size <= 256 )
+        LOG ( "Hex: %s", formatAsHex ( buffer.data, buffer.size ) );
 
-    LOG ( "Encoded '%s' to [ %u bytes ]", msg, buffer.size() );
+    return Socket::send ( buffer.data, buffer.size );
+}
+
+bool TcpSocket::sendShared ( SharedMessage& message )
+{
+    // The stream has no per-connection header, so the bytes are sent as is
+    const string& bytes = *message.getBytes ( _hashType, _compact );
 
-    if ( !buffer.empty() && buffer.size() <= 256 )
-        LOG ( "Hex: %s", formatAsHex ( buffer ) );
+    LOG ( "Sending shared '%s' [ %u bytes ]", message.msg, bytes.size() );
 
-    return Socket::send ( &buffer[0], buffer.size() );
+    return Socket::send ( &bytes[0], bytes.size() );
 }
 
 SocketPtr TcpSocket::shared ( Socket::Owner *owner, const SocketShareData& data )
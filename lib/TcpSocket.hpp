@@ -33,6 +33,7 @@ public:
     bool send ( SerializableMessage *message, const IpAddrPort& address = NullAddress ) override;
     bool send ( SerializableSequence *message, const IpAddrPort& address = NullAddress ) override;
     bool send ( const MsgPtr& message, const IpAddrPort& address = NullAddress ) override;
+    bool sendShared ( SharedMessage& message ) override;
 
 protected:
 
@@ -57,7 +58,7 @@ private:
     TcpSocket ( Socket::Owner *owner, const IpAddrPort& address, bool isRaw, uint64_t connectTimeout );
 
     // Construct an accepted client socket
-    TcpSocket ( Socket::Owner *owner, int fd, const IpAddrPort& address, bool isRaw );
+    TcpSocket ( Socket::Owner *owner, int fd, const IpAddrPort& address, bool isRaw, size_t readBufferSize );
 
     // Construct a socket from SocketShareData
     TcpSocket ( Socket::Owner *owner, const SocketShareData& data );
@@ -17,9 +17,15 @@ Timer::~Timer()
 void Timer::start ( uint64_t delay )
 {
     _delay = delay;
+
+    // The expiry is set relative to the next check
+    if ( _delay > 0 )
+        TimerManager::get().schedule ( this );
 }
 
 void Timer::stop()
 {
     _delay = _expiry = 0;
+
+    TimerManager::get().cancel ( this );
 }
@@ -2,6 +2,7 @@
 
 #include <iostream>
 #include <memory>
+#include <cstdint>
 
 
 class Timer
@@ -30,7 +31,11 @@ public:
 
 private:
 
+    // Delay in milliseconds until the next check, then the expiry time in nanoseconds
     uint64_t _delay = 0, _expiry = 0;
+
+    // Position in the TimerManager expiry heap and pending list, SIZE_MAX if not in them
+    size_t _heapIndex = SIZE_MAX, _pendingIndex = SIZE_MAX;
 };
 
 typedef std::shared_ptr<Timer> TimerPtr;
@@ -2,27 +2,42 @@
 #include "Timer.hpp"
 #include "Logger.hpp"
 
+#ifdef _WIN32
 #include <windows.h>
 #include <mmsystem.h>
+#else
+#include <time.h>
+#endif
+
+#include <algorithm>
 
 using namespace std;
 
 
 void TimerManager::updateNow()
 {
-    if ( ! _initialized )
+    if ( ! _initialized || _virtualTime )
         return;
 
+#ifdef _WIN32
     if ( _useHiResTimer )
     {
         QueryPerformanceCounter ( ( LARGE_INTEGER * ) &_ticks );
-        _now = ( 1000 * _ticks ) / _ticksPerSecond;
+
+        // Split the conversion so the multiplication doesn't overflow
+        _nowNs = ( _ticks / _ticksPerSecond ) * NS_PER_SECOND
+                 + ( ( _ticks % _ticksPerSecond ) * NS_PER_SECOND ) / _ticksPerSecond;
     }
     else
     {
         // Note: timeGetTime should be called between timeBeginPeriod / timeEndPeriod to ensure accuracy
-        _now = timeGetTime();
+        _nowNs = timeGetTime() * NS_PER_MS;
     }
+#else
+    timespec ts;
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+    _nowNs = uint64_t ( ts.tv_sec ) * NS_PER_SECOND + ts.tv_nsec;
+#endif
 }
 
 void TimerManager::check()
@@ -30,97 +45,186 @@ void TimerManager::check()
     if ( ! _initialized )
         return;
 
-    if ( _changed )
-    {
-        for ( Timer *timer : _allocatedTimers )
-        {
-            if ( _activeTimers.find ( timer ) != _activeTimers.end() )
-                continue;
-
-            LOG ( "Added timer %08x; delay='%llu ms'", timer, timer->_delay );
-            _activeTimers.insert ( timer );
-        }
-
-        for ( auto it = _activeTimers.begin(); it != _activeTimers.end(); )
-        {
-            if ( _allocatedTimers.find ( *it ) != _allocatedTimers.end() )
-            {
-                ++it;
-                continue;
-            }
-
-            LOG ( "Removed timer %08x", *it ); // Don't log any extra data cus already de-allocated
-            _activeTimers.erase ( it++ );
-        }
-
-        _changed = false;
-    }
-
     _nextExpiry = UINT64_MAX;
 
-    if ( _activeTimers.empty() )
+    if ( _heap.empty() && _pendingTimers.empty() )
         return;
 
     updateNow();
 
-    for ( Timer *timer : _activeTimers )
+    // Only pending timers can be added to the heap, and they are handled after this loop,
+    // so timers started from the callbacks are never expired during the same check.
+    while ( ! _heap.empty() && _nowNs >= _heap[0]->_expiry )
     {
-        if ( _allocatedTimers.find ( timer ) == _allocatedTimers.end() )
-            continue;
+        Timer *timer = _heap[0];
+
+        LOG ( "Expired timer %08x", timer );
+
+        heapErase ( timer );
 
-        if ( timer->_expiry > 0 && _now >= timer->_expiry )
-        {
-            LOG ( "Expired timer %08x", timer );
+        // Also drops any restart that was pending, the owner can start it again
+        timer->_delay = timer->_expiry = 0;
 
-            timer->_delay = timer->_expiry = 0;
+        if ( timer->owner )
+            timer->owner->timerExpired ( timer );
+    }
 
-            if ( timer->owner )
-            {
-                timer->owner->timerExpired ( timer );
+    for ( Timer *timer : _pendingTimers )
+    {
+        timer->_pendingIndex = SIZE_MAX;
 
-                if ( _allocatedTimers.find ( timer ) == _allocatedTimers.end() )
-                    continue;
-            }
-        }
+        if ( timer->_delay == 0 )
+            continue;
 
-        if ( timer->_delay > 0 )
-        {
-            LOG ( "Started timer %08x; delay='%llu ms'", timer, timer->_delay );
+        LOG ( "Started timer %08x; delay='%llu ms'", timer, timer->_delay );
 
-            timer->_expiry = _now + timer->_delay;
-            timer->_delay = 0;
-        }
+        timer->_expiry = _nowNs + timer->_delay * NS_PER_MS;
+        timer->_delay = 0;
 
-        if ( timer->_expiry > 0 && timer->_expiry < _nextExpiry )
-            _nextExpiry = timer->_expiry;
+        if ( timer->_heapIndex == SIZE_MAX )
+            heapPush ( timer );
+        else
+            heapUpdate ( timer->_heapIndex );
     }
+
+    _pendingTimers.clear();
+
+    if ( ! _heap.empty() )
+        _nextExpiry = _heap[0]->_expiry;
+}
+
+void TimerManager::setVirtualTime ( bool enabled )
+{
+    // Continue from the current real time, so existing expiry times still make sense
+    updateNow();
+
+    _virtualTime = enabled;
+
+    LOG ( "virtualTime=%u; now='%llu ns'", _virtualTime, _nowNs );
+}
+
+void TimerManager::advanceTime ( uint64_t timeout )
+{
+    ASSERT ( _virtualTime == true );
+
+    uint64_t next = _nowNs + timeout * NS_PER_MS;
+
+    if ( _nextExpiry < next )
+        next = max ( _nextExpiry, _nowNs );
+
+    _nowNs = next;
 }
 
 void TimerManager::add ( Timer *timer )
 {
     LOG ( "Adding timer %08x", timer );
-
-    _allocatedTimers.insert ( timer );
-    _changed = true;
 }
 
 void TimerManager::remove ( Timer *timer )
 {
-    if ( _allocatedTimers.erase ( timer ) )
-    {
-        LOG ( "Removing timer %08x", timer );
+    if ( timer->_heapIndex == SIZE_MAX && timer->_pendingIndex == SIZE_MAX )
+        return;
 
-        _changed = true;
-    }
+    LOG ( "Removing timer %08x", timer );
+
+    cancel ( timer );
 }
 
 void TimerManager::clear()
 {
     LOG ( "Clearing timers" );
 
-    _activeTimers.clear();
-    _allocatedTimers.clear();
-    _changed = true;
+    for ( Timer *timer : _heap )
+        timer->_heapIndex = SIZE_MAX;
+
+    for ( Timer *timer : _pendingTimers )
+        timer->_pendingIndex = SIZE_MAX;
+
+    _heap.clear();
+    _pendingTimers.clear();
+}
+
+void TimerManager::schedule ( Timer *timer )
+{
+    if ( timer->_pendingIndex != SIZE_MAX )
+        return;
+
+    timer->_pendingIndex = _pendingTimers.size();
+    _pendingTimers.push_back ( timer );
+}
+
+void TimerManager::cancel ( Timer *timer )
+{
+    if ( timer->_heapIndex != SIZE_MAX )
+        heapErase ( timer );
+
+    if ( timer->_pendingIndex != SIZE_MAX )
+        pendingErase ( timer );
+}
+
+void TimerManager::heapPush ( Timer *timer )
+{
+    timer->_heapIndex = _heap.size();
+    _heap.push_back ( timer );
+    heapUpdate ( timer->_heapIndex );
+}
+
+void TimerManager::heapErase ( Timer *timer )
+{
+    const size_t index = timer->_heapIndex;
+
+    heapSwap ( index, _heap.size() - 1 );
+    _heap.pop_back();
+    timer->_heapIndex = SIZE_MAX;
+
+    if ( index < _heap.size() )
+        heapUpdate ( index );
+}
+
+void TimerManager::heapUpdate ( size_t index )
+{
+    // Sift up
+    while ( index > 0 && _heap[index]->_expiry < _heap[ ( index - 1 ) / 2]->_expiry )
+    {
+        heapSwap ( index, ( index - 1 ) / 2 );
+        index = ( index - 1 ) / 2;
+    }
+
+    // Sift down
+    for ( ;; )
+    {
+        const size_t left = 2 * index + 1, right = left + 1;
+        size_t smallest = index;
+
+        if ( left < _heap.size() && _heap[left]->_expiry < _heap[smallest]->_expiry )
+            smallest = left;
+
+        if ( right < _heap.size() && _heap[right]->_expiry < _heap[smallest]->_expiry )
+            smallest = right;
+
+        if ( smallest == index )
+            break;
+
+        heapSwap ( index, smallest );
+        index = smallest;
+    }
+}
+
+void TimerManager::heapSwap ( size_t a, size_t b )
+{
+    swap ( _heap[a], _heap[b] );
+    _heap[a]->_heapIndex = a;
+    _heap[b]->_heapIndex = b;
+}
+
+void TimerManager::pendingErase ( Timer *timer )
+{
+    const size_t index = timer->_pendingIndex;
+
+    _pendingTimers[index] = _pendingTimers.back();
+    _pendingTimers[index]->_pendingIndex = index;
+    _pendingTimers.pop_back();
+    timer->_pendingIndex = SIZE_MAX;
 }
 
 TimerManager::TimerManager() : _useHiResTimer ( true ) {}
@@ -135,6 +239,7 @@ void TimerManager::initialize()
     // Seed the RNG in this thread because Windows has per-thread RNG, and timers are also thread specific
     srand ( time ( 0 ) );
 
+#ifdef _WIN32
     // Make sure we are using a single core on a dual core machine, otherwise timings will be off.
     DWORD_PTR oldMask = SetThreadAffinityMask ( GetCurrentThread(), 1 );
 
@@ -147,6 +252,7 @@ void TimerManager::initialize()
 
         SetThreadAffinityMask ( GetCurrentThread(), oldMask );
     }
+#endif
 }
 
 void TimerManager::deinitialize()
@@ -155,6 +261,7 @@ void TimerManager::deinitialize()
         return;
 
     _initialized = false;
+    _virtualTime = false;
 
     TimerManager::get().clear();
 }
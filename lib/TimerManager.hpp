@@ -1,6 +1,12 @@
 #pragma once
 
-#include <unordered_set>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+
+#define NS_PER_MS ( 1000000ULL )
+#define NS_PER_SECOND ( 1000000000ULL )
 
 
 class Timer;
@@ -21,6 +27,10 @@ public:
     void remove ( Timer *timer );
     void clear();
 
+    // Queue a started timer to have its expiry set on the next check, or cancel a stopped timer
+    void schedule ( Timer *timer );
+    void cancel ( Timer *timer );
+
     // Initialize / deinitialize timer manager
     void initialize();
     void deinitialize();
@@ -29,20 +39,41 @@ public:
     // Indicates if using the hi-res timer
     bool isHiRes() const { return _useHiResTimer; }
 
+    // Freeze the clock so it only moves with advanceTime, for testing purposes.
+    // Time then passes as fast as the event loop can run, this is reset on deinitialize.
+    void setVirtualTime ( bool enabled );
+    bool isVirtualTime() const { return _virtualTime; }
+
+    // Move the virtual clock forward to the next timer expiry, but by at most timeout milliseconds
+    void advanceTime ( uint64_t timeout );
+
+    // Get the current monotonic time in nanoseconds
+    uint64_t getNowNs() const { return _nowNs; }
+    uint64_t getNowNs ( bool update ) { if ( update ) updateNow(); return _nowNs; }
+
     // Get the current time in milliseconds
-    uint64_t getNow() const { return _now; }
-    uint64_t getNow ( bool update ) { if ( update ) updateNow(); return _now; }
+    uint64_t getNow() const { return _nowNs / NS_PER_MS; }
+    uint64_t getNow ( bool update ) { if ( update ) updateNow(); return getNow(); }
+
+    // Get the next time in nanoseconds when a timer will expire
+    uint64_t getNextExpiryNs() const { return _nextExpiry; }
 
-    // Get the next time when a timer will expire
-    uint64_t getNextExpiry() const { return _nextExpiry; }
+    // Get the next time in milliseconds when a timer will expire, rounded up so waiting until then is never early
+    uint64_t getNextExpiry() const
+    {
+        return ( _nextExpiry == UINT64_MAX ? UINT64_MAX : ( _nextExpiry + NS_PER_MS - 1 ) / NS_PER_MS );
+    }
 
     // Get the singleton instance
     static TimerManager& get();
 
 private:
 
-    // Sets of active and allocated timer instances
-    std::unordered_set<Timer *> _activeTimers, _allocatedTimers;
+    // Min-heap of running timers ordered by expiry, each timer tracks its own position
+    std::vector<Timer *> _heap;
+
+    // Timers started since the last check, these get their expiry on the next check
+    std::vector<Timer *> _pendingTimers;
 
     // Indicates if the hi-res timer should be used
     bool _useHiResTimer;
@@ -50,18 +81,27 @@ private:
     // Hi-res timer variables
     uint64_t _ticksPerSecond = 0, _ticks = 0;
 
-    // The current time in milliseconds
-    uint64_t _now = 0;
+    // The current time in nanoseconds
+    uint64_t _nowNs = 0;
 
-    // The next time when a timer will expire
+    // The next time in nanoseconds when a timer will expire
     uint64_t _nextExpiry = 0;
 
-    // Flag to indicate the set of allocated timers has changed
-    bool _changed = false;
+    // Flag to indicate if the clock only moves with advanceTime
+    bool _virtualTime = false;
 
     // Flag to indicate if initialized
     bool _initialized = false;
 
+    // Heap operations that keep Timer::_heapIndex up to date
+    void heapPush ( Timer *timer );
+    void heapErase ( Timer *timer );
+    void heapUpdate ( size_t index );
+    void heapSwap ( size_t a, size_t b );
+
+    // Remove a timer from the pending list
+    void pendingErase ( Timer *timer );
+
     // Private constructor, etc. for singleton class
     TimerManager();
     TimerManager ( const TimerManager& );
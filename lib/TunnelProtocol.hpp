@@ -0,0 +1,315 @@
+#pragma once
+
+#include "IpAddrPort.hpp"
+#include "Logger.hpp"
+
+#include <string>
+#include <cstring>
+#include <cctype>
+
+
+/* Tunnel protocol
+
+    1 - Host opens a TCP socket to the server and sends its TypedHostingPort.
+        Host should maintain the socket connection; reconnect and resend if needed.
+
+    2 - Client opens a TCP socket to the server and sends its TypedConnectionAddress.
+
+    2 - Server tries to match-make:
+        If a matching host if found, the server sends MatchInfo to host AND client over TCP.
+        Otherwise disconnects the client if no matching host exists.
+
+    3 - On match, host and client both create a new UDP socket bound to any port,
+        and start repeatedly sending UdpData to the server's UDP port.
+
+    4 - Server recvs UdpData from the client and sends TunInfo ONCE to the host over TCP.
+        Server recvs UdpData from the host and sends TunInfo ONCE to the client over TCP.
+
+    5 - Host and client can now connect over the address specified in TunInfo.
+
+    If the client can't connect over the tunnel, eg. behind a symmetric NAT, it can retry from step 2 with a lowercase
+    type char to ask the server to forward the UDP traffic itself. Then the server waits for UdpData from both sides,
+    and the address in each TunInfo is a server port that forwards to the other side. Servers that don't forward
+    disconnect the client instead.
+
+  Relay selection:
+
+    Hosts measure the round trip time to every server with RelayPing over UDP, then register on all of them,
+    reporting the measured time to servers that replied. Clients send RelayPing with the host's address to every
+    server, and try the servers in order of their own plus the host's round trip time.
+
+  Binary formats (little-endian):
+
+    TypedHostingPort is a char followed by a single uint16_t. The char must by 'T' for TCP or 'U' for UDP.
+    It can be followed by a uint32_t, the host's round trip time to the server in milliseconds.
+
+    TypedConnectionAddress is a NON-null-terminated string, eg. "T<ip>:<port>". The first char is the socket type,
+    lowercase to ask for forwarding.
+
+    MatchInfo is "MatchInfo" followed by the matchId.
+
+    UdpData is a uint8_t followed by the matchId. The uint8_t is a boolean flag indicating isClient.
+
+    TunInfo is "TunInfo" followed by the matchId, followed by a NULL-terminated address string (for easier parsing).
+
+    RelayPing is "RelayPing" followed by a uint64_t timestamp, optionally followed by a TypedConnectionAddress.
+
+    RelayPong is "RelayPong" followed by the timestamp of the RelayPing, followed by a uint32_t which is the round trip
+    time reported by the host at the TypedConnectionAddress, or UNKNOWN_RTT if there is no such host or time.
+
+    The matchId is always a uint32_t, and should be non-zero.
+
+*/
+
+#define UNKNOWN_RTT ( 0xFFFFFFFFu )
+
+struct TypedHostingPort
+{
+    char type = 0;
+
+    uint16_t port = 0;
+
+    // Only sent if known, older servers don't accept it
+    uint32_t rtt = UNKNOWN_RTT;
+
+    TypedHostingPort() {}
+    TypedHostingPort ( char type, uint16_t port, uint32_t rtt = UNKNOWN_RTT )
+        : type ( type ), port ( port ), rtt ( rtt ) {}
+
+    std::string encode() const
+    {
+        std::string buffer ( 1, type );
+        buffer.append ( ( const char * ) &port, sizeof ( uint16_t ) );
+
+        if ( rtt != UNKNOWN_RTT )
+            buffer.append ( ( const char * ) &rtt, sizeof ( uint32_t ) );
+
+        return buffer;
+    }
+
+    // Returns a zero port if the data is not a valid TypedHostingPort
+    static TypedHostingPort decode ( const char *buffer, size_t len )
+    {
+        static const size_t length = 1 + sizeof ( uint16_t );
+
+        if ( ( len != length && len != length + sizeof ( uint32_t ) ) || ( buffer[0] != 'T' && buffer[0] != 'U' ) )
+            return TypedHostingPort();
+
+        if ( len == length )
+            return TypedHostingPort ( buffer[0], * ( uint16_t * ) &buffer[1] );
+
+        return TypedHostingPort ( buffer[0], * ( uint16_t * ) &buffer[1], * ( uint32_t * ) &buffer[length] );
+    }
+};
+
+struct TypedConnectionAddress
+{
+    // Min data "T1.1.1.1:0", max data "T255.255.255.255:65535"
+    static const size_t MinLength = 10;
+    static const size_t MaxLength = 22;
+
+    static bool isValid ( const char *buffer, size_t len )
+    {
+        if ( len < MinLength || len > MaxLength || ( toupper ( buffer[0] ) != 'T' && toupper ( buffer[0] ) != 'U' ) )
+            return false;
+
+        for ( size_t i = 1; i < len; ++i )
+        {
+            if ( ( buffer[i] < '0' || buffer[i] > '9' ) && buffer[i] != '.' && buffer[i] != ':' )
+                return false;
+        }
+
+        return true;
+    }
+
+    // If the client asks the server to forward its UDP traffic
+    static bool isForwarded ( const char *buffer )
+    {
+        return ( buffer[0] == 't' || buffer[0] == 'u' );
+    }
+
+    // Get the key of the host, which is always registered with an uppercase type char
+    static std::string getHostKey ( const char *buffer, size_t len )
+    {
+        std::string key ( buffer, len );
+        key[0] = toupper ( key[0] );
+        return key;
+    }
+};
+
+struct MatchInfo
+{
+    static std::string encode ( uint32_t matchId )
+    {
+        ASSERT ( matchId != 0 );
+
+        std::string buffer = "MatchInfo";
+        buffer.append ( ( const char * ) &matchId, sizeof ( uint32_t ) );
+        return buffer;
+    }
+
+    static uint32_t decode ( const char *buffer, size_t len, size_t& consumed )
+    {
+        static const std::string header = "MatchInfo";
+
+        if ( len < header.size() + sizeof ( uint32_t ) || std::string ( buffer, header.size() ) != header )
+        {
+            consumed = 0;
+            return 0;
+        }
+
+        consumed = header.size() + sizeof ( uint32_t );
+        return * ( uint32_t * ) ( buffer + header.size() );
+    }
+};
+
+struct UdpData
+{
+    char buffer[5];
+
+    UdpData ( bool isClient, uint32_t matchId )
+    {
+        ASSERT ( matchId != 0 );
+
+        buffer[0] = ( char ) ( isClient ? 1 : 0 );
+        memcpy ( &buffer[1], ( char * ) &matchId, sizeof ( uint32_t ) );
+    }
+
+    // Returns a zero matchId if the data is not a valid UdpData
+    static uint32_t decode ( const char *data, size_t len, bool& isClient )
+    {
+        if ( len != sizeof ( buffer ) || ( uint8_t ) data[0] > 1 )
+            return 0;
+
+        isClient = ( data[0] == 1 );
+        return * ( uint32_t * ) &data[1];
+    }
+};
+
+struct TunInfo
+{
+    uint32_t matchId = 0;
+
+    IpAddrPort address;
+
+    TunInfo() {}
+    TunInfo ( uint32_t matchId, const std::string& address ) : matchId ( matchId ), address ( address ) {}
+
+    static std::string encode ( uint32_t matchId, const IpAddrPort& address )
+    {
+        ASSERT ( matchId != 0 );
+
+        std::string buffer = "TunInfo";
+        buffer.append ( ( const char * ) &matchId, sizeof ( uint32_t ) );
+        buffer += address.str();
+        buffer.push_back ( '\0' );
+        return buffer;
+    }
+
+    static TunInfo decode ( const char *buffer, size_t len, size_t& consumed )
+    {
+        static const std::string header = "TunInfo";
+
+        if ( len < header.size() + sizeof ( uint32_t ) || std::string ( buffer, header.size() ) != header )
+        {
+            consumed = 0;
+            return TunInfo();
+        }
+
+        const size_t start = header.size() + sizeof ( uint32_t );
+
+        size_t i, end = 0;
+
+        for ( i = 0; i < 22; ++i ) // max string length ("255.255.255.255:65535\0")
+        {
+            if ( start + i >= len )
+                break;
+
+            if ( buffer[start + i] == '\0' )
+            {
+                end = start + i;
+                break;
+            }
+        }
+
+        // Not enough data or failed to find null-terminator
+        if ( end == 0 || i == 22 )
+        {
+            consumed = 0;
+            return TunInfo();
+        }
+
+        consumed = end + 1;
+        return TunInfo ( * ( uint32_t * ) &buffer[header.size()], std::string ( buffer + start, end - start ) );
+    }
+};
+
+struct RelayPing
+{
+    uint64_t timestamp = 0;
+
+    // TypedConnectionAddress of the host to get the round trip time of, empty to only measure the server's
+    std::string hostKey;
+
+    RelayPing() {}
+    RelayPing ( uint64_t timestamp, const std::string& hostKey = "" ) : timestamp ( timestamp ), hostKey ( hostKey ) {}
+
+    std::string encode() const
+    {
+        std::string buffer = "RelayPing";
+        buffer.append ( ( const char * ) &timestamp, sizeof ( uint64_t ) );
+        buffer += hostKey;
+        return buffer;
+    }
+
+    // Returns false if the data is not a valid RelayPing
+    static bool decode ( const char *buffer, size_t len, RelayPing& ping )
+    {
+        static const std::string header = "RelayPing";
+        static const size_t start = header.size() + sizeof ( uint64_t );
+
+        if ( len < start || std::string ( buffer, header.size() ) != header )
+            return false;
+
+        if ( len > start && ! TypedConnectionAddress::isValid ( buffer + start, len - start ) )
+            return false;
+
+        ping.timestamp = * ( uint64_t * ) &buffer[header.size()];
+        ping.hostKey.assign ( buffer + start, len - start );
+        return true;
+    }
+};
+
+struct RelayPong
+{
+    uint64_t timestamp = 0;
+
+    uint32_t hostRtt = UNKNOWN_RTT;
+
+    RelayPong() {}
+    RelayPong ( uint64_t timestamp, uint32_t hostRtt ) : timestamp ( timestamp ), hostRtt ( hostRtt ) {}
+
+    std::string encode() const
+    {
+        std::string buffer = "RelayPong";
+        buffer.append ( ( const char * ) &timestamp, sizeof ( uint64_t ) );
+        buffer.append ( ( const char * ) &hostRtt, sizeof ( uint32_t ) );
+        return buffer;
+    }
+
+    // Returns false if the data is not a valid RelayPong
+    static bool decode ( const char *buffer, size_t len, RelayPong& pong )
+    {
+        static const std::string header = "RelayPong";
+
+        if ( len != header.size() + sizeof ( uint64_t ) + sizeof ( uint32_t )
+                || std::string ( buffer, header.size() ) != header )
+        {
+            return false;
+        }
+
+        pong.timestamp = * ( uint64_t * ) &buffer[header.size()];
+        pong.hostRtt = * ( uint32_t * ) &buffer[header.size() + sizeof ( uint64_t )];
+        return true;
+    }
+};
@@ -1,12 +1,11 @@
 #include "SocketManager.hpp"
+#include "TimerManager.hpp"
 #include "UdpSocket.hpp"
 #include "Protocol.hpp"
 #include "Exceptions.hpp"
 #include "ErrorStrings.hpp"
 
-#include <winsock2.h>
-#include <windows.h>
-#include <ws2tcpip.h>
+#include "SocketCompat.hpp"
 
 #include <typeinfo>
 #include <algorithm>
@@ -132,7 +131,10 @@ UdpSocket::~UdpSocket()
 
 void UdpSocket::disconnect()
 {
-    // Send 3 UdpControl::Disconnect messages if not connection-less
+    flush();
+
+    // Send 3 UdpControl::Disconnect messages if not connection-less.
+    // These are flushed individually so they are sent as separate datagrams.
     if ( !isConnectionLess() && ( isConnected() || isServer() ) )
     {
         MsgPtr msg ( new UdpControl ( UdpControl::Disconnect ) );
@@ -140,18 +142,27 @@ void UdpSocket::disconnect()
         if ( isClient() )
         {
             for ( int i = 0; i < 3; ++i )
+            {
                 send ( msg );
+                flush();
+            }
         }
         else if ( isServer() )
         {
             for ( int i = 0; i < 3; ++i )
             {
                 for ( auto& kv : _childSockets )
+                {
                     kv.second->send ( msg );
+                    kv.second->flush();
+                }
             }
         }
     }
 
+    if ( _messagesSent )
+        logSendRate();
+
     // Real UDP sockets need to be removed on disconnect
     if ( isReal() )
         SocketManager::get().remove ( this );
@@ -251,6 +262,24 @@ bool UdpSocket::send ( const MsgPtr& msg, const IpAddrPort& address )
     }
 }
 
+bool UdpSocket::sendShared ( SharedMessage& message )
+{
+    // Unsequenced messages piggyback the ACK sequence in their header, so only sequenced messages share bytes
+    if ( isConnectionLess() || message.msg->getBaseType() != BaseType::SerializableSequence )
+        return send ( message.msg );
+
+    const shared_ptr<const string>& bytes = message.getBytes ( _hashType, _compact );
+
+    // The shared bytes are hashed once, each connection only hashes its own sequence around them.
+    // Older peers get SplitMessages instead, which hash the whole payload again for each connection.
+    if ( getProtocolLevel() >= PROTOCOL_LEVEL_SHARED )
+        _gbn.sendViaGoBackN ( new SharedSequence ( bytes ) );
+    else
+        _gbn.sendViaGoBackN ( message.msg->getMsgType(), *bytes );
+
+    return isConnected();
+}
+
 bool UdpSocket::sendRaw ( const MsgPtr& msg, const IpAddrPort& address )
 {
 #ifndef RELEASE
@@ -262,6 +291,8 @@ bool UdpSocket::sendRaw ( const MsgPtr& msg, const IpAddrPort& address )
             LOG ( "Munging hash for '%s'", msg );
             for ( char& byte : msg->_hash )
                 byte = ( rand() % 0x100 );
+            msg->_hashType = _hashType;
+            msg->_hashCompact = ( _compact && msg->hasCompact() );
             msg->_hashValid = false;
         }
         else
@@ -271,25 +302,107 @@ bool UdpSocket::sendRaw ( const MsgPtr& msg, const IpAddrPort& address )
     }
 #endif // NOT RELEASE
 
-    const string buffer = ::Protocol::encode ( msg );
+    // Piggyback any pending ACK on unsequenced messages, since they are sent immediately
+    const uint32_t ackSequence = ( msg && !isConnectionLess() && msg->getBaseType() == BaseType::SerializableMessage
+                                   ? _gbn.takeAckSequence() : 0 );
+
+    const ByteSpan buffer = ::Protocol::encode ( msg, _encodeBuffer, _hashType, _compact, ackSequence );
+
+    LOG ( "Encoded '%s' to [ %u bytes ]; ackSequence=%u", msg, buffer.size, ackSequence );
 
-    LOG ( "Encoded '%s' to [ %u bytes ]", msg, buffer.size() );
+    if ( !buffer.empty() && buffer.size <= 256 )
+        LOG ( "Hex: %s", formatAsHex ( buffer.data, buffer.size ) );
+
+    return sendBytes ( buffer.data, buffer.size, address );
+}
+
+bool UdpSocket::sendBytes ( const char *bytes, size_t len, const IpAddrPort& address )
+{
+    const IpAddrPort& dest = ( address.empty() ? this->address : address );
 
-    if ( !buffer.empty() && buffer.size() <= 256 )
-        LOG ( "Hex: %s", formatAsHex ( buffer ) );
+    if ( _messagesSent++ == 0 )
+        _firstSendTime = TimerManager::get().getNow ( true );
+
+    // Zero byte packets can't be batched, and neither can anything that doesn't fit in one datagram
+    if ( !_sendBatching || len == 0 || len > getBatchSize() )
+    {
+        flush();
+        return sendDatagram ( bytes, len, dest );
+    }
+
+    // Send the current batch first if this is for another address or doesn't fit
+    if ( !_batch.empty() && ( dest != _batchAddress || _batch.size() + len > getBatchSize() ) )
+        flush();
+
+    if ( _batch.empty() )
+    {
+        if ( isDisconnected() || ( isChild() && !_parentSocket ) )
+        {
+            LOG_UDP_SOCKET ( this, "Cannot send over disconnected socket" );
+            return false;
+        }
+
+        _batchAddress = dest;
+        SocketManager::get().flushLater ( this );
+    }
+
+    _batch.append ( bytes, len );
+    return true;
+}
+
+bool UdpSocket::sendDatagram ( const char *bytes, size_t len, const IpAddrPort& address )
+{
+    ++_datagramsSent;
 
     // Real UDP sockets send directly
     if ( isReal()  )
-        return Socket::send ( &buffer[0], buffer.size(), address.empty() ? this->address : address );
+        return Socket::send ( bytes, len, address );
 
     // Child UDP sockets send via parent if not disconnected
     if ( isChild() && _parentSocket )
-        return _parentSocket->Socket::send ( &buffer[0], buffer.size(), address.empty() ? this->address : address );
+        return _parentSocket->Socket::send ( bytes, len, address );
 
     LOG_UDP_SOCKET ( this, "Cannot send over disconnected socket" );
     return false;
 }
 
+void UdpSocket::flush()
+{
+    if ( _batch.empty() )
+        return;
+
+    SocketManager::get().cancelFlush ( this );
+
+    // Swap the batch out first, since sending may re-enter this socket
+    string batch;
+    batch.swap ( _batch );
+
+    LOG_UDP_SOCKET ( this, "Sending batch of [ %u bytes ]", batch.size() );
+
+    sendDatagram ( batch.data(), batch.size(), _batchAddress );
+
+    // Reuse the allocation for the next batch
+    batch.clear();
+    _batch.swap ( batch );
+}
+
+void UdpSocket::setSendBatching ( bool enabled )
+{
+    if ( !enabled )
+        flush();
+
+    _sendBatching = enabled;
+}
+
+void UdpSocket::logSendRate() const
+{
+    const uint64_t elapsed = TimerManager::get().getNow ( true ) - _firstSendTime;
+    const double seconds = max ( elapsed, ( uint64_t ) 1 ) / 1000.0;
+
+    LOG_UDP_SOCKET ( this, "Sent %llu messages (%.1f/s) in %llu datagrams (%.1f/s) over %.1fs",
+                     _messagesSent, _messagesSent / seconds, _datagramsSent, _datagramsSent / seconds, seconds );
+}
+
 void UdpSocket::goBackNSendRaw ( GoBackN *gbn, const MsgPtr& msg )
 {
     ASSERT ( gbn == &_gbn );
@@ -298,6 +411,32 @@ void UdpSocket::goBackNSendRaw ( GoBackN *gbn, const MsgPtr& msg )
     sendRaw ( msg, getRemoteAddress() );
 }
 
+bool UdpSocket::goBackNEncode ( GoBackN *gbn, const MsgPtr& msg, string& bytes )
+{
+    ASSERT ( gbn == &_gbn );
+
+#ifndef RELEASE
+    // Simulated hash failures need to be applied on every send
+    if ( _hashFailRate )
+        return false;
+#endif // NOT RELEASE
+
+    const ByteSpan buffer = ::Protocol::encode ( msg, _encodeBuffer, _hashType, _compact );
+
+    LOG ( "Encoded '%s' to [ %u bytes ]", msg, buffer.size );
+
+    bytes.assign ( buffer.data, buffer.size );
+    return ! bytes.empty();
+}
+
+void UdpSocket::goBackNSendBytes ( GoBackN *gbn, const string& bytes )
+{
+    ASSERT ( gbn == &_gbn );
+    ASSERT ( getRemoteAddress().empty() == false );
+
+    sendBytes ( bytes.data(), bytes.size(), getRemoteAddress() );
+}
+
 void UdpSocket::goBackNRecvRaw ( GoBackN *gbn, const MsgPtr& msg )
 {
     ASSERT ( gbn == &_gbn );
@@ -503,6 +642,11 @@ MsgPtr UdpSocket::share ( int processId )
     if ( isChild() )
         return NullMsg;
 
+    flush();
+
+    for ( const auto& kv : _childSockets )
+        kv.second->flush();
+
     MsgPtr data = Socket::share ( processId );
 
     ASSERT ( typeid ( *data ) == typeid ( SocketShareData ) );
@@ -612,3 +756,12 @@ void UdpSocket::resetGbnState()
 {
     _gbn.reset();
 }
+
+void UdpSocket::setProtocolLevel ( uint8_t level )
+{
+    Socket::setProtocolLevel ( level );
+
+    _gbn.setSelectiveRepeat ( level >= PROTOCOL_LEVEL_SACK );
+    _gbn.setMtuProbing ( level >= PROTOCOL_LEVEL_MTU_PROBE );
+    _gbn.setDelayedAck ( level >= PROTOCOL_LEVEL_ACK_SEQUENCE );
+}
@@ -71,6 +71,22 @@ public:
     bool send ( SerializableMessage *message, const IpAddrPort& address = NullAddress ) override;
     bool send ( SerializableSequence *message, const IpAddrPort& address = NullAddress ) override;
     bool send ( const MsgPtr& message, const IpAddrPort& address = NullAddress ) override;
+    bool sendShared ( SharedMessage& message ) override;
+
+    // Get / set send batching, where messages sent during one event loop iteration are packed into as few
+    // datagrams as the MTU allows. The receiver decodes concatenated messages, so this is always compatible.
+    bool isSendBatching() const { return _sendBatching; }
+    void setSendBatching ( bool enabled );
+
+    // Send any batched messages now
+    void flush() override;
+
+    // Get the number of messages and datagrams sent, these are equal without batching
+    uint64_t getMessagesSent() const { return _messagesSent; }
+    uint64_t getDatagramsSent() const { return _datagramsSent; }
+
+    // Log the messages and datagrams sent per second
+    void logSendRate() const;
 
     // Get / set the interval to send packets, should be non-zero
     uint64_t getSendInterval() const { return _gbn.getSendInterval(); }
@@ -94,6 +110,9 @@ public:
     // Reset the state of the GoBackN instance
     void resetGbnState();
 
+    // Set the protocol level, this also enables selective repeat in GoBackN if supported
+    void setProtocolLevel ( uint8_t level ) override;
+
 private:
 
     // UDP child socket enum type for choosing the right constructor
@@ -117,11 +136,23 @@ private:
     // Currently accepted socket
     SocketPtr _acceptedSocket;
 
+    // Send batching mode
+    bool _sendBatching = true;
+
+    // Encoded messages waiting to be sent together, and the address to send them to
+    std::string _batch;
+    IpAddrPort _batchAddress;
+
+    // Number of messages and datagrams sent, and the time of the first send
+    uint64_t _messagesSent = 0, _datagramsSent = 0, _firstSendTime = 0;
+
     // Socket read event callback
     void socketRead ( const MsgPtr& msg, const IpAddrPort& address ) override;
 
     // GoBackN callbacks
     void goBackNSendRaw ( GoBackN *gbn, const MsgPtr& msg ) override;
+    bool goBackNEncode ( GoBackN *gbn, const MsgPtr& msg, std::string& bytes ) override;
+    void goBackNSendBytes ( GoBackN *gbn, const std::string& bytes ) override;
     void goBackNRecvRaw ( GoBackN *gbn, const MsgPtr& msg ) override;
     void goBackNRecvMsg ( GoBackN *gbn, const MsgPtr& msg ) override;
     void goBackNTimeout ( GoBackN *gbn ) override;
@@ -132,6 +163,15 @@ private:
     // Send a protocol message directly, not over GoBackN
     bool sendRaw ( const MsgPtr& msg, const IpAddrPort& address );
 
+    // Send already encoded bytes, batched if possible
+    bool sendBytes ( const char *bytes, size_t len, const IpAddrPort& address );
+
+    // Send a single datagram directly
+    bool sendDatagram ( const char *bytes, size_t len, const IpAddrPort& address );
+
+    // Get the largest batch that fits in one datagram
+    size_t getBatchSize() const { return ( isConnectionLess() ? MIN_MTU : _gbn.getMtu() ); }
+
     // Construct a server socket
     UdpSocket ( Socket::Owner *owner, uint16_t port, const Type& type, bool isRaw );
 
@@ -0,0 +1,140 @@
+#include "InputRedundancy.hpp"
+#include "Logger.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+
+void InputRedundancy::setMaxCopies ( uint8_t copies )
+{
+    _maxCopies = min<uint8_t> ( copies, MAX_INPUT_COPIES );
+    _copies = min ( _copies, _maxCopies );
+}
+
+void InputRedundancy::sendInputs ( const PlayerInputs& inputs )
+{
+    // Forget the sent frames for each transition index, since the frames restart
+    if ( inputs.getIndex() != _sentIndex )
+    {
+        if ( inputs.getIndex() < _sentIndex )
+            return;
+
+        _sentIndex = inputs.getIndex();
+        _sent.fill ( SentFrame() );
+    }
+
+    SentFrame& sent = _sent[inputs.getFrame() % INPUT_LOSS_HISTORY_FRAMES];
+
+    if ( sent.frame != inputs.getFrame() )
+    {
+        sent.frame = inputs.getFrame();
+        sent.count = 0;
+    }
+
+    ++sent.count;
+}
+
+void InputRedundancy::recvInputs ( const PlayerInputs& inputs )
+{
+    // Start counting again for each transition index, since the frames restart
+    if ( inputs.getIndex() != _index )
+    {
+        if ( inputs.getIndex() < _index )
+            return;
+
+        // The first frame is where the report starts, so it isn't counted, like any later copies of it
+        _index = inputs.getIndex();
+        _startFrame = _endFrame = inputs.getFrame();
+        _received = _receivedLatest = 0;
+        return;
+    }
+
+    // Ignore anything for frames that were already reported
+    if ( inputs.getFrame() <= _startFrame )
+        return;
+
+    if ( inputs.getFrame() > _endFrame )
+    {
+        _received += _receivedLatest;
+        _receivedLatest = 1;
+        _endFrame = inputs.getFrame();
+    }
+    else if ( inputs.getFrame() == _endFrame )
+    {
+        ++_receivedLatest;
+    }
+    else
+    {
+        ++_received;
+    }
+}
+
+MsgPtr InputRedundancy::getLossReport()
+{
+    // Report up to the frame before the latest
+    if ( _endFrame < _startFrame + INPUT_LOSS_REPORT_FRAMES + 1 )
+        return 0;
+
+    MsgPtr msg ( new InputLoss ( _index, _startFrame, _endFrame - 1 - _startFrame, _received ) );
+
+    _startFrame = _endFrame - 1;
+    _received = 0;
+
+    return msg;
+}
+
+void InputRedundancy::recvLossReport ( const InputLoss& report )
+{
+    if ( report.frames == 0 || report.frames > INPUT_LOSS_HISTORY_FRAMES || report.index != _sentIndex )
+        return;
+
+    // Compare to the PlayerInputs sent for the reported frames, since the number of copies might have changed
+    // after they were sent, and inputs are also resent while waiting for the remote.
+    uint32_t sent = 0;
+
+    for ( uint32_t frame = report.startFrame + 1; frame <= report.startFrame + report.frames; ++frame )
+    {
+        const SentFrame& entry = _sent[frame % INPUT_LOSS_HISTORY_FRAMES];
+
+        // The frame is too old, or wasn't sent, so the report can't be compared
+        if ( entry.frame != frame || entry.count == 0 )
+            return;
+
+        sent += entry.count;
+    }
+
+    const double expected = sent;
+    const double received = min<double> ( report.received, expected );
+
+    _lossRate.set ( 1.0 - received / expected );
+
+    const double loss = _lossRate.get();
+
+    uint8_t copies = 0;
+    double residual = loss;
+
+    while ( residual > TARGET_INPUT_LOSS && copies < _maxCopies )
+    {
+        residual *= loss;
+        ++copies;
+    }
+
+    if ( copies != _copies )
+    {
+        LOG ( "copies=%u; lossRate=%.3f; frames=%u; sent=%u; received=%u",
+              copies, loss, report.frames, sent, report.received );
+    }
+
+    _copies = copies;
+}
+
+void InputRedundancy::reset()
+{
+    _copies = 0;
+    _lossRate.reset();
+    _index = _startFrame = _endFrame = 0;
+    _received = _receivedLatest = 0;
+    _sentIndex = 0;
+    _sent.fill ( SentFrame() );
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "Messages.hpp"
+#include "RollingAverage.hpp"
+
+#include <array>
+
+
+// Default and largest number of extra copies of the local inputs to send each frame
+#define DEFAULT_MAX_INPUT_COPIES    ( 2 )
+#define MAX_INPUT_COPIES            ( 4 )
+
+// Number of remote frames between each InputLoss report
+#define INPUT_LOSS_REPORT_FRAMES    ( 60 )
+
+// Number of recent local frames to remember the sent PlayerInputs for, older reports are ignored
+#define INPUT_LOSS_HISTORY_FRAMES   ( 4 * INPUT_LOSS_REPORT_FRAMES )
+
+// Add copies until the chance of losing every packet for a frame is below this
+#define TARGET_INPUT_LOSS           ( 0.01 )
+
+
+// Forward error correction for the input stream.
+//
+// Each PlayerInputs already overlaps the previous NUM_INPUTS frames, so any single packet that arrives restores
+// every frame it covers, and parity over older packets can't recover anything extra. Instead, extra copies of
+// the latest inputs are sent in separate datagrams, so a frame is only lost if every copy is lost.
+//
+// The receiver counts the PlayerInputs that arrive and periodically reports back with InputLoss,
+// then the sender compares that to the PlayerInputs it sent for those frames,
+// and picks the fewest copies that bring the expected loss under TARGET_INPUT_LOSS.
+class InputRedundancy
+{
+public:
+
+    // Get / set the max number of extra copies, 0 disables redundancy
+    uint8_t getMaxCopies() const { return _maxCopies; }
+    void setMaxCopies ( uint8_t copies );
+
+    // Get the number of extra copies of the local inputs to send each frame
+    uint8_t getCopies() const { return _copies; }
+
+    // Get the smoothed packet loss rate from the remote's reports
+    double getLossRate() const { return _lossRate.get(); }
+
+    // Count a PlayerInputs sent to the remote, including copies and resends
+    void sendInputs ( const PlayerInputs& inputs );
+
+    // Count a PlayerInputs received from the remote
+    void recvInputs ( const PlayerInputs& inputs );
+
+    // Get the next InputLoss report to send to the remote, returns null if it isn't due yet
+    MsgPtr getLossReport();
+
+    // Handle an InputLoss report from the remote, and adapt the number of copies
+    void recvLossReport ( const InputLoss& report );
+
+    // Reset all the counters
+    void reset();
+
+private:
+
+    // Max and current number of extra copies
+    uint8_t _maxCopies = DEFAULT_MAX_INPUT_COPIES, _copies = 0;
+
+    // Smoothed packet loss rate
+    RollingAverage<double, 4> _lossRate;
+
+    // Transition index of the local inputs being sent
+    uint32_t _sentIndex = 0;
+
+    // Number of PlayerInputs sent for each recent local frame, at frame % INPUT_LOSS_HISTORY_FRAMES.
+    // The number of copies can change between reports, so each report is compared to what was actually sent.
+    struct SentFrame
+    {
+        uint32_t frame = 0, count = 0;
+    };
+
+    std::array<SentFrame, INPUT_LOSS_HISTORY_FRAMES> _sent;
+
+    // Transition index of the remote inputs being counted
+    uint32_t _index = 0;
+
+    // The last reported remote frame, and the latest remote frame received
+    uint32_t _startFrame = 0, _endFrame = 0;
+
+    // Number of packets received after the last reported frame, not including the latest frame,
+    // and the number received for the latest frame. The latest frame is only reported once the next one arrives,
+    // since its copies may still be in flight.
+    uint32_t _received = 0, _receivedLatest = 0;
+};
@@ -7,6 +7,7 @@
 #include "Version.hpp"
 #include "Compression.hpp"
 #include "CharacterSelect.hpp"
+#include "CompactCodec.hpp"
 
 #include <cereal/types/array.hpp>
 #include <cereal/types/vector.hpp>
@@ -35,6 +36,10 @@ struct ClientMode : public SerializableSequence
 
     enum { Training = 0x01, GameStarted = 0x02, UdpTunnel = 0x04, IsWine = 0x08, VersusCPU = 0x10 };
 
+    // The upper bits of flags are used to advertise the protocol level, older versions ignore them.
+    // They saturate at ProtocolLevelExtended, peers advertising that exchange their full level with ProtocolLevel.
+    enum { ProtocolLevelMask = 0xE0, ProtocolLevelShift = 5, ProtocolLevelExtended = 7 };
+
     uint8_t flags = 0;
 
     ClientMode ( Enum value, uint8_t flags ) : value ( value ), flags ( flags ) {}
@@ -63,6 +68,16 @@ struct ClientMode : public SerializableSequence
     bool isWine() const { return ( flags & IsWine ); }
     bool isSinglePlayer() const { return ( isNetplay() || isVersusCPU() ); }
 
+    uint8_t getProtocolLevel() const { return ( flags & ProtocolLevelMask ) >> ProtocolLevelShift; }
+
+    void setProtocolLevel ( uint8_t level )
+    {
+        if ( level > ProtocolLevelExtended )
+            level = ProtocolLevelExtended;
+
+        flags = ( flags & ~ProtocolLevelMask ) | ( ( level << ProtocolLevelShift ) & ProtocolLevelMask );
+    }
+
     std::string flagString() const
     {
         std::string str;
@@ -118,12 +133,29 @@ struct VersionConfig : public SerializableSequence
     Version version;
 
     VersionConfig ( const ClientMode& mode, uint8_t flags = 0 )
-        : mode ( mode.value, mode.flags | flags ), version ( LocalVersion ) {}
+        : mode ( mode.value, mode.flags | flags ), version ( LocalVersion )
+    {
+        this->mode.setProtocolLevel ( PROTOCOL_LEVEL );
+    }
 
     PROTOCOL_MESSAGE_BOILERPLATE ( VersionConfig, mode, version )
 };
 
 
+// The full protocol level, sent right after VersionConfig to peers advertising ClientMode::ProtocolLevelExtended,
+// since older versions can't decode it. Also used to pass the negotiated level to the DLL.
+struct ProtocolLevel : public SerializableSequence
+{
+    uint8_t level = 0;
+
+    ProtocolLevel ( uint8_t level ) : level ( level ) {}
+
+    std::string str() const override { return format ( "ProtocolLevel[%u]", level ); }
+
+    PROTOCOL_MESSAGE_BOILERPLATE ( ProtocolLevel, level )
+};
+
+
 struct InitialConfig : public SerializableSequence
 {
     ClientMode mode;
@@ -462,6 +494,21 @@ struct BaseInputs
     uint32_t getEndFrame() const { return indexedFrame.parts.frame + 1; }
 
     size_t size() const { return getEndFrame() - getStartFrame(); }
+
+protected:
+
+    // Compact encoding of the indexed frame, the index and frame are usually small
+    void saveCompactFrame ( cereal::BinaryOutputArchive& ar ) const
+    {
+        saveVarint ( ar, indexedFrame.parts.index );
+        saveVarint ( ar, indexedFrame.parts.frame );
+    }
+
+    void loadCompactFrame ( cereal::BinaryInputArchive& ar )
+    {
+        indexedFrame.parts.index = loadVarint ( ar );
+        indexedFrame.parts.frame = loadVarint ( ar );
+    }
 };
 
 
@@ -475,6 +522,40 @@ struct PlayerInputs : public SerializableMessage, public BaseInputs
     std::string str() const override { return format ( "PlayerInputs[%s]", indexedFrame ); }
 
     PROTOCOL_MESSAGE_BOILERPLATE ( PlayerInputs, indexedFrame.value, inputs )
+
+    bool hasCompact() const override { return true; }
+
+    void saveCompact ( cereal::BinaryOutputArchive& ar ) const override
+    {
+        saveCompactFrame ( ar );
+        saveCompactInputs ( ar, &inputs[0], inputs.size() );
+    }
+
+    void loadCompact ( cereal::BinaryInputArchive& ar ) override
+    {
+        loadCompactFrame ( ar );
+        loadCompactInputs ( ar, &inputs[0], inputs.size() );
+    }
+};
+
+
+struct InputLoss : public SerializableMessage
+{
+    // Transition index and last frame of the previous report, so the remote knows which frames this covers
+    uint32_t index = 0, startFrame = 0;
+
+    // Number of frames the remote inputs advanced by, and the number of PlayerInputs received for those frames
+    uint32_t frames = 0, received = 0;
+
+    InputLoss ( uint32_t index, uint32_t startFrame, uint32_t frames, uint32_t received )
+        : index ( index ), startFrame ( startFrame ), frames ( frames ), received ( received ) {}
+
+    std::string str() const override
+    {
+        return format ( "InputLoss[%u:%u,%u,%u]", index, startFrame, frames, received );
+    }
+
+    PROTOCOL_MESSAGE_BOILERPLATE ( InputLoss, index, startFrame, frames, received )
 };
 
 
@@ -488,4 +569,20 @@ struct BothInputs : public SerializableSequence, public BaseInputs
     std::string str() const override { return format ( "BothInputs[%s]", indexedFrame ); }
 
     PROTOCOL_MESSAGE_BOILERPLATE ( BothInputs, indexedFrame.value, inputs )
+
+    bool hasCompact() const override { return true; }
+
+    void saveCompact ( cereal::BinaryOutputArchive& ar ) const override
+    {
+        saveCompactFrame ( ar );
+        saveCompactInputs ( ar, &inputs[0][0], inputs[0].size() );
+        saveCompactInputs ( ar, &inputs[1][0], inputs[1].size() );
+    }
+
+    void loadCompact ( cereal::BinaryInputArchive& ar ) override
+    {
+        loadCompactFrame ( ar );
+        loadCompactInputs ( ar, &inputs[0][0], inputs[0].size() );
+        loadCompactInputs ( ar, &inputs[1][0], inputs[1].size() );
+    }
 };
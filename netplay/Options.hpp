@@ -22,6 +22,7 @@ ENUM ( Options,
        Tournament,
        MaxDelay,
        DefaultRollback,
+       Redundancy,
        Fullscreen,
        // Debug options
        Tests,
@@ -6,6 +6,7 @@
 
 #include <unordered_map>
 #include <list>
+#include <map>
 
 
 // Default pending socket timeout
@@ -70,6 +71,15 @@ public:
 
 private:
 
+    // Get the shared inputs for a spectator position, and advance the position, returns null if there are none yet
+    SharedMsgPtr getSharedInputs ( IndexedFrame& pos );
+
+    // Get the shared RngState for a transition index, returns null if there is none yet
+    SharedMsgPtr getSharedRngState ( uint32_t index );
+
+    // Forget the shared messages that no spectator can ask for anymore
+    void trimSharedMessages();
+
     std::unordered_map<Socket *, SocketPtr> _pendingSockets;
 
     std::unordered_map<Socket *, TimerPtr> _pendingSocketTimers;
@@ -84,6 +94,19 @@ private:
 
     std::unordered_map<Socket *, Spectator>::const_iterator _spectatorMapPos;
 
+    // Inputs for spectators that catch up from the same position, so each BothInputs is only encoded once.
+    // Keyed by the position the inputs were requested from, see NetplayManager::getBothInputs.
+    struct SharedInputs
+    {
+        IndexedFrame pos;
+        SharedMsgPtr msg;
+    };
+
+    std::map<uint64_t, SharedInputs> _sharedInputs;
+
+    // RngStates shared by spectators, keyed by transition index
+    std::map<uint32_t, SharedMsgPtr> _sharedRngStates;
+
     uint32_t _currentMinIndex = UINT_MAX;
 
     NetplayManager *_netManPtr = 0;
@@ -47,42 +47,42 @@ void PresentFrameEnd ( IDirect3DDevice9 *device )
 
     ++counter;
 
-    uint64_t now = TimerManager::get().getNow ( true );
+    uint64_t now = TimerManager::get().getNowNs ( true );
 
     /**
-     * The best timer resolution is only in milliseconds, and we need to make
-     * sure the spacing between frames is as close to even as possible.
+     * The timer has nanosecond resolution, but each frame can still overshoot by however long
+     * the last wait took, so the spacing between frames is corrected over longer periods too.
      *
-     * What this code does is check every 30f, 5f, and 1f how many milliseconds have
-     * passed since the last check and make sure we are close to or under the desired FPS.
+     * What this code does is check every 30f, 5f, and 1f how much time has passed
+     * since the last check and make sure we are close to or under the desired FPS.
      */
     if ( counter % 30 == 0 )
     {
-        while ( now - last30f < ( 30 * 1000 ) / desiredFps )
-            now = TimerManager::get().getNow ( true );
+        while ( now - last30f < ( 30 * NS_PER_SECOND ) / desiredFps )
+            now = TimerManager::get().getNowNs ( true );
 
         last30f = now;
     }
     else if ( counter % 5 == 0 )
     {
-        while ( now - last5f < ( 5 * 1000 ) / desiredFps )
-            now = TimerManager::get().getNow ( true );
+        while ( now - last5f < ( 5 * NS_PER_SECOND ) / desiredFps )
+            now = TimerManager::get().getNowNs ( true );
 
         last5f = now;
     }
     else
     {
-        while ( now - last1f < 1000 / desiredFps )
-            now = TimerManager::get().getNow ( true );
+        while ( now - last1f < NS_PER_SECOND / desiredFps )
+            now = TimerManager::get().getNowNs ( true );
     }
 
     last1f = now;
 
     if ( counter >= 60 )
     {
-        now = TimerManager::get().getNow ( true );
+        now = TimerManager::get().getNowNs ( true );
 
-        actualFps = 1000.0 / ( ( now - last60f ) / 60.0 );
+        actualFps = NS_PER_SECOND / ( ( now - last60f ) / 60.0 );
 
         *CC_FPS_COUNTER_ADDR = uint32_t ( actualFps + 0.5 );
 
@@ -16,6 +16,8 @@
 #include "DllFrameRate.hpp"
 #include "ReplayManager.hpp"
 #include "DllRollbackManager.hpp"
+#include "CompressionPolicy.hpp"
+#include "InputRedundancy.hpp"
 
 #include <windows.h>
 
@@ -44,6 +46,9 @@ using namespace std;
 // The number of milliseconds before resending inputs while waiting for more inputs
 #define RESEND_INPUTS_INTERVAL      ( 100 )
 
+// The number of milliseconds between each redundant copy of the inputs, these are sent while polling
+#define INPUT_COPY_INTERVAL         ( 1 )
+
 // The maximum number of milliseconds to wait for inputs before timeout
 #define MAX_WAIT_INPUTS_INTERVAL    ( 10000 )
 
@@ -117,6 +122,13 @@ struct DllMain
     // Timer for waiting for inputs
     int waitInputsTimer = -1;
 
+    // Redundant copies of the local inputs, to recover from packet loss without waiting for a resend
+    InputRedundancy inputRedundancy;
+
+    // Timer for sending the redundant copies, and the number of copies left to send this frame
+    TimerPtr inputCopyTimer;
+    uint8_t inputCopiesLeft = 0;
+
     // Indicates if we should sync the game RngState on this frame
     bool shouldSyncRngState = false;
 
@@ -145,6 +157,9 @@ struct DllMain
     // Client serverCtrlSocket address
     IpAddrPort clientServerAddr;
 
+    // Protocol level negotiated with the remote by MainApp, used for dataSocket
+    uint8_t protocolLevel = 0;
+
     // Sockets that have been redirected to another client
     unordered_set<Socket *> redirectedSockets;
 
@@ -454,7 +469,9 @@ struct DllMain
                         break;
                     }
 
-                    dataSocket->send ( netMan.getInputs ( localPlayer ) );
+                    sendLocalInputs();
+
+                    sendInputCopies();
                 }
                 else if ( clientMode.isLocal() )
                 {
@@ -977,6 +994,13 @@ struct DllMain
             AsmHacks::numLoadedColors = 0;
         }
 
+        // Entering Initial
+        if ( state == NetplayState::Initial )
+        {
+            // Start adapting the input copies again for the new connection
+            inputRedundancy.reset();
+        }
+
         // Entering InGame
         if ( state == NetplayState::InGame )
         {
@@ -1097,6 +1121,39 @@ struct DllMain
         stopping = true;
     }
 
+    void sendLocalInputs()
+    {
+        MsgPtr msgInputs = netMan.getInputs ( localPlayer );
+
+        // Count every PlayerInputs sent, since that is what the remote's InputLoss reports are compared to
+        inputRedundancy.sendInputs ( msgInputs->getAs<PlayerInputs>() );
+
+        dataSocket->send ( msgInputs );
+    }
+
+    void sendInputCopies()
+    {
+        // The remote needs to send InputLoss reports for the copies to adapt
+        if ( dataSocket->getProtocolLevel() < PROTOCOL_LEVEL_INPUT_LOSS )
+            return;
+
+        MsgPtr msgInputLoss = inputRedundancy.getLossReport();
+
+        if ( msgInputLoss )
+            dataSocket->send ( msgInputLoss );
+
+        inputCopiesLeft = inputRedundancy.getCopies();
+
+        if ( ! inputCopiesLeft )
+            return;
+
+        // Each copy is sent during a separate event loop iteration, so it goes out in its own datagram
+        if ( ! inputCopyTimer )
+            inputCopyTimer.reset ( new Timer ( this ) );
+
+        inputCopyTimer->start ( INPUT_COPY_INTERVAL );
+    }
+
     void checkRoundOver()
     {
         const bool isOver = ( ( *CC_P1_NO_INPUT_FLAG_ADDR ) && ( *CC_P2_NO_INPUT_FLAG_ADDR ) );
@@ -1196,6 +1253,8 @@ struct DllMain
             ASSERT ( dataSocket != 0 );
             ASSERT ( dataSocket->isConnected() == true );
 
+            dataSocket->setProtocolLevel ( protocolLevel );
+
             netplayStateChanged ( NetplayState::Initial );
 
             initialTimer.reset();
@@ -1231,6 +1290,7 @@ struct DllMain
             if ( netMan.getState() == NetplayState::PreInitial )
             {
                 dataSocket = SmartSocket::connectUDP ( this, address );
+                dataSocket->setProtocolLevel ( protocolLevel );
                 LOG ( "dataSocket=%08x", dataSocket.get() );
                 return;
             }
@@ -1286,10 +1346,25 @@ struct DllMain
                     return;
                 }
 
+                // Use the highest protocol level supported by both sides
+                socket->setProtocolLevel ( min<uint8_t> ( PROTOCOL_LEVEL,
+                                           msg->getAs<VersionConfig>().mode.getProtocolLevel() ) );
+
+                // The spectator may support a higher level than the flags can advertise
+                if ( msg->getAs<VersionConfig>().mode.getProtocolLevel() == ClientMode::ProtocolLevelExtended )
+                    socket->send ( new ProtocolLevel ( PROTOCOL_LEVEL ) );
+
                 socket->send ( new SpectateConfig ( netMan.config, netMan.getState().value ) );
                 return;
             }
 
+            case MsgType::ProtocolLevel:
+                if ( !isPendingSocket ( socket ) )
+                    break;
+
+                socket->setProtocolLevel ( min<uint8_t> ( PROTOCOL_LEVEL, msg->getAs<ProtocolLevel>().level ) );
+                return;
+
             case MsgType::ConfirmConfig:
                 // Wait for IpAddrPort before actually adding this new spectator
                 return;
@@ -1331,6 +1406,11 @@ struct DllMain
                 {
                     case MsgType::PlayerInputs:
                         netMan.setInputs ( remotePlayer, msg->getAs<PlayerInputs>() );
+                        inputRedundancy.recvInputs ( msg->getAs<PlayerInputs>() );
+                        return;
+
+                    case MsgType::InputLoss:
+                        inputRedundancy.recvLossReport ( msg->getAs<InputLoss>() );
                         return;
 
                     case MsgType::MenuIndex:
@@ -1446,6 +1526,12 @@ struct DllMain
                 if ( options[Options::HeldStartDuration] )
                     netMan.heldStartDuration = lexical_cast<uint32_t> ( options.arg ( Options::HeldStartDuration ) );
 
+                if ( options[Options::Redundancy] )
+                {
+                    inputRedundancy.setMaxCopies ( min<uint32_t> ( MAX_INPUT_COPIES,
+                                                   lexical_cast<uint32_t> ( options.arg ( Options::Redundancy ) ) ) );
+                }
+
                 // This will log in the previous appDir folder it not the same
                 LOG ( "appDir='%s'", ProcessManager::appDir );
 
@@ -1456,6 +1542,9 @@ struct DllMain
                 LOG ( "gameDir='%s'", ProcessManager::gameDir );
                 LOG ( "appDir='%s'", ProcessManager::appDir );
 
+                if ( SmartSocket::loadRelayServers ( ProcessManager::appDir + RELAYS_FILE ) )
+                    LOG ( "Loaded %u relay servers", SmartSocket::getRelayServers().size() );
+
                 syncLog.sessionId = options.arg ( Options::SessionId );
                 syncLog.initialize ( ProcessManager::appDir + SYNC_LOG_FILE, 0 );
                 syncLog.logVersion();
@@ -1563,6 +1652,11 @@ struct DllMain
                 initControllers ( msg->getAs<ControllerMappings>() );
                 break;
 
+            case MsgType::ProtocolLevel:
+                // The protocol level negotiated by the main app, sent before ClientMode
+                protocolLevel = msg->getAs<ProtocolLevel>().level;
+                break;
+
             case MsgType::ClientMode:
                 if ( clientMode != ClientMode::Unknown )
                     break;
@@ -1693,6 +1787,7 @@ struct DllMain
                         LOG ( "serverCtrlSocket=%08x", serverCtrlSocket.get() );
 
                         dataSocket = SmartSocket::connectUDP ( this, address, clientMode.isUdpTunnel() );
+                        dataSocket->setProtocolLevel ( protocolLevel );
                         LOG ( "dataSocket=%08x", dataSocket.get() );
                     }
 
@@ -1777,9 +1872,19 @@ struct DllMain
     // Timer callback
     void timerExpired ( Timer *timer ) override
     {
-        if ( timer == resendTimer.get() )
+        if ( timer == inputCopyTimer.get() )
         {
-            dataSocket->send ( netMan.getInputs ( localPlayer ) );
+            if ( dataSocket && dataSocket->isConnected() && inputCopiesLeft > 0 )
+            {
+                sendLocalInputs();
+
+                if ( --inputCopiesLeft > 0 )
+                    inputCopyTimer->start ( INPUT_COPY_INTERVAL );
+            }
+        }
+        else if ( timer == resendTimer.get() )
+        {
+            sendLocalInputs();
             resendTimer->start ( RESEND_INPUTS_INTERVAL );
 
             ++waitInputsTimer;
@@ -1864,6 +1969,8 @@ struct DllMain
 
         KeyboardManager::get().unhook();
 
+        CompressionPolicy::get().logStats();
+
         syncLog.deinitialize();
 
         procMan.disconnectPipe();
@@ -107,8 +107,67 @@ void SpectatorManager::popSpectator ( Socket *socketPtr )
 
 void SpectatorManager::newRngState ( const RngState& rngState )
 {
+    if ( _spectatorList.empty() )
+        return;
+
+    // Encoded once for all the spectators, each socket only adds its own sequence
+    SharedMessage shared ( rngState.clone() );
+
     for ( Socket *socket : _spectatorList )
-        socket->send ( rngState );
+        socket->sendShared ( shared );
+
+    LOG ( "spectators=%u; encodes=%u", _spectatorList.size(), shared.getEncodeCount() );
+}
+
+SharedMsgPtr SpectatorManager::getSharedInputs ( IndexedFrame& pos )
+{
+    const auto it = _sharedInputs.find ( pos.value );
+
+    if ( it != _sharedInputs.end() )
+    {
+        pos = it->second.pos;
+        return it->second.msg;
+    }
+
+    const IndexedFrame orig = pos;
+
+    MsgPtr msgBothInputs = _netManPtr->getBothInputs ( pos );
+
+    // Only available inputs are kept, since those never change
+    if ( ! msgBothInputs )
+        return 0;
+
+    SharedInputs& shared = _sharedInputs[orig.value];
+    shared.pos = pos;
+    shared.msg.reset ( new SharedMessage ( msgBothInputs ) );
+    return shared.msg;
+}
+
+SharedMsgPtr SpectatorManager::getSharedRngState ( uint32_t index )
+{
+    MsgPtr msgRngState = _netManPtr->getRngState ( index );
+
+    if ( ! msgRngState )
+        return 0;
+
+    SharedMsgPtr& shared = _sharedRngStates[index];
+
+    if ( ! shared || shared->msg != msgRngState )
+        shared.reset ( new SharedMessage ( msgRngState ) );
+
+    return shared;
+}
+
+void SpectatorManager::trimSharedMessages()
+{
+    IndexedFrame minPos = MaxIndexedFrame;
+
+    for ( const auto& kv : _spectatorMap )
+        minPos.value = min ( minPos.value, kv.second.pos.value );
+
+    // Spectator positions only move forward
+    _sharedInputs.erase ( _sharedInputs.begin(), _sharedInputs.lower_bound ( minPos.value ) );
+    _sharedRngStates.erase ( _sharedRngStates.begin(), _sharedRngStates.lower_bound ( minPos.parts.index ) );
 }
 
 void SpectatorManager::frameStepSpectators()
@@ -120,6 +179,9 @@ void SpectatorManager::frameStepSpectators()
 
         // Reset the preserve index
         _netManPtr->preserveStartIndex = _currentMinIndex = UINT_MAX;
+
+        _sharedInputs.clear();
+        _sharedRngStates.clear();
         return;
     }
 
@@ -167,11 +229,11 @@ void SpectatorManager::frameStepSpectators()
         LOG ( "socket=%08x; spectator.pos=[%s]; preserveStartIndex=%u",
               socket, spectator.pos, _netManPtr->preserveStartIndex );
 
-        MsgPtr msgBothInputs = _netManPtr->getBothInputs ( spectator.pos );
+        SharedMsgPtr sharedInputs = getSharedInputs ( spectator.pos );
 
         // Send inputs if available
-        if ( msgBothInputs )
-            socket->send ( msgBothInputs );
+        if ( sharedInputs )
+            socket->sendShared ( *sharedInputs );
 
         // Clear sent flags whenever the index changes
         if ( spectator.pos.parts.index > oldIndex )
@@ -180,13 +242,16 @@ void SpectatorManager::frameStepSpectators()
             spectator.sentRetryMenuIndex = false;
         }
 
-        MsgPtr msgRngState = _netManPtr->getRngState ( oldIndex );
-
         // Send RngState ONCE if available
-        if ( msgRngState && !spectator.sentRngState )
+        if ( !spectator.sentRngState )
         {
-            socket->send ( msgRngState );
-            spectator.sentRngState = true;
+            SharedMsgPtr sharedRngState = getSharedRngState ( oldIndex );
+
+            if ( sharedRngState )
+            {
+                socket->sendShared ( *sharedRngState );
+                spectator.sentRngState = true;
+            }
         }
 
         MsgPtr msgMenuIndex = _netManPtr->getRetryMenuIndex ( oldIndex );
@@ -203,6 +268,8 @@ void SpectatorManager::frameStepSpectators()
         // Update the current min index
         _currentMinIndex = min ( _currentMinIndex, spectator.pos.parts.index );
     }
+
+    trimSharedMessages();
 }
 
 const IpAddrPort& SpectatorManager::getRandomSpectatorAddress() const
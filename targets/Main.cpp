@@ -211,6 +211,12 @@ int main ( int argc, char *argv[] )
             "  --rollback, -r N     Set the default rollback to N.\n"
         },
 
+        {
+            Options::Redundancy, 0, "", "redundancy", Arg::Numeric,
+            "  --redundancy N       Send at most N extra copies of inputs, adapting to packet loss.\n"
+            "                         Defaults to 2, 0 disables.\n"
+        },
+
         {
             Options::Offline, 0, "o", "offline", Arg::OptionalNumeric,
             "  --offline, -o D      Force offline mode.\n"
@@ -366,6 +372,9 @@ int main ( int argc, char *argv[] )
 
     LOG ( "Running from: %s", ProcessManager::appDir );
 
+    if ( SmartSocket::loadRelayServers ( ProcessManager::appDir + RELAYS_FILE ) )
+        LOG ( "Loaded %u relay servers", SmartSocket::getRelayServers().size() );
+
     // Log parsed command line opt
     for ( size_t i = 0; i < opt.size(); ++i )
     {
@@ -16,6 +16,9 @@
 // Log file that contains all the data needed to keep games in sync
 #define SYNC_LOG_FILE FOLDER "sync.log"
 
+// Optional list of tunnel servers, one address per line, see SmartSocket::loadRelayServers
+#define RELAYS_FILE FOLDER "relays.txt"
+
 // Controller mappings file extension
 #define MAPPINGS_EXT ".mappings"
 
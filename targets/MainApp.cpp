@@ -302,6 +302,15 @@ struct MainApp
             return;
         }
 
+        // Use the highest protocol level supported by both sides
+        socket->setProtocolLevel ( min<uint8_t> ( PROTOCOL_LEVEL, versionConfig.mode.getProtocolLevel() ) );
+
+        LOG ( "protocolLevel=%u", socket->getProtocolLevel() );
+
+        // The remote may support a higher level than the flags can advertise
+        if ( versionConfig.mode.getProtocolLevel() == ClientMode::ProtocolLevelExtended )
+            socket->send ( new ProtocolLevel ( PROTOCOL_LEVEL ) );
+
         // Switch to spectate mode if the game is already started
         if ( clientMode.isClient() && versionConfig.mode.isGameStarted() )
             clientMode.value = ClientMode::SpectateNetplay;
@@ -348,6 +357,13 @@ struct MainApp
         ctrlSocket->send ( initialConfig );
     }
 
+    void gotProtocolLevel ( const ProtocolLevel& protocolLevel )
+    {
+        ctrlSocket->setProtocolLevel ( min<uint8_t> ( PROTOCOL_LEVEL, protocolLevel.level ) );
+
+        LOG ( "protocolLevel=%u", ctrlSocket->getProtocolLevel() );
+    }
+
     void gotInitialConfig ( const InitialConfig& initialConfig )
     {
         if ( ! isInitialConfigReady )
@@ -381,6 +397,7 @@ struct MainApp
 
             dataSocket = SmartSocket::connectUDP ( this, { address.addr, this->initialConfig.dataPort },
                                                    ctrlSocket->getAsSmart().isTunnel() );
+            dataSocket->setProtocolLevel ( ctrlSocket->getProtocolLevel() );
             LOG ( "dataSocket=%08x", dataSocket.get() );
 
             ui.display (
@@ -873,6 +890,8 @@ struct MainApp
             ASSERT ( dataSocket != 0 );
             ASSERT ( dataSocket->isConnected() == true );
 
+            dataSocket->setProtocolLevel ( ctrlSocket->getProtocolLevel() );
+
             pinger.start();
         }
         else
@@ -980,6 +999,11 @@ struct MainApp
             gotVersionConfig ( socket, msg->getAs<VersionConfig>() );
             return;
         }
+        else if ( msg->getMsgType() == MsgType::ProtocolLevel && socket == ctrlSocket.get() )
+        {
+            gotProtocolLevel ( msg->getAs<ProtocolLevel>() );
+            return;
+        }
         else if ( isDummyReady )
         {
             gotDummyMsg ( msg );
@@ -1055,6 +1079,8 @@ struct MainApp
 
         procMan.ipcSend ( options );
         procMan.ipcSend ( ControllerManager::get().getMappings() );
+        // The DLL gets the protocol level negotiated over ctrlSocket before the ClientMode
+        procMan.ipcSend ( new ProtocolLevel ( ctrlSocket ? ctrlSocket->getProtocolLevel() : 0 ) );
         procMan.ipcSend ( clientMode );
         procMan.ipcSend ( new IpAddrPort ( address.getAddrInfo()->ai_addr ) );
 
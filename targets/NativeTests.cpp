@@ -0,0 +1,54 @@
+#include "Logger.hpp"
+#include "Test.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+using namespace std;
+
+
+#define LOG_FILE "native_tests.log"
+
+
+// Only the native test runner replaces the global allocator, this just calls the hook a test installed
+void *operator new ( size_t size )
+{
+    if ( allocationHook )
+        allocationHook ( size );
+
+    void *ptr = malloc ( size ? size : 1 );
+
+    if ( ! ptr )
+        throw bad_alloc();
+
+    return ptr;
+}
+
+void operator delete ( void *ptr ) noexcept
+{
+    free ( ptr );
+}
+
+
+// Runs the unit tests for the networking core, built natively instead of with mingw
+int main ( int argc, char *argv[] )
+{
+    bool logToStdout = false;
+
+    for ( int i = 1; i < argc; ++i )
+        if ( strcmp ( argv[i], "--stdout" ) == 0 )
+            logToStdout = true;
+
+    if ( logToStdout )
+        Logger::get().initialize();
+    else
+        Logger::get().initialize ( LOG_FILE );
+
+    canHookAllocations = true;
+
+    const int result = RunAllTests ( argc, argv );
+
+    Logger::get().deinitialize();
+    return result;
+}
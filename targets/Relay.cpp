@@ -0,0 +1,50 @@
+#include "RelayServer.hpp"
+#include "EventManager.hpp"
+#include "SocketManager.hpp"
+#include "TimerManager.hpp"
+#include "Exceptions.hpp"
+
+#include <cstdlib>
+
+using namespace std;
+
+
+#define DEFAULT_PORT ( 3939 )
+
+#define STATS_INTERVAL ( 60000 )
+
+
+// Tunnel server for SmartSocket, usage: relay_server [port] [public IPv4 address to forward on] [worker threads]
+// Forwarding is only enabled if the public address is given, the default is one worker thread per core.
+// Events and statistics are printed to stdout, the per-packet logging is compiled out.
+int main ( int argc, char *argv[] )
+{
+    const uint16_t port = ( argc > 1 ? atoi ( argv[1] ) : DEFAULT_PORT );
+    const string forwardAddress = ( argc > 2 ? argv[2] : "" );
+    const size_t workerCount = ( argc > 3 ? atoi ( argv[3] ) : 0 );
+
+    TimerManager::get().initialize();
+    SocketManager::get().initialize();
+
+    int result = 0;
+
+    try
+    {
+        RelayServer server ( port, STATS_INTERVAL, true );
+
+        if ( ! forwardAddress.empty() )
+            server.enableForwarding ( forwardAddress, workerCount );
+
+        EventManager::get().start();
+    }
+    catch ( const Exception& exc )
+    {
+        PRINT ( "event=error; reason='%s'", exc.user );
+        result = -1;
+    }
+
+    SocketManager::get().deinitialize();
+    TimerManager::get().deinitialize();
+
+    return result;
+}
@@ -3,10 +3,12 @@
 #include "Test.Socket.hpp"
 #include "UdpSocket.hpp"
 #include "GoBackN.hpp"
+#include "Pinger.hpp"
 
 #include <gtest/gtest.h>
 
 #include <vector>
+#include <functional>
 
 using namespace std;
 
@@ -26,6 +28,7 @@ struct TestClass : public GoBackN::Owner, public Socket::Owner, public Timer::Ow
     virtual void socketAccepted ( Socket *socket ) override {}
     virtual void socketConnected ( Socket *socket ) override {}
     virtual void socketDisconnected ( Socket *socket ) override {}
+    virtual void socketRead ( Socket *socket, const MsgPtr& msg, const IpAddrPort& address ) override {}
 
     virtual void timerExpired ( Timer *timer ) override {}
 };
@@ -411,4 +414,1087 @@ TEST ( GoBackN, Timeout )
     TimerManager::get().deinitialize();
 }
 
+TEST ( GoBackN, CachedRetransmit )
+{
+    struct TestSender : public TestClass
+    {
+        GoBackN gbn;
+        Timer timer;
+        size_t encodes = 0, sends = 0;
+
+        bool goBackNEncode ( GoBackN *gbn, const MsgPtr& msg, string& bytes ) override
+        {
+            ++encodes;
+            bytes = Protocol::encode ( msg );
+            return true;
+        }
+
+        void goBackNSendBytes ( GoBackN *gbn, const string& bytes ) override
+        {
+            ++sends;
+
+            size_t consumed;
+            MsgPtr msg = Protocol::decode ( &bytes[0], bytes.size(), consumed );
+
+            EXPECT_TRUE ( msg.get() != 0 );
+            EXPECT_EQ ( bytes.size(), consumed );
+
+            if ( msg )
+            {
+                EXPECT_EQ ( MsgType::SplitMessage, msg->getMsgType() );
+            }
+        }
+
+        void goBackNSendRaw ( GoBackN *gbn, const MsgPtr& msg ) override
+        {
+            ADD_FAILURE() << "Unexpected goBackNSendRaw for " << msg;
+        }
+
+        void timerExpired ( Timer *timer ) override
+        {
+            LOG ( "Stopping because of timeout" );
+            EventManager::get().stop();
+        }
+
+        TestSender() : gbn ( this ), timer ( this )
+        {
+            timer.start ( 20 * DEFAULT_SEND_INTERVAL );
+        }
+    };
+
+    TimerManager::get().initialize();
+    SocketManager::get().initialize();
+
+    TestSender sender;
+
+    // Random data doesn't compress, so this gets split into several messages
+    string str ( 1000, 0 );
+    for ( char& c : str )
+        c = char ( rand() );
+
+    sender.gbn.sendViaGoBackN ( new TestMessage ( str ) );
+
+    // The original message is only encoded once, those bytes are split, then each SplitMessage is encoded once
+    EXPECT_GT ( sender.gbn.getSendCount(), 1u );
+    EXPECT_EQ ( sender.gbn.getSendCount() + 1, sender.encodes );
+
+    // Nothing gets ACKed, so every message is retransmitted from the cached bytes
+    EventManager::get().start();
+
+    EXPECT_EQ ( sender.gbn.getSendCount() + 1, sender.encodes );
+    EXPECT_GT ( sender.sends, sender.encodes );
+
+    SocketManager::get().deinitialize();
+    TimerManager::get().deinitialize();
+}
+
+TEST ( GoBackN, SharedSequence )
+{
+    SharedMessage shared ( MsgPtr ( new TestMessage ( "Hello spectators!" ) ) );
+
+    const shared_ptr<const string>& payload = shared.getBytes ( HashType::CRC32C, false );
+
+    MsgPtr msg ( new SharedSequence ( payload ) );
+    msg->getAs<SharedSequence>().setSequence ( 5 );
+
+    EncodeBuffer buffer;
+    const string bytes = Protocol::encode ( msg, buffer, HashType::CRC32C, false ).str();
+
+    // Only a small header and hash around the shared payload
+    EXPECT_GE ( payload->size() + SPLIT_MESSAGE_OVERHEAD, bytes.size() );
+
+    size_t consumed;
+    MsgPtr decoded = Protocol::decode ( &bytes[0], bytes.size(), consumed );
+
+    ASSERT_TRUE ( decoded.get() != 0 );
+    ASSERT_EQ ( MsgType::SharedSequence, decoded->getMsgType() );
+    EXPECT_EQ ( bytes.size(), consumed );
+    EXPECT_EQ ( 5u, decoded->getAs<SharedSequence>().getSequence() );
+    EXPECT_EQ ( *payload, *decoded->getAs<SharedSequence>().bytes );
+
+    // The sequence is covered by the wrapper's hash, it comes right after the 2 byte header
+    string corrupted = bytes;
+    corrupted[2] ^= 1;
+    EXPECT_TRUE ( Protocol::decode ( &corrupted[0], corrupted.size(), consumed ).get() == 0 );
+
+    // The payload isn't, but the wrapped message is decoded with it, so its hash rejects the whole SharedSequence
+    corrupted = bytes;
+    corrupted[bytes.size() - Protocol::getHashSize ( HashType::CRC32C ) - payload->size() / 2] ^= 1;
+    EXPECT_TRUE ( Protocol::decode ( &corrupted[0], corrupted.size(), consumed ).get() == 0 );
+}
+
+TEST ( GoBackN, SharedSequenceCorrupted )
+{
+    // Two GoBackN instances linked by a queue, the payload of the first transmission of sequence 2 is corrupted
+    struct TestLink : public TestClass
+    {
+        GoBackN gbn;
+        TestLink *peer = 0;
+        vector<string> queue;
+        vector<MsgPtr> msgs;
+        vector<uint32_t> sendCounts;
+
+        void goBackNSendRaw ( GoBackN *gbn, const MsgPtr& msg ) override
+        {
+            string bytes = Protocol::encode ( msg );
+
+            if ( msg->getMsgType() == MsgType::SharedSequence )
+            {
+                const uint32_t sequence = msg->getAs<SerializableSequence>().getSequence();
+                const string& payload = *msg->getAs<SharedSequence>().bytes;
+
+                if ( sequence >= sendCounts.size() )
+                    sendCounts.resize ( sequence + 1 );
+
+                if ( sequence == 2 && sendCounts[sequence] == 0 )
+                    bytes[bytes.find ( payload ) + payload.size() / 2] ^= 1;
+
+                ++sendCounts[sequence];
+            }
+
+            peer->queue.push_back ( bytes );
+        }
+
+        void goBackNRecvMsg ( GoBackN *gbn, const MsgPtr& msg ) override
+        {
+            msgs.push_back ( msg );
+        }
+
+        TestLink() : gbn ( this, 10 ) {}
+    };
+
+    struct TestPump : public TestClass
+    {
+        TestLink sender, receiver;
+        Timer timer;
+        uint32_t countDown = 5000;
+
+        void timerExpired ( Timer *timer ) override
+        {
+            for ( TestLink *link : { &sender, &receiver } )
+            {
+                vector<string> queue;
+                queue.swap ( link->queue );
+
+                for ( const string& bytes : queue )
+                {
+                    size_t consumed;
+                    link->gbn.recvFromSocket ( Protocol::decode ( &bytes[0], bytes.size(), consumed ) );
+                }
+            }
+
+            if ( ( receiver.msgs.size() == 3 && sender.gbn.getAckCount() == 3 ) || --countDown == 0 )
+            {
+                LOG ( "Stopping" );
+                EventManager::get().stop();
+                return;
+            }
+
+            timer->start ( 1 );
+        }
+
+        TestPump() : timer ( this )
+        {
+            sender.peer = &receiver;
+            receiver.peer = &sender;
+            timer.start ( 1 );
+        }
+    };
+
+    TimerManager::get().initialize();
+    SocketManager::get().initialize();
+
+    TestPump pump;
+
+    for ( uint32_t i = 1; i <= 3; ++i )
+    {
+        SharedMessage shared ( MsgPtr ( new TestMessage ( format ( "Shared message %u", i ) ) ) );
+        pump.sender.gbn.sendViaGoBackN ( new SharedSequence ( shared.getBytes ( HashType::CRC32C, false ) ) );
+    }
+
+    EventManager::get().start();
+
+    // The corrupted transmission was dropped without being acked, so it was resent and nothing was lost
+    ASSERT_EQ ( 3, pump.receiver.msgs.size() );
+
+    for ( size_t i = 0; i < pump.receiver.msgs.size(); ++i )
+    {
+        ASSERT_EQ ( MsgType::TestMessage, pump.receiver.msgs[i]->getMsgType() );
+        EXPECT_EQ ( format ( "Shared message %u", i + 1 ), pump.receiver.msgs[i]->getAs<TestMessage>().str );
+    }
+
+    ASSERT_EQ ( 4, pump.sender.sendCounts.size() );
+    EXPECT_LT ( 1, pump.sender.sendCounts[2] );
+
+    SocketManager::get().deinitialize();
+    TimerManager::get().deinitialize();
+}
+
+TEST ( GoBackN, SelectiveRepeat )
+{
+    // Two GoBackN instances linked by a queue, the first transmission of sequence 2 is lost
+    struct TestLink : public TestClass
+    {
+        GoBackN gbn;
+        TestLink *peer = 0;
+        vector<string> queue;
+        vector<MsgPtr> msgs;
+        vector<uint32_t> sendCounts;
+
+        void goBackNSendRaw ( GoBackN *gbn, const MsgPtr& msg ) override
+        {
+            goBackNSendBytes ( gbn, Protocol::encode ( msg ) );
+        }
+
+        bool goBackNEncode ( GoBackN *gbn, const MsgPtr& msg, string& bytes ) override
+        {
+            bytes = Protocol::encode ( msg );
+            return true;
+        }
+
+        void goBackNSendBytes ( GoBackN *gbn, const string& bytes ) override
+        {
+            size_t consumed;
+            MsgPtr msg = Protocol::decode ( &bytes[0], bytes.size(), consumed );
+
+            if ( msg && msg->getMsgType() == MsgType::TestMessage )
+            {
+                const uint32_t sequence = msg->getAs<SerializableSequence>().getSequence();
+
+                if ( sequence >= sendCounts.size() )
+                    sendCounts.resize ( sequence + 1 );
+
+                if ( sequence == 2 && sendCounts[sequence]++ == 0 )
+                    return;
+
+                if ( sequence != 2 )
+                    ++sendCounts[sequence];
+            }
+
+            peer->queue.push_back ( bytes );
+        }
+
+        void goBackNRecvMsg ( GoBackN *gbn, const MsgPtr& msg ) override
+        {
+            msgs.push_back ( msg );
+        }
+
+        TestLink() : gbn ( this, 10 ) {}
+    };
+
+    struct TestPump : public TestClass
+    {
+        TestLink sender, receiver;
+        Timer timer;
+        uint32_t countDown = 5000;
+
+        void timerExpired ( Timer *timer ) override
+        {
+            for ( TestLink *link : { &sender, &receiver } )
+            {
+                vector<string> queue;
+                queue.swap ( link->queue );
+
+                for ( const string& bytes : queue )
+                {
+                    size_t consumed;
+                    link->gbn.recvFromSocket ( Protocol::decode ( &bytes[0], bytes.size(), consumed ) );
+                }
+            }
+
+            if ( ( receiver.msgs.size() == 5 && sender.gbn.getAckCount() == 5 ) || --countDown == 0 )
+            {
+                LOG ( "Stopping" );
+                EventManager::get().stop();
+                return;
+            }
+
+            timer->start ( 1 );
+        }
+
+        TestPump ( bool selectiveRepeat ) : timer ( this )
+        {
+            sender.peer = &receiver;
+            receiver.peer = &sender;
+            sender.gbn.setSelectiveRepeat ( selectiveRepeat );
+            receiver.gbn.setSelectiveRepeat ( selectiveRepeat );
+            timer.start ( 1 );
+        }
+    };
+
+    for ( bool selectiveRepeat : { false, true } )
+    {
+        TimerManager::get().initialize();
+        SocketManager::get().initialize();
+
+        TestPump pump ( selectiveRepeat );
+
+        for ( uint32_t i = 1; i <= 5; ++i )
+            pump.sender.gbn.sendViaGoBackN ( new TestMessage ( format ( "Message %u", i ) ) );
+
+        EventManager::get().start();
+
+        ASSERT_EQ ( 5, pump.receiver.msgs.size() ) << "selectiveRepeat=" << selectiveRepeat;
+
+        for ( size_t i = 0; i < pump.receiver.msgs.size(); ++i )
+            EXPECT_EQ ( format ( "Message %u", i + 1 ), pump.receiver.msgs[i]->getAs<TestMessage>().str );
+
+        ASSERT_EQ ( 6, pump.sender.sendCounts.size() );
+        EXPECT_EQ ( 2, pump.sender.sendCounts[2] );
+
+        // Only the lost message is resent with selective repeat, Go-Back-N resends everything after it
+        if ( selectiveRepeat )
+        {
+            EXPECT_EQ ( 1, pump.sender.sendCounts[3] );
+            EXPECT_EQ ( 1, pump.sender.sendCounts[4] );
+            EXPECT_EQ ( 1, pump.sender.sendCounts[5] );
+        }
+        else
+        {
+            EXPECT_LT ( 1, pump.sender.sendCounts[3] );
+        }
+
+        SocketManager::get().deinitialize();
+        TimerManager::get().deinitialize();
+    }
+}
+
+TEST ( GoBackN, AdaptiveInterval )
+{
+    // Two GoBackN instances linked by a queue, optionally dropping everything
+    struct TestLink : public TestClass
+    {
+        GoBackN gbn;
+        TestLink *peer = 0;
+        vector<string> queue;
+        bool drop = false;
+
+        void goBackNSendRaw ( GoBackN *gbn, const MsgPtr& msg ) override
+        {
+            if ( ! drop )
+                peer->queue.push_back ( Protocol::encode ( msg ) );
+        }
+
+        TestLink() : gbn ( this ) {}
+    };
+
+    struct TestPump : public TestClass
+    {
+        TestLink sender, receiver;
+        Timer timer;
+        uint32_t countDown;
+
+        void timerExpired ( Timer *timer ) override
+        {
+            for ( TestLink *link : { &sender, &receiver } )
+            {
+                vector<string> queue;
+                queue.swap ( link->queue );
+
+                for ( const string& bytes : queue )
+                {
+                    size_t consumed;
+                    link->gbn.recvFromSocket ( Protocol::decode ( &bytes[0], bytes.size(), consumed ) );
+                }
+            }
+
+            // Keep sending messages so there are RTT samples
+            if ( countDown % 10 == 0 )
+                sender.gbn.sendViaGoBackN ( new TestMessage ( "Hello" ) );
+
+            if ( --countDown == 0 )
+            {
+                LOG ( "Stopping" );
+                EventManager::get().stop();
+                return;
+            }
+
+            timer->start ( 1 );
+        }
+
+        TestPump ( bool drop, uint32_t duration ) : timer ( this ), countDown ( duration )
+        {
+            sender.peer = &receiver;
+            receiver.peer = &sender;
+            sender.drop = drop;
+            timer.start ( 1 );
+        }
+    };
+
+    TimerManager::get().initialize();
+    SocketManager::get().initialize();
+
+    {
+        // A fast link should retransmit much sooner than the default interval
+        TestPump pump ( false, 500 );
+
+        EXPECT_EQ ( DEFAULT_SEND_INTERVAL, pump.sender.gbn.getSendInterval() );
+
+        EventManager::get().start();
+
+        EXPECT_GT ( pump.sender.gbn.getAckCount(), 10u );
+        EXPECT_LT ( pump.sender.gbn.getSmoothedRtt(), DEFAULT_SEND_INTERVAL );
+        EXPECT_LT ( pump.sender.gbn.getSendInterval(), DEFAULT_SEND_INTERVAL );
+        EXPECT_GE ( pump.sender.gbn.getSendInterval(), MIN_SEND_INTERVAL );
+
+        // Then everything is lost, the interval backs off, but only up to twice the RTT or the base interval
+        const uint64_t rto = pump.sender.gbn.getSendInterval();
+
+        pump.sender.drop = true;
+        pump.countDown = 1000;
+        pump.timer.start ( 1 );
+
+        EventManager::get().start();
+
+        EXPECT_GT ( pump.sender.gbn.getSendInterval(), rto );
+        EXPECT_LE ( pump.sender.gbn.getSendInterval(), DEFAULT_SEND_INTERVAL );
+    }
+
+    SocketManager::get().deinitialize();
+    TimerManager::get().deinitialize();
+
+    TimerManager::get().initialize();
+    SocketManager::get().initialize();
+
+    {
+        // Nothing is ACKed, without an RTT estimate the retransmission interval stays at the base interval
+        TestPump pump ( true, 1000 );
+
+        EventManager::get().start();
+
+        EXPECT_EQ ( 0u, pump.sender.gbn.getAckCount() );
+        EXPECT_EQ ( DEFAULT_SEND_INTERVAL, pump.sender.gbn.getSendInterval() );
+    }
+
+    SocketManager::get().deinitialize();
+    TimerManager::get().deinitialize();
+}
+
+TEST ( GoBackN, MtuProbe )
+{
+    // Two GoBackN instances linked by a queue that drops anything larger than the path MTU
+    struct TestLink : public TestClass
+    {
+        GoBackN gbn;
+        TestLink *peer = 0;
+        vector<string> queue;
+        vector<MsgPtr> msgs;
+        size_t pathMtu = 900;
+
+        void goBackNSendRaw ( GoBackN *gbn, const MsgPtr& msg ) override
+        {
+            const string bytes = Protocol::encode ( msg );
+
+            if ( bytes.size() <= pathMtu )
+                peer->queue.push_back ( bytes );
+        }
+
+        void goBackNRecvMsg ( GoBackN *gbn, const MsgPtr& msg ) override
+        {
+            msgs.push_back ( msg );
+        }
+
+        TestLink() : gbn ( this, 10, LONG_TIMEOUT ) {}
+    };
+
+    struct TestPump : public TestClass
+    {
+        TestLink sender, receiver;
+        Timer timer;
+        uint32_t countDown = 10000;
+        function<bool()> isDone;
+
+        void timerExpired ( Timer *timer ) override
+        {
+            for ( TestLink *link : { &sender, &receiver } )
+            {
+                vector<string> queue;
+                queue.swap ( link->queue );
+
+                for ( const string& bytes : queue )
+                {
+                    size_t consumed;
+                    link->gbn.recvFromSocket ( Protocol::decode ( &bytes[0], bytes.size(), consumed ) );
+                }
+            }
+
+            if ( isDone() || --countDown == 0 )
+            {
+                LOG ( "Stopping" );
+                EventManager::get().stop();
+                return;
+            }
+
+            timer->start ( 1 );
+        }
+
+        TestPump() : timer ( this )
+        {
+            sender.peer = &receiver;
+            receiver.peer = &sender;
+            sender.gbn.setMtuProbing ( true );
+        }
+    };
+
+    // Probes are padded to the exact size
+    EXPECT_EQ ( 1000, Protocol::encode ( MsgPtr ( new MtuProbe ( 1000 ) ) ).size() );
+
+    TimerManager::get().initialize();
+    SocketManager::get().initialize();
+
+    {
+        TestPump pump;
+
+        EXPECT_EQ ( MIN_MTU, pump.sender.gbn.getMtu() );
+
+        // Probe until the MTU is within one step of the path MTU
+        pump.isDone = [&]() { return pump.sender.gbn.getMtu() + MTU_PROBE_STEP > pump.sender.pathMtu; };
+        pump.sender.gbn.sendViaGoBackN ( new TestMessage ( "Hello" ) );
+        pump.timer.start ( 1 );
+
+        EventManager::get().start();
+
+        EXPECT_LE ( pump.sender.gbn.getMtu(), pump.sender.pathMtu );
+        EXPECT_GT ( pump.sender.gbn.getMtu() + MTU_PROBE_STEP, pump.sender.pathMtu );
+
+        // Random data doesn't compress, so this gets split using the probed MTU
+        string str ( 2000, 0 );
+        for ( char& c : str )
+            c = char ( rand() );
+
+        const uint32_t sendCount = pump.sender.gbn.getSendCount();
+        const size_t size = Protocol::encode ( MsgPtr ( new TestMessage ( str ) ) ).size();
+        const size_t chunk = pump.sender.gbn.getMtu() - SPLIT_MESSAGE_OVERHEAD;
+
+        pump.sender.gbn.sendViaGoBackN ( new TestMessage ( str ) );
+
+        EXPECT_EQ ( ( size + chunk - 1 ) / chunk, pump.sender.gbn.getSendCount() - sendCount );
+
+        // Every chunk fits the path MTU, so the message arrives
+        pump.isDone = [&]() { return pump.receiver.msgs.size() == 2; };
+        pump.timer.start ( 1 );
+
+        EventManager::get().start();
+
+        ASSERT_EQ ( 2, pump.receiver.msgs.size() );
+        EXPECT_EQ ( str, pump.receiver.msgs[1]->getAs<TestMessage>().str );
+    }
+
+    SocketManager::get().deinitialize();
+    TimerManager::get().deinitialize();
+
+    // An owner with a different encoding, the probes are padded to the exact size of its encoding
+    struct TestEncoder : public TestClass
+    {
+        GoBackN gbn;
+        Timer timer;
+        EncodeBuffer buffer;
+        vector<string> sent;
+
+        bool goBackNEncode ( GoBackN *gbn, const MsgPtr& msg, string& bytes ) override
+        {
+            bytes = Protocol::encode ( msg, buffer, HashType::CRC32C, true ).str();
+            return true;
+        }
+
+        void goBackNSendBytes ( GoBackN *gbn, const string& bytes ) override
+        {
+            sent.push_back ( bytes );
+        }
+
+        void timerExpired ( Timer *timer ) override
+        {
+            EventManager::get().stop();
+        }
+
+        TestEncoder() : gbn ( this, 10, LONG_TIMEOUT ), timer ( this )
+        {
+            gbn.setMtuProbing ( true );
+        }
+    };
+
+    TimerManager::get().initialize();
+    TimerManager::get().setVirtualTime ( true );
+    SocketManager::get().initialize();
+
+    {
+        TestEncoder sender;
+        sender.gbn.sendViaGoBackN ( new TestMessage ( "Hello" ) );
+        sender.timer.start ( 100 );
+
+        EventManager::get().start();
+
+        size_t probes = 0;
+
+        for ( const string& bytes : sender.sent )
+        {
+            size_t consumed;
+            MsgPtr msg = Protocol::decode ( &bytes[0], bytes.size(), consumed );
+
+            ASSERT_TRUE ( msg.get() != 0 );
+
+            if ( msg->getMsgType() != MsgType::MtuProbe )
+                continue;
+
+            ++probes;
+            EXPECT_EQ ( msg->getAs<MtuProbe>().size, bytes.size() );
+        }
+
+        EXPECT_LT ( 0u, probes );
+    }
+
+    SocketManager::get().deinitialize();
+    TimerManager::get().deinitialize();
+}
+
+TEST ( GoBackN, DelayedAck )
+{
+    // Two GoBackN instances linked by a queue, the receiver sends a Ping every frame like inputs
+    struct TestLink : public TestClass
+    {
+        GoBackN gbn;
+        TestLink *peer = 0;
+        vector<string> queue;
+        vector<MsgPtr> msgs;
+        size_t acks = 0;
+
+        void goBackNSendRaw ( GoBackN *gbn, const MsgPtr& msg ) override
+        {
+            if ( msg->getMsgType() == MsgType::AckSequence )
+                ++acks;
+
+            peer->queue.push_back ( Protocol::encode ( msg ) );
+        }
+
+        void goBackNRecvMsg ( GoBackN *gbn, const MsgPtr& msg ) override
+        {
+            msgs.push_back ( msg );
+        }
+
+        TestLink() : gbn ( this ) {}
+    };
+
+    struct TestPump : public TestClass
+    {
+        TestLink sender, receiver;
+        Timer timer;
+        EncodeBuffer buffer;
+        uint32_t tick = 0;
+
+        void timerExpired ( Timer *timer ) override
+        {
+            for ( TestLink *link : { &sender, &receiver } )
+            {
+                vector<string> queue;
+                queue.swap ( link->queue );
+
+                for ( const string& bytes : queue )
+                {
+                    size_t consumed;
+                    link->gbn.recvFromSocket ( Protocol::decode ( &bytes[0], bytes.size(), consumed ) );
+                }
+            }
+
+            ++tick;
+
+            if ( tick % 16 == 0 && sender.gbn.getSendCount() < 20 )
+                sender.gbn.sendViaGoBackN ( new TestMessage ( format ( "Message %u", tick / 16 ) ) );
+
+            if ( tick % 16 == 8 )
+            {
+                const ByteSpan bytes = Protocol::encode ( MsgPtr ( new Ping ( tick ) ), buffer, HashType::MD5, false,
+                                                          receiver.gbn.takeAckSequence() );
+                sender.queue.push_back ( bytes.str() );
+            }
+
+            if ( ( receiver.msgs.size() == 20 && sender.gbn.getAckCount() == 20 ) || tick == 5000 )
+            {
+                LOG ( "Stopping" );
+                EventManager::get().stop();
+                return;
+            }
+
+            timer->start ( 1 );
+        }
+
+        TestPump ( bool delayedAck ) : timer ( this )
+        {
+            sender.peer = &receiver;
+            receiver.peer = &sender;
+            sender.gbn.setDelayedAck ( delayedAck );
+            receiver.gbn.setDelayedAck ( delayedAck );
+            timer.start ( 1 );
+        }
+    };
+
+    for ( bool delayedAck : { false, true } )
+    {
+        // The ACK count depends on when the timers expire, so don't leave it to the scheduler
+        TimerManager::get().initialize();
+        TimerManager::get().setVirtualTime ( true );
+        SocketManager::get().initialize();
+
+        TestPump pump ( delayedAck );
+
+        EventManager::get().start();
+
+        EXPECT_EQ ( 20, pump.receiver.msgs.size() ) << "delayedAck=" << delayedAck;
+        EXPECT_EQ ( 20u, pump.sender.gbn.getAckCount() ) << "delayedAck=" << delayedAck;
+
+        // Every message gets its own ACK, unless they are piggybacked on the Pings
+        if ( delayedAck )
+            EXPECT_GT ( 10, pump.receiver.acks );
+        else
+            EXPECT_LE ( 20, pump.receiver.acks );
+
+        SocketManager::get().deinitialize();
+        TimerManager::get().deinitialize();
+    }
+}
+
+TEST ( GoBackN, LinkEmulator )
+{
+    struct TestSocket : public TestClass
+    {
+        SocketPtr socket;
+        IpAddrPort address;
+        GoBackN gbn;
+        Timer timer;
+        vector<MsgPtr> msgs;
+
+        void goBackNSendRaw ( GoBackN *gbn, const MsgPtr& msg ) override
+        {
+            if ( ! address.empty() )
+                socket->send ( msg, address );
+        }
+
+        void goBackNRecvMsg ( GoBackN *gbn, const MsgPtr& msg ) override
+        {
+            msgs.push_back ( msg );
+
+            if ( msgs.size() == 50 )
+            {
+                LOG ( "Stopping because all msgs have been received" );
+                EventManager::get().stop();
+            }
+        }
+
+        void socketRead ( Socket *socket, const MsgPtr& msg, const IpAddrPort& address ) override
+        {
+            if ( this->address.empty() )
+                this->address = address;
+
+            gbn.recvFromSocket ( msg );
+        }
+
+        void timerExpired ( Timer *timer ) override
+        {
+            if ( socket->isClient() )
+            {
+                for ( int i = 0; i < 50; ++i )
+                    gbn.sendViaGoBackN ( new TestMessage ( format ( "Message %u", i + 1 ) ) );
+            }
+            else
+            {
+                LOG ( "Stopping because of timeout" );
+                EventManager::get().stop();
+            }
+        }
+
+        void setLinkEmulator ( uint64_t seed )
+        {
+            LinkConfig config;
+            config.seed = seed;
+            config.distribution = LinkConfig::Normal;
+            config.delay = 20;
+            config.jitter = 5;
+            config.goodToBad = 0.05;
+            config.badToGood = 0.5;
+            config.goodLoss = 0.1;
+            config.badLoss = 0.75;
+            config.duplicate = 0.05;
+            config.reorder = 0.1;
+            config.reorderDelay = 30;
+            config.rate = 64 * 1024;
+            socket->setLinkEmulator ( config );
+
+            // One datagram per message, so there are enough packets to lose
+            socket->getAsUDP().setSendBatching ( false );
+        }
+
+        TestSocket ( uint16_t port )
+            : socket ( UdpSocket::bind ( this, port ) )
+            , gbn ( this ), timer ( this )
+        {
+            setLinkEmulator ( 1 );
+            timer.start ( LONG_TIMEOUT );
+        }
+
+        TestSocket ( const string& address, uint16_t port )
+            : socket ( UdpSocket::bind ( this, IpAddrPort ( address, port ) ) )
+            , address ( address, port ), gbn ( this ), timer ( this )
+        {
+            setLinkEmulator ( 2 );
+            timer.start ( 1000 );
+        }
+    };
+
+    // Runs until the server times out, so skip the waiting
+    TimerManager::get().initialize();
+    TimerManager::get().setVirtualTime ( true );
+    SocketManager::get().initialize();
+    SocketManager::get().setLoopback ( true );
+
+    TestSocket server ( 0 );
+    TestSocket client ( "127.0.0.1", server.socket->address.port );
+
+    EventManager::get().start();
+
+    EXPECT_EQ ( 50, server.msgs.size() );
+
+    for ( size_t i = 0; i < server.msgs.size(); ++i )
+    {
+        EXPECT_EQ ( MsgType::TestMessage, server.msgs[i]->getMsgType() );
+        EXPECT_EQ ( format ( "Message %u", i + 1 ), server.msgs[i]->getAs<TestMessage>().str );
+    }
+
+    const LinkEmulator *clientLink = client.socket->getLinkEmulator();
+    const LinkEmulator *serverLink = server.socket->getLinkEmulator();
+
+    ASSERT_TRUE ( clientLink != 0 );
+    ASSERT_TRUE ( serverLink != 0 );
+    EXPECT_LT ( 0u, clientLink->getStats().dropped + serverLink->getStats().dropped );
+
+    SocketManager::get().deinitialize();
+    TimerManager::get().deinitialize();
+}
+
+TEST ( GoBackN, RandomLoss )
+{
+    struct TestSocket : public TestClass
+    {
+        SocketPtr socket;
+        IpAddrPort address;
+        GoBackN gbn;
+        Timer timer;
+        vector<MsgPtr> msgs;
+        uint64_t finished = 0;
+
+        void goBackNSendRaw ( GoBackN *gbn, const MsgPtr& msg ) override
+        {
+            if ( ! address.empty() )
+                socket->send ( msg, address );
+        }
+
+        void goBackNRecvMsg ( GoBackN *gbn, const MsgPtr& msg ) override
+        {
+            msgs.push_back ( msg );
+
+            if ( msgs.size() == 100 )
+            {
+                LOG ( "Stopping because all msgs have been received" );
+                finished = TimerManager::get().getNow();
+                EventManager::get().stop();
+            }
+        }
+
+        void socketRead ( Socket *socket, const MsgPtr& msg, const IpAddrPort& address ) override
+        {
+            if ( this->address.empty() )
+                this->address = address;
+
+            gbn.recvFromSocket ( msg );
+        }
+
+        void timerExpired ( Timer *timer ) override
+        {
+            if ( socket->isClient() )
+            {
+                for ( int i = 0; i < 100; ++i )
+                    gbn.sendViaGoBackN ( new TestMessage ( format ( "Message %u", i + 1 ) ) );
+            }
+            else
+            {
+                LOG ( "Stopping because of timeout" );
+                EventManager::get().stop();
+            }
+        }
+
+        void setLinkEmulator ( uint64_t seed )
+        {
+            LinkConfig config = LinkConfig::loss ( 0.2, seed );
+            config.delay = 20;
+            socket->setLinkEmulator ( config );
+            socket->getAsUDP().setSendBatching ( false );
+        }
+
+        TestSocket ( uint16_t port, bool selectiveRepeat )
+            : socket ( UdpSocket::bind ( this, port ) )
+            , gbn ( this ), timer ( this )
+        {
+            setLinkEmulator ( 1 );
+            gbn.setSelectiveRepeat ( selectiveRepeat );
+            timer.start ( LONG_TIMEOUT );
+        }
+
+        TestSocket ( const string& address, uint16_t port, bool selectiveRepeat )
+            : socket ( UdpSocket::bind ( this, IpAddrPort ( address, port ) ) )
+            , address ( address, port ), gbn ( this ), timer ( this )
+        {
+            setLinkEmulator ( 2 );
+            gbn.setSelectiveRepeat ( selectiveRepeat );
+            timer.start ( 1000 );
+        }
+    };
+
+    for ( bool selectiveRepeat : { false, true } )
+    {
+        // Runs until the server times out if the messages don't get through, so skip the waiting
+        TimerManager::get().initialize();
+        TimerManager::get().setVirtualTime ( true );
+        SocketManager::get().initialize();
+        SocketManager::get().setLoopback ( true );
+
+        const uint64_t start = TimerManager::get().getNow();
+
+        TestSocket server ( 0, selectiveRepeat );
+        TestSocket client ( "127.0.0.1", server.socket->address.port, selectiveRepeat );
+
+        EventManager::get().start();
+
+        printf ( "selectiveRepeat=%u; elapsed=%u ms; rto=%u ms\n", selectiveRepeat,
+                 ( unsigned ) ( server.finished - start ), ( unsigned ) client.gbn.getSendInterval() );
+
+        EXPECT_EQ ( 100, server.msgs.size() ) << "selectiveRepeat=" << selectiveRepeat;
+
+        for ( size_t i = 0; i < server.msgs.size(); ++i )
+            EXPECT_EQ ( format ( "Message %u", i + 1 ), server.msgs[i]->getAs<TestMessage>().str );
+
+        // Backing off once per lost round keeps the interval near the round trip time, instead of
+        // doubling for every resent message until it is stuck at the maximum
+        if ( server.msgs.size() == 100 )
+        {
+            EXPECT_GT ( ( selectiveRepeat ? 12 : 30 ) * 1000u, server.finished - start );
+        }
+        EXPECT_GT ( MAX_SEND_INTERVAL, client.gbn.getSendInterval() ) << "selectiveRepeat=" << selectiveRepeat;
+
+        SocketManager::get().deinitialize();
+        TimerManager::get().deinitialize();
+    }
+}
+
+TEST ( GoBackN, UniformLoss )
+{
+    // Both sides send 100 messages over a 50% loss link with no delay, like SendAndRecv but in virtual time
+    static int done = 0;
+
+    struct TestSocket : public TestClass
+    {
+        SocketPtr socket;
+        IpAddrPort address;
+        GoBackN gbn;
+        Timer timer;
+        vector<MsgPtr> msgs;
+        uint64_t finished = 0;
+
+        void goBackNSendRaw ( GoBackN *gbn, const MsgPtr& msg ) override
+        {
+            if ( ! address.empty() )
+                socket->send ( msg, address );
+        }
+
+        void goBackNRecvMsg ( GoBackN *gbn, const MsgPtr& msg ) override
+        {
+            msgs.push_back ( msg );
+
+            if ( msgs.size() == 100 && ++done == 2 )
+            {
+                LOG ( "Stopping because all msgs have been received" );
+                finished = TimerManager::get().getNow();
+                EventManager::get().stop();
+            }
+        }
+
+        void socketRead ( Socket *socket, const MsgPtr& msg, const IpAddrPort& address ) override
+        {
+            if ( this->address.empty() )
+                this->address = address;
+
+            gbn.recvFromSocket ( msg );
+        }
+
+        void timerExpired ( Timer *timer ) override
+        {
+            if ( msgs.empty() && gbn.getSendCount() == 0 )
+            {
+                for ( int i = 0; i < 100; ++i )
+                    gbn.sendViaGoBackN ( new TestMessage ( format ( "Message %u", i + 1 ) ) );
+
+                timer->start ( LONG_TIMEOUT );
+            }
+            else
+            {
+                LOG ( "Stopping because of timeout" );
+                EventManager::get().stop();
+            }
+        }
+
+        TestSocket ( uint16_t port, bool selectiveRepeat )
+            : socket ( UdpSocket::bind ( this, port ) )
+            , gbn ( this ), timer ( this )
+        {
+            socket->setLinkEmulator ( LinkConfig::loss ( 0.5, 1 ) );
+            socket->getAsUDP().setSendBatching ( false );
+            gbn.setSelectiveRepeat ( selectiveRepeat );
+            timer.start ( 1000 );
+        }
+
+        TestSocket ( const string& address, uint16_t port, bool selectiveRepeat )
+            : socket ( UdpSocket::bind ( this, IpAddrPort ( address, port ) ) )
+            , address ( address, port ), gbn ( this ), timer ( this )
+        {
+            socket->setLinkEmulator ( LinkConfig::loss ( 0.5, 2 ) );
+            socket->getAsUDP().setSendBatching ( false );
+            gbn.setSelectiveRepeat ( selectiveRepeat );
+            timer.start ( 1000 );
+        }
+    };
+
+    for ( bool selectiveRepeat : { false, true } )
+    {
+        done = 0;
+
+        TimerManager::get().initialize();
+        TimerManager::get().setVirtualTime ( true );
+        SocketManager::get().initialize();
+        SocketManager::get().setLoopback ( true );
+
+        TestSocket server ( 0, selectiveRepeat );
+        TestSocket client ( "127.0.0.1", server.socket->address.port, selectiveRepeat );
+
+        // Both sides start sending after 1 second
+        const uint64_t start = TimerManager::get().getNow() + 1000;
+
+        EventManager::get().start();
+
+        const uint64_t finished = max ( server.finished, client.finished );
+
+        printf ( "selectiveRepeat=%u; elapsed=%u ms; rto=%u ms\n", selectiveRepeat,
+                 ( unsigned ) ( finished - start ), ( unsigned ) client.gbn.getSendInterval() );
+
+        EXPECT_EQ ( 100, server.msgs.size() ) << "selectiveRepeat=" << selectiveRepeat;
+        EXPECT_EQ ( 100, client.msgs.size() ) << "selectiveRepeat=" << selectiveRepeat;
+
+        // The old fixed 50 ms interval took about 33 seconds without selective repeat, and 9 seconds with it.
+        // Random loss shouldn't back off far past the round trip time, so this should be no slower.
+        if ( done == 2 )
+        {
+            EXPECT_GT ( ( selectiveRepeat ? 11 : 40 ) * 1000u, finished - start ) << "selectiveRepeat=" << selectiveRepeat;
+        }
+
+        SocketManager::get().deinitialize();
+        TimerManager::get().deinitialize();
+    }
+}
+
 #endif // NOT RELEASE
@@ -0,0 +1,144 @@
+#ifndef RELEASE
+
+#include "InputRedundancy.hpp"
+
+#include <gtest/gtest.h>
+
+using namespace std;
+
+
+static PlayerInputs makeInputs ( uint32_t index, uint32_t frame )
+{
+    IndexedFrame indexedFrame = {{ frame, index }};
+    return PlayerInputs ( indexedFrame );
+}
+
+
+TEST ( InputRedundancy, LossReport )
+{
+    InputRedundancy redundancy;
+
+    // The first frame of a new transition index starts the count
+    redundancy.recvInputs ( makeInputs ( 1, 1 ) );
+
+    // Every 4th frame only gets one packet, the rest get two
+    uint32_t received = 0;
+
+    for ( uint32_t frame = 2; frame <= INPUT_LOSS_REPORT_FRAMES + 1; ++frame )
+    {
+        const uint32_t count = ( frame % 4 == 0 ? 1 : 2 );
+
+        for ( uint32_t i = 0; i < count; ++i )
+            redundancy.recvInputs ( makeInputs ( 1, frame ) );
+
+        received += count;
+
+        // The latest frame is only reported once the next one arrives, since its copies may still be in flight
+        EXPECT_TRUE ( redundancy.getLossReport().get() == 0 ) << frame;
+    }
+
+    // Old frames and other transition indexes aren't counted
+    redundancy.recvInputs ( makeInputs ( 1, 1 ) );
+    redundancy.recvInputs ( makeInputs ( 0, 10 ) );
+
+    redundancy.recvInputs ( makeInputs ( 1, INPUT_LOSS_REPORT_FRAMES + 2 ) );
+
+    MsgPtr msg = redundancy.getLossReport();
+
+    ASSERT_TRUE ( msg.get() != 0 );
+    ASSERT_EQ ( MsgType::InputLoss, msg->getMsgType() );
+
+    const InputLoss& report = msg->getAs<InputLoss>();
+
+    EXPECT_EQ ( 1u, report.index );
+    EXPECT_EQ ( 1u, report.startFrame );
+    EXPECT_EQ ( ( uint32_t ) INPUT_LOSS_REPORT_FRAMES, report.frames );
+    EXPECT_EQ ( received, report.received );
+
+    // The next report starts after the reported frames
+    EXPECT_TRUE ( redundancy.getLossReport().get() == 0 );
+}
+
+TEST ( InputRedundancy, AdaptCopies )
+{
+    InputRedundancy sender, receiver;
+
+    uint32_t frame = 0, packets = 0;
+
+    // Send each frame plus the current copies, dropping every other packet if lossy
+    const auto run = [&] ( uint32_t frames, bool lossy )
+    {
+        for ( uint32_t end = frame + frames; frame < end; )
+        {
+            const PlayerInputs inputs = makeInputs ( 0, ++frame );
+
+            for ( uint32_t i = 0; i <= sender.getCopies(); ++i )
+            {
+                sender.sendInputs ( inputs );
+
+                if ( ! lossy || ( packets++ % 2 ) )
+                    receiver.recvInputs ( inputs );
+            }
+
+            MsgPtr msg = receiver.getLossReport();
+
+            if ( msg )
+                sender.recvLossReport ( msg->getAs<InputLoss>() );
+        }
+    };
+
+    run ( 10 * INPUT_LOSS_REPORT_FRAMES, true );
+
+    // Half the packets are lost, so this uses as many copies as allowed
+    EXPECT_NEAR ( 0.5, sender.getLossRate(), 0.01 );
+    EXPECT_EQ ( DEFAULT_MAX_INPUT_COPIES, sender.getCopies() );
+
+    run ( 10 * INPUT_LOSS_REPORT_FRAMES, false );
+
+    // Once nothing is lost, the copies aren't needed anymore
+    EXPECT_NEAR ( 0.0, sender.getLossRate(), 0.01 );
+    EXPECT_EQ ( 0u, sender.getCopies() );
+
+    sender.setMaxCopies ( 1 );
+    run ( 10 * INPUT_LOSS_REPORT_FRAMES, true );
+
+    EXPECT_EQ ( 1u, sender.getCopies() );
+
+    sender.reset();
+
+    EXPECT_EQ ( 0u, sender.getCopies() );
+    EXPECT_EQ ( 1u, sender.getMaxCopies() );
+    EXPECT_EQ ( 0.0, sender.getLossRate() );
+}
+
+TEST ( InputRedundancy, CopiesChangedBeforeReport )
+{
+    InputRedundancy sender;
+
+    // Frames [1, 60] are sent once each, and only half arrive
+    for ( uint32_t frame = 1; frame <= INPUT_LOSS_REPORT_FRAMES; ++frame )
+        sender.sendInputs ( makeInputs ( 0, frame ) );
+
+    sender.recvLossReport ( InputLoss ( 0, 0, INPUT_LOSS_REPORT_FRAMES, INPUT_LOSS_REPORT_FRAMES / 2 ) );
+
+    EXPECT_NEAR ( 0.5, sender.getLossRate(), 0.001 );
+    EXPECT_EQ ( DEFAULT_MAX_INPUT_COPIES, sender.getCopies() );
+
+    // Frames [61, 120] were also sent once each before the copies changed, and all of them arrive.
+    // The report must be compared to what was sent for those frames, not to the current copies.
+    for ( uint32_t frame = INPUT_LOSS_REPORT_FRAMES + 1; frame <= 2 * INPUT_LOSS_REPORT_FRAMES; ++frame )
+        sender.sendInputs ( makeInputs ( 0, frame ) );
+
+    sender.recvLossReport ( InputLoss ( 0, INPUT_LOSS_REPORT_FRAMES, INPUT_LOSS_REPORT_FRAMES,
+                                        INPUT_LOSS_REPORT_FRAMES ) );
+
+    EXPECT_NEAR ( 0.25, sender.getLossRate(), 0.001 );
+
+    // Reports for frames that weren't sent, or for another transition index, are ignored
+    sender.recvLossReport ( InputLoss ( 0, 2 * INPUT_LOSS_REPORT_FRAMES, INPUT_LOSS_REPORT_FRAMES, 0 ) );
+    sender.recvLossReport ( InputLoss ( 1, 0, INPUT_LOSS_REPORT_FRAMES, 0 ) );
+
+    EXPECT_NEAR ( 0.25, sender.getLossRate(), 0.001 );
+}
+
+#endif // NOT RELEASE
@@ -0,0 +1,525 @@
+#ifndef RELEASE
+
+#include "Protocol.hpp"
+#include "Protocol.include.hpp"
+#include "Compression.hpp"
+#include "CompressionPolicy.hpp"
+#include "Test.hpp"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace std;
+
+
+#define NUM_BENCHMARK_ENCODES ( 1000 )
+
+#define NUM_BENCHMARK_HASHES ( 100000 )
+
+static const vector<HashType> hashTypes = { HashType::MD5, HashType::CRC32C, HashType::XXHash64 };
+
+
+// Allocation counters, only updated while the allocation hook is installed
+static size_t numAllocations = 0;
+static size_t numAllocatedBytes = 0;
+
+static void countAllocation ( size_t size )
+{
+    ++numAllocations;
+    numAllocatedBytes += size;
+}
+
+
+static MsgPtr createMsg ( MsgType type )
+{
+    MsgPtr msg;
+
+    switch ( type )
+    {
+#include "Protocol.switchdecode.hpp"
+
+        default:
+            break;
+    }
+
+    return msg;
+}
+
+struct EncodeStats
+{
+    size_t allocations = 0;
+    size_t allocatedBytes = 0;
+    double nanoseconds = 0;
+};
+
+template<typename F>
+static EncodeStats benchmarkEncode ( const MsgPtr& msg, F encode )
+{
+    // Warm up first so any reused buffers have reached their final size
+    msg->invalidate();
+    encode ( msg );
+
+    numAllocations = numAllocatedBytes = 0;
+    allocationHook = countAllocation;
+
+    const auto start = chrono::high_resolution_clock::now();
+
+    for ( size_t i = 0; i < NUM_BENCHMARK_ENCODES; ++i )
+    {
+        msg->invalidate();
+        encode ( msg );
+    }
+
+    const auto end = chrono::high_resolution_clock::now();
+
+    allocationHook = 0;
+
+    EncodeStats stats;
+    stats.allocations = numAllocations / NUM_BENCHMARK_ENCODES;
+    stats.allocatedBytes = numAllocatedBytes / NUM_BENCHMARK_ENCODES;
+    stats.nanoseconds = chrono::duration<double, nano> ( end - start ).count() / NUM_BENCHMARK_ENCODES;
+    return stats;
+}
+
+
+TEST ( Protocol, EncodeBuffer )
+{
+    CompressionPolicy::get().reset();
+
+    EncodeBuffer buffer;
+
+    for ( uint8_t i = uint8_t ( MsgType::FirstType ) + 1; i < uint8_t ( MsgType::LastType ); ++i )
+    {
+        const MsgType type = MsgType ( i );
+
+        // SocketShareData can't be encoded without socket info
+        if ( type == MsgType::SocketShareData )
+            continue;
+
+        // SharedSequence can't be decoded without a wrapped message
+        if ( type == MsgType::SharedSequence )
+            continue;
+
+        MsgPtr msg = createMsg ( type );
+
+        if ( ! msg )
+            continue;
+
+        // Encoding into a reused buffer must produce the same bytes
+        const string expected = Protocol::encode ( msg );
+        const string actual = Protocol::encode ( msg, buffer ).str();
+
+        EXPECT_EQ ( expected, actual ) << type;
+
+        size_t consumed;
+        MsgPtr decoded = Protocol::decode ( actual.data(), actual.size(), consumed );
+
+        ASSERT_TRUE ( decoded.get() != 0 ) << type;
+        EXPECT_EQ ( type, decoded->getMsgType() );
+        EXPECT_EQ ( actual.size(), consumed ) << type;
+
+        // Every hash type and encoding must decode, regardless of the cached hash type
+        for ( HashType hashType : hashTypes )
+        {
+            for ( bool compact : { false, true } )
+            {
+                const string bytes = Protocol::encode ( msg, buffer, hashType, compact ).str();
+
+                decoded = Protocol::decode ( bytes.data(), bytes.size(), consumed );
+
+                ASSERT_TRUE ( decoded.get() != 0 ) << type << " hashType=" << int ( hashType ) << " compact=" << compact;
+                EXPECT_EQ ( bytes.size(), consumed ) << type;
+
+                decoded->compressionLevel = msg->compressionLevel;
+                EXPECT_EQ ( Protocol::encode ( decoded, buffer, hashType, compact ).str(), bytes ) << type;
+
+                // A corrupted hash must fail the hash check
+                if ( msg->compressionLevel == 0 )
+                {
+                    string corrupt = bytes;
+                    corrupt.back() ^= 0x5A;
+                    EXPECT_FALSE ( Protocol::decode ( corrupt.data(), corrupt.size(), consumed ) ) << type;
+                }
+            }
+        }
+    }
+}
+
+TEST ( Protocol, CompactInputs )
+{
+    EncodeBuffer buffer;
+
+    IndexedFrame indexedFrame = {{ 0, 0 }};
+    indexedFrame.parts.index = 3;
+    indexedFrame.parts.frame = 1234;
+
+    // Held inputs should only take a few bytes
+    PlayerInputs *playerInputs = new PlayerInputs ( indexedFrame );
+    playerInputs->inputs.fill ( 0x1234 );
+
+    MsgPtr msg ( playerInputs );
+
+    const string full = Protocol::encode ( msg, buffer, HashType::CRC32C, false ).str();
+    const string compact = Protocol::encode ( msg, buffer, HashType::CRC32C, true ).str();
+
+    printf ( "PlayerInputs: full=%u bytes; compact=%u bytes\n", ( unsigned ) full.size(), ( unsigned ) compact.size() );
+
+    EXPECT_LE ( compact.size(), 2 + 5 + 3 + 2 + 4u );
+    EXPECT_LT ( compact.size(), full.size() );
+
+    // Mixed inputs must round trip exactly
+    BothInputs *bothInputs = new BothInputs ( indexedFrame );
+
+    for ( size_t i = 0; i < NUM_INPUTS; ++i )
+    {
+        bothInputs->inputs[0][i] = ( i < 10 ? 0 : ( i < 25 ? 0x8006 : 0xFFFF ) );
+        bothInputs->inputs[1][i] = uint16_t ( rand() );
+    }
+
+    msg.reset ( bothInputs );
+
+    const ByteSpan bytes = Protocol::encode ( msg, buffer, HashType::XXHash64, true );
+
+    size_t consumed;
+    MsgPtr decoded = Protocol::decode ( bytes.data, bytes.size, consumed );
+
+    ASSERT_TRUE ( decoded.get() != 0 );
+    ASSERT_EQ ( MsgType::BothInputs, decoded->getMsgType() );
+    EXPECT_EQ ( bytes.size, consumed );
+    EXPECT_EQ ( indexedFrame.value, decoded->getAs<BothInputs>().indexedFrame.value );
+    EXPECT_EQ ( bothInputs->inputs, decoded->getAs<BothInputs>().inputs );
+
+    // Runs that don't add up to the window size must fail to decode
+    for ( uint32_t extra : { NUM_INPUTS - 2u, uint32_t ( NUM_INPUTS ), 1000u } )
+    {
+        stringstream ss;
+        {
+            cereal::BinaryOutputArchive archive ( ss );
+            saveVarint ( archive, 0 );
+            saveVarint ( archive, 0 );
+            saveVarint ( archive, 0 );
+            saveVarint ( archive, extra );
+        }
+
+        const string invalid = string ( 1, char ( MsgType::PlayerInputs ) ) + char ( 0x40 ) + ss.str();
+
+        EXPECT_FALSE ( Protocol::decode ( invalid.data(), invalid.size(), consumed ) ) << extra;
+    }
+}
+
+TEST ( Protocol, HashTypes )
+{
+    const string check = "123456789";
+
+    // Standard check values
+    EXPECT_EQ ( 0xE3069283u, getCRC32C ( check.data(), check.size() ) );
+    EXPECT_EQ ( 0xEF46DB3751D8E999ull, getXXHash64 ( "", 0 ) );
+    EXPECT_EQ ( 0x44BC2CF5AD770999ull, getXXHash64 ( "abc", 3 ) );
+
+    // Exercise the bulk paths
+    string data ( 1000, 0 );
+    for ( size_t i = 0; i < data.size(); ++i )
+        data[i] = char ( i * 7 + 3 );
+
+    EXPECT_NE ( getXXHash64 ( &data[0], data.size() ), getXXHash64 ( &data[1], data.size() - 1 ) );
+    EXPECT_NE ( getCRC32C ( &data[0], data.size() ), getCRC32C ( &data[1], data.size() - 1 ) );
+
+    EXPECT_EQ ( 16, Protocol::getHashSize ( HashType::MD5 ) );
+    EXPECT_EQ ( 4, Protocol::getHashSize ( HashType::CRC32C ) );
+    EXPECT_EQ ( 8, Protocol::getHashSize ( HashType::XXHash64 ) );
+}
+
+TEST ( Protocol, HashBenchmark )
+{
+    static const vector<size_t> sizes = { 16, 64, 256, 1024 };
+
+    string data ( sizes.back(), 0 );
+    for ( size_t i = 0; i < data.size(); ++i )
+        data[i] = char ( rand() );
+
+    // The timings depend on the machine and its load, so only check that the timed functions hash correctly
+    const string check = "123456789";
+    char checkMd5[16];
+    getMD5 ( check.data(), check.size(), checkMd5 );
+
+    EXPECT_EQ ( string ( "\x25\xf9\xe7\x94\x32\x3b\x45\x38\x85\xf5\x18\x1f\x1b\x62\x4d\x0b", 16 ),
+                string ( checkMd5, 16 ) );
+    EXPECT_EQ ( 0xE3069283u, getCRC32C ( check.data(), check.size() ) );
+    EXPECT_EQ ( 0x44BC2CF5AD770999ull, getXXHash64 ( "abc", 3 ) );
+
+    printf ( "hardware CRC32C: %s\n", hasHardwareCRC32C() ? "yes" : "no" );
+    printf ( "%-10s %12s %12s %12s\n", "Bytes", "MD5 ns", "CRC32C ns", "XXHash64 ns" );
+
+    // Prevent the hashing from being optimized out
+    volatile uint64_t sink = 0;
+
+    for ( size_t size : sizes )
+    {
+        double ns[3];
+
+        for ( size_t i = 0; i < hashTypes.size(); ++i )
+        {
+            char md5[16];
+
+            const auto start = chrono::high_resolution_clock::now();
+
+            for ( size_t j = 0; j < NUM_BENCHMARK_HASHES; ++j )
+            {
+                data[0] = char ( j );
+
+                if ( hashTypes[i] == HashType::MD5 )
+                {
+                    getMD5 ( &data[0], size, md5 );
+                    sink += md5[0];
+                }
+                else if ( hashTypes[i] == HashType::CRC32C )
+                {
+                    sink += getCRC32C ( &data[0], size );
+                }
+                else
+                {
+                    sink += getXXHash64 ( &data[0], size );
+                }
+            }
+
+            const auto end = chrono::high_resolution_clock::now();
+
+            ns[i] = chrono::duration<double, nano> ( end - start ).count() / NUM_BENCHMARK_HASHES;
+        }
+
+        printf ( "%-10u %12.1f %12.1f %12.1f\n", ( unsigned ) size, ns[0], ns[1], ns[2] );
+    }
+}
+
+TEST ( Protocol, DecodeConcatenated )
+{
+    // Mix of uncompressed and compressed messages back to back in one buffer
+    const vector<string> strings = { "short", string ( 1000, 'x' ), "", string ( 500, 'y' ) + "z" };
+
+    string bytes;
+
+    for ( const string& str : strings )
+        bytes += Protocol::encode ( MsgPtr ( new TestMessage ( str ) ) );
+
+    size_t pos = 0;
+
+    for ( const string& str : strings )
+    {
+        size_t consumed;
+        MsgPtr msg = Protocol::decode ( &bytes[pos], bytes.size() - pos, consumed );
+
+        ASSERT_TRUE ( msg.get() != 0 );
+        ASSERT_EQ ( MsgType::TestMessage, msg->getMsgType() );
+        EXPECT_EQ ( str, msg->getAs<TestMessage>().str );
+        EXPECT_EQ ( Protocol::encode ( msg ).size(), consumed );
+
+        pos += consumed;
+    }
+
+    EXPECT_EQ ( bytes.size(), pos );
+
+    // Truncated messages must fail without consuming anything
+    for ( size_t len = 0; len + 1 < bytes.size(); len += 7 )
+    {
+        size_t consumed = 1;
+        MsgPtr msg = Protocol::decode ( &bytes[0], len, consumed );
+
+        if ( ! msg )
+        {
+            EXPECT_EQ ( 0, consumed );
+        }
+    }
+}
+
+TEST ( Protocol, ProtocolLevel )
+{
+    // The flags only advertise up to ProtocolLevelExtended, without touching the other flags
+    ClientMode mode ( ClientMode::Host, ClientMode::Training | ClientMode::VersusCPU );
+
+    for ( uint8_t level : { 0, 1, 6, 7, 8, 100, 255 } )
+    {
+        mode.setProtocolLevel ( level );
+
+        EXPECT_EQ ( min<uint8_t> ( level, ClientMode::ProtocolLevelExtended ), mode.getProtocolLevel() );
+        EXPECT_EQ ( ClientMode::Training | ClientMode::VersusCPU, mode.flags & ~ClientMode::ProtocolLevelMask );
+    }
+
+    // VersionConfig keeps the same layout, so older versions can still decode it
+    VersionConfig versionConfig ( ClientMode ( ClientMode::Client, 0 ) );
+    versionConfig.mode.setProtocolLevel ( 200 );
+
+    string bytes = Protocol::encode ( versionConfig );
+    size_t consumed;
+    MsgPtr msg = Protocol::decode ( &bytes[0], bytes.size(), consumed );
+
+    ASSERT_TRUE ( msg.get() != 0 );
+    EXPECT_EQ ( bytes.size(), consumed );
+    EXPECT_EQ ( ClientMode::ProtocolLevelExtended, msg->getAs<VersionConfig>().mode.getProtocolLevel() );
+
+    // The full level goes in its own byte
+    bytes = Protocol::encode ( MsgPtr ( new ProtocolLevel ( 200 ) ) );
+    msg = Protocol::decode ( &bytes[0], bytes.size(), consumed );
+
+    ASSERT_TRUE ( msg.get() != 0 );
+    ASSERT_EQ ( MsgType::ProtocolLevel, msg->getMsgType() );
+    EXPECT_EQ ( 200, msg->getAs<ProtocolLevel>().level );
+}
+
+TEST ( Protocol, AckSequence )
+{
+    CompressionPolicy::get().reset();
+
+    EncodeBuffer buffer;
+
+    // Both uncompressed and compressed messages
+    for ( const string& str : { string ( "short" ), string ( 1000, 'x' ) } )
+    {
+        for ( uint32_t ackSequence : { 0u, 1u, 0x12345678u } )
+        {
+            MsgPtr msg ( new TestMessage ( str ) );
+
+            const string plain = Protocol::encode ( msg );
+            const string bytes = Protocol::encode ( msg, buffer, HashType::MD5, false, ackSequence ).str();
+
+            // The ACK sequence only adds to the header, but it also changes the hash, which compresses differently
+            if ( str.size() < 100 )
+            {
+                EXPECT_EQ ( plain.size() + ( ackSequence ? 4 : 0 ), bytes.size() );
+            }
+            else
+            {
+                EXPECT_NEAR ( plain.size() + ( ackSequence ? 4 : 0 ), bytes.size(), 4 );
+            }
+
+            size_t consumed;
+            MsgPtr decoded = Protocol::decode ( &bytes[0], bytes.size(), consumed );
+
+            ASSERT_TRUE ( decoded.get() != 0 );
+            EXPECT_EQ ( bytes.size(), consumed );
+            EXPECT_EQ ( str, decoded->getAs<TestMessage>().str );
+            EXPECT_EQ ( ackSequence, decoded->ackSequence );
+
+            if ( ! ackSequence )
+                continue;
+
+            // The ACK sequence is right after the 2 byte header, and a corrupted one must fail the hash check
+            for ( size_t i = 2; i < 6; ++i )
+            {
+                string corrupted = bytes;
+                corrupted[i] ^= 1;
+                EXPECT_TRUE ( Protocol::decode ( &corrupted[0], corrupted.size(), consumed ).get() == 0 ) << i;
+            }
+
+            // Re-encoding the decoded message reuses its hash, which must not include the old ACK sequence
+            const string reencoded = Protocol::encode ( decoded, buffer, HashType::MD5, false, ackSequence + 1 ).str();
+            decoded = Protocol::decode ( &reencoded[0], reencoded.size(), consumed );
+
+            ASSERT_TRUE ( decoded.get() != 0 );
+            EXPECT_EQ ( ackSequence + 1, decoded->ackSequence );
+        }
+    }
+}
+
+TEST ( Protocol, CompressionPolicy )
+{
+    CompressionPolicy& policy = CompressionPolicy::get();
+    policy.reset();
+
+    EncodeBuffer buffer;
+
+    // Random data never compresses, so compression should get disabled
+    for ( size_t i = 0; i < 100; ++i )
+    {
+        string str ( 200, 0 );
+        for ( char& c : str )
+            c = char ( rand() );
+
+        MsgPtr msg ( new TestMessage ( str ) );
+        Protocol::encode ( msg, buffer );
+
+        size_t consumed;
+        MsgPtr decoded = Protocol::decode ( buffer.bytes().data, buffer.bytes().size, consumed );
+
+        ASSERT_TRUE ( decoded.get() != 0 );
+        EXPECT_EQ ( str, decoded->getAs<TestMessage>().str );
+    }
+
+    EXPECT_FALSE ( policy.isEnabled ( MsgType::TestMessage ) );
+    EXPECT_LT ( policy.getStats ( MsgType::TestMessage ).attempts, 100u );
+    EXPECT_EQ ( 0u, policy.getStats ( MsgType::TestMessage ).wins );
+    EXPECT_GT ( policy.getStats ( MsgType::TestMessage ).skipped, 0u );
+
+    policy.reset();
+
+    // Repetitive data always compresses, so compression should stay enabled
+    for ( size_t i = 0; i < 100; ++i )
+    {
+        MsgPtr msg ( new TestMessage ( string ( 200, 'a' + ( i % 26 ) ) ) );
+        Protocol::encode ( msg, buffer );
+
+        EXPECT_NE ( 0, msg->compressionLevel );
+    }
+
+    EXPECT_TRUE ( policy.isEnabled ( MsgType::TestMessage ) );
+    EXPECT_EQ ( 100u, policy.getStats ( MsgType::TestMessage ).attempts );
+    EXPECT_EQ ( 100u, policy.getStats ( MsgType::TestMessage ).wins );
+    EXPECT_GT ( policy.getStats ( MsgType::TestMessage ).bytesSaved, 100u * 100 );
+
+    // Small messages are skipped entirely
+    MsgPtr msg ( new TestMessage ( "short" ) );
+    Protocol::encode ( msg, buffer );
+
+    EXPECT_EQ ( 100u, policy.getStats ( MsgType::TestMessage ).attempts );
+    EXPECT_EQ ( 1u, policy.getStats ( MsgType::TestMessage ).skipped );
+}
+
+TEST ( Protocol, EncodeBenchmark )
+{
+    CompressionPolicy::get().reset();
+
+    EncodeBuffer buffer;
+
+    printf ( "%-24s %8s %16s %16s %12s %12s\n",
+             "MsgType", "Bytes", "String allocs", "Buffer allocs", "String ns", "Buffer ns" );
+
+    for ( uint8_t i = uint8_t ( MsgType::FirstType ) + 1; i < uint8_t ( MsgType::LastType ); ++i )
+    {
+        const MsgType type = MsgType ( i );
+
+        if ( type == MsgType::SocketShareData )
+            continue;
+
+        MsgPtr msg = createMsg ( type );
+
+        if ( ! msg )
+            continue;
+
+        const size_t size = Protocol::encode ( msg, buffer ).size;
+
+        const EncodeStats str = benchmarkEncode ( msg, [] ( const MsgPtr & msg ) { Protocol::encode ( msg ); } );
+        const EncodeStats buf = benchmarkEncode ( msg, [&] ( const MsgPtr & msg ) { Protocol::encode ( msg, buffer ); } );
+
+        stringstream ss;
+        ss << type;
+
+        printf ( "%-24s %8u %7u (%6u B) %7u (%6u B) %12.0f %12.0f\n", ss.str().c_str(), ( unsigned ) size,
+                 ( unsigned ) str.allocations, ( unsigned ) str.allocatedBytes,
+                 ( unsigned ) buf.allocations, ( unsigned ) buf.allocatedBytes,
+                 str.nanoseconds, buf.nanoseconds );
+
+        // Messages with flat fields must not allocate at all when encoding into a reused buffer,
+        // allocations are only counted if the test runner supports it
+        const bool isFlat = ( type == MsgType::PlayerInputs || type == MsgType::BothInputs
+                              || type == MsgType::AckSequence );
+
+        if ( canHookAllocations && isFlat )
+        {
+            EXPECT_EQ ( 0u, buf.allocations ) << type;
+        }
+    }
+}
+
+#endif // NOT RELEASE
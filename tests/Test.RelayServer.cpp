@@ -0,0 +1,907 @@
+#ifndef RELEASE
+
+#include "Test.Socket.hpp"
+#include "RelayServer.hpp"
+#include "RelayProbe.hpp"
+#include "SmartSocket.hpp"
+#include "TunnelProtocol.hpp"
+#include "TcpSocket.hpp"
+#include "UdpSocket.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+
+#define RELAY_TIMEOUT ( 10000 )
+
+
+// Host or client talking the tunnel protocol to the relay server
+struct RelayPeer : public Socket::Owner
+{
+    IpAddrPort relayAddress;
+
+    SocketPtr tcp, udp;
+
+    // TypedHostingPort or TypedConnectionAddress
+    string request;
+
+    string buffer;
+
+    uint32_t matchId = 0;
+
+    IpAddrPort tunAddress;
+
+    bool disconnected = false;
+
+    // Send a datagram through the tunnel once it is known
+    bool ping = false;
+
+    size_t pings = 0;
+
+    // Decremented when this gets its TunInfo or a ping
+    size_t *remaining = 0;
+
+    RelayPeer ( const IpAddrPort& relayAddress, const string& request )
+        : relayAddress ( relayAddress ), request ( request )
+    {
+        tcp = TcpSocket::connect ( this, relayAddress, true ); // Raw socket
+        tcp->setReadBufferSize ( 256 );
+    }
+
+    void socketAccepted ( Socket *socket ) override {}
+    void socketRead ( Socket *socket, const MsgPtr& msg, const IpAddrPort& address ) override {}
+
+    void socketConnected ( Socket *socket ) override
+    {
+        tcp->send ( &request[0], request.size() );
+    }
+
+    void socketDisconnected ( Socket *socket ) override
+    {
+        disconnected = true;
+    }
+
+    void socketRead ( Socket *socket, const char *bytes, size_t len, const IpAddrPort& address ) override
+    {
+        if ( socket == udp.get() )
+        {
+            ++pings;
+            done();
+            return;
+        }
+
+        buffer.append ( bytes, len );
+
+        for ( ;; )
+        {
+            size_t consumed;
+
+            const uint32_t id = MatchInfo::decode ( &buffer[0], buffer.size(), consumed );
+
+            if ( id )
+            {
+                buffer.erase ( 0, consumed );
+                gotMatch ( id );
+                continue;
+            }
+
+            const TunInfo tun = TunInfo::decode ( &buffer[0], buffer.size(), consumed );
+
+            if ( tun.matchId )
+            {
+                buffer.erase ( 0, consumed );
+                gotTunInfo ( tun );
+                continue;
+            }
+
+            break;
+        }
+    }
+
+    void gotMatch ( uint32_t id )
+    {
+        matchId = id;
+
+        const UdpData data ( isClient(), matchId );
+
+        udp = UdpSocket::bind ( this, relayAddress, true ); // Raw socket
+        udp->setReadBufferSize ( 256 );
+        udp->send ( data.buffer, sizeof ( data.buffer ) );
+    }
+
+    void gotTunInfo ( const TunInfo& tun )
+    {
+        EXPECT_EQ ( matchId, tun.matchId );
+
+        tunAddress = tun.address;
+
+        if ( ping )
+            udp->send ( "ping", 4, tunAddress );
+
+        done();
+    }
+
+    void done()
+    {
+        if ( remaining && --*remaining == 0 )
+            EventManager::get().stop();
+    }
+
+    bool isClient() const { return ( request.size() != 3 ); }
+};
+
+typedef shared_ptr<RelayPeer> RelayPeerPtr;
+
+struct RelayTimeout : public Timer::Owner
+{
+    Timer timer;
+
+    void timerExpired ( Timer *timer ) override
+    {
+        LOG ( "Stopping because of timeout" );
+        EventManager::get().stop();
+    }
+
+    RelayTimeout() : timer ( this ) { timer.start ( RELAY_TIMEOUT ); }
+};
+
+
+TEST ( RelayServer, Tunnel )
+{
+    // UDP goes over the loopback network, so the UdpData can't be lost
+    TimerManager::get().initialize();
+    SocketManager::get().initialize();
+    SocketManager::get().setLoopback ( true );
+
+    RelayServer relay ( 0 );
+    const IpAddrPort relayAddress ( "127.0.0.1", relay.getPort() );
+
+    // Both TunInfos and both pings
+    size_t remaining = 4;
+
+    RelayPeer host ( relayAddress, TypedHostingPort ( 'U', 1234 ).encode() );
+
+    // Wait for the host to be registered
+    EventManager::get().startPolling();
+
+    for ( int i = 0; i < 100 && relay.getHostCount() == 0; ++i )
+        EventManager::get().poll ( 10 );
+
+    ASSERT_EQ ( 1u, relay.getHostCount() );
+
+    RelayPeer client ( relayAddress, "U127.0.0.1:1234" );
+    RelayPeer unknown ( relayAddress, "U127.0.0.1:4321" );
+
+    host.remaining = client.remaining = &remaining;
+    host.ping = client.ping = true;
+
+    RelayTimeout timer;
+
+    EventManager::get().start();
+
+    // Each side is told the other side's UDP hole, so they can reach each other directly
+    EXPECT_NE ( 0u, host.matchId );
+    EXPECT_EQ ( host.matchId, client.matchId );
+    EXPECT_EQ ( 1u, host.pings );
+    EXPECT_EQ ( 1u, client.pings );
+
+    // Clients for a host that doesn't exist are disconnected
+    EXPECT_EQ ( 0u, unknown.matchId );
+    EXPECT_TRUE ( unknown.disconnected );
+
+    // The match is done once both sides have their TunInfo
+    EXPECT_EQ ( 0u, relay.getMatchCount() );
+    EXPECT_EQ ( 1u, relay.getStats().matched );
+    EXPECT_EQ ( 1u, relay.getStats().rejected );
+    EXPECT_EQ ( 2u, relay.getStats().tunneled );
+
+    // The host is forgotten when it disconnects
+    host.tcp.reset();
+
+    EventManager::get().startPolling();
+
+    for ( int i = 0; i < 100 && relay.getHostCount() != 0; ++i )
+        EventManager::get().poll ( 10 );
+
+    EXPECT_EQ ( 0u, relay.getHostCount() );
+    EXPECT_EQ ( 1u, relay.getConnectionCount() );
+
+    SocketManager::get().deinitialize();
+    TimerManager::get().deinitialize();
+}
+
+TEST ( RelayServer, LoadBenchmark )
+{
+    // Each pair of host and client uses 4 TCP sockets, including the relay's side
+#ifdef _WIN32
+    // The select backend only handles FD_SETSIZE sockets
+    static const vector<size_t> counts = { 4, 12 };
+#else
+    static const vector<size_t> counts = { 16, 256, 2048 };
+
+    rlimit limit;
+    getrlimit ( RLIMIT_NOFILE, &limit );
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit ( RLIMIT_NOFILE, &limit );
+    getrlimit ( RLIMIT_NOFILE, &limit );
+#endif
+
+    struct TestDriver : public Timer::Owner
+    {
+        RelayServer& relay;
+        const size_t count;
+        Timer timer;
+        uint64_t end = 0;
+
+        void timerExpired ( Timer *timer ) override
+        {
+            if ( relay.getHostCount() == count || TimerManager::get().getNow() >= end )
+            {
+                EventManager::get().stop();
+                return;
+            }
+
+            timer->start ( 1 );
+        }
+
+        TestDriver ( RelayServer& relay, size_t count ) : relay ( relay ), count ( count ), timer ( this )
+        {
+            end = TimerManager::get().getNow ( true ) + RELAY_TIMEOUT;
+            timer.start ( 1 );
+        }
+    };
+
+    // UDP goes over the loopback network, so only the relay's own work and TCP are measured
+    TimerManager::get().initialize();
+    SocketManager::get().initialize();
+    SocketManager::get().setLoopback ( true );
+
+    printf ( "backend: %s\n", SocketManager::get().getBackendName() );
+    printf ( "%-10s %12s %12s\n", "Pairs", "Host ms", "Match ms" );
+
+    for ( size_t count : counts )
+    {
+#ifndef _WIN32
+        if ( 4 * count + 64 > limit.rlim_cur )
+        {
+            printf ( "%-10u skipped, the fd limit is %u\n", ( unsigned ) count, ( unsigned ) limit.rlim_cur );
+            continue;
+        }
+#endif
+
+        RelayServer relay ( 0 );
+        const IpAddrPort relayAddress ( "127.0.0.1", relay.getPort() );
+
+        vector<RelayPeerPtr> hosts, clients;
+        size_t remaining = 2 * count;
+
+        const auto start = chrono::steady_clock::now();
+
+        for ( size_t i = 0; i < count; ++i )
+        {
+            hosts.push_back ( RelayPeerPtr ( new RelayPeer ( relayAddress,
+                                             TypedHostingPort ( 'U', 10000 + i ).encode() ) ) );
+            hosts.back()->remaining = &remaining;
+        }
+
+        {
+            TestDriver driver ( relay, count );
+            EventManager::get().start();
+        }
+
+        ASSERT_EQ ( count, relay.getHostCount() );
+
+        const auto hosted = chrono::steady_clock::now();
+
+        for ( size_t i = 0; i < count; ++i )
+        {
+            clients.push_back ( RelayPeerPtr ( new RelayPeer ( relayAddress,
+                                               format ( "U127.0.0.1:%u", 10000 + i ) ) ) );
+            clients.back()->remaining = &remaining;
+        }
+
+        {
+            RelayTimeout timer;
+            EventManager::get().start();
+        }
+
+        const auto end = chrono::steady_clock::now();
+
+        printf ( "%-10u %12.1f %12.1f\n", ( unsigned ) count,
+                 chrono::duration<double, milli> ( hosted - start ).count(),
+                 chrono::duration<double, milli> ( end - hosted ).count() );
+
+        EXPECT_EQ ( 0u, remaining );
+        EXPECT_EQ ( count, relay.getStats().matched );
+        EXPECT_EQ ( 2 * count, relay.getStats().tunneled );
+        EXPECT_EQ ( 0u, relay.getMatchCount() );
+
+        for ( size_t i = 0; i < count; ++i )
+        {
+            EXPECT_EQ ( hosts[i]->matchId, clients[i]->matchId );
+            EXPECT_FALSE ( hosts[i]->tunAddress.empty() );
+            EXPECT_NE ( hosts[i]->tunAddress, clients[i]->tunAddress );
+        }
+
+        clients.clear();
+        hosts.clear();
+    }
+
+    SocketManager::get().deinitialize();
+    TimerManager::get().deinitialize();
+}
+
+TEST ( RelayServer, Forward )
+{
+    if ( ! RelayForwarder::isSupported() )
+        return;
+
+    // The forwarder reads its own sockets, so UDP goes over the real network
+    TimerManager::get().initialize();
+    SocketManager::get().initialize();
+
+    RelayServer relay ( 0 );
+    relay.enableForwarding ( "127.0.0.1", 2, 500 );
+
+    const IpAddrPort relayAddress ( "127.0.0.1", relay.getPort() );
+
+    // Both TunInfos
+    size_t remaining = 2;
+
+    RelayPeer host ( relayAddress, TypedHostingPort ( 'U', 1234 ).encode() );
+
+    EventManager::get().startPolling();
+
+    for ( int i = 0; i < 100 && relay.getHostCount() == 0; ++i )
+        EventManager::get().poll ( 10 );
+
+    ASSERT_EQ ( 1u, relay.getHostCount() );
+
+    // Servers that don't forward reject clients that ask for it
+    RelayServer plainRelay ( 0 );
+    RelayPeer rejected ( IpAddrPort ( "127.0.0.1", plainRelay.getPort() ), "u127.0.0.1:1234" );
+
+    RelayPeer client ( relayAddress, "u127.0.0.1:1234" );
+
+    host.remaining = client.remaining = &remaining;
+
+    {
+        RelayTimeout timer;
+        EventManager::get().start();
+    }
+
+    EXPECT_TRUE ( rejected.disconnected );
+    EXPECT_EQ ( 1u, plainRelay.getStats().rejected );
+
+    // Each side is told its own relay port instead of the other side's UDP hole
+    ASSERT_NE ( 0u, host.matchId );
+    EXPECT_EQ ( host.matchId, client.matchId );
+    EXPECT_EQ ( "127.0.0.1", host.tunAddress.addr );
+    EXPECT_EQ ( "127.0.0.1", client.tunAddress.addr );
+    EXPECT_NE ( host.tunAddress.port, client.tunAddress.port );
+    EXPECT_EQ ( 1u, relay.getStats().forwarded );
+    EXPECT_EQ ( 1u, relay.getForwarder()->getMatchCount() );
+
+    host.remaining = client.remaining = 0;
+
+    // Datagrams are dropped until both sides are latched, so keep sending until both sides got one
+    EventManager::get().startPolling();
+
+    for ( int i = 0; i < 100 && ( host.pings == 0 || client.pings == 0 ); ++i )
+    {
+        host.udp->send ( "ping", 4, host.tunAddress );
+        client.udp->send ( "ping", 4, client.tunAddress );
+        EventManager::get().poll ( 10 );
+    }
+
+    EXPECT_NE ( 0u, host.pings );
+    EXPECT_NE ( 0u, client.pings );
+
+    RelayForwarder::Counters counters;
+
+    ASSERT_TRUE ( relay.getForwarder()->getCounters ( host.matchId, counters ) );
+    EXPECT_EQ ( host.pings, counters.packets[RelayForwarder::Client] );
+    EXPECT_EQ ( client.pings, counters.packets[RelayForwarder::Host] );
+    EXPECT_EQ ( 4 * host.pings, counters.bytes[RelayForwarder::Client] );
+    EXPECT_EQ ( 4 * client.pings, counters.bytes[RelayForwarder::Host] );
+
+    // The match is removed after it's idle
+    for ( int i = 0; i < 200 && relay.getForwarder()->getMatchCount() != 0; ++i )
+        EventManager::get().poll ( 10 );
+
+    EXPECT_EQ ( 0u, relay.getForwarder()->getMatchCount() );
+    EXPECT_FALSE ( relay.getForwarder()->getCounters ( host.matchId, counters ) );
+
+    SocketManager::get().deinitialize();
+    TimerManager::get().deinitialize();
+}
+
+struct SmartSocketOwner : public SmartSocket::Owner
+{
+    SocketPtr host, client, accepted;
+    size_t switched = 0;
+
+    void smartSocketSwitchedToUDP ( SmartSocket *smartSocket ) override { ++switched; }
+
+    void socketAccepted ( Socket *serverSocket ) override
+    {
+        accepted = serverSocket->accept ( this );
+        check();
+    }
+
+    void socketConnected ( Socket *socket ) override { check(); }
+    void socketDisconnected ( Socket *socket ) override { EventManager::get().stop(); }
+    void socketRead ( Socket *socket, const MsgPtr& msg, const IpAddrPort& address ) override {}
+
+    void check()
+    {
+        if ( accepted && client && client->isConnected() )
+            EventManager::get().stop();
+    }
+};
+
+// Connect a SmartSocket client to a host, racing the UDP tunnel through one relay server.
+// If the host's port is already taken, the host can only be reached over the tunnel.
+static void testRace ( uint64_t stagger, bool isDirectBlocked )
+{
+    TimerManager::get().initialize();
+    SocketManager::get().initialize();
+    SocketManager::get().setLoopback ( true );
+
+    RelayProbe::clearCache();
+
+    RelayServer relay ( 0 );
+
+    const vector<IpAddrPort> defaultRelays = SmartSocket::getRelayServers();
+    SmartSocket::setRelayServers ( { IpAddrPort ( "127.0.0.1", relay.getPort() ) } );
+
+    const uint64_t defaultStagger = SmartSocket::getRaceStagger();
+    SmartSocket::setRaceStagger ( stagger );
+
+    SmartSocketOwner owner;
+    SocketPtr blocker;
+    uint16_t port = 0;
+
+    // A raw socket never replies to the UDP connect
+    if ( isDirectBlocked )
+    {
+        blocker = UdpSocket::bind ( &owner, 0, true );
+        port = blocker->address.port;
+    }
+
+    owner.host = SmartSocket::listenUDP ( &owner, port );
+
+    // Wait for the host to register
+    EventManager::get().startPolling();
+
+    for ( int i = 0; i < 300 && relay.getHostCount() == 0; ++i )
+        EventManager::get().poll ( 10 );
+
+    ASSERT_EQ ( 1u, relay.getHostCount() );
+
+    const uint64_t pinged = relay.getStats().pinged;
+
+    owner.client = SmartSocket::connectUDP ( &owner, IpAddrPort ( "127.0.0.1", owner.host->address.port ) );
+
+    {
+        RelayTimeout timer;
+        EventManager::get().start();
+    }
+
+    ASSERT_TRUE ( owner.client->isConnected() );
+    EXPECT_TRUE ( owner.accepted.get() != 0 );
+
+    // The tunnel connects long before the direct socket would time out
+    EXPECT_EQ ( isDirectBlocked, owner.client->getAsSmart().isTunnel() );
+    EXPECT_LT ( owner.client->getAsSmart().getConnectTime(), ( uint64_t ) DEFAULT_CONNECT_TIMEOUT );
+
+    // Racing the tunnel isn't a switch, the direct connection never failed
+    EXPECT_EQ ( 0u, owner.switched );
+
+    // The direct socket connects before the tunnel starts racing
+    if ( ! isDirectBlocked && stagger > 0 )
+    {
+        EXPECT_EQ ( pinged, relay.getStats().pinged );
+    }
+
+    if ( isDirectBlocked )
+    {
+        EXPECT_EQ ( 1u, relay.getStats().matched );
+    }
+
+    owner.accepted.reset();
+    owner.client.reset();
+    owner.host.reset();
+    blocker.reset();
+
+    SmartSocket::setRaceStagger ( defaultStagger );
+    SmartSocket::setRelayServers ( defaultRelays );
+    RelayProbe::clearCache();
+
+    SocketManager::get().deinitialize();
+    TimerManager::get().deinitialize();
+}
+
+TEST ( SmartSocket, RaceDirect )
+{
+    testRace ( DEFAULT_RACE_STAGGER, false );
+}
+
+TEST ( SmartSocket, RaceDirectNoStagger )
+{
+    testRace ( 0, false );
+}
+
+TEST ( SmartSocket, RaceTunnel )
+{
+    testRace ( DEFAULT_RACE_STAGGER, true );
+}
+
+TEST ( RelayProbe, Rank )
+{
+    vector<RelayProbe::Result> results ( 5 );
+
+    const uint32_t rtts[5][2] =
+    {
+        { 10, 100 },                    // Close to the client, far from the host
+        { UNKNOWN_RTT, UNKNOWN_RTT },   // Didn't reply
+        { 40, 40 },                     // Lowest combined latency
+        { 5, UNKNOWN_RTT },             // Doesn't know the host
+        { 60, 60 },
+    };
+
+    for ( size_t i = 0; i < results.size(); ++i )
+    {
+        results[i].address = IpAddrPort ( "127.0.0.1", 1000 + i );
+        results[i].rtt = rtts[i][0];
+        results[i].hostRtt = rtts[i][1];
+    }
+
+    const vector<IpAddrPort> ranked = RelayProbe::rank ( results );
+
+    ASSERT_EQ ( 5u, ranked.size() );
+    EXPECT_EQ ( 1002, ranked[0].port );
+    EXPECT_EQ ( 1000, ranked[1].port );
+    EXPECT_EQ ( 1004, ranked[2].port );
+    EXPECT_EQ ( 1003, ranked[3].port );
+    EXPECT_EQ ( 1001, ranked[4].port );
+}
+
+TEST ( RelayProbe, MultiRelay )
+{
+    // UDP goes over the loopback network, where each relay delays its replies
+    TimerManager::get().initialize();
+    SocketManager::get().initialize();
+    SocketManager::get().setLoopback ( true );
+
+    RelayProbe::clearCache();
+
+    static const vector<double> delays = { 80, 10, 40 };
+
+    vector<shared_ptr<RelayServer>> relays;
+    vector<IpAddrPort> relayAddresses;
+
+    for ( double delay : delays )
+    {
+        LinkConfig config;
+        config.delay = delay;
+
+        relays.push_back ( shared_ptr<RelayServer> ( new RelayServer ( 0 ) ) );
+        relays.back()->setLinkEmulator ( config );
+
+        relayAddresses.push_back ( IpAddrPort ( "127.0.0.1", relays.back()->getPort() ) );
+    }
+
+    // A relay that doesn't exist is tried last
+    relayAddresses.insert ( relayAddresses.begin(), IpAddrPort ( "127.0.0.1", 1 ) );
+
+    const vector<IpAddrPort> defaultRelays = SmartSocket::getRelayServers();
+    SmartSocket::setRelayServers ( relayAddresses );
+
+    SmartSocketOwner owner;
+    owner.host = SmartSocket::listenUDP ( &owner, 0 );
+
+    // Wait for the host to probe and register on every relay
+    EventManager::get().startPolling();
+
+    for ( int i = 0; i < 300; ++i )
+    {
+        size_t registered = 0;
+
+        for ( const auto& relay : relays )
+            registered += relay->getHostCount();
+
+        if ( registered == relays.size() )
+            break;
+
+        EventManager::get().poll ( 10 );
+    }
+
+    for ( size_t i = 0; i < relays.size(); ++i )
+        ASSERT_EQ ( 1u, relays[i]->getHostCount() ) << "relay " << i;
+
+    uint32_t rtt = 0;
+    EXPECT_FALSE ( RelayProbe::getCachedRtt ( relayAddresses[0], rtt ) && rtt != UNKNOWN_RTT );
+    EXPECT_TRUE ( RelayProbe::getCachedRtt ( relayAddresses[2], rtt ) );
+    EXPECT_GE ( rtt, 10u );
+
+    // The client goes straight to the tunnel, and picks the relay with the lowest combined latency
+    owner.client = SmartSocket::connectUDP ( &owner, IpAddrPort ( "127.0.0.1", owner.host->address.port ), true );
+
+    {
+        RelayTimeout timer;
+        EventManager::get().start();
+    }
+
+    ASSERT_TRUE ( owner.client->isConnected() );
+    EXPECT_TRUE ( owner.accepted.get() != 0 );
+
+    EXPECT_EQ ( 0u, relays[0]->getStats().matched );
+    EXPECT_EQ ( 1u, relays[1]->getStats().matched );
+    EXPECT_EQ ( 0u, relays[2]->getStats().matched );
+
+    // Every relay was asked about the host
+    for ( const auto& relay : relays )
+        EXPECT_LE ( 2u, relay->getStats().pinged );
+
+    owner.accepted.reset();
+    owner.client.reset();
+    owner.host.reset();
+
+    SmartSocket::setRelayServers ( defaultRelays );
+    RelayProbe::clearCache();
+
+    SocketManager::get().deinitialize();
+    TimerManager::get().deinitialize();
+}
+
+struct RelayProbeOwner : public RelayProbe::Owner
+{
+    size_t done = 0;
+
+    void relayProbeDone ( RelayProbe *relayProbe ) override
+    {
+        ++done;
+        EventManager::get().stop();
+    }
+};
+
+TEST ( RelayProbe, Complete )
+{
+    TimerManager::get().initialize();
+    SocketManager::get().initialize();
+    SocketManager::get().setLoopback ( true );
+
+    RelayProbe::clearCache();
+
+    // A relay that doesn't exist, so it doesn't reply before the timeout
+    const vector<IpAddrPort> relays = { IpAddrPort ( "127.0.0.1", 1 ) };
+
+    for ( const vector<IpAddrPort>& list : { vector<IpAddrPort>(), relays, relays } )
+    {
+        // The second time the relay is cached as unreachable, so there is nothing to wait for
+        const bool cached = RelayProbe::isCached ( list );
+
+        RelayProbeOwner owner;
+        RelayProbe probe ( &owner, list, "", 100 );
+
+        // The owner is never called back from the constructor
+        EXPECT_EQ ( 0u, owner.done );
+
+        const uint64_t start = TimerManager::get().getNow();
+
+        {
+            RelayTimeout timer;
+            EventManager::get().start();
+        }
+
+        EXPECT_EQ ( 1u, owner.done );
+        EXPECT_TRUE ( probe.isDone() );
+
+        if ( cached )
+        {
+            EXPECT_GT ( 100u, TimerManager::get().getNow() - start );
+        }
+    }
+
+    uint32_t rtt = 0;
+    EXPECT_TRUE ( RelayProbe::getCachedRtt ( relays[0], rtt ) );
+    EXPECT_EQ ( UNKNOWN_RTT, rtt );
+
+    RelayProbe::clearCache();
+
+    SocketManager::get().deinitialize();
+    TimerManager::get().deinitialize();
+}
+
+TEST ( RelayProbe, HostName )
+{
+    TimerManager::get().initialize();
+    SocketManager::get().initialize();
+    SocketManager::get().setLoopback ( true );
+
+    RelayProbe::clearCache();
+
+    RelayServer relay ( 0 );
+
+    // Replies come from the numeric address, they still count for the relay given by name
+    const vector<IpAddrPort> relays = { IpAddrPort ( "localhost", relay.getPort() ) };
+
+    RelayProbeOwner owner;
+    RelayProbe probe ( &owner, relays );
+
+    {
+        RelayTimeout timer;
+        EventManager::get().start();
+    }
+
+    ASSERT_EQ ( 1u, owner.done );
+    ASSERT_EQ ( 1u, probe.getResults().size() );
+    EXPECT_EQ ( relays[0], probe.getResults()[0].address );
+    EXPECT_NE ( UNKNOWN_RTT, probe.getResults()[0].rtt );
+
+    uint32_t rtt = UNKNOWN_RTT;
+    EXPECT_TRUE ( RelayProbe::getCachedRtt ( relays[0], rtt ) );
+    EXPECT_NE ( UNKNOWN_RTT, rtt );
+
+    RelayProbe::clearCache();
+
+    SocketManager::get().deinitialize();
+    TimerManager::get().deinitialize();
+}
+
+#ifdef __linux__
+
+TEST ( RelayServer, ForwardBenchmark )
+{
+    static const vector<size_t> workerCounts = { 1, 2, 4 };
+    static const size_t matchCount = 16;
+    static const size_t batchSize = 64;
+    static const size_t datagramSize = 32;
+    static const chrono::milliseconds duration ( 500 );
+
+    // Unconnected UDP socket bound to an ephemeral loopback port
+    auto bindLoopback = []() -> int
+    {
+        const int fd = socket ( AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP );
+
+        sockaddr_in addr;
+        memset ( &addr, 0, sizeof ( addr ) );
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl ( INADDR_LOOPBACK );
+
+        bind ( fd, ( sockaddr * ) &addr, sizeof ( addr ) );
+        return fd;
+    };
+
+    const string addrs[2] = { "127.0.0.1", "127.0.0.1" };
+
+    char payload[datagramSize];
+    memset ( payload, 'x', sizeof ( payload ) );
+
+    // Workers beyond the number of cores share them
+    const size_t coreCount = max ( 1u, thread::hardware_concurrency() );
+
+    printf ( "cores: %u\n", ( unsigned ) coreCount );
+    printf ( "%-10s %12s %12s %12s %12s\n", "Workers", "Sent", "Forwarded", "Kpps", "Kpps/core" );
+
+    for ( size_t workerCount : workerCounts )
+    {
+        RelayForwarder forwarder ( workerCount );
+
+        // Each match has a client and a host socket, and the relay port each one sends to
+        vector<int> fds[2];
+        vector<sockaddr_in> relayPorts[2];
+
+        for ( size_t i = 0; i < matchCount; ++i )
+        {
+            uint16_t ports[2];
+            forwarder.add ( i + 1, addrs, ports );
+
+            for ( size_t side = 0; side < 2; ++side )
+            {
+                sockaddr_in addr;
+                memset ( &addr, 0, sizeof ( addr ) );
+                addr.sin_family = AF_INET;
+                addr.sin_addr.s_addr = htonl ( INADDR_LOOPBACK );
+                addr.sin_port = htons ( ports[side] );
+
+                fds[side].push_back ( bindLoopback() );
+                relayPorts[side].push_back ( addr );
+            }
+        }
+
+        // Latch the client side first, then the host's datagram is forwarded once it's latched too
+        for ( size_t side = 0; side < 2; ++side )
+        {
+            for ( size_t i = 0; i < matchCount; ++i )
+            {
+                sendto ( fds[side][i], payload, sizeof ( payload ), 0,
+                         ( sockaddr * ) &relayPorts[side][i], sizeof ( sockaddr_in ) );
+            }
+
+            this_thread::sleep_for ( chrono::milliseconds ( 50 ) );
+        }
+
+        RelayForwarder::Counters counters;
+
+        for ( size_t i = 0; i < matchCount; ++i )
+        {
+            ASSERT_TRUE ( forwarder.getCounters ( i + 1, counters ) );
+            ASSERT_EQ ( 1u, counters.packets[RelayForwarder::Host] );
+        }
+
+        // Only the clients send, the hosts never read so their datagrams are dropped by the kernel after forwarding
+        iovec iov = { payload, sizeof ( payload ) };
+        vector<mmsghdr> msgs ( batchSize );
+
+        uint64_t sent = 0;
+
+        const auto start = chrono::steady_clock::now();
+
+        while ( chrono::steady_clock::now() - start < duration )
+        {
+            for ( size_t i = 0; i < matchCount; ++i )
+            {
+                for ( mmsghdr& msg : msgs )
+                {
+                    memset ( &msg, 0, sizeof ( msg ) );
+                    msg.msg_hdr.msg_iov = &iov;
+                    msg.msg_hdr.msg_iovlen = 1;
+                    msg.msg_hdr.msg_name = &relayPorts[RelayForwarder::Client][i];
+                    msg.msg_hdr.msg_namelen = sizeof ( sockaddr_in );
+                }
+
+                const int count = sendmmsg ( fds[RelayForwarder::Client][i], &msgs[0], batchSize, MSG_DONTWAIT );
+
+                if ( count > 0 )
+                    sent += count;
+            }
+        }
+
+        const double seconds = chrono::duration<double> ( chrono::steady_clock::now() - start ).count();
+
+        // Let the workers drain their queues
+        this_thread::sleep_for ( chrono::milliseconds ( 100 ) );
+
+        uint64_t forwarded = 0;
+
+        for ( size_t i = 0; i < matchCount; ++i )
+        {
+            forwarder.getCounters ( i + 1, counters );
+            forwarded += counters.packets[RelayForwarder::Client];
+
+            EXPECT_EQ ( datagramSize * counters.packets[RelayForwarder::Client], counters.bytes[RelayForwarder::Client] );
+        }
+
+        printf ( "%-10u %12llu %12llu %12.1f %12.1f\n", ( unsigned ) workerCount, ( unsigned long long ) sent,
+                 ( unsigned long long ) forwarded, forwarded / seconds / 1000,
+                 forwarded / seconds / 1000 / min ( workerCount, coreCount ) );
+
+        EXPECT_NE ( 0u, forwarded );
+
+        for ( size_t side = 0; side < 2; ++side )
+        {
+            for ( int fd : fds[side] )
+                close ( fd );
+        }
+    }
+}
+
+#endif // __linux__
+
+#endif // NOT RELEASE
@@ -0,0 +1,183 @@
+#ifndef RELEASE
+
+#include "Test.Socket.hpp"
+#include "UdpSocket.hpp"
+#include "Thread.hpp"
+
+#include <chrono>
+#include <cstdio>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#define Sleep(MILLISECONDS) usleep ( ( MILLISECONDS ) * 1000 )
+#endif
+
+using namespace std;
+
+
+#define NUM_BENCHMARK_CHECKS ( 1000 )
+
+
+TEST ( SocketManager, DispatchBenchmark )
+{
+    static const vector<size_t> counts = { 2, 20, 200, 2000 };
+
+    // Idle sockets never read anything, so they don't need the default read buffer.
+    // Thousands of default sized buffers don't fit in a 32-bit process.
+    static const size_t idleReadBufferSize = 64;
+
+#ifndef _WIN32
+    rlimit limit;
+    getrlimit ( RLIMIT_NOFILE, &limit );
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit ( RLIMIT_NOFILE, &limit );
+    getrlimit ( RLIMIT_NOFILE, &limit );
+#endif
+
+    struct TestOwner : public Socket::Owner
+    {
+        size_t reads = 0;
+
+        void socketAccepted ( Socket *socket ) override {}
+        void socketConnected ( Socket *socket ) override {}
+        void socketDisconnected ( Socket *socket ) override {}
+        void socketRead ( Socket *socket, const MsgPtr& msg, const IpAddrPort& address ) override {}
+
+        void socketRead ( Socket *socket, const char *buffer, size_t len, const IpAddrPort& address ) override
+        {
+            ++reads;
+        }
+    };
+
+    TimerManager::get().initialize();
+    SocketManager::get().initialize();
+
+    printf ( "backend: %s\n", SocketManager::get().getBackendName() );
+    printf ( "%-10s %12s\n", "Sockets", "Check ns" );
+
+    for ( size_t count : counts )
+    {
+#ifndef _WIN32
+        if ( count + 64 > limit.rlim_cur )
+        {
+            printf ( "%-10u skipped, the fd limit is %u\n", ( unsigned ) count, ( unsigned ) limit.rlim_cur );
+            continue;
+        }
+#endif
+
+        TestOwner owner;
+
+        // One socket receives every packet, the rest stay idle
+        SocketPtr server = UdpSocket::bind ( &owner, 0, true );
+        SocketPtr client = UdpSocket::bind ( &owner, IpAddrPort ( "127.0.0.1", server->address.port ), true );
+
+        vector<SocketPtr> idle;
+
+        for ( size_t i = 2; i < count; ++i )
+        {
+            idle.push_back ( UdpSocket::bind ( &owner, 0, true ) );
+            idle.back()->setReadBufferSize ( idleReadBufferSize );
+        }
+
+        const auto start = chrono::high_resolution_clock::now();
+
+        for ( size_t i = 0; i < NUM_BENCHMARK_CHECKS; ++i )
+        {
+            client->send ( "x", 1 );
+            SocketManager::get().check ( 1000 );
+        }
+
+        const auto end = chrono::high_resolution_clock::now();
+
+        const double ns = chrono::duration<double, nano> ( end - start ).count() / NUM_BENCHMARK_CHECKS;
+
+        printf ( "%-10u %12.1f\n", ( unsigned ) count, ns );
+
+        EXPECT_EQ ( size_t ( NUM_BENCHMARK_CHECKS ), owner.reads );
+
+        idle.clear();
+        client.reset();
+        server.reset();
+    }
+
+    SocketManager::get().deinitialize();
+    TimerManager::get().deinitialize();
+}
+
+TEST ( SocketManager, WakeupFromThread )
+{
+    struct StopThread : public Thread
+    {
+        void run() override
+        {
+            Sleep ( 50 );
+            EventManager::get().stop();
+        }
+    };
+
+    TimerManager::get().initialize();
+    SocketManager::get().initialize();
+
+    StopThread thread;
+    thread.start();
+
+    // Nothing to wait for, so without a wakeup this blocks for the full default timeout
+    const uint64_t start = TimerManager::get().getNow ( true );
+    EventManager::get().start();
+    const uint64_t elapsed = TimerManager::get().getNow ( true ) - start;
+
+    thread.join();
+
+    EXPECT_LT ( elapsed, 500 );
+
+    SocketManager::get().deinitialize();
+    TimerManager::get().deinitialize();
+}
+
+TEST ( SocketManager, PostFromThread )
+{
+    static const size_t numTasks = 1000;
+
+    struct PostThread : public Thread
+    {
+        size_t count = 0;
+
+        void run() override
+        {
+            Sleep ( 50 );
+
+            for ( size_t i = 0; i < numTasks; ++i )
+            {
+                EventManager::get().post ( [this]
+                {
+                    // Runs on the event loop thread, so this doesn't need a lock
+                    if ( ++count == numTasks )
+                        EventManager::get().stop();
+                } );
+            }
+        }
+    };
+
+    TimerManager::get().initialize();
+    SocketManager::get().initialize();
+
+    PostThread thread;
+    thread.start();
+
+    const uint64_t start = TimerManager::get().getNow ( true );
+    EventManager::get().start();
+    const uint64_t elapsed = TimerManager::get().getNow ( true ) - start;
+
+    thread.join();
+
+    EXPECT_EQ ( numTasks, thread.count );
+    EXPECT_LT ( elapsed, 500 );
+
+    SocketManager::get().deinitialize();
+    TimerManager::get().deinitialize();
+}
+
+#endif // NOT RELEASE
@@ -7,6 +7,9 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
 #include <cstdlib>
 #include <vector>
 
@@ -17,6 +20,9 @@ using namespace std;
 #define NUM_ITERATIONS          ( 10 )
 #define MAX_DELAY_MILLISECONDS  ( 2000 )
 
+#define NUM_BENCHMARK_TIMERS    ( 10000 )
+#define MAX_BENCHMARK_DELAY     ( 100 )
+
 
 TEST ( Timer, RepeatRandom )
 {
@@ -71,4 +77,98 @@ TEST ( Timer, RepeatRandom )
     TimerManager::get().deinitialize();
 }
 
+TEST ( Timer, NanosecondClock )
+{
+    TimerManager::get().initialize();
+
+    uint64_t last = TimerManager::get().getNowNs ( true );
+    bool subMillisecond = false;
+
+    for ( size_t i = 0; i < 1000; ++i )
+    {
+        const uint64_t now = TimerManager::get().getNowNs ( true );
+
+        EXPECT_GE ( now, last );
+        EXPECT_EQ ( now / NS_PER_MS, TimerManager::get().getNow() );
+
+        if ( now > last && now - last < NS_PER_MS )
+            subMillisecond = true;
+
+        last = now;
+    }
+
+    if ( TimerManager::get().isHiRes() )
+    {
+        EXPECT_TRUE ( subMillisecond );
+    }
+
+    TimerManager::get().deinitialize();
+}
+
+TEST ( Timer, Benchmark )
+{
+    struct TestTimer : public Timer::Owner
+    {
+        size_t expired = 0;
+        bool inOrder = true;
+        uint64_t lastExpiry = 0;
+
+        void timerExpired ( Timer *timer ) override
+        {
+            ++expired;
+
+            if ( TimerManager::get().getNow() < lastExpiry )
+                inOrder = false;
+
+            lastExpiry = TimerManager::get().getNow();
+        }
+    };
+
+    TimerManager::get().initialize();
+
+    TestTimer test;
+    vector<TimerPtr> timers;
+
+    for ( size_t i = 0; i < NUM_BENCHMARK_TIMERS; ++i )
+        timers.push_back ( TimerPtr ( new Timer ( &test ) ) );
+
+    auto start = chrono::high_resolution_clock::now();
+
+    for ( const TimerPtr& timer : timers )
+        timer->start ( 1 + rand() % MAX_BENCHMARK_DELAY );
+
+    // Stop every 10th timer, these should never expire
+    for ( size_t i = 0; i < timers.size(); i += 10 )
+        timers[i]->stop();
+
+    auto end = chrono::high_resolution_clock::now();
+
+    const double startNs = chrono::duration<double, nano> ( end - start ).count() / NUM_BENCHMARK_TIMERS;
+
+    double checkNs = 0;
+    size_t checks = 0;
+
+    TimerManager::get().check();
+
+    while ( TimerManager::get().getNextExpiry() != UINT64_MAX )
+    {
+        start = chrono::high_resolution_clock::now();
+        TimerManager::get().check();
+        end = chrono::high_resolution_clock::now();
+
+        checkNs += chrono::duration<double, nano> ( end - start ).count();
+        ++checks;
+    }
+
+    printf ( "timers: %u; start+stop: %.1f ns; check: %.1f ns over %u checks\n",
+             ( unsigned ) NUM_BENCHMARK_TIMERS, startNs, checkNs / max<size_t> ( 1, checks ), ( unsigned ) checks );
+
+    EXPECT_EQ ( size_t ( NUM_BENCHMARK_TIMERS - NUM_BENCHMARK_TIMERS / 10 ), test.expired );
+    EXPECT_TRUE ( test.inOrder );
+
+    timers.clear();
+
+    TimerManager::get().deinitialize();
+}
+
 #endif // NOT RELEASE
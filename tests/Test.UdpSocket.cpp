@@ -3,8 +3,10 @@
 #include "Test.Socket.hpp"
 #include "UdpSocket.hpp"
 #include "Timer.hpp"
+#include "LinkEmulator.hpp"
 
 #include <memory>
+#include <chrono>
 
 using namespace std;
 
@@ -272,4 +274,341 @@ TEST ( UdpSocket, BindThenConnect )
     TimerManager::get().deinitialize();
 }
 
+TEST ( UdpSocket, SendBatching )
+{
+    struct TestSocket : public Socket::Owner, public Timer::Owner
+    {
+        SocketPtr socket;
+        Timer timer;
+        vector<string> received;
+
+        void socketAccepted ( Socket *socket ) override {}
+        void socketConnected ( Socket *socket ) override {}
+        void socketDisconnected ( Socket *socket ) override {}
+
+        void socketRead ( Socket *socket, const MsgPtr& msg, const IpAddrPort& address ) override
+        {
+            if ( msg.get() && msg->getMsgType() == MsgType::TestMessage )
+                received.push_back ( msg->getAs<TestMessage>().str );
+
+            if ( received.size() == 10 )
+                EventManager::get().stop();
+        }
+
+        void timerExpired ( Timer *timer ) override
+        {
+            if ( socket->getRemoteAddress().addr.empty() )
+            {
+                EventManager::get().stop();
+                return;
+            }
+
+            // Everything sent in one iteration should go out together
+            for ( int i = 0; i < 10; ++i )
+                socket->send ( new TestMessage ( format ( "Message %d", i ) ) );
+        }
+
+        TestSocket ( uint16_t port )
+            : socket ( UdpSocket::bind ( this, port ) )
+            , timer ( this )
+        {
+            timer.start ( 5000 );
+        }
+
+        TestSocket ( const string& address, uint16_t port )
+            : socket ( UdpSocket::bind ( this, IpAddrPort ( address, port ) ) )
+            , timer ( this )
+        {
+            timer.start ( 100 );
+        }
+    };
+
+    TimerManager::get().initialize();
+    SocketManager::get().initialize();
+
+    TestSocket server ( 0 );
+    TestSocket client ( "127.0.0.1", server.socket->address.port );
+
+    EventManager::get().start();
+
+    ASSERT_EQ ( 10, server.received.size() );
+
+    for ( int i = 0; i < 10; ++i )
+        EXPECT_EQ ( format ( "Message %d", i ), server.received[i] );
+
+    EXPECT_EQ ( 10, client.socket->getAsUDP().getMessagesSent() );
+    EXPECT_EQ ( 1, client.socket->getAsUDP().getDatagramsSent() );
+
+    SocketManager::get().deinitialize();
+    TimerManager::get().deinitialize();
+}
+
+// Bytes that don't compress, so the encoded message is larger than the MTU
+static string getNoise ( size_t size )
+{
+    string noise ( size, 0 );
+    uint32_t state = 1;
+
+    for ( char& c : noise )
+    {
+        state = state * 1103515245 + 12345;
+        c = char ( state >> 16 );
+    }
+
+    return noise;
+}
+
+TEST ( UdpSocket, SendShared )
+{
+    static const size_t numClients = 3;
+
+    // Shared by the server and every client
+    static size_t numReceived = 0;
+
+    struct TestSocket : public Socket::Owner, public Timer::Owner
+    {
+        SocketPtr socket;
+        vector<SocketPtr> accepted;
+        Timer timer;
+        vector<string> received;
+
+        SharedMessage small, large;
+
+        void socketAccepted ( Socket *serverSocket ) override
+        {
+            accepted.push_back ( serverSocket->accept ( this ) );
+
+            // Sockets with different hash types can't share the same bytes
+            accepted.back()->setProtocolLevel ( accepted.size() == 1 ? 0 : PROTOCOL_LEVEL );
+
+            if ( accepted.size() < numClients )
+                return;
+
+            for ( const SocketPtr& socket : accepted )
+            {
+                socket->sendShared ( small );
+                socket->sendShared ( large );
+            }
+        }
+
+        void socketConnected ( Socket *socket ) override {}
+        void socketDisconnected ( Socket *socket ) override {}
+
+        void socketRead ( Socket *socket, const MsgPtr& msg, const IpAddrPort& address ) override
+        {
+            if ( msg.get() && msg->getMsgType() == MsgType::TestMessage )
+                received.push_back ( msg->getAs<TestMessage>().str );
+
+            if ( ++numReceived == 2 * numClients )
+                EventManager::get().stop();
+        }
+
+        void timerExpired ( Timer *timer ) override
+        {
+            LOG ( "Stopping because of timeout" );
+            EventManager::get().stop();
+        }
+
+        TestSocket ( uint16_t port )
+            : socket ( UdpSocket::listen ( this, port ) ), timer ( this )
+            , small ( MsgPtr ( new TestMessage ( "Hello spectators!" ) ) )
+            , large ( MsgPtr ( new TestMessage ( getNoise ( 4 * MAX_MTU ) ) ) )
+        {
+            // Lose some datagrams so the split messages need to be resent
+            socket->setLinkEmulator ( LinkConfig::loss ( 0.1, 1 ) );
+            timer.start ( LONG_TIMEOUT );
+        }
+
+        TestSocket ( const string& address, uint16_t port )
+            : socket ( UdpSocket::connect ( this, IpAddrPort ( address, port ) ) ), timer ( this )
+            , small ( NullMsg ), large ( NullMsg )
+        {
+            timer.start ( LONG_TIMEOUT );
+        }
+    };
+
+    TimerManager::get().initialize();
+    SocketManager::get().initialize();
+    SocketManager::get().setLoopback ( true );
+
+    numReceived = 0;
+
+    TestSocket server ( 0 );
+    vector<shared_ptr<TestSocket>> clients;
+
+    for ( size_t i = 0; i < numClients; ++i )
+        clients.push_back ( make_shared<TestSocket> ( "127.0.0.1", server.socket->address.port ) );
+
+    EventManager::get().start();
+
+    for ( const auto& client : clients )
+    {
+        ASSERT_EQ ( 2, client->received.size() );
+        EXPECT_EQ ( "Hello spectators!", client->received[0] );
+        EXPECT_EQ ( getNoise ( 4 * MAX_MTU ), client->received[1] );
+    }
+
+    // Encoded once per hash type, instead of once per client
+    EXPECT_EQ ( 2, server.small.getEncodeCount() );
+    EXPECT_EQ ( 2, server.large.getEncodeCount() );
+
+    clients.clear();
+
+    SocketManager::get().deinitialize();
+    TimerManager::get().deinitialize();
+}
+
+TEST ( UdpSocket, LinkEmulator )
+{
+    struct TestLink : public LinkEmulator::Owner
+    {
+        vector<uint32_t> delivered;
+
+        void linkEmulatorSend ( LinkEmulator *link, const char *bytes, size_t len, const IpAddrPort& address ) override
+        {
+            ASSERT_EQ ( sizeof ( uint32_t ), len );
+            delivered.push_back ( *reinterpret_cast<const uint32_t *> ( bytes ) );
+        }
+    };
+
+    LinkConfig config;
+    config.goodToBad = 0.05;
+    config.badToGood = 0.25;
+    config.badLoss = 1;
+    config.duplicate = 0.1;
+
+    TimerManager::get().initialize();
+
+    vector<uint32_t> results[3];
+
+    for ( int i = 0; i < 3; ++i )
+    {
+        config.seed = ( i < 2 ? 1234 : 5678 );
+
+        TestLink owner;
+        LinkEmulator link ( &owner, config );
+
+        for ( uint32_t j = 0; j < 1000; ++j )
+            link.send ( reinterpret_cast<const char *> ( &j ), sizeof ( j ), IpAddrPort ( "127.0.0.1", 1 ) );
+
+        const LinkEmulator::Stats& stats = link.getStats();
+
+        EXPECT_EQ ( 1000u, stats.sent );
+        EXPECT_LT ( 0u, stats.dropped );
+        EXPECT_LT ( 0u, stats.duplicated );
+        EXPECT_EQ ( stats.sent - stats.dropped + stats.duplicated, stats.delivered );
+        EXPECT_EQ ( stats.delivered, owner.delivered.size() );
+
+        // Losses come in bursts, the average burst is 1 / badToGood packets long
+        size_t bursts = 0;
+
+        for ( size_t j = 0; j < owner.delivered.size(); ++j )
+        {
+            const uint32_t prev = ( j == 0 ? 0 : owner.delivered[j - 1] + 1 );
+
+            if ( owner.delivered[j] > prev )
+                ++bursts;
+        }
+
+        ASSERT_LT ( 0u, bursts );
+        EXPECT_LT ( 2.0, double ( stats.dropped ) / bursts );
+
+        results[i].swap ( owner.delivered );
+    }
+
+    // The same seed always gives the same results
+    EXPECT_EQ ( results[0], results[1] );
+    EXPECT_NE ( results[0], results[2] );
+
+    TimerManager::get().deinitialize();
+}
+
+TEST ( UdpSocket, VirtualTime )
+{
+    struct TestSocket : public BaseTestSocket<UdpSocket, DEFAULT_KEEP_ALIVE_TIMEOUT, LONG_TIMEOUT>
+    {
+        vector<string> received;
+        bool disconnected = false;
+
+        void socketAccepted ( Socket *serverSocket ) override
+        {
+            accepted = serverSocket->accept ( this );
+        }
+
+        void socketConnected ( Socket *socket ) override
+        {
+            for ( int i = 0; i < 100; ++i )
+                socket->send ( new TestMessage ( format ( "Message %d", i ) ) );
+        }
+
+        void socketDisconnected ( Socket *socket ) override
+        {
+            LOG ( "Stopping because of keep alive timeout" );
+            disconnected = true;
+            EventManager::get().stop();
+        }
+
+        void socketRead ( Socket *socket, const MsgPtr& msg, const IpAddrPort& address ) override
+        {
+            if ( msg.get() && msg->getMsgType() == MsgType::TestMessage )
+                received.push_back ( msg->getAs<TestMessage>().str );
+
+            // Go silent so the client times out
+            if ( received.size() == 100 )
+                this->socket->setLinkEmulator ( LinkConfig::loss ( 1 ) );
+        }
+
+        void timerExpired ( Timer *timer ) override
+        {
+            LOG ( "Stopping because of timeout" );
+            EventManager::get().stop();
+        }
+
+        TestSocket ( uint16_t port ) : BaseTestSocket ( port ) { setLinkEmulator ( 1 ); }
+
+        TestSocket ( const string& address, uint16_t port ) : BaseTestSocket ( address, port ) { setLinkEmulator ( 2 ); }
+
+        void setLinkEmulator ( uint64_t seed )
+        {
+            LinkConfig config = LinkConfig::loss ( 0.2, seed );
+            config.delay = 50;
+            config.jitter = 10;
+            socket->setLinkEmulator ( config );
+        }
+    };
+
+    TimerManager::get().initialize();
+    TimerManager::get().setVirtualTime ( true );
+    SocketManager::get().initialize();
+    SocketManager::get().setLoopback ( true );
+
+    const auto realStart = chrono::steady_clock::now();
+    const uint64_t start = TimerManager::get().getNow();
+
+    TestSocket server ( 0 );
+    TestSocket client ( "127.0.0.1", server.socket->address.port );
+
+    EventManager::get().start();
+
+    const uint64_t elapsed = TimerManager::get().getNow() - start;
+    const uint64_t realElapsed = chrono::duration_cast<chrono::milliseconds> (
+                                     chrono::steady_clock::now() - realStart ).count();
+
+    LOG ( "elapsed=%llu ms; realElapsed=%llu ms", elapsed, realElapsed );
+
+    ASSERT_EQ ( 100, server.received.size() );
+
+    for ( int i = 0; i < 100; ++i )
+        EXPECT_EQ ( format ( "Message %d", i ), server.received[i] );
+
+    // The keep alive timeout passed in virtual time, without actually waiting for it
+    EXPECT_TRUE ( client.disconnected );
+    EXPECT_LE ( DEFAULT_KEEP_ALIVE_TIMEOUT, elapsed );
+    EXPECT_GT ( LONG_TIMEOUT, elapsed );
+    EXPECT_GT ( elapsed, realElapsed );
+
+    SocketManager::get().deinitialize();
+    TimerManager::get().deinitialize();
+}
+
 #endif // NOT RELEASE
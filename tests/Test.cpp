@@ -1,10 +1,17 @@
 #ifndef RELEASE
 
+#include "Test.hpp"
+
 #include <gtest/gtest.h>
 
 using namespace std;
 
 
+AllocationHook allocationHook = 0;
+
+bool canHookAllocations = false;
+
+
 int RunAllTests ( int& argc, char *argv[] )
 {
     testing::InitGoogleTest ( &argc, argv );
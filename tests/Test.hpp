@@ -1,3 +1,11 @@
 #pragma once
 
+#include <cstddef>
+
 int RunAllTests ( int& argc, char *argv[] );
+
+// Called for every allocation while set, so a test can count the allocations of the code it measures.
+// Only test runners that replace the global allocator call this, and they set canHookAllocations.
+typedef void ( *AllocationHook ) ( size_t size );
+extern AllocationHook allocationHook;
+extern bool canHookAllocations;